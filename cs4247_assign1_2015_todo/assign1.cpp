@@ -12,10 +12,17 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
 #include <GL/glew.h>
 #include <GL/glut.h>
 #include "image_io.h"
+#include "texture_file.h"
+#include "profiler.h"
 
 
 /////////////////////////////////////////////////////////////////////////////
@@ -43,6 +50,27 @@
 
 #define TABLE_THICKNESS     0.1
 
+// The teapot and the sphere stand on the tabletop.
+
+#define TEAPOT_SIZE         0.45
+#define SPHERE_RADIUS       0.35
+
+// The sphere is tessellated at SPHERE_LODS levels of detail, with 8, 16, 32, ...
+// slices and half as many stacks. The level that is drawn has slices about
+// SPHERE_SLICE_PIXELS pixels wide at its silhouette.
+
+#define SPHERE_LODS             4
+#define SPHERE_SLICE_PIXELS     10.0
+
+// The reflection image is rendered into a texture of this size, if framebuffer
+// objects are supported. Only mipmap levels 0 to REFLECTION_TEX_MAX_LEVEL are made.
+// Smaller levels are only needed when the tabletop covers fewer than about
+// 32 x 32 pixels, where the difference cannot be seen.
+
+#define REFLECTION_TEX_WIDTH        512
+#define REFLECTION_TEX_HEIGHT       512
+#define REFLECTION_TEX_MAX_LEVEL    4
+
 // The followings are for navigation and setting the view of the (actual) eye.
 
 #define LOOKAT_X            0.0     // Look-at point x coordinate.
@@ -58,6 +86,8 @@
 #define EYE_LATITUDE_INCR   2.0     // Degree increment when changing eye's latitude.
 #define EYE_LONGITUDE_INCR  2.0     // Degree increment when changing eye's longitude.
 
+#define BENCHMARK_FRAMES    200     // Frames rendered with each reflection mode by RunBenchmark().
+
 
 // Light 0.
 const GLfloat light0Ambient[] = { 0.2, 0.2, 0.2, 1.0 };
@@ -80,6 +110,65 @@ const char checkerTexFile[] = "images/checker.png";
 const char spotsTexFile[] = "images/spots.png";
 
 
+// Sections of the frame that are timed by the profiler.
+enum ProfileSection { PROFILE_FRAME, PROFILE_REFLECTION, PROFILE_ROOM, PROFILE_TEAPOT,
+                      PROFILE_SPHERE, PROFILE_TABLE, NUM_PROFILE_SECTIONS };
+
+const char *const profileSectionNames[ NUM_PROFILE_SECTIONS ] =
+    { "Frame", "Reflection", "Room", "Teapot", "Sphere", "Table" };
+
+
+// Ways of drawing the reflection on the tabletop. REFLECTION_TEXTURE renders it
+// into a texture map in a separate pass (see MakeReflectionImage()), and
+// REFLECTION_STENCIL draws the mirrored scene in the frame (see DrawMirroredScene()).
+enum ReflectionMode { REFLECTION_TEXTURE, REFLECTION_STENCIL, NUM_REFLECTION_MODES };
+
+const char *const reflectionModeNames[ NUM_REFLECTION_MODES ] = { "Texture", "Stencil" };
+
+
+// Per-pixel Phong lighting of the scene. It computes the same lighting as the
+// fixed-function pipeline with the settings in GLInit(), for lights 0 and 1, but
+// at every pixel instead of at the vertices. The texture map is applied as with
+// GL_MODULATE and GL_SEPARATE_SPECULAR_COLOR. Texture object 0 has a white texel
+// when this is used, so it leaves the color as is, like no texture mapping.
+const char phongVertexShader[] =
+    "varying vec3 position;     // In eye space.\n"
+    "varying vec3 normal;\n"
+    "void main()\n"
+    "{\n"
+    "    position = vec3( gl_ModelViewMatrix * gl_Vertex );\n"
+    "    normal = gl_NormalMatrix * gl_Normal;\n"
+    "    gl_TexCoord[0] = gl_TextureMatrix[0] * gl_MultiTexCoord0;\n"
+    "    gl_ClipVertex = gl_ModelViewMatrix * gl_Vertex;\n"
+    "    gl_Position = ftransform();\n"
+    "}\n";
+
+const char phongFragmentShader[] =
+    "uniform sampler2D textureMap;\n"
+    "uniform bool textured;     // False if texture mapping is off.\n"
+    "varying vec3 position;\n"
+    "varying vec3 normal;\n"
+    "void main()\n"
+    "{\n"
+    "    vec3 n = normalize( gl_FrontFacing? normal : -normal );  // Two-sided lighting.\n"
+    "    vec3 v = normalize( -position );                         // Local viewer.\n"
+    "    vec4 color = gl_FrontLightModelProduct.sceneColor;\n"
+    "    vec3 specular = vec3( 0.0 );\n"
+    "    for ( int i = 0; i < 2; i++ )\n"
+    "    {\n"
+    "        vec3 l = normalize( gl_LightSource[i].position.xyz - position * gl_LightSource[i].position.w );\n"
+    "        float nDotL = max( dot( n, l ), 0.0 );\n"
+    "        color += gl_FrontLightProduct[i].ambient + gl_FrontLightProduct[i].diffuse * nDotL;\n"
+    "        if ( nDotL > 0.0 )\n"
+    "            specular += gl_FrontLightProduct[i].specular.rgb *\n"
+    "                        pow( max( dot( n, normalize( l + v ) ), 0.0 ), gl_FrontMaterial.shininess );\n"
+    "    }\n"
+    "    color = vec4( min( color.rgb, 1.0 ), gl_FrontMaterial.diffuse.a );\n"
+    "    if ( textured ) color *= texture2D( textureMap, gl_TexCoord[0].st );\n"
+    "    gl_FragColor = vec4( color.rgb + specular, color.a );\n"
+    "}\n";
+
+
 
 /////////////////////////////////////////////////////////////////////////////
 // GLOBAL VARIABLES
@@ -112,13 +201,103 @@ GLuint brickTexObj;
 GLuint checkerTexObj;
 GLuint spotsTexObj;
 
+// The texture maps that are read from image files, and their texture objects.
+// Each is read from the texture file made from its image file by
+// "--convert-textures" instead, if there is one.
+const int NUM_TEXTURE_MAPS = 5;
+const char *const textureMapFiles[ NUM_TEXTURE_MAPS ] =
+    { woodTexFile, ceilingTexFile, brickTexFile, checkerTexFile, spotsTexFile };
+GLuint *const textureMapObjs[ NUM_TEXTURE_MAPS ] =
+    { &woodTexObj, &ceilingTexObj, &brickTexObj, &checkerTexObj, &spotsTexObj };
+
+bool useFramebufferObjects = false;    // True if framebuffer objects are supported.
+bool hasStencil = false;               // True if the window has a stencil buffer.
+
+ReflectionMode reflectionMode = REFLECTION_TEXTURE;
+
+// Framebuffer object for rendering the reflection image into reflectionTexObj,
+// and its depth buffer. Both are 0 if framebuffer objects are not supported.
+GLuint reflectionFBO = 0;
+GLuint reflectionDepthRBO = 0;
+
+// The last rendered frame, kept in a texture of the window's size, so that it can
+// be redisplayed without rendering the scene again. frameDepthRBO has the depth
+// and stencil buffers. All 0 if it cannot be kept.
+GLuint frameFBO = 0;
+GLuint frameTexObj = 0;
+GLuint frameDepthRBO = 0;
+
+// The scene is lit by phongProgram if it is not 0, otherwise by the fixed-function
+// pipeline, and then its surfaces are subdivided to show the specular highlights.
+bool usePhongShader = true;     // False to use fixed-function lighting.
+GLuint phongProgram = 0;
+GLint phongTexturedLoc;         // Location of the uniform "textured".
+
+// The inputs that the rendered images depend on. MyDisplay() compares them with
+// the inputs of the current reflection image and of the kept frame, and only
+// renders those again if they have changed.
+typedef struct ViewState {
+    double eyeLatitude;
+    double eyeLongitude;
+    double eyeDistance;
+    bool drawAxes;
+    bool drawWireframe;
+    bool hasTexture;
+    ReflectionMode reflectionMode;
+}
+ViewState;
+
+ViewState reflectionState;      // Inputs of the current reflection image.
+ViewState frameState;           // Inputs of the kept frame.
+bool reflectionValid = false;   // False if there is no current reflection image.
+bool frameValid = false;        // False if there is no kept frame.
+
+// Static geometry of the room, the table, the teapot and the sphere, made once by
+// BuildStaticGeometry(). All the parts share one vertex array and one index array,
+// which are kept in buffer objects if OpenGL 1.5 is supported. Each part has a single
+// material and texture, and is drawn with one glDrawElements() call (see DrawStaticPart()).
+// The sphere has a part for each level of detail, from PART_SPHERE.
+
+enum StaticPart { PART_CEILING, PART_WALLS, PART_FLOOR, PART_TABLETOP, PART_TABLE_SIDES, PART_TABLE_LEGS,
+                  PART_SPHERE, PART_TEAPOT = PART_SPHERE + SPHERE_LODS, NUM_STATIC_PARTS };
+
+typedef struct StaticVertex {
+    GLfloat tc[2];  // Texture coordinates.
+    GLfloat n[3];   // Normal vector.
+    GLfloat v[3];   // Vertex position.
+}
+StaticVertex;       // Same layout as GL_T2F_N3F_V3F.
+
+StaticVertex *staticVertices = NULL;    // Freed after copying to staticVertexBufObj.
+GLushort *staticIndices = NULL;         // Freed after copying to staticIndexBufObj.
+int numStaticVertices = 0;
+int numStaticIndices = 0;
+GLuint staticVertexBufObj = 0;          // 0 if buffer objects are not supported.
+GLuint staticIndexBufObj = 0;
+
+// The quads of part p are the indices staticPartStart[p] to staticPartStart[p+1] - 1.
+int staticPartStart[ NUM_STATIC_PARTS + 1 ];
+
+bool hasTeapotMesh = false;     // False if the teapot is not in the static geometry, and is drawn by GLUT.
+
 // Others.
 bool drawAxes = true;           // Draw world coordinate frame axes iff true.
 bool drawWireframe = false;     // Draw polygons in wireframe if true, otherwise polygons are filled.
 bool hasTexture = true;         // Toggle texture mapping.
+bool showProfile = false;       // Show the profiling overlay iff true.
+bool hideFrames = false;        // True while RunBenchmark() or RunCapture() renders frames, which are not shown.
+const char *profileFile = NULL; // The frame times are saved to this CSV file on exit, if not NULL.
+const char *captureEyeFile = NULL;  // The views to render by RunCapture(), if not NULL.
+const char *capturePrefix = NULL;   // Filename prefix of the images saved by RunCapture().
 
 
 // Forward function declarations.
+void SetUpReflectionFramebuffer( void );
+void SetUpFrameCache( int width, int height );
+void SetUpPhongShader( void );
+void UsePhongShader( bool use );
+void BuildStaticGeometry( void );
+void DrawStaticPart( StaticPart part );
 void DrawAxes( double length );
 void DrawRoom( void );
 void DrawTeapot( void );
@@ -138,6 +317,8 @@ void DrawTable( void );
 
 void MakeReflectionImage( void )
 {
+    ProfilerBeginSection( PROFILE_REFLECTION );
+
     //********************************************************
     //*********** TASK #1: WRITE YOUR CODE BELOW *************
     //********************************************************
@@ -151,6 +332,12 @@ void MakeReflectionImage( void )
     //********************************************************
 
 	//step 1
+	if (reflectionFBO != 0)
+	{
+		// Render directly into reflectionTexObj.
+		glBindFramebuffer(GL_FRAMEBUFFER, reflectionFBO);
+		glViewport(0, 0, REFLECTION_TEX_WIDTH, REFLECTION_TEX_HEIGHT);
+	}
 	glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
 
 	//step 2
@@ -170,6 +357,8 @@ void MakeReflectionImage( void )
 	gluLookAt(eyePos[0], eyePos[1], lookAtZ, eyePos[0], eyePos[1], eyePos[2],  1.0, 0.0, 0.0);
 
 	//step 4
+	glLightfv(GL_LIGHT0, GL_POSITION, light0Position);
+	glLightfv(GL_LIGHT1, GL_POSITION, light1Position);
 	glEnable(GL_LIGHT0);
 	glEnable(GL_LIGHT1);
 	glEnable(GL_LIGHTING);
@@ -180,10 +369,180 @@ void MakeReflectionImage( void )
 	DrawSphere();
 	
 	//step 6
-	glReadBuffer(GL_BACK);
-	glBindTexture(GL_TEXTURE_2D, reflectionTexObj);
-	glCopyTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 0, 0, winWidth, winHeight, 0);
+	if (reflectionFBO != 0)
+	{
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, winWidth, winHeight);
+
+		// Only makes levels 1 to REFLECTION_TEX_MAX_LEVEL.
+		glBindTexture(GL_TEXTURE_2D, reflectionTexObj);
+		glGenerateMipmap(GL_TEXTURE_2D);
+	}
+	else
+	{
+		glReadBuffer(GL_BACK);
+		glBindTexture(GL_TEXTURE_2D, reflectionTexObj);
+		glCopyTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 0, 0, winWidth, winHeight, 0);
+	}
+
+    ProfilerEndSection( PROFILE_REFLECTION );
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Draw the reflection on the tabletop directly into the frame, as the scene
+// mirrored through the tabletop plane, only where the tabletop is.
+// This is done instead of MakeReflectionImage() in REFLECTION_STENCIL mode.
+// Must be called first in the frame, after the view and the light positions
+// are set. DrawTable() then blends the tabletop with the reflection.
+/////////////////////////////////////////////////////////////////////////////
+
+void DrawMirroredScene( void )
+{
+    ProfilerBeginSection( PROFILE_REFLECTION );
+
+// Set the stencil to 1 where the tabletop is.
+
+    glEnable( GL_STENCIL_TEST );
+    glStencilFunc( GL_ALWAYS, 1, 0xFF );
+    glStencilOp( GL_KEEP, GL_KEEP, GL_REPLACE );
+    glColorMask( GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE );
+    glDepthMask( GL_FALSE );
+    DrawStaticPart( PART_TABLETOP );
+    glDepthMask( GL_TRUE );
+    glColorMask( GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE );
+
+// Draw the mirrored scene there, without what is mirrored from below the tabletop.
+
+    glStencilFunc( GL_EQUAL, 1, 0xFF );
+    glStencilOp( GL_KEEP, GL_KEEP, GL_KEEP );
+
+    GLdouble belowTabletop[] = { 0.0, 0.0, -1.0, TABLETOP_Z };   // Keeps z <= TABLETOP_Z.
+    glClipPlane( GL_CLIP_PLANE0, belowTabletop );
+    glEnable( GL_CLIP_PLANE0 );
+
+    glPushMatrix();
+    glTranslated( 0.0, 0.0, TABLETOP_Z );
+    glScaled( 1.0, 1.0, -1.0 );
+    glTranslated( 0.0, 0.0, -TABLETOP_Z );
+    glLightfv( GL_LIGHT0, GL_POSITION, light0Position );
+    glLightfv( GL_LIGHT1, GL_POSITION, light1Position );
+
+    glFrontFace( GL_CW );  // The mirroring reverses the polygon winding.
+    DrawRoom();
+    DrawTeapot();
+    DrawSphere();
+    glFrontFace( GL_CCW );
+
+    glPopMatrix();
+    glLightfv( GL_LIGHT0, GL_POSITION, light0Position );
+    glLightfv( GL_LIGHT1, GL_POSITION, light1Position );
+    glDisable( GL_CLIP_PLANE0 );
+
+// Replace the depth of the mirrored scene with the depth of the tabletop, so that
+// the rest of the scene is depth-tested against the tabletop and not the reflection.
+
+    glColorMask( GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE );
+    glDepthFunc( GL_ALWAYS );
+    DrawStaticPart( PART_TABLETOP );
+    glDepthFunc( GL_LESS );
+    glColorMask( GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE );
+
+    glDisable( GL_STENCIL_TEST );
+
+    ProfilerEndSection( PROFILE_REFLECTION );
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Get the current inputs of the rendered images.
+/////////////////////////////////////////////////////////////////////////////
+
+ViewState GetViewState( void )
+{
+    ViewState state;
+    state.eyeLatitude = eyeLatitude;
+    state.eyeLongitude = eyeLongitude;
+    state.eyeDistance = eyeDistance;
+    state.drawAxes = drawAxes;
+    state.drawWireframe = drawWireframe;
+    state.hasTexture = hasTexture;
+    state.reflectionMode = reflectionMode;
+    return state;
+}
+
+
+// Returns true if the reflection image is the same for both inputs.
+// It does not show the axes.
+bool SameReflection( const ViewState *a, const ViewState *b )
+{
+    return a->eyeLatitude == b->eyeLatitude && a->eyeLongitude == b->eyeLongitude &&
+           a->eyeDistance == b->eyeDistance && a->drawWireframe == b->drawWireframe &&
+           a->hasTexture == b->hasTexture;
+}
+
+
+// Returns true if the frame is the same for both inputs.
+bool SameFrame( const ViewState *a, const ViewState *b )
+{
+    return SameReflection( a, b ) && a->drawAxes == b->drawAxes && a->reflectionMode == b->reflectionMode;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Draw the kept frame to fill the window.
+/////////////////////////////////////////////////////////////////////////////
+
+void DrawKeptFrame( void )
+{
+    glPushAttrib( GL_ALL_ATTRIB_BITS );
+    glDisable( GL_LIGHTING );
+    glDisable( GL_DEPTH_TEST );
+    glEnable( GL_TEXTURE_2D );
+    glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
+    glTexEnvf( GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE );
+    glBindTexture( GL_TEXTURE_2D, frameTexObj );
+
+    glMatrixMode( GL_PROJECTION );
+    glPushMatrix();
+    glLoadIdentity();
+    glMatrixMode( GL_MODELVIEW );
+    glPushMatrix();
+    glLoadIdentity();
+
+    glBegin( GL_QUADS );
+        glTexCoord2f( 0.0, 0.0 );  glVertex2f( -1.0, -1.0 );
+        glTexCoord2f( 1.0, 0.0 );  glVertex2f( 1.0, -1.0 );
+        glTexCoord2f( 1.0, 1.0 );  glVertex2f( 1.0, 1.0 );
+        glTexCoord2f( 0.0, 1.0 );  glVertex2f( -1.0, 1.0 );
+    glEnd();
+
+    glPopMatrix();
+    glMatrixMode( GL_PROJECTION );
+    glPopMatrix();
+    glMatrixMode( GL_MODELVIEW );
+    glPopAttrib();
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Draw the profiling overlay if it is shown, and show the frame.
+/////////////////////////////////////////////////////////////////////////////
 
+void FinishFrame( void )
+{
+    ProfilerEndSection( PROFILE_FRAME );
+    if ( showProfile ) ProfilerDrawOverlay( winWidth, winHeight );
+    if ( !hideFrames ) glutSwapBuffers();
+    ProfilerEndFrame();
 }
 
 
@@ -195,6 +554,17 @@ void MakeReflectionImage( void )
 
 void MyDisplay( void )
 {
+    ProfilerBeginSection( PROFILE_FRAME );
+    ViewState state = GetViewState();
+
+    // Nothing has changed since the kept frame was rendered.
+    if ( frameValid && SameFrame( &state, &frameState ) )
+    {
+        DrawKeptFrame();
+        FinishFrame();
+        return;
+    }
+
     if ( hasTexture )
         glEnable( GL_TEXTURE_2D );
     else
@@ -206,9 +576,20 @@ void MyDisplay( void )
     eyePos[0] = xy * cos( eyeLongitude * PI / 180.0 ) + LOOKAT_X;
     eyePos[1] = xy * sin( eyeLongitude * PI / 180.0 ) + LOOKAT_Y;
 
-    MakeReflectionImage();
+    UsePhongShader( true );
+
+    if ( reflectionMode == REFLECTION_TEXTURE &&
+         ( !reflectionValid || !SameReflection( &state, &reflectionState ) ) )
+    {
+        MakeReflectionImage();
+        reflectionState = state;
+        reflectionValid = true;
+    }
 
-    glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+    // Render the frame into frameTexObj, if it can be kept.
+    if ( frameFBO != 0 ) glBindFramebuffer( GL_FRAMEBUFFER, frameFBO );
+
+    glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT );
 
     glMatrixMode( GL_PROJECTION );
     glLoadIdentity();
@@ -222,8 +603,14 @@ void MyDisplay( void )
     glLightfv( GL_LIGHT0, GL_POSITION, light0Position );
     glLightfv( GL_LIGHT1, GL_POSITION, light1Position );
 
+    // Draw the reflection, if it is not from the reflection image. Like the reflection
+    // image, it is only shown with texture mapping.
+    if ( reflectionMode == REFLECTION_STENCIL && hasTexture ) DrawMirroredScene();
+
     // Draw axes.
+    UsePhongShader( false );
     if ( drawAxes ) DrawAxes( SCENE_RADIUS );
+    UsePhongShader( true );
 
     // Draw scene.
     DrawRoom();
@@ -231,7 +618,66 @@ void MyDisplay( void )
     DrawSphere();
     DrawTable();
 
-    glutSwapBuffers();
+    UsePhongShader( false );
+
+    if ( frameFBO != 0 )
+    {
+        glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+        frameState = state;
+        frameValid = true;
+        DrawKeptFrame();
+    }
+
+    FinishFrame();
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Render BENCHMARK_FRAMES frames in each reflection mode, print the average
+// time per frame, and keep the faster mode. Every frame is rendered in full,
+// and is not shown, so that the display's refresh rate does not limit it.
+// Texture mapping is on for the benchmark, since there is no reflection
+// without it.
+/////////////////////////////////////////////////////////////////////////////
+
+void RunBenchmark( void )
+{
+    int numModes = hasStencil? NUM_REFLECTION_MODES : 1;
+    double frameMs[ NUM_REFLECTION_MODES ];
+
+    bool savedHasTexture = hasTexture;
+    hasTexture = true;
+    hideFrames = true;
+    for ( int m = 0; m < numModes; m++ )
+    {
+        reflectionMode = (ReflectionMode) m;
+        glFinish();
+        int startTime = glutGet( GLUT_ELAPSED_TIME );
+
+        for ( int i = 0; i < BENCHMARK_FRAMES; i++ )
+        {
+            reflectionValid = false;
+            frameValid = false;
+            MyDisplay();
+        }
+
+        glFinish();
+        frameMs[m] = (double) ( glutGet( GLUT_ELAPSED_TIME ) - startTime ) / BENCHMARK_FRAMES;
+        printf( "Status: %s reflection takes %.3f ms per frame.\n", reflectionModeNames[m], frameMs[m] );
+    }
+    hideFrames = false;
+    hasTexture = savedHasTexture;
+
+    reflectionMode = REFLECTION_TEXTURE;
+    for ( int m = 1; m < numModes; m++ )
+        if ( frameMs[m] < frameMs[ reflectionMode ] ) reflectionMode = (ReflectionMode) m;
+    printf( "Status: Using %s reflection.\n\n", reflectionModeNames[ reflectionMode ] );
+
+    reflectionValid = false;
+    frameValid = false;
+    glutPostRedisplay();
 }
 
 
@@ -290,6 +736,32 @@ void MyKeyboard( unsigned char key, int x, int y )
 			eyeLatitude = -eyeLatitude;
 			glutPostRedisplay();
 			break;
+
+        // Toggle profiling overlay.
+        case 'f':
+        case 'F':
+            showProfile = !showProfile;
+            glutPostRedisplay();
+            break;
+
+        // Switch between the reflection modes.
+        case 'm':
+        case 'M':
+            if ( !hasStencil )
+            {
+                printf( "Status: Stencil reflection needs a stencil buffer.\n" );
+                break;
+            }
+            reflectionMode = ( reflectionMode == REFLECTION_TEXTURE )? REFLECTION_STENCIL : REFLECTION_TEXTURE;
+            printf( "Status: Using %s reflection.\n", reflectionModeNames[ reflectionMode ] );
+            glutPostRedisplay();
+            break;
+
+        // Compare the reflection modes.
+        case 'b':
+        case 'B':
+            RunBenchmark();
+            break;
     }
 }
 
@@ -359,6 +831,11 @@ void MyReshape( int w, int h )
     winWidth = w;
     winHeight = h;
     glViewport( 0, 0, w, h );
+
+    // The reflection image is copied from the window if it is not rendered into its texture.
+    if ( reflectionFBO == 0 ) reflectionValid = false;
+    frameValid = false;
+    if ( useFramebufferObjects ) SetUpFrameCache( w, h );
 }
 
 
@@ -415,136 +892,167 @@ void GLInit( void )
     // Let OpenGL automatically renomarlize all normal vectors.
     // This is important if objects are to be scaled.
     glEnable( GL_NORMALIZE ); 
+
+    // Make the vertex and index arrays of the room and the table, which depend on
+    // the lighting.
+    if ( usePhongShader ) SetUpPhongShader();
+    BuildStaticGeometry();
 }
 
 
 
 
 /////////////////////////////////////////////////////////////////////////////
-// Set up texture maps.
+// Read a texture map, from its texture file if there is one and it can be
+// used, otherwise from its image file. A texture file that is older than its
+// image file is made again first. Can be called by any thread, since it
+// makes no OpenGL calls.
 /////////////////////////////////////////////////////////////////////////////
 
-void SetUpTextureMaps( void )
-{
-    unsigned char *imageData = NULL;
-    int imageWidth, imageHeight, numComponents;
+typedef struct TextureMapLoad {
+    const char *imageFile;  // In: the image file.
+    bool useTextureFile;    // In: true if compressed texture files can be used.
+    bool ok;                // Out: true if successful.
+    TextureFile file;       // Out: the mapped texture file, if read from it.
+    MipmapChain chain;      // Out: the mipmap levels, if read from the image file.
+}
+TextureMapLoad;
 
-    glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
 
+void LoadTextureMap( TextureMapLoad *load )
+{
+    load->ok = false;
+    load->file.data = NULL;
+    load->chain.numLevels = 0;
 
-// This texture object is for the wood texture map.
+    char textureFile[256];
+    GetTextureFileName( load->imageFile, textureFile, sizeof(textureFile) );
+    if ( load->useTextureFile && MapTextureFile( textureFile, &load->file ) )
+    {
+        if ( TextureFileIsUpToDate( &load->file, load->imageFile ) )
+        {
+            load->ok = true;
+            return;
+        }
 
-    glGenTextures( 1, &woodTexObj );
-    glBindTexture( GL_TEXTURE_2D, woodTexObj );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
+        UnmapTextureFile( &load->file );
+        printf( "Status: %s has changed. Converting it to %s again.\n", load->imageFile, textureFile );
+        if ( ConvertTextureFile( load->imageFile, textureFile ) && MapTextureFile( textureFile, &load->file ) )
+        {
+            load->ok = true;
+            return;
+        }
+    }
 
-    if ( ReadImageFile( woodTexFile, &imageData, 
-                        &imageWidth, &imageHeight, &numComponents ) == 0 ) exit( 1 );
-    if ( numComponents != 3 )
+    ImageFile image;
+    if ( ReadImageFileDirect( load->imageFile, &image ) == 0 ) return;
+    if ( image.numComponents != 3 )
     {
         fprintf( stderr, "Error: Texture image is not in RGB format.\n" );
-        exit( 1 );
+        ReleaseImageFile( &image );
+        return;
     }
 
-    gluBuild2DMipmaps( GL_TEXTURE_2D, GL_RGB, imageWidth, imageHeight,
-                       GL_RGB, GL_UNSIGNED_BYTE, imageData );
+    load->ok = ( MakeMipmapChain( image.data, image.width, image.height, image.numComponents, &load->chain ) != 0 );
+    ReleaseImageFile( &image );
+}
+
 
-    DeallocateImageData( &imageData );
 
 
-// This texture object is for the ceiling texture map.
+/////////////////////////////////////////////////////////////////////////////
+// Convert the image files of the texture maps to compressed texture files
+// with all their mipmap levels, to be read by SetUpTextureMaps().
+// Returns 1 if successful or 0 if unsuccessful.
+/////////////////////////////////////////////////////////////////////////////
 
-    glGenTextures( 1, &ceilingTexObj );
-    glBindTexture( GL_TEXTURE_2D, ceilingTexObj );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
-
-    if ( ReadImageFile( ceilingTexFile, &imageData, 
-                        &imageWidth, &imageHeight, &numComponents ) == 0 ) exit( 1 );
-    if ( numComponents != 3 )
+int ConvertTextureMaps( void )
+{
+    for ( int i = 0; i < NUM_TEXTURE_MAPS; i++ )
     {
-        fprintf( stderr, "Error: Texture image is not in RGB format.\n" );
-        exit( 1 );
+        char textureFile[256];
+        GetTextureFileName( textureMapFiles[i], textureFile, sizeof(textureFile) );
+        if ( !ConvertTextureFile( textureMapFiles[i], textureFile ) ) return 0;
+        printf( "Status: Converted %s to %s.\n", textureMapFiles[i], textureFile );
     }
+    return 1;
+}
 
-    gluBuild2DMipmaps( GL_TEXTURE_2D, GL_RGB, imageWidth, imageHeight,
-                       GL_RGB, GL_UNSIGNED_BYTE, imageData );
 
-    DeallocateImageData( &imageData );
 
 
-// This texture object is for the brick texture map.
+/////////////////////////////////////////////////////////////////////////////
+// Set up texture maps.
+/////////////////////////////////////////////////////////////////////////////
 
-    glGenTextures( 1, &brickTexObj );
-    glBindTexture( GL_TEXTURE_2D, brickTexObj );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
-
-    if ( ReadImageFile( brickTexFile, &imageData, 
-                        &imageWidth, &imageHeight, &numComponents ) == 0 ) exit( 1 );
-    if ( numComponents != 3 )
-    {
-        fprintf( stderr, "Error: Texture image is not in RGB format.\n" );
-        exit( 1 );
-    }
+void SetUpTextureMaps( void )
+{
+    int startTime = glutGet( GLUT_ELAPSED_TIME );
 
-    gluBuild2DMipmaps( GL_TEXTURE_2D, GL_RGB, imageWidth, imageHeight,
-                       GL_RGB, GL_UNSIGNED_BYTE, imageData );
+    glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
 
-    DeallocateImageData( &imageData );
 
+// Read the texture maps in parallel. Only OpenGL calls need to be made by this thread.
 
-// This texture object is for the checkered texture map.
+    bool useTextureFiles = ( GLEW_EXT_texture_compression_s3tc != 0 );
+    TextureMapLoad loads[ NUM_TEXTURE_MAPS ];
+    std::thread loaders[ NUM_TEXTURE_MAPS ];
 
-    glGenTextures( 1, &checkerTexObj );
-    glBindTexture( GL_TEXTURE_2D, checkerTexObj );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
-
-    if ( ReadImageFile( checkerTexFile, &imageData, 
-                        &imageWidth, &imageHeight, &numComponents ) == 0 ) exit( 1 );
-    if ( numComponents != 3 )
+    for ( int i = 0; i < NUM_TEXTURE_MAPS; i++ )
     {
-        fprintf( stderr, "Error: Texture image is not in RGB format.\n" );
-        exit( 1 );
+        loads[i].imageFile = textureMapFiles[i];
+        loads[i].useTextureFile = useTextureFiles;
+        loaders[i] = std::thread( LoadTextureMap, &loads[i] );
     }
 
-    gluBuild2DMipmaps( GL_TEXTURE_2D, GL_RGB, imageWidth, imageHeight,
-                       GL_RGB, GL_UNSIGNED_BYTE, imageData );
-
-    DeallocateImageData( &imageData );
-
-
-// This texture object is for the spots texture map.
+    // Wait for all the loaders before giving up on any texture map.
+    bool allLoaded = true;
+    for ( int i = 0; i < NUM_TEXTURE_MAPS; i++ )
+    {
+        loaders[i].join();
+        if ( !loads[i].ok )
+        {
+            fprintf( stderr, "Error: Cannot load texture map %s.\n", loads[i].imageFile );
+            allLoaded = false;
+        }
+    }
 
-    glGenTextures( 1, &spotsTexObj );
-    glBindTexture( GL_TEXTURE_2D, spotsTexObj );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
-    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
-
-    if ( ReadImageFile( spotsTexFile, &imageData, 
-                        &imageWidth, &imageHeight, &numComponents ) == 0 ) exit( 1 );
-    if ( numComponents != 3 )
+    if ( !allLoaded )
     {
-        fprintf( stderr, "Error: Texture image is not in RGB format.\n" );
+        for ( int i = 0; i < NUM_TEXTURE_MAPS; i++ )
+        {
+            if ( !loads[i].ok ) continue;
+            if ( loads[i].file.data != NULL ) UnmapTextureFile( &loads[i].file );
+            else DeallocateMipmapChain( &loads[i].chain );
+        }
         exit( 1 );
     }
 
-    gluBuild2DMipmaps( GL_TEXTURE_2D, GL_RGB, imageWidth, imageHeight,
-                       GL_RGB, GL_UNSIGNED_BYTE, imageData );
+    int numFromTextureFiles = 0;
+    for ( int i = 0; i < NUM_TEXTURE_MAPS; i++ )
+    {
+        glGenTextures( 1, textureMapObjs[i] );
+        glBindTexture( GL_TEXTURE_2D, *textureMapObjs[i] );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR );
+
+        if ( loads[i].file.data != NULL )
+        {
+            UploadTextureFile( &loads[i].file );
+            UnmapTextureFile( &loads[i].file );
+            numFromTextureFiles++;
+        }
+        else
+        {
+            UploadMipmapChain( &loads[i].chain );
+            DeallocateMipmapChain( &loads[i].chain );
+        }
+    }
 
-    DeallocateImageData( &imageData );
+    printf( "Status: Texture maps loaded in %d ms (%d of %d from texture files).\n\n",
+            glutGet( GLUT_ELAPSED_TIME ) - startTime, numFromTextureFiles, NUM_TEXTURE_MAPS );
 
 
 // This texture object is for storing the reflection image read from the color buffer.
@@ -565,89 +1073,618 @@ void SetUpTextureMaps( void )
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
 
-	DeallocateImageData(&imageData);
+	// Render the reflection image directly into the texture if possible. Otherwise it is
+	// copied from the color buffer, and the mipmap levels are made automatically.
+	if (useFramebufferObjects)
+		SetUpReflectionFramebuffer();
+	if (reflectionFBO == 0)
+		glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
 }
 
 
 
 
 /////////////////////////////////////////////////////////////////////////////
-// The main function.
+// Set up the framebuffer object for rendering the reflection image into
+// reflectionTexObj, which must be bound. reflectionFBO is left as 0 if the
+// framebuffer object is not complete.
 /////////////////////////////////////////////////////////////////////////////
 
-int main( int argc, char** argv )
+void SetUpReflectionFramebuffer( void )
 {
-// Initialize GLUT and create window.
-
-    glutInit( &argc, argv );
-    glutInitDisplayMode ( GLUT_RGB | GLUT_DOUBLE | GLUT_DEPTH );
-    glutInitWindowSize( winWidth, winHeight );
-    glutCreateWindow( "Assign1" );
+    // Allocate the mipmap levels once. They are rewritten every frame.
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, REFLECTION_TEX_MAX_LEVEL );
+    glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA8, REFLECTION_TEX_WIDTH, REFLECTION_TEX_HEIGHT, 0,
+                  GL_RGBA, GL_UNSIGNED_BYTE, NULL );
+    glGenerateMipmap( GL_TEXTURE_2D );
+
+    glGenRenderbuffers( 1, &reflectionDepthRBO );
+    glBindRenderbuffer( GL_RENDERBUFFER, reflectionDepthRBO );
+    glRenderbufferStorage( GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, REFLECTION_TEX_WIDTH, REFLECTION_TEX_HEIGHT );
+    glBindRenderbuffer( GL_RENDERBUFFER, 0 );
+
+    glGenFramebuffers( 1, &reflectionFBO );
+    glBindFramebuffer( GL_FRAMEBUFFER, reflectionFBO );
+    glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, reflectionTexObj, 0 );
+    glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, reflectionDepthRBO );
+    GLenum status = glCheckFramebufferStatus( GL_FRAMEBUFFER );
+    glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+
+    if ( status != GL_FRAMEBUFFER_COMPLETE )
+    {
+        fprintf( stderr, "Warning: Cannot render to the reflection texture map. "
+                         "Copying it from the color buffer instead.\n" );
+        glDeleteFramebuffers( 1, &reflectionFBO );
+        glDeleteRenderbuffers( 1, &reflectionDepthRBO );
+        reflectionFBO = 0;
+        reflectionDepthRBO = 0;
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 1000 );  // The default.
+    }
+}
 
 
-// Register the callback functions.
 
-    glutDisplayFunc( MyDisplay ); 
-    glutReshapeFunc( MyReshape );
-    glutKeyboardFunc( MyKeyboard );
-    glutSpecialFunc( MySpecialKey );
 
+/////////////////////////////////////////////////////////////////////////////
+// Set up the framebuffer object for keeping the rendered frame, for a window
+// of the given size. frameFBO is left as 0 if it is not complete.
+/////////////////////////////////////////////////////////////////////////////
 
-// Initialize GLEW.
-// The followings make sure OpenGL 1.4 is supported and set up the extensions.
+void SetUpFrameCache( int width, int height )
+{
+    if ( width <= 0 || height <= 0 ) return;  // The window is minimized.
 
-    GLenum err = glewInit();
-    if ( err != GLEW_OK )
+    if ( frameTexObj == 0 )
     {
-        fprintf( stderr, "Error: %s.\n", glewGetErrorString( err ) );
-        exit( 1 );
+        glGenTextures( 1, &frameTexObj );
+        glBindTexture( GL_TEXTURE_2D, frameTexObj );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+        glGenRenderbuffers( 1, &frameDepthRBO );
+        glGenFramebuffers( 1, &frameFBO );
     }
-    printf( "Status: Using GLEW %s.\n\n", glewGetString( GLEW_VERSION ) );
 
-    if ( !GLEW_VERSION_1_4 )
-    {
-        fprintf( stderr, "Error: OpenGL 1.4 is not supported.\n" );
-        exit( 1 );
-    }
+    glBindTexture( GL_TEXTURE_2D, frameTexObj );
+    glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL );
+    glBindTexture( GL_TEXTURE_2D, 0 );
 
+    glBindRenderbuffer( GL_RENDERBUFFER, frameDepthRBO );
+    glRenderbufferStorage( GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height );
+    glBindRenderbuffer( GL_RENDERBUFFER, 0 );
 
-// Setup the initial render context.
+    glBindFramebuffer( GL_FRAMEBUFFER, frameFBO );
+    glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, frameTexObj, 0 );
+    glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, frameDepthRBO );
+    GLenum status = glCheckFramebufferStatus( GL_FRAMEBUFFER );
+    glBindFramebuffer( GL_FRAMEBUFFER, 0 );
 
-    GLInit();
-    SetUpTextureMaps();
+    if ( status != GL_FRAMEBUFFER_COMPLETE )
+    {
+        // Render every frame to the window instead.
+        glDeleteFramebuffers( 1, &frameFBO );
+        glDeleteRenderbuffers( 1, &frameDepthRBO );
+        glDeleteTextures( 1, &frameTexObj );
+        frameFBO = 0;
+        frameDepthRBO = 0;
+        frameTexObj = 0;
+    }
+}
 
 
-// Display user instructions in console window.
 
-    printf( "Press LEFT to move eye left.\n" );
-    printf( "Press RIGHT to move eye right.\n" );
-    printf( "Press UP to move eye up.\n" );
-    printf( "Press DOWN to move eye down.\n" );
-    printf( "Press SHIFT+UP to move closer.\n" );
-    printf( "Press SHIFT+DOWN to move further.\n" );
-    printf( "Press 'W' to toggle wireframe.\n" );
-    printf( "Press 'T' to toggle texture mapping.\n" );
-    printf( "Press 'X' to toggle axes.\n" );
-    printf( "Press 'R' to reset to initial view.\n" );
-    printf( "Press 'Q' to quit.\n\n" );
 
+/////////////////////////////////////////////////////////////////////////////
+// Start or stop lighting with phongProgram, if there is one.
+/////////////////////////////////////////////////////////////////////////////
 
-// Enter GLUT event loop.
+void UsePhongShader( bool use )
+{
+    if ( phongProgram == 0 ) return;
 
-    glutMainLoop();
-    return 0;
+    if ( use )
+    {
+        glUseProgram( phongProgram );
+        glUniform1i( phongTexturedLoc, hasTexture );
+    }
+    else
+        glUseProgram( 0 );
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Compile a GLSL shader of the given type.
+// Returns the shader, or 0 if there is an error, which is printed.
+/////////////////////////////////////////////////////////////////////////////
+
+GLuint CompileShader( GLenum type, const char *source )
+{
+    GLuint shader = glCreateShader( type );
+    glShaderSource( shader, 1, &source, NULL );
+    glCompileShader( shader );
+
+    GLint status;
+    glGetShaderiv( shader, GL_COMPILE_STATUS, &status );
+    if ( status != GL_TRUE )
+    {
+        char log[1024];
+        glGetShaderInfoLog( shader, sizeof(log), NULL, log );
+        printf( "Error: Cannot compile %s shader:\n%s\n",
+                ( type == GL_VERTEX_SHADER )? "vertex" : "fragment", log );
+        glDeleteShader( shader );
+        return 0;
+    }
+    return shader;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Make phongProgram from phongVertexShader and phongFragmentShader.
+// phongProgram is left 0 if OpenGL 2.0 is not supported or if there is an error,
+// and then the scene is lit by the fixed-function pipeline.
+/////////////////////////////////////////////////////////////////////////////
+
+void SetUpPhongShader( void )
+{
+    if ( !GLEW_VERSION_2_0 )
+    {
+        printf( "Status: OpenGL 2.0 is not supported. Using fixed-function lighting.\n" );
+        return;
+    }
+
+    GLuint vertexShader = CompileShader( GL_VERTEX_SHADER, phongVertexShader );
+    GLuint fragmentShader = CompileShader( GL_FRAGMENT_SHADER, phongFragmentShader );
+    if ( vertexShader == 0 || fragmentShader == 0 )
+    {
+        glDeleteShader( vertexShader );
+        glDeleteShader( fragmentShader );
+        printf( "Status: Using fixed-function lighting.\n" );
+        return;
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader( program, vertexShader );
+    glAttachShader( program, fragmentShader );
+    glLinkProgram( program );
+
+    // The shaders are deleted together with the program.
+    glDeleteShader( vertexShader );
+    glDeleteShader( fragmentShader );
+
+    GLint status;
+    glGetProgramiv( program, GL_LINK_STATUS, &status );
+    if ( status != GL_TRUE )
+    {
+        char log[1024];
+        glGetProgramInfoLog( program, sizeof(log), NULL, log );
+        printf( "Error: Cannot link shader program:\n%s\n", log );
+        printf( "Status: Using fixed-function lighting.\n" );
+        glDeleteProgram( program );
+        return;
+    }
+
+    phongProgram = program;
+    phongTexturedLoc = glGetUniformLocation( phongProgram, "textured" );
+    glUseProgram( phongProgram );
+    glUniform1i( glGetUniformLocation( phongProgram, "textureMap" ), 0 );
+    glUseProgram( 0 );
+
+    // Give texture object 0 a white texel, so that the shader can read it.
+    GLubyte white[] = { 255, 255, 255, 255 };
+    glBindTexture( GL_TEXTURE_2D, 0 );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+    glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+    glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, white );
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Save the frame times on exit, if requested.
+/////////////////////////////////////////////////////////////////////////////
+
+void SaveProfile( void )
+{
+    if ( profileFile != NULL && ProfilerSaveCSV( profileFile ) )
+        printf( "Status: Frame times saved to %s.\n", profileFile );
+}
+
+
+
+
+// A view rendered by RunCapture().
+typedef struct CaptureView {
+    double eyeLatitude;
+    double eyeLongitude;
+    double eyeDistance;
+}
+CaptureView;
+
+// A frame read back by RunCapture(), to be saved by SaveCapturedFrames().
+typedef struct CapturedFrame {
+    char filename[256];
+    uchar *data;        // RGB, from the bottom row, as taken by SaveImageFile().
+}
+CapturedFrame;
+
+// The frames waiting to be saved, passed from RunCapture() to the thread
+// running SaveCapturedFrames().
+typedef struct CaptureQueue {
+    std::queue<CapturedFrame> frames;
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool done;          // True when no more frames will be added.
+    int width;          // Size of all the frames.
+    int height;
+    int numFailed;      // Number of frames that could not be saved.
+}
+CaptureQueue;
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Read the views for RunCapture() from a text file. Each line has the eye's
+// latitude and longitude in degrees, and its distance from the look-at
+// point, separated by spaces. Empty lines and lines starting with '#' are
+// skipped. (*views) must be deallocated with free().
+// Returns the number of views, or 0 if unsuccessful.
+/////////////////////////////////////////////////////////////////////////////
+
+int ReadCaptureViews( const char *filename, CaptureView **views )
+{
+    FILE *fp = fopen( filename, "r" );
+    if ( fp == NULL )
+    {
+        printf( "Error: Cannot open view file %s.\n", filename );
+        return 0;
+    }
+
+    int numViews = 0, capacity = 0;
+    *views = NULL;
+    char line[256];
+
+    for ( int lineNum = 1; fgets( line, sizeof(line), fp ) != NULL; lineNum++ )
+    {
+        const char *c = line;
+        while ( *c == ' ' || *c == '\t' ) c++;
+        if ( *c == '\0' || *c == '\r' || *c == '\n' || *c == '#' ) continue;
+
+        CaptureView v;
+        if ( sscanf( c, "%lf %lf %lf", &v.eyeLatitude, &v.eyeLongitude, &v.eyeDistance ) != 3 ||
+             v.eyeLatitude < EYE_MIN_LATITUDE || v.eyeLatitude > EYE_MAX_LATITUDE ||
+             v.eyeDistance < EYE_MIN_DIST )
+        {
+            printf( "Error: Invalid view at line %d of %s.\n", lineNum, filename );
+            fclose( fp );
+            free( *views );
+            *views = NULL;
+            return 0;
+        }
+
+        if ( numViews == capacity )
+        {
+            capacity = ( capacity == 0 )? 64 : 2 * capacity;
+            *views = (CaptureView *) realloc( *views, sizeof(CaptureView) * capacity );
+            if ( *views == NULL )
+            {
+                fprintf( stderr, "Error: Not enough memory for the views.\n" );
+                exit( 1 );
+            }
+        }
+        (*views)[ numViews++ ] = v;
+    }
+
+    fclose( fp );
+    if ( numViews == 0 ) printf( "Error: No views in %s.\n", filename );
+    return numViews;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Save the frames in the queue until it is done and empty.
+// Runs in its own thread, and makes no OpenGL calls.
+/////////////////////////////////////////////////////////////////////////////
+
+void SaveCapturedFrames( CaptureQueue *queue )
+{
+    for ( ;; )
+    {
+        std::unique_lock<std::mutex> lock( queue->mutex );
+        while ( queue->frames.empty() && !queue->done ) queue->changed.wait( lock );
+        if ( queue->frames.empty() ) return;
+        CapturedFrame frame = queue->frames.front();
+        queue->frames.pop();
+        lock.unlock();
+
+        if ( !SaveImageFile( frame.filename, frame.data, queue->width, queue->height, 3 ) )
+            queue->numFailed++;   // Only used by this thread until it is joined.
+        free( frame.data );
+    }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Render the views in the file captureEyeFile offscreen, one frame each, and
+// save the frames to image files named by capturePrefix followed by the
+// frame number, e.g. "capture0000.png". The time of each frame is printed.
+//
+// Each frame is read back into one of two pixel buffer objects, so that the
+// next frame is rendered while the GPU copies it. It is then mapped and
+// copied out one frame later, and saved by another thread.
+// A frame that cannot be copied out of its pixel buffer object is not saved.
+// Returns 1 if all the frames are saved or 0 if any frame is not.
+/////////////////////////////////////////////////////////////////////////////
+
+int RunCapture( void )
+{
+    if ( !useFramebufferObjects || !( GLEW_VERSION_2_1 || GLEW_ARB_pixel_buffer_object ) )
+    {
+        printf( "Error: Capturing needs framebuffer objects and pixel buffer objects.\n" );
+        return 0;
+    }
+
+    CaptureView *views;
+    int numViews = ReadCaptureViews( captureEyeFile, &views );
+    if ( numViews == 0 ) return 0;
+
+    // Renders into frameFBO, as when the window is displayed.
+    MyReshape( winWidth, winHeight );
+    if ( frameFBO == 0 )
+    {
+        printf( "Error: Cannot set up the framebuffer object for capturing.\n" );
+        free( views );
+        return 0;
+    }
+
+    const int frameSize = 3 * winWidth * winHeight;
+    GLuint pixelBufObjs[2];
+    glGenBuffers( 2, pixelBufObjs );
+    for ( int i = 0; i < 2; i++ )
+    {
+        glBindBuffer( GL_PIXEL_PACK_BUFFER, pixelBufObjs[i] );
+        glBufferData( GL_PIXEL_PACK_BUFFER, frameSize, NULL, GL_STREAM_READ );
+    }
+    glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+    glPixelStorei( GL_PACK_ALIGNMENT, 1 );
+
+    CaptureQueue queue;
+    queue.done = false;
+    queue.width = winWidth;
+    queue.height = winHeight;
+    queue.numFailed = 0;
+    std::thread saver( SaveCapturedFrames, &queue );
+    int numNotCopied = 0;   // Number of frames that could not be copied out.
+
+    hideFrames = true;
+    double startTime = ProfilerGetTimeMs();
+    double renderMs[2];     // Time to render and read back the frames in pixelBufObjs.
+
+    // Frame i is rendered and read back while frame i - 1 is copied out.
+    for ( int i = 0; i <= numViews; i++ )
+    {
+        if ( i < numViews )
+        {
+            double renderStart = ProfilerGetTimeMs();
+            eyeLatitude = views[i].eyeLatitude;
+            eyeLongitude = views[i].eyeLongitude;
+            eyeDistance = views[i].eyeDistance;
+            frameValid = false;
+            MyDisplay();
+
+            glBindFramebuffer( GL_READ_FRAMEBUFFER, frameFBO );
+            glBindBuffer( GL_PIXEL_PACK_BUFFER, pixelBufObjs[ i % 2 ] );
+            glReadPixels( 0, 0, winWidth, winHeight, GL_RGB, GL_UNSIGNED_BYTE, NULL );
+            glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+            glBindFramebuffer( GL_READ_FRAMEBUFFER, 0 );
+            renderMs[ i % 2 ] = ProfilerGetTimeMs() - renderStart;
+        }
+
+        if ( i > 0 )
+        {
+            int f = i - 1;
+            double waitStart = ProfilerGetTimeMs();
+            CapturedFrame frame;
+            sprintf( frame.filename, "%.240s%04d.png", capturePrefix, f );
+            frame.data = (uchar *) malloc( frameSize );
+            if ( frame.data == NULL )
+            {
+                fprintf( stderr, "Error: Not enough memory for capturing.\n" );
+                exit( 1 );
+            }
+
+            // glUnmapBuffer() returns GL_FALSE if the data became corrupt while mapped.
+            glBindBuffer( GL_PIXEL_PACK_BUFFER, pixelBufObjs[ f % 2 ] );
+            const void *pixels = glMapBuffer( GL_PIXEL_PACK_BUFFER, GL_READ_ONLY );
+            bool copied = ( pixels != NULL );
+            if ( copied )
+            {
+                memcpy( frame.data, pixels, frameSize );
+                copied = ( glUnmapBuffer( GL_PIXEL_PACK_BUFFER ) == GL_TRUE );
+            }
+            glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+            double waitMs = ProfilerGetTimeMs() - waitStart;
+
+            if ( !copied )
+            {
+                printf( "Error: Frame %d could not be copied out, and is not saved.\n", f );
+                free( frame.data );
+                numNotCopied++;
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock( queue.mutex );
+                queue.frames.push( frame );
+            }
+            queue.changed.notify_one();
+
+            printf( "Status: Frame %d: %.3f ms to render, %.3f ms to copy out.\n",
+                    f, renderMs[ f % 2 ], waitMs );
+        }
+    }
+
+    double totalMs = ProfilerGetTimeMs() - startTime;
+    hideFrames = false;
+
+    {
+        std::lock_guard<std::mutex> lock( queue.mutex );
+        queue.done = true;
+    }
+    queue.changed.notify_one();
+    saver.join();
+
+    glDeleteBuffers( 2, pixelBufObjs );
+    free( views );
+
+    printf( "Status: Rendered %d frames in %.1f ms (%.3f ms per frame).\n",
+            numViews, totalMs, totalMs / numViews );
+    int numSaved = numViews - numNotCopied - queue.numFailed;
+    if ( numNotCopied > 0 || queue.numFailed > 0 )
+    {
+        printf( "Error: Saved only %d of %d frames to %s*.png. %d could not be copied out, "
+                "and %d could not be saved.\n", numSaved, numViews, capturePrefix, numNotCopied, queue.numFailed );
+        return 0;
+    }
+    printf( "Status: Saved %d frames to %s*.png.\n", numViews, capturePrefix );
+    return 1;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// The main function.
+/////////////////////////////////////////////////////////////////////////////
+
+int main( int argc, char** argv )
+{
+// Converting the texture maps needs no window.
+
+    if ( argc == 2 && strcmp( argv[1], "--convert-textures" ) == 0 )
+        return ConvertTextureMaps()? 0 : 1;
+
+// Initialize GLUT and create window.
+
+    glutInit( &argc, argv );
+
+// Read the command-line options that are left by GLUT.
+
+    for ( int i = 1; i < argc; i++ )
+    {
+        if ( strcmp( argv[i], "--profile" ) == 0 && i + 1 < argc )
+            profileFile = argv[++i];
+        else if ( strcmp( argv[i], "--fixed-function" ) == 0 )
+            usePhongShader = false;
+        else if ( strcmp( argv[i], "--capture" ) == 0 && i + 2 < argc )
+        {
+            captureEyeFile = argv[++i];
+            capturePrefix = argv[++i];
+        }
+        else
+        {
+            fprintf( stderr, "Usage: %s [--profile <CSV file>] [--fixed-function]\n"
+                             "                [--capture <view file> <image filename prefix>]\n"
+                             "       %s --convert-textures\n", argv[0], argv[0] );
+            exit( 1 );
+        }
+    }
+
+    glutInitDisplayMode ( GLUT_RGB | GLUT_DOUBLE | GLUT_DEPTH | GLUT_STENCIL );
+    glutInitWindowSize( winWidth, winHeight );
+    glutCreateWindow( "Assign1" );
+    if ( captureEyeFile != NULL ) glutHideWindow();  // Only needed for the OpenGL context.
+
+
+// Register the callback functions.
+
+    glutDisplayFunc( MyDisplay ); 
+    glutReshapeFunc( MyReshape );
+    glutKeyboardFunc( MyKeyboard );
+    glutSpecialFunc( MySpecialKey );
+
+
+// Initialize GLEW.
+// The followings make sure OpenGL 1.4 is supported and set up the extensions.
+
+    GLenum err = glewInit();
+    if ( err != GLEW_OK )
+    {
+        fprintf( stderr, "Error: %s.\n", glewGetErrorString( err ) );
+        exit( 1 );
+    }
+    printf( "Status: Using GLEW %s.\n\n", glewGetString( GLEW_VERSION ) );
+
+    if ( !GLEW_VERSION_1_4 )
+    {
+        fprintf( stderr, "Error: OpenGL 1.4 is not supported.\n" );
+        exit( 1 );
+    }
+
+    useFramebufferObjects = ( GLEW_VERSION_3_0 || GLEW_ARB_framebuffer_object );
+
+    GLint stencilBits = 0;
+    glGetIntegerv( GL_STENCIL_BITS, &stencilBits );
+    hasStencil = ( stencilBits > 0 );
+
+
+// Setup the initial render context.
+
+    GLInit();
+    SetUpTextureMaps();
+    ProfilerInit( NUM_PROFILE_SECTIONS, profileSectionNames );
+    atexit( SaveProfile );
+
+
+// Render the views to capture offscreen instead, if requested.
+
+    if ( captureEyeFile != NULL )
+        return RunCapture()? 0 : 1;
+
+
+// Display user instructions in console window.
+
+    printf( "Press LEFT to move eye left.\n" );
+    printf( "Press RIGHT to move eye right.\n" );
+    printf( "Press UP to move eye up.\n" );
+    printf( "Press DOWN to move eye down.\n" );
+    printf( "Press SHIFT+UP to move closer.\n" );
+    printf( "Press SHIFT+DOWN to move further.\n" );
+    printf( "Press 'W' to toggle wireframe.\n" );
+    printf( "Press 'T' to toggle texture mapping.\n" );
+    printf( "Press 'X' to toggle axes.\n" );
+    printf( "Press 'F' to toggle profiling overlay.\n" );
+    printf( "Press 'M' to switch between texture and stencil reflection.\n" );
+    printf( "Press 'B' to benchmark the reflection modes.\n" );
+    printf( "Press 'R' to reset to initial view.\n" );
+    printf( "Press 'Q' to quit.\n\n" );
+
+
+// Enter GLUT event loop.
+
+    glutMainLoop();
+    return 0;
 }
 
 
 
 
 //============================================================================
-//============================================================================
-// Functions below are for modeling the 3D objects.
-//============================================================================
-//============================================================================
+//============================================================================
+// Functions below are for modeling the 3D objects.
+//============================================================================
+//============================================================================
 
 
 /////////////////////////////////////////////////////////////////////////////
@@ -682,75 +1719,563 @@ void DrawAxes( double length )
 
 
 /////////////////////////////////////////////////////////////////////////////
-// Subdivide input quad into uSteps x vSteps smaller quads, and draw them.
-// The first vertex of the input quad has texture coordinates (s0, t0) and
-// vertex position (x0, y0, z0), and so on.
+// Make room for numVertices more vertices and numIndices more indices in the
+// static geometry arrays.
+/////////////////////////////////////////////////////////////////////////////
+
+void GrowStaticArrays( int numVertices, int numIndices )
+{
+    static int vertexCapacity = 0;
+    static int indexCapacity = 0;
+
+    // The indices are unsigned shorts.
+    if ( numStaticVertices + numVertices > 65536 )
+    {
+        fprintf( stderr, "Error: Too many vertices in static geometry.\n" );
+        exit( 1 );
+    }
+
+    if ( numStaticVertices + numVertices > vertexCapacity )
+    {
+        vertexCapacity = 2 * ( numStaticVertices + numVertices );
+        staticVertices = (StaticVertex *) realloc( staticVertices, sizeof(StaticVertex) * vertexCapacity );
+    }
+    if ( numStaticIndices + numIndices > indexCapacity )
+    {
+        indexCapacity = 2 * ( numStaticIndices + numIndices );
+        staticIndices = (GLushort *) realloc( staticIndices, sizeof(GLushort) * indexCapacity );
+    }
+    if ( staticVertices == NULL || staticIndices == NULL )
+    {
+        fprintf( stderr, "Error: Cannot allocate memory for static geometry.\n" );
+        exit( 1 );
+    }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Subdivide input quad into uSteps x vSteps smaller quads, and add them to
+// the static geometry arrays. All the vertices have the normal vector
+// (nx, ny, nz). The first vertex of the input quad has texture coordinates
+// (s0, t0) and vertex position (x0, y0, z0), and so on.
 //
 // The vertices of the input quad should be given in anti-clockwise order.
 //
 // The texture coordinates at the input vertices are bilinearly
-// interpolated to the newly created vertices.
+// interpolated to the newly created vertices. The smaller quads share
+// their vertices, which are added as a (uSteps + 1) x (vSteps + 1) grid.
+//
+// The subdivision is only for fixed-function lighting, which is computed at
+// the vertices, to show the sharp specular highlights. With per-pixel
+// lighting (see phongProgram), the input quad is added as it is.
 /////////////////////////////////////////////////////////////////////////////
 
-void SubdivideAndDrawQuad( int uSteps, int vSteps,
-                           float s0, float t0, float x0, float y0, float z0,
-                           float s1, float t1, float x1, float y1, float z1,
-                           float s2, float t2, float x2, float y2, float z2,
-                           float s3, float t3, float x3, float y3, float z3 )
+void SubdivideQuad( int uSteps, int vSteps, float nx, float ny, float nz,
+                    float s0, float t0, float x0, float y0, float z0,
+                    float s1, float t1, float x1, float y1, float z1,
+                    float s2, float t2, float x2, float y2, float z2,
+                    float s3, float t3, float x3, float y3, float z3 )
 {
-    float tc0[3] = { s0, t0, 0.0 };  float v0[3] = { x0, y0, z0 };
-    float tc1[3] = { s1, t1, 0.0 };  float v1[3] = { x1, y1, z1 };
-    float tc2[3] = { s2, t2, 0.0 };  float v2[3] = { x2, y2, z2 };
-    float tc3[3] = { s3, t3, 0.0 };  float v3[3] = { x3, y3, z3 };
+    float tc0[2] = { s0, t0 };  float v0[3] = { x0, y0, z0 };
+    float tc1[2] = { s1, t1 };  float v1[3] = { x1, y1, z1 };
+    float tc2[2] = { s2, t2 };  float v2[3] = { x2, y2, z2 };
+    float tc3[2] = { s3, t3 };  float v3[3] = { x3, y3, z3 };
 
-    glBegin( GL_QUADS );
+    if ( phongProgram != 0 ) uSteps = vSteps = 1;
 
-    for ( int u = 0; u < uSteps; u++ )
+    GrowStaticArrays( ( uSteps + 1 ) * ( vSteps + 1 ), 4 * uSteps * vSteps );
+    int firstVertex = numStaticVertices;
+
+    for ( int u = 0; u <= uSteps; u++ )
     {
         float uu = (float) u / uSteps;
-        float uu1 = (float) (u + 1) / uSteps;
-        float Atc[3], Btc[3], Ctc[3], Dtc[3];
-        float Av[3], Bv[3], Cv[3], Dv[3];
+        float Atc[2], Btc[2];
+        float Av[3], Bv[3];
 
+        for ( int i = 0; i < 2; i++ )
+        {
+            Atc[i] = tc0[i] + uu * ( tc1[i] - tc0[i] );
+            Btc[i] = tc3[i] + uu * ( tc2[i] - tc3[i] );
+        }
         for ( int i = 0; i < 3; i++ )
         {
-            Atc[i] = tc0[i] + uu  * ( tc1[i] - tc0[i] );
-            Btc[i] = tc3[i] + uu  * ( tc2[i] - tc3[i] );
-            Ctc[i] = tc0[i] + uu1 * ( tc1[i] - tc0[i] );
-            Dtc[i] = tc3[i] + uu1 * ( tc2[i] - tc3[i] );
-            Av[i] = v0[i] + uu  * ( v1[i] - v0[i] );
-            Bv[i] = v3[i] + uu  * ( v2[i] - v3[i] );
-            Cv[i] = v0[i] + uu1 * ( v1[i] - v0[i] );
-            Dv[i] = v3[i] + uu1 * ( v2[i] - v3[i] );
+            Av[i] = v0[i] + uu * ( v1[i] - v0[i] );
+            Bv[i] = v3[i] + uu * ( v2[i] - v3[i] );
         }
 
-        for ( int v = 0; v < vSteps; v++ )
+        for ( int v = 0; v <= vSteps; v++ )
         {
             float vv = (float) v / vSteps;
-            float vv1 = (float) (v + 1) / vSteps;
-            float Etc[3], Ftc[3], Gtc[3], Htc[3];
-            float Ev[3], Fv[3], Gv[3], Hv[3];
+            StaticVertex *sv = &staticVertices[ numStaticVertices++ ];
+
+            for ( int i = 0; i < 2; i++ ) sv->tc[i] = Atc[i] + vv * ( Btc[i] - Atc[i] );
+            for ( int i = 0; i < 3; i++ ) sv->v[i] = Av[i] + vv * ( Bv[i] - Av[i] );
+            sv->n[0] = nx;  sv->n[1] = ny;  sv->n[2] = nz;
+        }
+    }
+
+    // Each smaller quad is at grid vertices (u, v), (u+1, v), (u+1, v+1), (u, v+1).
+    for ( int u = 0; u < uSteps; u++ )
+        for ( int v = 0; v < vSteps; v++ )
+        {
+            int e = firstVertex + u * ( vSteps + 1 ) + v;
+            staticIndices[ numStaticIndices++ ] = (GLushort) e;
+            staticIndices[ numStaticIndices++ ] = (GLushort) ( e + vSteps + 1 );
+            staticIndices[ numStaticIndices++ ] = (GLushort) ( e + vSteps + 2 );
+            staticIndices[ numStaticIndices++ ] = (GLushort) ( e + 1 );
+        }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Add an axis-aligned box, from corner (x1, y1, z1) to corner (x2, y2, z2),
+// to the static geometry arrays. Its faces are facing outwards.
+/////////////////////////////////////////////////////////////////////////////
+
+void AddBox( float x1, float y1, float z1, float x2, float y2, float z2 )
+{
+    SubdivideQuad( 1, 1,  1.0, 0.0, 0.0,  0.0, 0.0, x2, y1, z1,  1.0, 0.0, x2, y2, z1,  1.0, 1.0, x2, y2, z2,  0.0, 1.0, x2, y1, z2 );
+    SubdivideQuad( 1, 1, -1.0, 0.0, 0.0,  0.0, 0.0, x1, y2, z1,  1.0, 0.0, x1, y1, z1,  1.0, 1.0, x1, y1, z2,  0.0, 1.0, x1, y2, z2 );
+    SubdivideQuad( 1, 1,  0.0, 1.0, 0.0,  0.0, 0.0, x2, y2, z1,  1.0, 0.0, x1, y2, z1,  1.0, 1.0, x1, y2, z2,  0.0, 1.0, x2, y2, z2 );
+    SubdivideQuad( 1, 1,  0.0,-1.0, 0.0,  0.0, 0.0, x1, y1, z1,  1.0, 0.0, x2, y1, z1,  1.0, 1.0, x2, y1, z2,  0.0, 1.0, x1, y1, z2 );
+    SubdivideQuad( 1, 1,  0.0, 0.0, 1.0,  0.0, 0.0, x1, y1, z2,  1.0, 0.0, x2, y1, z2,  1.0, 1.0, x2, y2, z2,  0.0, 1.0, x1, y2, z2 );
+    SubdivideQuad( 1, 1,  0.0, 0.0,-1.0,  0.0, 0.0, x1, y1, z1,  1.0, 0.0, x1, y2, z1,  1.0, 1.0, x2, y2, z1,  0.0, 1.0, x2, y1, z1 );
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Add a sphere centered at the origin, with the given number of slices around
+// the z-axis and stacks along the z-axis, to the static geometry arrays.
+// Like glutSolidSphere(), but also with texture coordinates, which go from 0
+// to 1 around the z-axis and from the -z pole to the +z pole.
+/////////////////////////////////////////////////////////////////////////////
+
+void AddSphere( float radius, int slices, int stacks )
+{
+    GrowStaticArrays( ( slices + 1 ) * ( stacks + 1 ), 4 * slices * stacks );
+    int firstVertex = numStaticVertices;
+
+    for ( int i = 0; i <= slices; i++ )
+    {
+        double theta = 2.0 * PI * i / slices;
+
+        for ( int j = 0; j <= stacks; j++ )
+        {
+            double phi = PI * j / stacks;
+            StaticVertex *sv = &staticVertices[ numStaticVertices++ ];
+
+            sv->n[0] = (float) ( sin( phi ) * cos( theta ) );
+            sv->n[1] = (float) ( sin( phi ) * sin( theta ) );
+            sv->n[2] = (float) -cos( phi );
+            for ( int k = 0; k < 3; k++ ) sv->v[k] = radius * sv->n[k];
+            sv->tc[0] = (float) i / slices;
+            sv->tc[1] = (float) j / stacks;
+        }
+    }
+
+    // The quads at the poles have two vertices at the same position, like in glutSolidSphere().
+    for ( int i = 0; i < slices; i++ )
+        for ( int j = 0; j < stacks; j++ )
+        {
+            int e = firstVertex + i * ( stacks + 1 ) + j;
+            staticIndices[ numStaticIndices++ ] = (GLushort) e;
+            staticIndices[ numStaticIndices++ ] = (GLushort) ( e + stacks + 1 );
+            staticIndices[ numStaticIndices++ ] = (GLushort) ( e + stacks + 2 );
+            staticIndices[ numStaticIndices++ ] = (GLushort) ( e + 1 );
+        }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Draw glutSolidTeapot( size ) in feedback mode, into a buffer of bufferSize
+// values, with the vertex format GL_3D_COLOR_TEXTURE. The vertex colors are
+// lit if lighting is true.
+// Returns the number of values in the buffer, or -1 if it is too small.
+/////////////////////////////////////////////////////////////////////////////
+
+GLint FeedbackTeapot( double size, bool lighting, GLfloat *buffer, int bufferSize )
+{
+    if ( lighting )
+        glEnable( GL_LIGHTING );
+    else
+        glDisable( GL_LIGHTING );
+
+    glFeedbackBuffer( bufferSize, GL_3D_COLOR_TEXTURE, buffer );
+    glRenderMode( GL_FEEDBACK );
+    glutSolidTeapot( size );
+    return glRenderMode( GL_RENDER );
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Add the polygons drawn by glutSolidTeapot( size ) to the static geometry
+// arrays, with the texture coordinates that GLUT generates for them.
+// They are captured in feedback mode, which gives the vertices in window
+// coordinates, so they are drawn in a view volume that is mapped back here.
+// Feedback mode does not give the normal vectors, so a second pass is lit
+// such that the color of each vertex is 0.5 + 0.5 * (its normal vector).
+// If any normal vector read back this way is not of unit length, e.g. if
+// the colors were clamped or quantized too coarsely, the teapot is not
+// captured, and is drawn by glutSolidTeapot() instead.
+// Each polygon is added as quads, where the last quad repeats its last
+// vertex if it is really a triangle.
+// Returns false if the teapot cannot be captured, e.g. if there are too
+// many vertices.
+/////////////////////////////////////////////////////////////////////////////
+
+bool CaptureTeapot( double size )
+{
+    const int VIEWPORT_SIZE = 1024;
+    const double R = 2.0 * size;    // The view volume is a cube from -R to R, which contains the teapot.
+    const int VALUES_PER_VERTEX = 11;   // Position, color and texture coordinates.
+    const double NORMAL_TOLERANCE = 0.05;   // Largest error allowed in the length of a normal vector.
+
+    glPushAttrib( GL_ALL_ATTRIB_BITS );
+    glDisable( GL_CULL_FACE );
+    glDisable( GL_COLOR_MATERIAL );
+    glEnable( GL_NORMALIZE );
+    glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
+    glViewport( 0, 0, VIEWPORT_SIZE, VIEWPORT_SIZE );
+    glDepthRange( 0.0, 1.0 );
+
+    glMatrixMode( GL_PROJECTION );
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho( -R, R, -R, R, -R, R );
+    glMatrixMode( GL_TEXTURE );
+    glPushMatrix();
+    glLoadIdentity();
+    glMatrixMode( GL_MODELVIEW );
+    glPushMatrix();
+    glLoadIdentity();
+
+    // Lights 0 to 5 shine along the +x, -x, +y, -y, +z and -z axes, and add
+    // +0.5 or -0.5 times the component of the normal vector along the axis to
+    // the red, green or blue. The global ambient light adds 0.5.
+    GLfloat black[] = { 0.0, 0.0, 0.0, 1.0 };
+    GLfloat gray[] = { 0.5, 0.5, 0.5, 1.0 };
+    GLfloat white[] = { 1.0, 1.0, 1.0, 1.0 };
+    glLightModelfv( GL_LIGHT_MODEL_AMBIENT, gray );
+    glLightModeli( GL_LIGHT_MODEL_TWO_SIDE, GL_FALSE );
+    glLightModeli( GL_LIGHT_MODEL_COLOR_CONTROL, GL_SINGLE_COLOR );
+    glMaterialfv( GL_FRONT_AND_BACK, GL_AMBIENT, white );
+    glMaterialfv( GL_FRONT_AND_BACK, GL_DIFFUSE, white );
+    glMaterialfv( GL_FRONT_AND_BACK, GL_SPECULAR, black );
+    glMaterialfv( GL_FRONT_AND_BACK, GL_EMISSION, black );
+    for ( int i = 0; i < 6; i++ )
+    {
+        GLfloat direction[] = { 0.0, 0.0, 0.0, 0.0 };
+        GLfloat diffuse[] = { 0.0, 0.0, 0.0, 1.0 };
+        direction[ i / 2 ] = ( i % 2 == 0 )? 1.0f : -1.0f;
+        diffuse[ i / 2 ] = 0.5f * direction[ i / 2 ];
+
+        glLightfv( GL_LIGHT0 + i, GL_POSITION, direction );
+        glLightfv( GL_LIGHT0 + i, GL_AMBIENT, black );
+        glLightfv( GL_LIGHT0 + i, GL_DIFFUSE, diffuse );
+        glLightfv( GL_LIGHT0 + i, GL_SPECULAR, black );
+        glEnable( GL_LIGHT0 + i );
+    }
+    glDisable( GL_LIGHT6 );
+    glDisable( GL_LIGHT7 );
+
+    int bufferSize = 1 << 19;
+    GLfloat *buffer = NULL;
+    GLfloat *normalBuffer = NULL;
+    GLint numValues, numNormalValues;
+    for (;;)
+    {
+        buffer = (GLfloat *) realloc( buffer, sizeof(GLfloat) * bufferSize );
+        normalBuffer = (GLfloat *) realloc( normalBuffer, sizeof(GLfloat) * bufferSize );
+        if ( buffer == NULL || normalBuffer == NULL )
+        {
+            fprintf( stderr, "Error: Cannot allocate memory for teapot.\n" );
+            exit( 1 );
+        }
+
+        numValues = FeedbackTeapot( size, false, buffer, bufferSize );
+        numNormalValues = FeedbackTeapot( size, true, normalBuffer, bufferSize );
+        if ( numValues >= 0 && numNormalValues >= 0 ) break;
+        bufferSize *= 2;
+    }
+
+    glPopMatrix();
+    glMatrixMode( GL_TEXTURE );
+    glPopMatrix();
+    glMatrixMode( GL_PROJECTION );
+    glPopMatrix();
+    glMatrixMode( GL_MODELVIEW );
+    glPopAttrib();
+
+    // Check that both passes have the same polygons, that the normal vectors
+    // are of unit length, and count the vertices.
+    bool ok = ( numValues == numNormalValues );
+    int numVertices = 0;
+    for ( int i = 0; ok && i < numValues; )
+    {
+        int n = ( i + 1 < numValues )? (int) buffer[i + 1] : 0;
+        ok = ( buffer[i] == (GLfloat) GL_POLYGON_TOKEN && normalBuffer[i] == (GLfloat) GL_POLYGON_TOKEN &&
+               normalBuffer[i + 1] == buffer[i + 1] && n >= 3 &&
+               i + 2 + n * VALUES_PER_VERTEX <= numValues );
+
+        for ( int k = 0; ok && k < n; k++ )
+        {
+            const GLfloat *nv = &normalBuffer[ i + 2 + k * VALUES_PER_VERTEX ];
+            double len = 0.0;
+            for ( int j = 0; j < 3; j++ )
+                len += ( 2.0 * nv[3 + j] - 1.0 ) * ( 2.0 * nv[3 + j] - 1.0 );
+            ok = ( fabs( sqrt( len ) - 1.0 ) <= NORMAL_TOLERANCE );
+        }
+
+        numVertices += n;
+        i += 2 + n * VALUES_PER_VERTEX;
+    }
+    if ( numStaticVertices + numVertices > 65536 ) ok = false;
+
+    // Add the polygons.
+    for ( int i = 0; ok && i < numValues; )
+    {
+        int n = (int) buffer[i + 1];
+        const GLfloat *v = &buffer[i + 2];
+        const GLfloat *nv = &normalBuffer[i + 2];
+        i += 2 + n * VALUES_PER_VERTEX;
+
+        int numQuads = ( n - 1 ) / 2;
+        GrowStaticArrays( n, 4 * numQuads );
+        int firstVertex = numStaticVertices;
+
+        for ( int k = 0; k < n; k++, v += VALUES_PER_VERTEX, nv += VALUES_PER_VERTEX )
+        {
+            StaticVertex *sv = &staticVertices[ numStaticVertices++ ];
 
-            for ( int i = 0; i < 3; i++ )
+            // Inverse of the orthographic projection and the viewport transformation.
+            sv->v[0] = (float) ( ( 2.0 * v[0] / VIEWPORT_SIZE - 1.0 ) * R );
+            sv->v[1] = (float) ( ( 2.0 * v[1] / VIEWPORT_SIZE - 1.0 ) * R );
+            sv->v[2] = (float) ( ( 1.0 - 2.0 * v[2] ) * R );
+            sv->tc[0] = v[7];
+            sv->tc[1] = v[8];
+
+            double n[3], len = 0.0;
+            for ( int j = 0; j < 3; j++ )
             {
-                Etc[i] = Atc[i] + vv  * ( Btc[i] - Atc[i] );
-                Ftc[i] = Ctc[i] + vv  * ( Dtc[i] - Ctc[i] );
-                Gtc[i] = Atc[i] + vv1 * ( Btc[i] - Atc[i] );
-                Htc[i] = Ctc[i] + vv1 * ( Dtc[i] - Ctc[i] );
-                Ev[i] = Av[i] + vv  * ( Bv[i] - Av[i] );
-                Fv[i] = Cv[i] + vv  * ( Dv[i] - Cv[i] );
-                Gv[i] = Av[i] + vv1 * ( Bv[i] - Av[i] );
-                Hv[i] = Cv[i] + vv1 * ( Dv[i] - Cv[i] );
+                n[j] = 2.0 * nv[3 + j] - 1.0;
+                len += n[j] * n[j];
             }
+            len = ( len > 0.0 )? sqrt( len ) : 1.0;
+            for ( int j = 0; j < 3; j++ ) sv->n[j] = (float) ( n[j] / len );
+        }
 
-            glTexCoord2fv( Etc );  glVertex3fv( Ev );
-            glTexCoord2fv( Ftc );  glVertex3fv( Fv );
-            glTexCoord2fv( Htc );  glVertex3fv( Hv );
-            glTexCoord2fv( Gtc );  glVertex3fv( Gv );
+        for ( int q = 0; q < numQuads; q++ )
+        {
+            int k = 2 * q + 1;
+            staticIndices[ numStaticIndices++ ] = (GLushort) firstVertex;
+            staticIndices[ numStaticIndices++ ] = (GLushort) ( firstVertex + k );
+            staticIndices[ numStaticIndices++ ] = (GLushort) ( firstVertex + k + 1 );
+            staticIndices[ numStaticIndices++ ] = (GLushort) ( firstVertex + ( ( k + 2 < n )? k + 2 : k + 1 ) );
         }
     }
 
-    glEnd();
+    free( buffer );
+    free( normalBuffer );
+    return ok;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Make the vertex and index arrays of the room, the table, the teapot and the
+// sphere, which do not change. If OpenGL 1.5 is supported, they are copied to
+// buffer objects.
+/////////////////////////////////////////////////////////////////////////////
+
+void BuildStaticGeometry( void )
+{
+    const float ROOM_HALF_WIDTH = ROOM_WIDTH / 2.0f;
+
+// Ceiling.
+
+    staticPartStart[ PART_CEILING ] = numStaticIndices;
+    SubdivideQuad( 24, 24, 0.0, 0.0, -1.0,
+                           0.0, 0.0, ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, ROOM_HEIGHT, 
+                           ROOM_WIDTH, 0.0, ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, ROOM_HEIGHT, 
+                           ROOM_WIDTH, ROOM_WIDTH, -ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, ROOM_HEIGHT, 
+                           0.0, ROOM_WIDTH, -ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, ROOM_HEIGHT );
+
+// Walls.
+
+    staticPartStart[ PART_WALLS ] = numStaticIndices;
+
+    // In +y direction.
+    SubdivideQuad( 24, 16, 0.0, -1.0, 0.0,
+                           0.0, 0.0, -ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, 0.0, 
+                           ROOM_WIDTH/2, 0.0, ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, 0.0, 
+                           ROOM_WIDTH/2, ROOM_HEIGHT/2, ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, ROOM_HEIGHT, 
+                           0.0, ROOM_HEIGHT/2, -ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, ROOM_HEIGHT );
+    // In -y direction.
+    SubdivideQuad( 24, 16, 0.0, 1.0, 0.0,
+                           0.0, 0.0, ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, 0.0, 
+                           ROOM_WIDTH/2, 0.0, -ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, 0.0, 
+                           ROOM_WIDTH/2, ROOM_HEIGHT/2, -ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, ROOM_HEIGHT, 
+                           0.0, ROOM_HEIGHT/2, ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, ROOM_HEIGHT );
+    // In +x direction.
+    SubdivideQuad( 24, 16, -1.0, 0.0, 0.0,
+                           0.0, 0.0, ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, 0.0, 
+                           ROOM_WIDTH/2, 0.0, ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, 0.0, 
+                           ROOM_WIDTH/2, ROOM_HEIGHT/2, ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, ROOM_HEIGHT, 
+                           0.0, ROOM_HEIGHT/2, ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, ROOM_HEIGHT );
+    // In -x direction.
+    SubdivideQuad( 24, 16, 1.0, 0.0, 0.0,
+                           0.0, 0.0, -ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, 0.0, 
+                           ROOM_WIDTH/2, 0.0, -ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, 0.0, 
+                           ROOM_WIDTH/2, ROOM_HEIGHT/2, -ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, ROOM_HEIGHT, 
+                           0.0, ROOM_HEIGHT/2, -ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, ROOM_HEIGHT );
+
+// Floor.
+
+    staticPartStart[ PART_FLOOR ] = numStaticIndices;
+    SubdivideQuad( 24, 24, 0.0, 0.0, 1.0,
+                           0.0, 0.0, ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, 0.0, 
+                           ROOM_WIDTH, 0.0, ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, 0.0, 
+                           ROOM_WIDTH, ROOM_WIDTH, -ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, 0.0, 
+                           0.0, ROOM_WIDTH, -ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, 0.0 );
+
+// Tabletop.
+
+    // The texture coordinates map the reflection texture map onto it.
+    staticPartStart[ PART_TABLETOP ] = numStaticIndices;
+    SubdivideQuad( 24, 24, 0.0, 0.0, 1.0,
+                           0.0, 1.0, TABLETOP_X2, TABLETOP_Y1, TABLETOP_Z,
+                           1.0, 1.0, TABLETOP_X2, TABLETOP_Y2, TABLETOP_Z,
+                           1.0, 0.0, TABLETOP_X1, TABLETOP_Y2, TABLETOP_Z,
+                           0.0, 0.0, TABLETOP_X1, TABLETOP_Y1, TABLETOP_Z );
+
+// Sides and bottom of the table.
+
+    staticPartStart[ PART_TABLE_SIDES ] = numStaticIndices;
+
+    // In +y direction.
+    SubdivideQuad( 24, 2,  0.0, 1.0, 0.0,
+                           0.0, 0.0, TABLETOP_X2, TABLETOP_Y2, TABLETOP_Z - TABLE_THICKNESS, 
+                           1.0, 0.0, TABLETOP_X1, TABLETOP_Y2, TABLETOP_Z - TABLE_THICKNESS, 
+                           1.0, 1.0, TABLETOP_X1, TABLETOP_Y2, TABLETOP_Z, 
+                           0.0, 1.0, TABLETOP_X2, TABLETOP_Y2, TABLETOP_Z );
+    // In -y direction.
+    SubdivideQuad( 24, 2,  0.0, -1.0, 0.0,
+                           0.0, 0.0, TABLETOP_X1, TABLETOP_Y1, TABLETOP_Z - TABLE_THICKNESS, 
+                           1.0, 0.0, TABLETOP_X2, TABLETOP_Y1, TABLETOP_Z - TABLE_THICKNESS, 
+                           1.0, 1.0, TABLETOP_X2, TABLETOP_Y1, TABLETOP_Z, 
+                           0.0, 1.0, TABLETOP_X1, TABLETOP_Y1, TABLETOP_Z );
+    // In +x direction.
+    SubdivideQuad( 24, 2,  1.0, 0.0, 0.0,
+                           0.0, 0.0, TABLETOP_X2, TABLETOP_Y1, TABLETOP_Z - TABLE_THICKNESS, 
+                           1.0, 0.0, TABLETOP_X2, TABLETOP_Y2, TABLETOP_Z - TABLE_THICKNESS, 
+                           1.0, 1.0, TABLETOP_X2, TABLETOP_Y2, TABLETOP_Z, 
+                           0.0, 1.0, TABLETOP_X2, TABLETOP_Y1, TABLETOP_Z );
+    // In -x direction.
+    SubdivideQuad( 24, 2,  -1.0, 0.0, 0.0,
+                           0.0, 0.0, TABLETOP_X1, TABLETOP_Y2, TABLETOP_Z - TABLE_THICKNESS, 
+                           1.0, 0.0, TABLETOP_X1, TABLETOP_Y1, TABLETOP_Z - TABLE_THICKNESS, 
+                           1.0, 1.0, TABLETOP_X1, TABLETOP_Y1, TABLETOP_Z, 
+                           0.0, 1.0, TABLETOP_X1, TABLETOP_Y2, TABLETOP_Z );
+    // Bottom.
+    SubdivideQuad( 24, 24, 0.0, 0.0, -1.0,
+                           0.0, 0.0, TABLETOP_X1, TABLETOP_Y1, TABLETOP_Z - TABLE_THICKNESS, 
+                           1.0, 0.0, TABLETOP_X1, TABLETOP_Y2, TABLETOP_Z - TABLE_THICKNESS, 
+                           1.0, 1.0, TABLETOP_X2, TABLETOP_Y2, TABLETOP_Z - TABLE_THICKNESS, 
+                           0.0, 1.0, TABLETOP_X2, TABLETOP_Y1, TABLETOP_Z - TABLE_THICKNESS );
+
+// Legs.
+
+    // Each leg is TABLE_THICKNESS wide, and centered TABLE_THICKNESS from the corners of the tabletop.
+    staticPartStart[ PART_TABLE_LEGS ] = numStaticIndices;
+
+    const float LEG_X[4] = { TABLETOP_X1 + TABLE_THICKNESS, TABLETOP_X2 - TABLE_THICKNESS,
+                             TABLETOP_X2 - TABLE_THICKNESS, TABLETOP_X1 + TABLE_THICKNESS };
+    const float LEG_Y[4] = { TABLETOP_Y1 + TABLE_THICKNESS, TABLETOP_Y1 + TABLE_THICKNESS,
+                             TABLETOP_Y2 - TABLE_THICKNESS, TABLETOP_Y2 - TABLE_THICKNESS };
+    for ( int i = 0; i < 4; i++ )
+        AddBox( LEG_X[i] - TABLE_THICKNESS / 2, LEG_Y[i] - TABLE_THICKNESS / 2, 0.0,
+                LEG_X[i] + TABLE_THICKNESS / 2, LEG_Y[i] + TABLE_THICKNESS / 2, TABLETOP_Z - TABLE_THICKNESS );
+
+// Sphere.
+
+    for ( int lod = 0; lod < SPHERE_LODS; lod++ )
+    {
+        staticPartStart[ PART_SPHERE + lod ] = numStaticIndices;
+        AddSphere( SPHERE_RADIUS, 8 << lod, 4 << lod );
+    }
+
+// Teapot.
+
+    // Added last, because it is left out if there are too many vertices.
+    staticPartStart[ PART_TEAPOT ] = numStaticIndices;
+    hasTeapotMesh = CaptureTeapot( TEAPOT_SIZE );
+    if ( !hasTeapotMesh )
+        printf( "Status: Cannot capture the teapot. It is drawn by GLUT.\n" );
+
+    staticPartStart[ NUM_STATIC_PARTS ] = numStaticIndices;
+
+// Copy the arrays to buffer objects.
+
+    if ( GLEW_VERSION_1_5 )
+    {
+        glGenBuffers( 1, &staticVertexBufObj );
+        glBindBuffer( GL_ARRAY_BUFFER, staticVertexBufObj );
+        glBufferData( GL_ARRAY_BUFFER, sizeof(StaticVertex) * numStaticVertices, staticVertices, GL_STATIC_DRAW );
+        glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+        glGenBuffers( 1, &staticIndexBufObj );
+        glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, staticIndexBufObj );
+        glBufferData( GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * numStaticIndices, staticIndices, GL_STATIC_DRAW );
+        glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
+
+        free( staticVertices );
+        free( staticIndices );
+        staticVertices = NULL;
+        staticIndices = NULL;
+    }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Draw a part of the static geometry, with the current material and texture.
+/////////////////////////////////////////////////////////////////////////////
+
+void DrawStaticPart( StaticPart part )
+{
+    int first = staticPartStart[ part ];
+    int count = staticPartStart[ part + 1 ] - first;
+
+    glPushClientAttrib( GL_CLIENT_VERTEX_ARRAY_BIT );
+
+    if ( staticVertexBufObj != 0 )
+    {
+        glBindBuffer( GL_ARRAY_BUFFER, staticVertexBufObj );
+        glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, staticIndexBufObj );
+        glInterleavedArrays( GL_T2F_N3F_V3F, 0, NULL );
+        glDrawElements( GL_QUADS, count, GL_UNSIGNED_SHORT, (const GLvoid *) ( sizeof(GLushort) * first ) );
+        glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
+        glBindBuffer( GL_ARRAY_BUFFER, 0 );
+    }
+    else
+    {
+        glInterleavedArrays( GL_T2F_N3F_V3F, 0, staticVertices );
+        glDrawElements( GL_QUADS, count, GL_UNSIGNED_SHORT, staticIndices + first );
+    }
+
+    glPopClientAttrib();
 }
 
 
@@ -763,7 +2288,7 @@ void SubdivideAndDrawQuad( int uSteps, int vSteps,
 
 void DrawRoom( void )
 {
-    const float ROOM_HALF_WIDTH = ROOM_WIDTH / 2.0f;
+    ProfilerBeginSection( PROFILE_ROOM );
 
     glTexEnvf( GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE );
 
@@ -779,40 +2304,12 @@ void DrawRoom( void )
     glMaterialfv( GL_FRONT_AND_BACK, GL_SHININESS, matShininess1 );
 
     glBindTexture( GL_TEXTURE_2D, ceilingTexObj );
-    glNormal3f( 0.0, 0.0, -1.0 ); // Normal vector.
-    SubdivideAndDrawQuad( 24, 24, 0.0, 0.0, ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, ROOM_HEIGHT, 
-                                  ROOM_WIDTH, 0.0, ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, ROOM_HEIGHT, 
-                                  ROOM_WIDTH, ROOM_WIDTH, -ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, ROOM_HEIGHT, 
-                                  0.0, ROOM_WIDTH, -ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, ROOM_HEIGHT );
+    DrawStaticPart( PART_CEILING );
 
 // Walls.
 
     glBindTexture( GL_TEXTURE_2D, brickTexObj );
-
-    // In +y direction.
-    glNormal3f( 0.0, -1.0, 0.0 ); // Normal vector.
-    SubdivideAndDrawQuad( 24, 16, 0.0, 0.0, -ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, 0.0, 
-                                  ROOM_WIDTH/2, 0.0, ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, 0.0, 
-                                  ROOM_WIDTH/2, ROOM_HEIGHT/2, ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, ROOM_HEIGHT, 
-                                  0.0, ROOM_HEIGHT/2, -ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, ROOM_HEIGHT );
-    // In -y direction.
-    glNormal3f( 0.0, 1.0, 0.0 ); // Normal vector.
-    SubdivideAndDrawQuad( 24, 16, 0.0, 0.0, ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, 0.0, 
-                                  ROOM_WIDTH/2, 0.0, -ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, 0.0, 
-                                  ROOM_WIDTH/2, ROOM_HEIGHT/2, -ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, ROOM_HEIGHT, 
-                                  0.0, ROOM_HEIGHT/2, ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, ROOM_HEIGHT );
-    // In +x direction.
-    glNormal3f( -1.0, 0.0, 0.0 ); // Normal vector.
-    SubdivideAndDrawQuad( 24, 16, 0.0, 0.0, ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, 0.0, 
-                                  ROOM_WIDTH/2, 0.0, ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, 0.0, 
-                                  ROOM_WIDTH/2, ROOM_HEIGHT/2, ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, ROOM_HEIGHT, 
-                                  0.0, ROOM_HEIGHT/2, ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, ROOM_HEIGHT );
-    // In -x direction.
-    glNormal3f( 1.0, 0.0, 0.0 ); // Normal vector.
-    SubdivideAndDrawQuad( 24, 16, 0.0, 0.0, -ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, 0.0, 
-                                  ROOM_WIDTH/2, 0.0, -ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, 0.0, 
-                                  ROOM_WIDTH/2, ROOM_HEIGHT/2, -ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, ROOM_HEIGHT, 
-                                  0.0, ROOM_HEIGHT/2, -ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, ROOM_HEIGHT );
+    DrawStaticPart( PART_WALLS );
 
 // Floor.
 
@@ -826,11 +2323,9 @@ void DrawRoom( void )
     glMaterialfv( GL_FRONT_AND_BACK, GL_SHININESS, matShininess2 );
 
     glBindTexture( GL_TEXTURE_2D, checkerTexObj );
-    glNormal3f( 0.0, 0.0, 1.0 ); // Normal vector.
-    SubdivideAndDrawQuad( 24, 24, 0.0, 0.0, ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, 0.0, 
-                                  ROOM_WIDTH, 0.0, ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, 0.0, 
-                                  ROOM_WIDTH, ROOM_WIDTH, -ROOM_HALF_WIDTH, ROOM_HALF_WIDTH, 0.0, 
-                                  0.0, ROOM_WIDTH, -ROOM_HALF_WIDTH, -ROOM_HALF_WIDTH, 0.0 );
+    DrawStaticPart( PART_FLOOR );
+
+    ProfilerEndSection( PROFILE_ROOM );
 }
 
 
@@ -842,7 +2337,9 @@ void DrawRoom( void )
 
 void DrawTeapot( void )
 {
-    double size = 0.45;
+    ProfilerBeginSection( PROFILE_TEAPOT );
+
+    double size = TEAPOT_SIZE;
 
     GLfloat matAmbient[] = { 0.8, 0.8, 0.8, 1.0 };
     GLfloat matDiffuse[] = { 0.8, 0.8, 0.8, 1.0 };
@@ -856,18 +2353,56 @@ void DrawTeapot( void )
     glTexEnvf( GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE );
     glBindTexture( GL_TEXTURE_2D, spotsTexObj );
 
-    glFrontFace( GL_CW ); // Need to do this because the built-in teapot is modelled using clockwise polygon winding.
+    // Need to reverse the polygon winding because the built-in teapot is modelled using
+    // clockwise polygon winding. It is already reversed if the scene is mirrored.
+    GLint frontFace;
+    glGetIntegerv( GL_FRONT_FACE, &frontFace );
+    glFrontFace( ( frontFace == GL_CCW )? GL_CW : GL_CCW );
     glDisable( GL_CULL_FACE );  // Disable back-face culling.
 
     glPushMatrix();
     glTranslated( -0.3, -0.5, size * 0.75 + TABLETOP_Z );
     glRotated( 90.0, 0.0, 0.0, 1.0 );
     glRotated( 90.0, 1.0, 0.0, 0.0 );
-    glutSolidTeapot( size ); // This function also generates texture coordinates on the teapot.
+    if ( hasTeapotMesh )
+        DrawStaticPart( PART_TEAPOT );
+    else
+        glutSolidTeapot( size ); // This function also generates texture coordinates on the teapot.
     glPopMatrix();
 
     glEnable( GL_CULL_FACE );	// Enable back-face culling.
-    glFrontFace( GL_CCW );		// Go back to counter-clockwise polygon winding.
+    glFrontFace( frontFace );	// Go back to the previous polygon winding.
+
+    ProfilerEndSection( PROFILE_TEAPOT );
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Returns the level of detail of a sphere of the given radius, centered at
+// the origin of the current modelview coordinates, for the current projection
+// and viewport. The level has slices about SPHERE_SLICE_PIXELS pixels wide
+// at the silhouette, or as close to it as there is.
+/////////////////////////////////////////////////////////////////////////////
+
+int SelectSphereLOD( double radius )
+{
+    GLdouble modelview[16], projection[16];
+    GLint viewport[4];
+    glGetDoublev( GL_MODELVIEW_MATRIX, modelview );
+    glGetDoublev( GL_PROJECTION_MATRIX, projection );
+    glGetIntegerv( GL_VIEWPORT, viewport );
+
+    // Distance of the center from the eye, and the radius in pixels.
+    double dist = sqrt( modelview[12] * modelview[12] + modelview[13] * modelview[13] + modelview[14] * modelview[14] );
+    if ( dist <= radius ) return SPHERE_LODS - 1;
+    double pixelRadius = radius * projection[5] * viewport[3] / ( 2.0 * dist );
+
+    double slices = 2.0 * PI * pixelRadius / SPHERE_SLICE_PIXELS;
+    int lod = 0;
+    while ( lod < SPHERE_LODS - 1 && ( 8 << lod ) < slices ) lod++;
+    return lod;
 }
 
 
@@ -879,7 +2414,9 @@ void DrawTeapot( void )
 
 void DrawSphere( void )
 {
-    double radius = 0.35;
+    ProfilerBeginSection( PROFILE_SPHERE );
+
+    double radius = SPHERE_RADIUS;
 
     GLfloat matAmbient[] = { 0.7, 0.5, 0.2, 1.0 };
     GLfloat matDiffuse[] = { 0.7, 0.5, 0.2, 1.0 };
@@ -894,8 +2431,10 @@ void DrawSphere( void )
 
     glPushMatrix();
     glTranslated( 0.3, 0.5, radius + TABLETOP_Z );
-    glutSolidSphere( radius, 32, 16 );
+    DrawStaticPart( (StaticPart) ( PART_SPHERE + SelectSphereLOD( radius ) ) );
     glPopMatrix();
+
+    ProfilerEndSection( PROFILE_SPHERE );
 }
 
 
@@ -908,6 +2447,8 @@ void DrawSphere( void )
 
 void DrawTable( void )
 {
+    ProfilerBeginSection( PROFILE_TABLE );
+
 // Tabletop.
 
     GLfloat matAmbient1[] = { 0.4, 0.6, 0.8, 1.0 };
@@ -922,8 +2463,8 @@ void DrawTable( void )
     //********************************************************
     //*********** TASK #1: WRITE YOUR CODE BELOW *************
     //********************************************************
-    // Must use the SubdivideAndDrawQuad() function to draw the tabletop rectangle.
-    // So that the tabletop has small enough quads to show the sharp specular highlight.
+    // The tabletop rectangle is subdivided by SubdivideQuad() in BuildStaticGeometry(),
+    // so that the tabletop has small enough quads to show the sharp specular highlight.
     //
     // Correct texture coordinates must be provided at the vertices of the tabletop rectangle,
     // so that the reflection tecture map is correctly mapped on it.
@@ -932,17 +2473,39 @@ void DrawTable( void )
     // and the underlying diffuse color and lighting on the tabletop must still be visible.
     //********************************************************
 
-	glBindTexture(GL_TEXTURE_2D, reflectionTexObj);
+	if (reflectionMode == REFLECTION_STENCIL && hasTexture)
+	{
+		// The reflection is already drawn where the tabletop is (see DrawMirroredScene()).
+		// Blend the tabletop with it like the reflection texture with GL_MODULATE and
+		// GL_SEPARATE_SPECULAR_COLOR: multiply by the ambient and diffuse color, then add
+		// the specular color. The depth of the tabletop is already in the depth buffer.
+		GLfloat black[] = { 0.0, 0.0, 0.0, 1.0 };
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glEnable(GL_BLEND);
+		glDepthFunc(GL_LEQUAL);
+
+		glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, black);
+		glBlendFunc(GL_DST_COLOR, GL_ZERO);
+		DrawStaticPart(PART_TABLETOP);
+
+		glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, black);
+		glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, black);
+		glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, matSpecular1);
+		glBlendFunc(GL_ONE, GL_ONE);
+		DrawStaticPart(PART_TABLETOP);
 
-	glNormal3f(0.0, 0.0, 1.0);
-	SubdivideAndDrawQuad(24, 24, 0.0, 1.0, TABLETOP_X2, TABLETOP_Y1, TABLETOP_Z,
-								 1.0, 1.0, TABLETOP_X2, TABLETOP_Y2, TABLETOP_Z,
-								 1.0, 0.0, TABLETOP_X1, TABLETOP_Y2, TABLETOP_Z,
-								 0.0, 0.0, TABLETOP_X1, TABLETOP_Y1, TABLETOP_Z);
+		glDepthFunc(GL_LESS);
+		glDisable(GL_BLEND);
+	}
+	else
+	{
+		glBindTexture(GL_TEXTURE_2D, reflectionTexObj);
+		DrawStaticPart(PART_TABLETOP);
+	}
 
 
 
-// Sides.
+// Sides and bottom.
 
     GLfloat matAmbient2[] = { 0.2, 0.3, 0.4, 1.0 };
     GLfloat matDiffuse2[] = { 0.2, 0.3, 0.4, 1.0 };
@@ -954,39 +2517,7 @@ void DrawTable( void )
     glMaterialfv( GL_FRONT_AND_BACK, GL_SHININESS, matShininess2 );
 
     glBindTexture( GL_TEXTURE_2D, 0 ); // Texture object ID == 0 means no texture mapping.
-
-    // In +y direction.
-    glNormal3f( 0.0, 1.0, 0.0 ); // Normal vector.
-    SubdivideAndDrawQuad( 24, 2,  0.0, 0.0, TABLETOP_X2, TABLETOP_Y2, TABLETOP_Z - TABLE_THICKNESS, 
-                                  1.0, 0.0, TABLETOP_X1, TABLETOP_Y2, TABLETOP_Z - TABLE_THICKNESS, 
-                                  1.0, 1.0, TABLETOP_X1, TABLETOP_Y2, TABLETOP_Z, 
-                                  0.0, 1.0, TABLETOP_X2, TABLETOP_Y2, TABLETOP_Z );
-    // In -y direction.
-    glNormal3f( 0.0, -1.0, 0.0 ); // Normal vector.
-    SubdivideAndDrawQuad( 24, 2,  0.0, 0.0, TABLETOP_X1, TABLETOP_Y1, TABLETOP_Z - TABLE_THICKNESS, 
-                                  1.0, 0.0, TABLETOP_X2, TABLETOP_Y1, TABLETOP_Z - TABLE_THICKNESS, 
-                                  1.0, 1.0, TABLETOP_X2, TABLETOP_Y1, TABLETOP_Z, 
-                                  0.0, 1.0, TABLETOP_X1, TABLETOP_Y1, TABLETOP_Z );
-    // In +x direction.
-    glNormal3f( 1.0, 0.0, 0.0 ); // Normal vector.
-    SubdivideAndDrawQuad( 24, 2,  0.0, 0.0, TABLETOP_X2, TABLETOP_Y1, TABLETOP_Z - TABLE_THICKNESS, 
-                                  1.0, 0.0, TABLETOP_X2, TABLETOP_Y2, TABLETOP_Z - TABLE_THICKNESS, 
-                                  1.0, 1.0, TABLETOP_X2, TABLETOP_Y2, TABLETOP_Z, 
-                                  0.0, 1.0, TABLETOP_X2, TABLETOP_Y1, TABLETOP_Z );
-    // In -x direction.
-    glNormal3f( -1.0, 0.0, 0.0 ); // Normal vector.
-    SubdivideAndDrawQuad( 24, 2,  0.0, 0.0, TABLETOP_X1, TABLETOP_Y2, TABLETOP_Z - TABLE_THICKNESS, 
-                                  1.0, 0.0, TABLETOP_X1, TABLETOP_Y1, TABLETOP_Z - TABLE_THICKNESS, 
-                                  1.0, 1.0, TABLETOP_X1, TABLETOP_Y1, TABLETOP_Z, 
-                                  0.0, 1.0, TABLETOP_X1, TABLETOP_Y2, TABLETOP_Z );
-
-// Bottom.
-
-    glNormal3f( 0.0, 0.0, -1.0 ); // Normal vector.
-    SubdivideAndDrawQuad( 24, 24, 0.0, 0.0, TABLETOP_X1, TABLETOP_Y1, TABLETOP_Z - TABLE_THICKNESS, 
-                                  1.0, 0.0, TABLETOP_X1, TABLETOP_Y2, TABLETOP_Z - TABLE_THICKNESS, 
-                                  1.0, 1.0, TABLETOP_X2, TABLETOP_Y2, TABLETOP_Z - TABLE_THICKNESS, 
-                                  0.0, 1.0, TABLETOP_X2, TABLETOP_Y1, TABLETOP_Z - TABLE_THICKNESS );
+    DrawStaticPart( PART_TABLE_SIDES );
 
 // Legs.
 
@@ -999,31 +2530,7 @@ void DrawTable( void )
     glMaterialfv( GL_FRONT_AND_BACK, GL_SPECULAR, matSpecular3 );
     glMaterialfv( GL_FRONT_AND_BACK, GL_SHININESS, matShininess3 );
 
-    glPushMatrix();
-    glTranslated( TABLETOP_X1 + TABLE_THICKNESS, TABLETOP_Y1 + TABLE_THICKNESS, 0.0 );
-    glScaled( TABLE_THICKNESS, TABLE_THICKNESS, TABLETOP_Z - TABLE_THICKNESS );
-    glTranslated( 0.0, 0.0, 0.5 );
-    glutSolidCube( 1.0 );
-    glPopMatrix();
-
-    glPushMatrix();
-    glTranslated( TABLETOP_X2 - TABLE_THICKNESS, TABLETOP_Y1 + TABLE_THICKNESS, 0.0 );
-    glScaled( TABLE_THICKNESS, TABLE_THICKNESS, TABLETOP_Z - TABLE_THICKNESS );
-    glTranslated( 0.0, 0.0, 0.5 );
-    glutSolidCube( 1.0 );
-    glPopMatrix();
+    DrawStaticPart( PART_TABLE_LEGS );
 
-    glPushMatrix();
-    glTranslated( TABLETOP_X2 - TABLE_THICKNESS, TABLETOP_Y2 - TABLE_THICKNESS, 0.0 );
-    glScaled( TABLE_THICKNESS, TABLE_THICKNESS, TABLETOP_Z - TABLE_THICKNESS );
-    glTranslated( 0.0, 0.0, 0.5 );
-    glutSolidCube( 1.0 );
-    glPopMatrix();
-
-    glPushMatrix();
-    glTranslated( TABLETOP_X1 + TABLE_THICKNESS, TABLETOP_Y2 - TABLE_THICKNESS, 0.0 );
-    glScaled( TABLE_THICKNESS, TABLE_THICKNESS, TABLETOP_Z - TABLE_THICKNESS );
-    glTranslated( 0.0, 0.0, 0.5 );
-    glutSolidCube( 1.0 );
-    glPopMatrix();
+    ProfilerEndSection( PROFILE_TABLE );
 }
@@ -1,8 +1,28 @@
 #ifndef _IMAGE_IO_H_
 #define _IMAGE_IO_H_
 
+#include <stddef.h>
+
 typedef unsigned char uchar;
 
+
+// Allocates size bytes for the image data returned by ReadImageFile().
+// Returns NULL if there is not enough memory.
+typedef void *(*ImageAllocator)( size_t size );
+
+
+// An image read by ReadImageFileDirect(). The image data is in the memory
+// that FreeImage read the image into.
+typedef struct ImageFile {
+    const uchar *data;          // The image data, laid out as by ReadImageFile().
+    int width;
+    int height;
+    int numComponents;
+    void *bitmap;               // The FIBITMAP that holds the image data.
+}
+ImageFile;
+
+
 /////////////////////////////////////////////////////////////////////////////
 // Deallocate the memory allocated to (*imageData) returned by 
 // the function ReadImageFile().
@@ -24,11 +44,35 @@ extern void DeallocateImageData( uchar **imageData );
 // and alpha arranged from lower to higher memory addresses. 
 // Each color channel take one byte.
 // The first pixel (origin of the image) is at the bottom-left of the image.
+// The image data is allocated with allocate(), or with malloc() if allocate
+// is NULL. Only image data allocated with malloc() can be deallocated with
+// DeallocateImageData().
 /////////////////////////////////////////////////////////////////////////////
 
 extern int ReadImageFile( const char *filename, uchar **imageData,
                    int *imageWidth, int *imageHeight, int *numComponents,
-				   int flags = 0 );
+				   int flags = 0, ImageAllocator allocate = NULL );
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Read an image from the input filename, like ReadImageFile(), but without
+// copying the image data. The image data stays in the memory that FreeImage
+// read the image into, and is converted there to the layout returned by
+// ReadImageFile(). This needs no work if the layout already matches, i.e.
+// for grey images and images in RGB(A) order whose rows have no padding.
+// Returns 1 if successful or 0 if unsuccessful.
+// The image must be released with ReleaseImageFile().
+/////////////////////////////////////////////////////////////////////////////
+
+extern int ReadImageFileDirect( const char *filename, ImageFile *image, int flags = 0 );
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Release the image read by ReadImageFileDirect().
+// image->data will be set to NULL.
+/////////////////////////////////////////////////////////////////////////////
+
+extern void ReleaseImageFile( ImageFile *image );
 
 
 /////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,329 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <GL/glew.h>
+#include <GL/glut.h>
+#include "profiler.h"
+
+
+#define MAX_CALLS       4   // Calls of a section in a frame that are timed on the GPU.
+#define QUERY_FRAMES    4   // Number of frames whose timer queries can be in flight.
+#define HISTORY         60  // Number of frames averaged in the overlay.
+
+
+// Times of the sections in a frame, in milliseconds.
+typedef struct FrameTimes {
+    float cpuMs[ PROFILER_MAX_SECTIONS ];   // Negative if the section is not in the frame.
+    float gpuMs[ PROFILER_MAX_SECTIONS ];   // Negative if not measured.
+}
+FrameTimes;
+
+
+static int numSections = 0;
+static const char *const *sectionNames = NULL;
+static bool useTimerQueries = false;
+
+// Timestamp queries at the start and the end of each timed call of each section,
+// for each frame in flight. The current frame uses slot currentSlot.
+static GLuint queries[ QUERY_FRAMES ][ PROFILER_MAX_SECTIONS ][ MAX_CALLS ][ 2 ];
+static int numQueryCalls[ QUERY_FRAMES ][ PROFILER_MAX_SECTIONS ];
+static int slotFrame[ QUERY_FRAMES ];   // The frame using each slot, or -1.
+static int currentSlot = 0;
+
+static double sectionStartTime[ PROFILER_MAX_SECTIONS ];
+
+// Times of all the frames so far. The last one is the current frame.
+// Only frames 0 to numCompleteFrames - 1 have their GPU times.
+static FrameTimes *frames = NULL;
+static int numFrames = 0;
+static int frameCapacity = 0;
+static int numCompleteFrames = 0;
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Returns the time in milliseconds from an arbitrary starting point.
+/////////////////////////////////////////////////////////////////////////////
+
+double ProfilerGetTimeMs( void )
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency = { 0 };
+    if ( frequency.QuadPart == 0 ) QueryPerformanceFrequency( &frequency );
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter( &counter );
+    return 1000.0 * (double) counter.QuadPart / (double) frequency.QuadPart;
+#else
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return 1000.0 * t.tv_sec + t.tv_nsec / 1.0e6;
+#endif
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Start a new current frame, in slot currentSlot.
+/////////////////////////////////////////////////////////////////////////////
+
+static void NewFrame( void )
+{
+    if ( numFrames == frameCapacity )
+    {
+        frameCapacity = ( frameCapacity == 0 )? 1024 : 2 * frameCapacity;
+        frames = (FrameTimes *) realloc( frames, sizeof(FrameTimes) * frameCapacity );
+        if ( frames == NULL )
+        {
+            fprintf( stderr, "Error: Not enough memory for profiling.\n" );
+            exit( 1 );
+        }
+    }
+
+    FrameTimes *f = &frames[ numFrames ];
+    for ( int s = 0; s < PROFILER_MAX_SECTIONS; s++ )
+    {
+        f->cpuMs[s] = -1.0f;
+        f->gpuMs[s] = -1.0f;
+        numQueryCalls[ currentSlot ][s] = 0;
+    }
+    slotFrame[ currentSlot ] = numFrames;
+    numFrames++;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Read the results of the timer queries in the slot into its frame.
+/////////////////////////////////////////////////////////////////////////////
+
+static void ReadQueries( int slot )
+{
+    FrameTimes *f = &frames[ slotFrame[slot] ];
+
+    for ( int s = 0; s < numSections; s++ )
+    {
+        if ( numQueryCalls[slot][s] == 0 ) continue;
+
+        GLuint64 sum = 0;
+        for ( int c = 0; c < numQueryCalls[slot][s]; c++ )
+        {
+            GLuint64 start, end;
+            glGetQueryObjectui64v( queries[slot][s][c][0], GL_QUERY_RESULT, &start );
+            glGetQueryObjectui64v( queries[slot][s][c][1], GL_QUERY_RESULT, &end );
+            sum += end - start;
+        }
+        f->gpuMs[s] = (float) ( sum / 1.0e6 );
+    }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Set up the profiler for numSections sections, with the given names.
+// The names are not copied. Must be called after OpenGL is initialized.
+/////////////////////////////////////////////////////////////////////////////
+
+void ProfilerInit( int _numSections, const char *const _sectionNames[] )
+{
+    numSections = ( _numSections < PROFILER_MAX_SECTIONS )? _numSections : PROFILER_MAX_SECTIONS;
+    sectionNames = _sectionNames;
+
+    useTimerQueries = ( GLEW_VERSION_3_3 || GLEW_ARB_timer_query );
+    if ( useTimerQueries )
+        glGenQueries( QUERY_FRAMES * PROFILER_MAX_SECTIONS * MAX_CALLS * 2, &queries[0][0][0][0] );
+    else
+        printf( "Status: Timer queries are not supported. Only CPU times are measured.\n" );
+
+    for ( int i = 0; i < QUERY_FRAMES; i++ ) slotFrame[i] = -1;
+    currentSlot = 0;
+    NewFrame();
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Start and stop timing a section in the current frame.
+/////////////////////////////////////////////////////////////////////////////
+
+void ProfilerBeginSection( int section )
+{
+    if ( section < 0 || section >= numSections ) return;
+
+    int call = numQueryCalls[ currentSlot ][ section ];
+    if ( useTimerQueries && call < MAX_CALLS )
+        glQueryCounter( queries[ currentSlot ][ section ][ call ][0], GL_TIMESTAMP );
+
+    sectionStartTime[ section ] = ProfilerGetTimeMs();
+}
+
+
+void ProfilerEndSection( int section )
+{
+    if ( section < 0 || section >= numSections ) return;
+
+    double time = ProfilerGetTimeMs() - sectionStartTime[ section ];
+    FrameTimes *f = &frames[ numFrames - 1 ];
+    f->cpuMs[ section ] = (float) ( ( f->cpuMs[ section ] < 0.0f )? time : f->cpuMs[ section ] + time );
+
+    int call = numQueryCalls[ currentSlot ][ section ];
+    if ( useTimerQueries && call < MAX_CALLS )
+    {
+        glQueryCounter( queries[ currentSlot ][ section ][ call ][1], GL_TIMESTAMP );
+        numQueryCalls[ currentSlot ][ section ]++;
+    }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// End the current frame. Call after the frame is completed, e.g. after
+// swapping the buffers.
+/////////////////////////////////////////////////////////////////////////////
+
+void ProfilerEndFrame( void )
+{
+    if ( frames == NULL ) return;  // Not set up.
+
+    if ( !useTimerQueries )
+    {
+        numCompleteFrames = numFrames;
+        NewFrame();
+        return;
+    }
+
+    // The oldest frame in flight gives its slot to the new frame.
+    currentSlot = ( currentSlot + 1 ) % QUERY_FRAMES;
+    if ( slotFrame[ currentSlot ] >= 0 )
+    {
+        ReadQueries( currentSlot );
+        numCompleteFrames = slotFrame[ currentSlot ] + 1;
+    }
+    NewFrame();
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Draw the average CPU and GPU time of each section, over the last frames
+// that the section was in, at the top-left corner of a window of the given
+// size. Uses the fixed-function pipeline.
+/////////////////////////////////////////////////////////////////////////////
+
+void ProfilerDrawOverlay( int winWidth, int winHeight )
+{
+    const int LINE_HEIGHT = 15;
+    const int MARGIN = 8;
+
+    char lines[ PROFILER_MAX_SECTIONS + 1 ][64];
+    int numLines = 0;
+
+    sprintf( lines[ numLines++ ], "%-12s %8s %8s", "ms", "CPU", "GPU" );
+
+    int firstFrame = ( numCompleteFrames > HISTORY )? numCompleteFrames - HISTORY : 0;
+    for ( int s = 0; s < numSections; s++ )
+    {
+        double cpuSum = 0.0, gpuSum = 0.0;
+        int cpuCount = 0, gpuCount = 0;
+        for ( int i = firstFrame; i < numCompleteFrames; i++ )
+        {
+            if ( frames[i].cpuMs[s] >= 0.0f ) { cpuSum += frames[i].cpuMs[s]; cpuCount++; }
+            if ( frames[i].gpuMs[s] >= 0.0f ) { gpuSum += frames[i].gpuMs[s]; gpuCount++; }
+        }
+
+        char cpu[16] = "-", gpu[16] = "-";
+        if ( cpuCount > 0 ) sprintf( cpu, "%.3f", cpuSum / cpuCount );
+        if ( gpuCount > 0 ) sprintf( gpu, "%.3f", gpuSum / gpuCount );
+        sprintf( lines[ numLines++ ], "%-12.12s %8s %8s", sectionNames[s], cpu, gpu );
+    }
+
+    glPushAttrib( GL_ALL_ATTRIB_BITS );
+    glDisable( GL_LIGHTING );
+    glDisable( GL_TEXTURE_2D );
+    glDisable( GL_DEPTH_TEST );
+    glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
+
+    glMatrixMode( GL_PROJECTION );
+    glPushMatrix();
+    glLoadIdentity();
+    gluOrtho2D( 0.0, winWidth, 0.0, winHeight );
+    glMatrixMode( GL_MODELVIEW );
+    glPushMatrix();
+    glLoadIdentity();
+
+    // Darken the background of the text.
+    glEnable( GL_BLEND );
+    glBlendFunc( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA );
+    glColor4f( 0.0, 0.0, 0.0, 0.6 );
+    glRecti( 0, winHeight - numLines * LINE_HEIGHT - 2 * MARGIN, 32 * 8 + 2 * MARGIN, winHeight );
+    glDisable( GL_BLEND );
+
+    glColor3f( 1.0, 1.0, 0.0 );
+    for ( int i = 0; i < numLines; i++ )
+    {
+        glRasterPos2i( MARGIN, winHeight - MARGIN - ( i + 1 ) * LINE_HEIGHT + 3 );
+        for ( const char *c = lines[i]; *c != '\0'; c++ )
+            glutBitmapCharacter( GLUT_BITMAP_8_BY_13, *c );
+    }
+
+    glPopMatrix();
+    glMatrixMode( GL_PROJECTION );
+    glPopMatrix();
+    glMatrixMode( GL_MODELVIEW );
+    glPopAttrib();
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Save the times of all the frames with complete GPU times to a CSV file,
+// one frame per line. The times are in milliseconds, and are empty for
+// sections that are not in the frame.
+// Returns 1 if successful or 0 if unsuccessful.
+/////////////////////////////////////////////////////////////////////////////
+
+int ProfilerSaveCSV( const char *filename )
+{
+    FILE *fp = fopen( filename, "w" );
+    if ( fp == NULL )
+    {
+        printf( "Error: Cannot write profile file %s.\n", filename );
+        return 0;
+    }
+
+    fprintf( fp, "frame" );
+    for ( int s = 0; s < numSections; s++ )
+        fprintf( fp, ",%s CPU ms,%s GPU ms", sectionNames[s], sectionNames[s] );
+    fprintf( fp, "\n" );
+
+    for ( int i = 0; i < numCompleteFrames; i++ )
+    {
+        fprintf( fp, "%d", i );
+        for ( int s = 0; s < numSections; s++ )
+        {
+            fprintf( fp, "," );
+            if ( frames[i].cpuMs[s] >= 0.0f ) fprintf( fp, "%.4f", frames[i].cpuMs[s] );
+            fprintf( fp, "," );
+            if ( frames[i].gpuMs[s] >= 0.0f ) fprintf( fp, "%.4f", frames[i].gpuMs[s] );
+        }
+        fprintf( fp, "\n" );
+    }
+
+    if ( fclose( fp ) != 0 )
+    {
+        printf( "Error: Cannot write profile file %s.\n", filename );
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,66 @@
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+// Measures the CPU time and the GPU time of named sections of each frame.
+// The GPU time is measured with timestamp queries, if OpenGL 3.3 or
+// ARB_timer_query is supported. The query results are read a few frames
+// later, so that waiting for them does not stall the GPU.
+//
+// A section can be timed several times in a frame, and the times are added up.
+// Sections can be nested in other sections, but not in themselves.
+
+#define PROFILER_MAX_SECTIONS   16
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Set up the profiler for numSections sections, with the given names.
+// The names are not copied. Must be called after OpenGL is initialized.
+/////////////////////////////////////////////////////////////////////////////
+
+extern void ProfilerInit( int numSections, const char *const sectionNames[] );
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Start and stop timing a section in the current frame.
+/////////////////////////////////////////////////////////////////////////////
+
+extern void ProfilerBeginSection( int section );
+
+extern void ProfilerEndSection( int section );
+
+
+/////////////////////////////////////////////////////////////////////////////
+// End the current frame. Call after the frame is completed, e.g. after
+// swapping the buffers.
+/////////////////////////////////////////////////////////////////////////////
+
+extern void ProfilerEndFrame( void );
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Draw the average CPU and GPU time of each section, over the last frames
+// that the section was in, at the top-left corner of a window of the given
+// size. Uses the fixed-function pipeline.
+/////////////////////////////////////////////////////////////////////////////
+
+extern void ProfilerDrawOverlay( int winWidth, int winHeight );
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Returns the time in milliseconds from an arbitrary starting point, from the
+// clock that the CPU times are measured with.
+/////////////////////////////////////////////////////////////////////////////
+
+extern double ProfilerGetTimeMs( void );
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Save the times of all the frames with complete GPU times to a CSV file,
+// one frame per line. The times are in milliseconds, and are empty for
+// sections that are not in the frame.
+// Returns 1 if successful or 0 if unsuccessful.
+/////////////////////////////////////////////////////////////////////////////
+
+extern int ProfilerSaveCSV( const char *filename );
+
+#endif
@@ -0,0 +1,714 @@
+#ifdef _WIN32
+#include <windows.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <GL/glew.h>
+#include "image_io.h"
+#include "texture_file.h"
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Returns the largest power of two that is not larger than n (at least 1).
+/////////////////////////////////////////////////////////////////////////////
+
+static int FloorPowerOfTwo( int n )
+{
+    int p = 1;
+    while ( 2 * p <= n ) p *= 2;
+    return p;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Scale the image to newWidth x newHeight with bilinear interpolation.
+/////////////////////////////////////////////////////////////////////////////
+
+static void ScaleImage( const uchar *src, int width, int height, int numComponents,
+                        uchar *dst, int newWidth, int newHeight )
+{
+    for ( int y = 0; y < newHeight; y++ )
+    {
+        float fy = ( y + 0.5f ) * height / newHeight - 0.5f;
+        if ( fy < 0.0f ) fy = 0.0f;
+        int y0 = (int) fy;
+        int y1 = ( y0 + 1 < height )? y0 + 1 : y0;
+        float ty = fy - y0;
+
+        for ( int x = 0; x < newWidth; x++ )
+        {
+            float fx = ( x + 0.5f ) * width / newWidth - 0.5f;
+            if ( fx < 0.0f ) fx = 0.0f;
+            int x0 = (int) fx;
+            int x1 = ( x0 + 1 < width )? x0 + 1 : x0;
+            float tx = fx - x0;
+
+            for ( int c = 0; c < numComponents; c++ )
+            {
+                float a = src[ ( y0 * width + x0 ) * numComponents + c ];
+                float b = src[ ( y0 * width + x1 ) * numComponents + c ];
+                float d = src[ ( y1 * width + x0 ) * numComponents + c ];
+                float e = src[ ( y1 * width + x1 ) * numComponents + c ];
+                float value = ( 1.0f - ty ) * ( a + tx * ( b - a ) ) + ty * ( d + tx * ( e - d ) );
+                dst[ ( y * newWidth + x ) * numComponents + c ] = (uchar) ( value + 0.5f );
+            }
+        }
+    }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Make the next mipmap level of the image, by averaging 2 x 2 pixels.
+/////////////////////////////////////////////////////////////////////////////
+
+static void HalveImage( const uchar *src, int width, int height, int numComponents,
+                        uchar *dst, int newWidth, int newHeight )
+{
+    for ( int y = 0; y < newHeight; y++ )
+    {
+        int y0 = 2 * y;
+        int y1 = ( y0 + 1 < height )? y0 + 1 : y0;
+
+        for ( int x = 0; x < newWidth; x++ )
+        {
+            int x0 = 2 * x;
+            int x1 = ( x0 + 1 < width )? x0 + 1 : x0;
+
+            for ( int c = 0; c < numComponents; c++ )
+            {
+                int sum = src[ ( y0 * width + x0 ) * numComponents + c ] + src[ ( y0 * width + x1 ) * numComponents + c ] +
+                          src[ ( y1 * width + x0 ) * numComponents + c ] + src[ ( y1 * width + x1 ) * numComponents + c ];
+                dst[ ( y * newWidth + x ) * numComponents + c ] = (uchar) ( ( sum + 2 ) / 4 );
+            }
+        }
+    }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Make the mipmap levels of the image, with numComponents bytes per pixel.
+// Like gluBuild2DMipmaps(), level 0 is the image scaled down to the largest
+// power of two in each dimension that is not larger than the image.
+// Returns 1 if successful or 0 if unsuccessful.
+/////////////////////////////////////////////////////////////////////////////
+
+int MakeMipmapChain( const uchar *imageData, int imageWidth, int imageHeight,
+                     int numComponents, MipmapChain *chain )
+{
+    chain->numLevels = 0;
+    chain->numComponents = numComponents;
+
+    int width = FloorPowerOfTwo( imageWidth );
+    int height = FloorPowerOfTwo( imageHeight );
+
+    for ( int level = 0; level < MAX_MIPMAP_LEVELS; level++ )
+    {
+        chain->width[level] = width;
+        chain->height[level] = height;
+        chain->data[level] = (uchar *) malloc( width * height * numComponents );
+        if ( chain->data[level] == NULL )
+        {
+            DeallocateMipmapChain( chain );
+            printf( "Error: Not enough memory.\n" );
+            return 0;
+        }
+        chain->numLevels++;
+
+        if ( level == 0 )
+        {
+            if ( width == imageWidth && height == imageHeight )
+                memcpy( chain->data[0], imageData, width * height * numComponents );
+            else
+                ScaleImage( imageData, imageWidth, imageHeight, numComponents, chain->data[0], width, height );
+        }
+        else
+        {
+            HalveImage( chain->data[ level - 1 ], chain->width[ level - 1 ], chain->height[ level - 1 ],
+                        numComponents, chain->data[level], width, height );
+        }
+
+        if ( width == 1 && height == 1 ) break;
+        width = ( width > 1 )? width / 2 : 1;
+        height = ( height > 1 )? height / 2 : 1;
+    }
+
+    return 1;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Deallocate the memory of the mipmap levels made by MakeMipmapChain().
+/////////////////////////////////////////////////////////////////////////////
+
+void DeallocateMipmapChain( MipmapChain *chain )
+{
+    for ( int level = 0; level < chain->numLevels; level++ )
+    {
+        free( chain->data[level] );
+        chain->data[level] = NULL;
+    }
+    chain->numLevels = 0;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Load the mipmap levels into the texture object bound to GL_TEXTURE_2D.
+/////////////////////////////////////////////////////////////////////////////
+
+void UploadMipmapChain( const MipmapChain *chain )
+{
+    const GLenum formats[4] = { GL_LUMINANCE, GL_LUMINANCE_ALPHA, GL_RGB, GL_RGBA };
+    GLenum format = formats[ chain->numComponents - 1 ];
+
+    glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+    for ( int level = 0; level < chain->numLevels; level++ )
+        glTexImage2D( GL_TEXTURE_2D, level, format, chain->width[level], chain->height[level], 0,
+                      format, GL_UNSIGNED_BYTE, chain->data[level] );
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Get the 4 x 4 block of pixels at block (bx, by) of the image, as RGBA.
+// Pixels outside the image are copies of the nearest edge pixels.
+/////////////////////////////////////////////////////////////////////////////
+
+static void GetBlock( const uchar *image, int width, int height, int numComponents,
+                      int bx, int by, uchar block[16][4] )
+{
+    for ( int j = 0; j < 4; j++ )
+        for ( int i = 0; i < 4; i++ )
+        {
+            int x = 4 * bx + i, y = 4 * by + j;
+            if ( x >= width ) x = width - 1;
+            if ( y >= height ) y = height - 1;
+            const uchar *p = &image[ ( y * width + x ) * numComponents ];
+            uchar *b = block[ 4 * j + i ];
+
+            switch ( numComponents )
+            {
+                case 1:  b[0] = b[1] = b[2] = p[0];  b[3] = 255;   break;
+                case 2:  b[0] = b[1] = b[2] = p[0];  b[3] = p[1];  break;
+                case 3:  b[0] = p[0];  b[1] = p[1];  b[2] = p[2];  b[3] = 255;  break;
+                default: b[0] = p[0];  b[1] = p[1];  b[2] = p[2];  b[3] = p[3];  break;
+            }
+        }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Conversion between 8-bit RGB and 5:6:5 RGB.
+/////////////////////////////////////////////////////////////////////////////
+
+static unsigned short PackRGB565( const uchar rgb[3] )
+{
+    int r = ( rgb[0] * 31 + 127 ) / 255;
+    int g = ( rgb[1] * 63 + 127 ) / 255;
+    int b = ( rgb[2] * 31 + 127 ) / 255;
+    return (unsigned short) ( ( r << 11 ) | ( g << 5 ) | b );
+}
+
+
+static void UnpackRGB565( unsigned short c, int rgb[3] )
+{
+    int r = ( c >> 11 ) & 31, g = ( c >> 5 ) & 63, b = c & 31;
+    rgb[0] = ( r << 3 ) | ( r >> 2 );
+    rgb[1] = ( g << 2 ) | ( g >> 4 );
+    rgb[2] = ( b << 3 ) | ( b >> 2 );
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Compress the colors of a 4 x 4 block into an 8-byte BC1 block.
+// The two end colors are the colors furthest apart along the principal
+// axis of the colors, and each pixel gets the nearest of the four colors
+// between them.
+/////////////////////////////////////////////////////////////////////////////
+
+static void CompressColorBlock( const uchar block[16][4], uchar out[8] )
+{
+    float mean[3] = { 0.0f, 0.0f, 0.0f };
+    for ( int i = 0; i < 16; i++ )
+        for ( int k = 0; k < 3; k++ ) mean[k] += block[i][k] / 16.0f;
+
+    // Covariance matrix: rr, rg, rb, gg, gb, bb.
+    float cov[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+    for ( int i = 0; i < 16; i++ )
+    {
+        float r = block[i][0] - mean[0], g = block[i][1] - mean[1], b = block[i][2] - mean[2];
+        cov[0] += r * r;  cov[1] += r * g;  cov[2] += r * b;
+        cov[3] += g * g;  cov[4] += g * b;  cov[5] += b * b;
+    }
+
+    // Principal axis by power iteration.
+    float axis[3] = { 1.0f, 1.0f, 1.0f };
+    for ( int iter = 0; iter < 4; iter++ )
+    {
+        float r = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+        float g = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+        float b = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+        float len = sqrtf( r * r + g * g + b * b );
+        if ( len < 1.0e-6f ) break;  // All colors are the same.
+        axis[0] = r / len;  axis[1] = g / len;  axis[2] = b / len;
+    }
+
+    int minPixel = 0, maxPixel = 0;
+    float minDot = 1.0e30f, maxDot = -1.0e30f;
+    for ( int i = 0; i < 16; i++ )
+    {
+        float d = block[i][0] * axis[0] + block[i][1] * axis[1] + block[i][2] * axis[2];
+        if ( d < minDot ) { minDot = d; minPixel = i; }
+        if ( d > maxDot ) { maxDot = d; maxPixel = i; }
+    }
+
+    // The first end color must be larger for the four-color mode.
+    unsigned short c0 = PackRGB565( block[ maxPixel ] );
+    unsigned short c1 = PackRGB565( block[ minPixel ] );
+    if ( c0 < c1 ) { unsigned short t = c0; c0 = c1; c1 = t; }
+
+    unsigned int indices = 0;
+    if ( c0 != c1 )
+    {
+        int palette[4][3];
+        UnpackRGB565( c0, palette[0] );
+        UnpackRGB565( c1, palette[1] );
+        for ( int k = 0; k < 3; k++ )
+        {
+            palette[2][k] = ( 2 * palette[0][k] + palette[1][k] ) / 3;
+            palette[3][k] = ( palette[0][k] + 2 * palette[1][k] ) / 3;
+        }
+
+        for ( int i = 0; i < 16; i++ )
+        {
+            int best = 0, bestDist = 1 << 30;
+            for ( int p = 0; p < 4; p++ )
+            {
+                int dr = block[i][0] - palette[p][0], dg = block[i][1] - palette[p][1], db = block[i][2] - palette[p][2];
+                int dist = dr * dr + dg * dg + db * db;
+                if ( dist < bestDist ) { bestDist = dist; best = p; }
+            }
+            indices |= (unsigned int) best << ( 2 * i );
+        }
+    }
+
+    // Little-endian, as defined by the format.
+    out[0] = (uchar) ( c0 & 0xFF );  out[1] = (uchar) ( c0 >> 8 );
+    out[2] = (uchar) ( c1 & 0xFF );  out[3] = (uchar) ( c1 >> 8 );
+    for ( int b = 0; b < 4; b++ ) out[4 + b] = (uchar) ( indices >> ( 8 * b ) );
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Compress the alpha values of a 4 x 4 block into the 8-byte alpha part of
+// a BC3 block, with 8 alpha values from the largest to the smallest.
+/////////////////////////////////////////////////////////////////////////////
+
+static void CompressAlphaBlock( const uchar block[16][4], uchar out[8] )
+{
+    int a0 = 0, a1 = 255;
+    for ( int i = 0; i < 16; i++ )
+    {
+        if ( block[i][3] > a0 ) a0 = block[i][3];
+        if ( block[i][3] < a1 ) a1 = block[i][3];
+    }
+
+    unsigned long long indices = 0;
+    if ( a0 > a1 )
+    {
+        int palette[8];
+        palette[0] = a0;
+        palette[1] = a1;
+        for ( int p = 2; p < 8; p++ ) palette[p] = ( ( 8 - p ) * a0 + ( p - 1 ) * a1 ) / 7;
+
+        for ( int i = 0; i < 16; i++ )
+        {
+            int best = 0, bestDist = 1 << 30;
+            for ( int p = 0; p < 8; p++ )
+            {
+                int dist = abs( block[i][3] - palette[p] );
+                if ( dist < bestDist ) { bestDist = dist; best = p; }
+            }
+            indices |= (unsigned long long) best << ( 3 * i );
+        }
+    }
+
+    out[0] = (uchar) a0;
+    out[1] = (uchar) a1;
+    for ( int b = 0; b < 6; b++ ) out[2 + b] = (uchar) ( indices >> ( 8 * b ) );
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Returns the size in bytes of a width x height level in the format.
+/////////////////////////////////////////////////////////////////////////////
+
+static unsigned int CompressedLevelSize( unsigned int format, unsigned int width, unsigned int height )
+{
+    unsigned int blockSize = ( format == TEXTURE_FILE_BC3 )? 16 : 8;
+    return ( ( width + 3 ) / 4 ) * ( ( height + 3 ) / 4 ) * blockSize;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Get the size in bytes and the modification time of a file.
+// Returns 1 if successful or 0 if unsuccessful.
+/////////////////////////////////////////////////////////////////////////////
+
+static int GetFileSizeAndTime( const char *filename, unsigned long long *size, long long *time )
+{
+#ifdef _WIN32
+    struct _stat64 st;
+    if ( _stat64( filename, &st ) != 0 ) return 0;
+#else
+    struct stat st;
+    if ( stat( filename, &st ) != 0 ) return 0;
+#endif
+    *size = (unsigned long long) st.st_size;
+    *time = (long long) st.st_mtime;
+    return 1;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Save the mipmap levels, compressed, to the output texture filename.
+// sourceSize and sourceTime are those of the image file they were made from.
+// Returns 1 if successful or 0 if unsuccessful.
+/////////////////////////////////////////////////////////////////////////////
+
+static int SaveTextureFile( const char *filename, const MipmapChain *chain,
+                            unsigned long long sourceSize, long long sourceTime )
+{
+    TextureFileHeader header;
+    memcpy( header.magic, TEXTURE_FILE_MAGIC, 4 );
+    header.version = TEXTURE_FILE_VERSION;
+    header.byteOrder = TEXTURE_FILE_BYTE_ORDER;
+    header.format = ( chain->numComponents == 2 || chain->numComponents == 4 )? TEXTURE_FILE_BC3 : TEXTURE_FILE_BC1;
+    header.numLevels = chain->numLevels;
+    header.reserved = 0;
+    header.sourceSize = sourceSize;
+    header.sourceTime = sourceTime;
+
+    TextureFileLevel levels[ MAX_MIPMAP_LEVELS ];
+    unsigned int offset = sizeof(TextureFileHeader) + sizeof(TextureFileLevel) * header.numLevels;
+    for ( int level = 0; level < chain->numLevels; level++ )
+    {
+        levels[level].width = chain->width[level];
+        levels[level].height = chain->height[level];
+        levels[level].offset = offset;
+        levels[level].size = CompressedLevelSize( header.format, levels[level].width, levels[level].height );
+        offset += levels[level].size;
+    }
+
+    FILE *fp = fopen( filename, "wb" );
+    if ( fp == NULL )
+    {
+        printf( "Error: Cannot write texture file %s.\n", filename );
+        return 0;
+    }
+
+    bool ok = ( fwrite( &header, sizeof(header), 1, fp ) == 1 &&
+                fwrite( levels, sizeof(TextureFileLevel), header.numLevels, fp ) == header.numLevels );
+
+    for ( int level = 0; ok && level < chain->numLevels; level++ )
+    {
+        uchar *data = (uchar *) malloc( levels[level].size );
+        if ( data == NULL )
+        {
+            printf( "Error: Not enough memory.\n" );
+            ok = false;
+            break;
+        }
+
+        int blocksWide = ( chain->width[level] + 3 ) / 4, blocksHigh = ( chain->height[level] + 3 ) / 4;
+        uchar *out = data;
+        for ( int by = 0; by < blocksHigh; by++ )
+            for ( int bx = 0; bx < blocksWide; bx++ )
+            {
+                uchar block[16][4];
+                GetBlock( chain->data[level], chain->width[level], chain->height[level],
+                          chain->numComponents, bx, by, block );
+                if ( header.format == TEXTURE_FILE_BC3 )
+                {
+                    CompressAlphaBlock( block, out );
+                    out += 8;
+                }
+                CompressColorBlock( block, out );
+                out += 8;
+            }
+
+        ok = ( fwrite( data, 1, levels[level].size, fp ) == levels[level].size );
+        free( data );
+    }
+
+    if ( fclose( fp ) != 0 ) ok = false;
+    if ( !ok )
+    {
+        printf( "Error: Cannot write texture file %s.\n", filename );
+        remove( filename );
+        return 0;
+    }
+    return 1;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Read an image from the input image filename, and save it with all its
+// mipmap levels to the output texture filename.
+// Images with 2 or 4 components are saved in BC3, and others in BC1.
+// Returns 1 if successful or 0 if unsuccessful.
+/////////////////////////////////////////////////////////////////////////////
+
+int ConvertTextureFile( const char *imageFilename, const char *textureFilename )
+{
+    // Taken before reading, so that a change made while reading is seen later.
+    unsigned long long sourceSize = 0;
+    long long sourceTime = 0;
+    GetFileSizeAndTime( imageFilename, &sourceSize, &sourceTime );
+
+    ImageFile image;
+    if ( ReadImageFileDirect( imageFilename, &image ) == 0 )
+        return 0;
+
+    MipmapChain chain;
+    int ok = MakeMipmapChain( image.data, image.width, image.height, image.numComponents, &chain );
+    ReleaseImageFile( &image );
+    if ( !ok ) return 0;
+
+    ok = SaveTextureFile( textureFilename, &chain, sourceSize, sourceTime );
+    DeallocateMipmapChain( &chain );
+    return ok;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Write the name of the texture file made from the image filename to
+// textureFilename, which has room for size characters. It is the image
+// filename with its extension replaced by ".txc".
+/////////////////////////////////////////////////////////////////////////////
+
+void GetTextureFileName( const char *imageFilename, char *textureFilename, size_t size )
+{
+    const char *dot = strrchr( imageFilename, '.' );
+    const char *slash = strrchr( imageFilename, '/' );
+    const char *backslash = strrchr( imageFilename, '\\' );
+    if ( dot == NULL || ( slash != NULL && dot < slash ) || ( backslash != NULL && dot < backslash ) )
+        dot = imageFilename + strlen( imageFilename );
+
+    size_t length = dot - imageFilename;
+    if ( length + 5 > size ) length = ( size > 5 )? size - 5 : 0;
+    memcpy( textureFilename, imageFilename, length );
+    strcpy( textureFilename + length, ".txc" );
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Map the texture file into memory, and check that it is valid.
+// Returns 1 if successful or 0 if unsuccessful. A file that does not exist
+// is not reported as an error.
+/////////////////////////////////////////////////////////////////////////////
+
+int MapTextureFile( const char *filename, TextureFile *file )
+{
+    file->data = NULL;
+    file->size = 0;
+    file->header = NULL;
+    file->levels = NULL;
+
+#ifdef _WIN32
+    HANDLE fileHandle = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                     FILE_ATTRIBUTE_NORMAL, NULL );
+    if ( fileHandle == INVALID_HANDLE_VALUE ) return 0;
+
+    LARGE_INTEGER fileSize;
+    if ( !GetFileSizeEx( fileHandle, &fileSize ) || fileSize.QuadPart == 0 )
+    {
+        CloseHandle( fileHandle );
+        printf( "Error: Cannot read texture file %s.\n", filename );
+        return 0;
+    }
+
+    // The view keeps the mapping alive after the handles are closed.
+    HANDLE mapping = CreateFileMappingA( fileHandle, NULL, PAGE_READONLY, 0, 0, NULL );
+    CloseHandle( fileHandle );
+    void *data = ( mapping != NULL )? MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 ) : NULL;
+    if ( mapping != NULL ) CloseHandle( mapping );
+    size_t size = (size_t) fileSize.QuadPart;
+#else
+    int fd = open( filename, O_RDONLY );
+    if ( fd < 0 )
+    {
+        if ( errno != ENOENT ) printf( "Error: Cannot read texture file %s.\n", filename );
+        return 0;
+    }
+
+    struct stat st;
+    if ( fstat( fd, &st ) != 0 || st.st_size == 0 )
+    {
+        close( fd );
+        printf( "Error: Cannot read texture file %s.\n", filename );
+        return 0;
+    }
+
+    // The mapping stays valid after the file is closed.
+    void *data = mmap( NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if ( data == MAP_FAILED ) data = NULL;
+    size_t size = (size_t) st.st_size;
+#endif
+
+    if ( data == NULL )
+    {
+        printf( "Error: Cannot map texture file %s.\n", filename );
+        return 0;
+    }
+
+    file->data = data;
+    file->size = size;
+    file->header = (const TextureFileHeader *) data;
+    file->levels = (const TextureFileLevel *) ( file->header + 1 );
+
+// Check the header and the levels.
+
+    const TextureFileHeader *h = file->header;
+    bool valid = ( size >= sizeof(TextureFileHeader) &&
+                   memcmp( h->magic, TEXTURE_FILE_MAGIC, 4 ) == 0 &&
+                   h->version == TEXTURE_FILE_VERSION &&
+                   h->byteOrder == TEXTURE_FILE_BYTE_ORDER &&
+                   ( h->format == TEXTURE_FILE_BC1 || h->format == TEXTURE_FILE_BC3 ) &&
+                   h->numLevels >= 1 && h->numLevels <= MAX_MIPMAP_LEVELS &&
+                   size >= sizeof(TextureFileHeader) + sizeof(TextureFileLevel) * h->numLevels );
+
+    for ( unsigned int level = 0; valid && level < h->numLevels; level++ )
+    {
+        // Each level is half the size of the previous one.
+        const TextureFileLevel *l = &file->levels[level];
+        unsigned int width = file->levels[0].width >> level;
+        unsigned int height = file->levels[0].height >> level;
+        if ( width == 0 ) width = 1;
+        if ( height == 0 ) height = 1;
+
+        valid = ( l->width == width && l->height == height &&
+                  l->size == CompressedLevelSize( h->format, width, height ) &&
+                  l->offset <= size && l->size <= size - l->offset );
+    }
+
+    // Level 0 must be a power of two in each dimension.
+    if ( valid )
+    {
+        unsigned int width = file->levels[0].width, height = file->levels[0].height;
+        valid = ( width > 0 && height > 0 && ( width & ( width - 1 ) ) == 0 && ( height & ( height - 1 ) ) == 0 );
+    }
+
+    // The last level must be 1 x 1.
+    if ( valid ) valid = ( file->levels[ h->numLevels - 1 ].width == 1 && file->levels[ h->numLevels - 1 ].height == 1 );
+
+    if ( !valid )
+    {
+        printf( "Error: %s is not a valid texture file.\n", filename );
+        UnmapTextureFile( file );
+        return 0;
+    }
+    return 1;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Returns 1 if the image file still has the size and modification time
+// recorded in the mapped texture file when it was made from the image file,
+// or if the image file cannot be found. Returns 0 if the texture file is out
+// of date and should be made again with ConvertTextureFile().
+/////////////////////////////////////////////////////////////////////////////
+
+int TextureFileIsUpToDate( const TextureFile *file, const char *imageFilename )
+{
+    unsigned long long size;
+    long long time;
+    if ( !GetFileSizeAndTime( imageFilename, &size, &time ) ) return 1;
+    return ( size == file->header->sourceSize && time == file->header->sourceTime );
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Release the memory mapped by MapTextureFile().
+/////////////////////////////////////////////////////////////////////////////
+
+void UnmapTextureFile( TextureFile *file )
+{
+    if ( file->data == NULL ) return;
+#ifdef _WIN32
+    UnmapViewOfFile( file->data );
+#else
+    munmap( (void *) file->data, file->size );
+#endif
+    file->data = NULL;
+    file->size = 0;
+    file->header = NULL;
+    file->levels = NULL;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Load the mipmap levels of the mapped texture file into the texture object
+// bound to GL_TEXTURE_2D, directly from the mapped memory. Needs
+// EXT_texture_compression_s3tc.
+/////////////////////////////////////////////////////////////////////////////
+
+void UploadTextureFile( const TextureFile *file )
+{
+    GLenum internalFormat = ( file->header->format == TEXTURE_FILE_BC3 )?
+                            GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+
+    for ( unsigned int level = 0; level < file->header->numLevels; level++ )
+    {
+        const TextureFileLevel *l = &file->levels[level];
+        glCompressedTexImage2D( GL_TEXTURE_2D, level, internalFormat, l->width, l->height, 0,
+                                l->size, (const char *) file->data + l->offset );
+    }
+}
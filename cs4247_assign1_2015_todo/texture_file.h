@@ -0,0 +1,157 @@
+#ifndef _TEXTURE_FILE_H_
+#define _TEXTURE_FILE_H_
+
+#include <stddef.h>
+#include "image_io.h"
+
+// Binary file format of a texture map with all its mipmap levels, compressed
+// in a format that the GPU can use directly (S3TC, also known as BC1 and BC3).
+// Written by ConvertTextureFile(), and read by MapTextureFile().
+//
+// The file has these parts, one after another:
+//   1. A TextureFileHeader.
+//   2. An array of TextureFileHeader::numLevels TextureFileLevel, one per
+//      mipmap level, from level 0.
+//   3. The compressed data of the levels. Each starts TextureFileLevel::offset
+//      bytes from the start of the file.
+// Level 0 is a power of two in each dimension, and each next level is half
+// the size of the previous one, down to 1 x 1.
+// All values are stored in the byte order of the machine that wrote the file,
+// which is checked using TextureFileHeader::byteOrder.
+// The header also records the size and modification time of the image file
+// that the texture file was made from, so that a texture file can be made
+// again when its image file has changed.
+
+#define TEXTURE_FILE_MAGIC          "TXC1"      // First 4 bytes of the file.
+#define TEXTURE_FILE_VERSION        2
+#define TEXTURE_FILE_BYTE_ORDER     0x01020304u
+
+#define TEXTURE_FILE_BC1            1           // RGB, 8 bytes per 4 x 4 block.
+#define TEXTURE_FILE_BC3            3           // RGBA, 16 bytes per 4 x 4 block.
+
+#define MAX_MIPMAP_LEVELS           32
+
+
+typedef struct TextureFileHeader {
+    char magic[4];              // TEXTURE_FILE_MAGIC, without the terminating null character.
+    unsigned int version;       // TEXTURE_FILE_VERSION.
+    unsigned int byteOrder;     // TEXTURE_FILE_BYTE_ORDER.
+    unsigned int format;        // TEXTURE_FILE_BC1 or TEXTURE_FILE_BC3.
+    unsigned int numLevels;     // Number of mipmap levels.
+    unsigned int reserved;      // Zero. Keeps the next fields 8-byte aligned.
+    unsigned long long sourceSize;  // Size of the image file in bytes.
+    long long sourceTime;       // Modification time of the image file, in seconds since 1970.
+}
+TextureFileHeader;
+
+
+typedef struct TextureFileLevel {
+    unsigned int width;         // Width of the level in pixels.
+    unsigned int height;        // Height of the level in pixels.
+    unsigned int offset;        // Offset of the compressed data from the start of the file.
+    unsigned int size;          // Size of the compressed data in bytes.
+}
+TextureFileLevel;
+
+
+// A texture file mapped into memory by MapTextureFile().
+typedef struct TextureFile {
+    const void *data;           // The whole file.
+    size_t size;                // Size of the file in bytes.
+    const TextureFileHeader *header;
+    const TextureFileLevel *levels;
+}
+TextureFile;
+
+
+// The mipmap levels of an image, made by MakeMipmapChain(). The pixels are
+// packed tightly, as in the image data returned by ReadImageFile().
+typedef struct MipmapChain {
+    int numLevels;
+    int numComponents;
+    int width[ MAX_MIPMAP_LEVELS ];
+    int height[ MAX_MIPMAP_LEVELS ];
+    uchar *data[ MAX_MIPMAP_LEVELS ];
+}
+MipmapChain;
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Make the mipmap levels of the image, with numComponents bytes per pixel.
+// Like gluBuild2DMipmaps(), level 0 is the image scaled down to the largest
+// power of two in each dimension that is not larger than the image.
+// Returns 1 if successful or 0 if unsuccessful.
+/////////////////////////////////////////////////////////////////////////////
+
+extern int MakeMipmapChain( const uchar *imageData, int imageWidth, int imageHeight,
+                            int numComponents, MipmapChain *chain );
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Deallocate the memory of the mipmap levels made by MakeMipmapChain().
+/////////////////////////////////////////////////////////////////////////////
+
+extern void DeallocateMipmapChain( MipmapChain *chain );
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Load the mipmap levels into the texture object bound to GL_TEXTURE_2D.
+/////////////////////////////////////////////////////////////////////////////
+
+extern void UploadMipmapChain( const MipmapChain *chain );
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Read an image from the input image filename, and save it with all its
+// mipmap levels to the output texture filename.
+// Images with 2 or 4 components are saved in BC3, and others in BC1.
+// Returns 1 if successful or 0 if unsuccessful.
+/////////////////////////////////////////////////////////////////////////////
+
+extern int ConvertTextureFile( const char *imageFilename, const char *textureFilename );
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Write the name of the texture file made from the image filename to
+// textureFilename, which has room for size characters. It is the image
+// filename with its extension replaced by ".txc".
+/////////////////////////////////////////////////////////////////////////////
+
+extern void GetTextureFileName( const char *imageFilename, char *textureFilename, size_t size );
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Map the texture file into memory, and check that it is valid.
+// Returns 1 if successful or 0 if unsuccessful. A file that does not exist
+// is not reported as an error.
+/////////////////////////////////////////////////////////////////////////////
+
+extern int MapTextureFile( const char *filename, TextureFile *file );
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Returns 1 if the image file still has the size and modification time
+// recorded in the mapped texture file when it was made from the image file,
+// or if the image file cannot be found. Returns 0 if the texture file is out
+// of date and should be made again with ConvertTextureFile().
+/////////////////////////////////////////////////////////////////////////////
+
+extern int TextureFileIsUpToDate( const TextureFile *file, const char *imageFilename );
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Release the memory mapped by MapTextureFile().
+/////////////////////////////////////////////////////////////////////////////
+
+extern void UnmapTextureFile( TextureFile *file );
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Load the mipmap levels of the mapped texture file into the texture object
+// bound to GL_TEXTURE_2D, directly from the mapped memory. Needs
+// EXT_texture_compression_s3tc.
+/////////////////////////////////////////////////////////////////////////////
+
+extern void UploadTextureFile( const TextureFile *file );
+
+#endif
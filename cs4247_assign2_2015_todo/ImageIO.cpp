@@ -1,46 +1,169 @@
-#include <cstdlib>
+#include <cstdlib>
 #include <cstdio>
-#include <cmath>
+#include <cmath>
+#include <cstring>
 #include <FreeImage.h>
 #include "ImageIO.h"
 
 using namespace std;
 
 
+// The row conversion uses the SSSE3 byte shuffle on x86 processors that have it.
+// Only the functions marked SSSE3_FUNCTION are compiled for SSSE3, and they are
+// called only if CPUID reports it, so the program also runs on older processors.
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define IMAGE_IO_USE_SSSE3
+#include <tmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SSSE3_FUNCTION
+#else
+#include <cpuid.h>
+#define SSSE3_FUNCTION __attribute__(( target( "ssse3" ) ))
+#endif
+#endif
 
+
+#ifdef IMAGE_IO_USE_SSSE3
 /////////////////////////////////////////////////////////////////////////////
-// Deallocate the memory allocated to (*imageData) returned by 
-// the function ReadImageFile().
-// (*imageData) will be set to NULL.
+// Returns true if the processor supports SSSE3 (CPUID function 1, ECX bit 9).
 /////////////////////////////////////////////////////////////////////////////
 
-void ImageIO::DeallocateImageData( uchar **imageData )
+static bool ProcessorHasSSSE3( void )
 {
-    free( *imageData );
-    (*imageData) = NULL;
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid( info, 1 );
+    return ( info[2] & ( 1 << 9 ) ) != 0;
+#else
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid( 1, &eax, &ebx, &ecx, &edx ) && ( ecx & ( 1u << 9 ) ) != 0;
+#endif
 }
 
+// Set before main() runs, so the loader threads only read it.
+static const bool hasSSSE3 = ProcessorHasSSSE3();
+
+
+/////////////////////////////////////////////////////////////////////////////
+// SSSE3 versions of the loops in SwapRedBlue3() and SwapRedBlue4().
+// Return the number of pixels converted, leaving the rest of the row.
+/////////////////////////////////////////////////////////////////////////////
+
+SSSE3_FUNCTION static int SwapRedBlue3SSSE3( uchar *dst, const uchar *src, int numPixels )
+{
+    // 5 pixels (15 bytes) at a time. The 16th byte is written back unchanged,
+    // and is converted again with the next pixels.
+    const __m128i shuffle = _mm_setr_epi8( 2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15 );
+    int x = 0;
+    for ( ; x + 6 <= numPixels; x += 5 )
+    {
+        __m128i p = _mm_loadu_si128( (const __m128i *) ( src + 3 * x ) );
+        _mm_storeu_si128( (__m128i *) ( dst + 3 * x ), _mm_shuffle_epi8( p, shuffle ) );
+    }
+    return x;
+}
 
 
+SSSE3_FUNCTION static int SwapRedBlue4SSSE3( uchar *dst, const uchar *src, int numPixels )
+{
+    const __m128i shuffle = _mm_setr_epi8( 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15 );
+    int x = 0;
+    for ( ; x + 4 <= numPixels; x += 4 )
+    {
+        __m128i p = _mm_loadu_si128( (const __m128i *) ( src + 4 * x ) );
+        _mm_storeu_si128( (__m128i *) ( dst + 4 * x ), _mm_shuffle_epi8( p, shuffle ) );
+    }
+    return x;
+}
+#endif
 
 
 /////////////////////////////////////////////////////////////////////////////
-// Read an image from the input filename. 
-// Returns 1 if successful or 0 if unsuccessful.
-// The returned image data will be pointed to by (*imageData).
-// The image width, image height, and number of components (color channels) 
-// per pixel will be returned in (*imageWidth), (*imageHeight),
-// and (*numComponents).
-// The value of (*numComponents) can be 1, 2, 3 or 4.
-// The returned image data is always packed tightly with red, green, blue,
-// and alpha arranged from lower to higher memory addresses. 
-// Each color channel take one byte.
-// The first pixel (origin of the image) is at the bottom-left of the image.
+// Swap the first and third bytes of each pixel in a row of numPixels pixels
+// with 3 or 4 bytes per pixel, converting between RGB(A) and BGR(A).
+// dst and src can be the same row, or dst can be before src in the same buffer.
 /////////////////////////////////////////////////////////////////////////////
 
-int ImageIO::ReadImageFile( const char *filename, uchar **imageData,
-                   int *imageWidth, int *imageHeight, int *numComponents,
-				   int flags )
+static void SwapRedBlue3( uchar *dst, const uchar *src, int numPixels )
+{
+    int x = 0;
+
+#ifdef IMAGE_IO_USE_SSSE3
+    if ( hasSSSE3 ) x = SwapRedBlue3SSSE3( dst, src, numPixels );
+#endif
+
+    for ( ; x < numPixels; x++ )
+    {
+        uchar c0 = src[ 3 * x + 0 ];
+        uchar c1 = src[ 3 * x + 1 ];
+        uchar c2 = src[ 3 * x + 2 ];
+        dst[ 3 * x + 0 ] = c2;
+        dst[ 3 * x + 1 ] = c1;
+        dst[ 3 * x + 2 ] = c0;
+    }
+}
+
+
+static void SwapRedBlue4( uchar *dst, const uchar *src, int numPixels )
+{
+    int x = 0;
+
+#ifdef IMAGE_IO_USE_SSSE3
+    if ( hasSSSE3 ) x = SwapRedBlue4SSSE3( dst, src, numPixels );
+#endif
+
+    for ( ; x < numPixels; x++ )
+    {
+        uchar c0 = src[ 4 * x + 0 ];
+        uchar c1 = src[ 4 * x + 1 ];
+        uchar c2 = src[ 4 * x + 2 ];
+        uchar c3 = src[ 4 * x + 3 ];
+        dst[ 4 * x + 0 ] = c2;
+        dst[ 4 * x + 1 ] = c1;
+        dst[ 4 * x + 2 ] = c0;
+        dst[ 4 * x + 3 ] = c3;
+    }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Convert a row of numPixels pixels between the FIBITMAP layout and the
+// user image data layout. The conversion is the same in both directions.
+// dst and src can be the same row, or dst can be before src in the same buffer.
+/////////////////////////////////////////////////////////////////////////////
+
+static void ConvertRow( uchar *dst, const uchar *src, int numPixels, int numComponents )
+{
+#if FREEIMAGE_COLORORDER == FREEIMAGE_COLORORDER_BGR
+    if ( numComponents == 3 )
+    {
+        SwapRedBlue3( dst, src, numPixels );
+        return;
+    }
+    if ( numComponents == 4 )
+    {
+        SwapRedBlue4( dst, src, numPixels );
+        return;
+    }
+#endif
+
+    // Grey, grey-alpha, or already in RGB(A) order.
+    if ( dst != src )
+        memmove( dst, src, (size_t) numPixels * numComponents );
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Read an image file into a FIBITMAP with 8, 16, 24 or 32 bits per pixel.
+// Returns NULL if unsuccessful.
+/////////////////////////////////////////////////////////////////////////////
+
+static FIBITMAP *LoadBitmap( const char *filename, int flags )
 {
 // Determine image format.
     FREE_IMAGE_FORMAT fif = FreeImage_GetFileType( filename, 0 );
@@ -48,7 +171,7 @@ int ImageIO::ReadImageFile( const char *filename, uchar **imageData,
     if( fif == FIF_UNKNOWN )
     {
         printf( "Error: Cannot determine image format of %s.\n", filename );
-        return 0;
+        return NULL;
     }
 
 // Read image data from file.
@@ -59,7 +182,7 @@ int ImageIO::ReadImageFile( const char *filename, uchar **imageData,
     if( !dib )
     {
         printf( "Error: Cannot read image file %s.\n", filename );
-        return 0;
+        return NULL;
     }
 
 // Check image type.
@@ -68,7 +191,7 @@ int ImageIO::ReadImageFile( const char *filename, uchar **imageData,
     {
         FreeImage_Unload( dib );
         printf( "Error: Only 8-bits-per-component standard bitmap is supported.\n" );
-        return 0;
+        return NULL;
     }
 
 // Check bits per pixel.
@@ -77,13 +200,62 @@ int ImageIO::ReadImageFile( const char *filename, uchar **imageData,
     {
         FreeImage_Unload( dib );
         printf( "Error: Only 8, 16, 24, 32 bits per pixel are supported.\n" );
-        return 0;
+        return NULL;
     }
 
-    int _numComponents = bits_per_pixel / 8;
+    return dib;
+}
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Deallocate the memory allocated to (*imageData) returned by 
+// the function ReadImageFile().
+// (*imageData) will be set to NULL.
+/////////////////////////////////////////////////////////////////////////////
+
+void ImageIO::DeallocateImageData( uchar **imageData )
+{
+    free( *imageData );
+    (*imageData) = NULL;
+}
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Read an image from the input filename. 
+// Returns 1 if successful or 0 if unsuccessful.
+// The returned image data will be pointed to by (*imageData).
+// The image width, image height, and number of components (color channels) 
+// per pixel will be returned in (*imageWidth), (*imageHeight),
+// and (*numComponents).
+// The value of (*numComponents) can be 1, 2, 3 or 4.
+// The returned image data is always packed tightly with red, green, blue,
+// and alpha arranged from lower to higher memory addresses. 
+// Each color channel take one byte.
+// The first pixel (origin of the image) is at the bottom-left of the image.
+// The image data is allocated with allocate(), or with malloc() if allocate
+// is NULL. Only image data allocated with malloc() can be deallocated with
+// DeallocateImageData().
+/////////////////////////////////////////////////////////////////////////////
+
+int ImageIO::ReadImageFile( const char *filename, uchar **imageData,
+                   int *imageWidth, int *imageHeight, int *numComponents,
+				   int flags, ImageAllocator allocate )
+{
+    FIBITMAP *dib = LoadBitmap( filename, flags );
+    if ( dib == NULL ) return 0;
+
+    int _numComponents = FreeImage_GetBPP( dib ) / 8;
     int _imageWidth = FreeImage_GetWidth( dib );
     int _imageHeight = FreeImage_GetHeight( dib );
-    uchar *_imageData = (uchar *) malloc( _imageWidth * _imageHeight * _numComponents );
+    size_t rowSize = (size_t) _imageWidth * _numComponents;
+    size_t imageSize = rowSize * _imageHeight;
+    uchar *_imageData = (uchar *) ( ( allocate != NULL )? allocate( imageSize ) : malloc( imageSize ) );
     if ( _imageData == NULL )
     {
         FreeImage_Unload( dib );
@@ -91,66 +263,9 @@ int ImageIO::ReadImageFile( const char *filename, uchar **imageData,
         return 0;
     }
 
-// Copy image in FIBITMAP to user image data.
-    int imageDataCount = 0;
-
-    if ( _numComponents == 1 )
-    {
-        for( int y = 0; y < _imageHeight; y++ )
-        {
-            BYTE *dibData = FreeImage_GetScanLine( dib, y );
-
-            for( int x = 0; x < _imageWidth; x++) 
-            {
-                _imageData[imageDataCount++] = dibData[x];
-            }
-        }
-    }
-    else if ( _numComponents == 2 )
-    {
-        for( int y = 0; y < _imageHeight; y++ )
-        {
-            BYTE *dibData = FreeImage_GetScanLine( dib, y );
-
-            for( int x = 0; x < _imageWidth; x++) 
-            {
-                _imageData[imageDataCount++] = dibData[0];
-                _imageData[imageDataCount++] = dibData[1];
-                dibData += _numComponents;
-            }
-        }
-    }
-    else if ( _numComponents == 3 )
-    {
-        for( int y = 0; y < _imageHeight; y++ )
-        {
-            BYTE *dibData = FreeImage_GetScanLine( dib, y );
-
-            for( int x = 0; x < _imageWidth; x++) 
-            {
-                _imageData[imageDataCount++] = dibData[FI_RGBA_RED];
-                _imageData[imageDataCount++] = dibData[FI_RGBA_GREEN];
-                _imageData[imageDataCount++] = dibData[FI_RGBA_BLUE];
-                dibData += _numComponents;
-            }
-        }
-    }
-    else if ( _numComponents == 4 )
-    {
-        for( int y = 0; y < _imageHeight; y++ )
-        {
-            BYTE *dibData = FreeImage_GetScanLine( dib, y );
-
-            for( int x = 0; x < _imageWidth; x++) 
-            {
-                _imageData[imageDataCount++] = dibData[FI_RGBA_RED];
-                _imageData[imageDataCount++] = dibData[FI_RGBA_GREEN];
-                _imageData[imageDataCount++] = dibData[FI_RGBA_BLUE];
-                _imageData[imageDataCount++] = dibData[FI_RGBA_ALPHA];
-                dibData += _numComponents;
-            }
-        }
-    }
+// Copy image in FIBITMAP to user image data, a row at a time.
+    for( int y = 0; y < _imageHeight; y++ )
+        ConvertRow( _imageData + y * rowSize, FreeImage_GetScanLine( dib, y ), _imageWidth, _numComponents );
 
     FreeImage_Unload( dib );
 
@@ -165,6 +280,65 @@ int ImageIO::ReadImageFile( const char *filename, uchar **imageData,
 
 
 
+/////////////////////////////////////////////////////////////////////////////
+// Read an image from the input filename, like ReadImageFile(), but without
+// copying the image data. The image data stays in the memory that FreeImage
+// read the image into, and is converted there to the layout returned by
+// ReadImageFile(). This needs no work if the layout already matches, i.e.
+// for grey images and images in RGB(A) order whose rows have no padding.
+// Returns 1 if successful or 0 if unsuccessful.
+// The image must be released with ReleaseImageFile().
+/////////////////////////////////////////////////////////////////////////////
+
+int ImageIO::ReadImageFileDirect( const char *filename, ImageFile *image, int flags )
+{
+    FIBITMAP *dib = LoadBitmap( filename, flags );
+    if ( dib == NULL ) return 0;
+
+    int numComponents = FreeImage_GetBPP( dib ) / 8;
+    int imageWidth = FreeImage_GetWidth( dib );
+    int imageHeight = FreeImage_GetHeight( dib );
+    size_t rowSize = (size_t) imageWidth * numComponents;
+    size_t pitch = FreeImage_GetPitch( dib );
+    uchar *bits = FreeImage_GetBits( dib );
+
+// Convert the rows in place, from the bottom row up. Each row is moved down
+// to where it is packed tightly, which is never after where it is read from.
+    bool swapRedBlue = ( numComponents >= 3 && FI_RGBA_RED != 0 );
+    if ( swapRedBlue || pitch != rowSize )
+    {
+        for( int y = 0; y < imageHeight; y++ )
+            ConvertRow( bits + y * rowSize, bits + y * pitch, imageWidth, numComponents );
+    }
+
+    image->data = bits;
+    image->width = imageWidth;
+    image->height = imageHeight;
+    image->numComponents = numComponents;
+    image->bitmap = dib;
+    return 1;
+}
+
+
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Release the image read by ReadImageFileDirect().
+// image->data will be set to NULL.
+/////////////////////////////////////////////////////////////////////////////
+
+void ImageIO::ReleaseImageFile( ImageFile *image )
+{
+    if ( image->bitmap != NULL ) FreeImage_Unload( (FIBITMAP *) image->bitmap );
+    image->bitmap = NULL;
+    image->data = NULL;
+}
+
+
+
+
+
 /////////////////////////////////////////////////////////////////////////////
 // Save an image to the output filename. 
 // Returns 1 if successful or 0 if unsuccessful.
@@ -216,67 +390,11 @@ int ImageIO::SaveImageFile( const char *filename, const uchar *imageData,
     }
 
 
-// Copy user image data to the FIBITMAP.
-    int imageDataCount = 0;
+// Copy user image data to the FIBITMAP, a row at a time.
+    size_t rowSize = (size_t) imageWidth * numComponents;
+    for( int y = 0; y < imageHeight; y++ )
+        ConvertRow( FreeImage_GetScanLine( dib, y ), imageData + y * rowSize, imageWidth, numComponents );
 
-    if ( numComponents == 1 )
-    {
-        for( int y = 0; y < imageHeight; y++ )
-        {
-            BYTE *dibData = FreeImage_GetScanLine( dib, y );
-
-            for( int x = 0; x < imageWidth; x++) 
-            {
-                 dibData[x] = imageData[imageDataCount++];
-            }
-        }
-    }
-    else if ( numComponents == 2 )
-    {
-        for( int y = 0; y < imageHeight; y++ )
-        {
-            BYTE *dibData = FreeImage_GetScanLine( dib, y );
-
-            for( int x = 0; x < imageWidth; x++) 
-            {
-                dibData[0] = imageData[imageDataCount++];
-                dibData[1] = imageData[imageDataCount++];
-                dibData += numComponents;
-            }
-        }
-    }
-    else if ( numComponents == 3 )
-    {
-        for( int y = 0; y < imageHeight; y++ )
-        {
-            BYTE *dibData = FreeImage_GetScanLine( dib, y );
-
-            for( int x = 0; x < imageWidth; x++) 
-            {
-                dibData[FI_RGBA_RED] = imageData[imageDataCount++];
-                dibData[FI_RGBA_GREEN] = imageData[imageDataCount++];
-                dibData[FI_RGBA_BLUE] = imageData[imageDataCount++];
-                dibData += numComponents;
-            }
-        }
-    }
-    else if ( numComponents == 4 )
-    {
-        for( int y = 0; y < imageHeight; y++ )
-        {
-            BYTE *dibData = FreeImage_GetScanLine( dib, y );
-
-            for( int x = 0; x < imageWidth; x++) 
-            {
-                dibData[FI_RGBA_RED] = imageData[imageDataCount++];
-                dibData[FI_RGBA_GREEN] = imageData[imageDataCount++];
-                dibData[FI_RGBA_BLUE] = imageData[imageDataCount++];
-                dibData[FI_RGBA_ALPHA] = imageData[imageDataCount++];
-                dibData += numComponents;
-            }
-        }
-    }
-	
 // Write image in FIBITMAP to file.
 	if ( !FreeImage_Save( fif, dib, filename, flags ) )
     {
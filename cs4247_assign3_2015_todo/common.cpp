@@ -4,6 +4,17 @@
 #include <math.h>
 #include <sys/types.h>
 #include <sys/timeb.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <thread>
+#include <atomic>
+#include <vector>
 #include "common.h"
 
 #define MSG_BUF_LEN		2048
@@ -52,3 +63,118 @@ double GetCurrRealTime( void )
 #endif
 	return ((double)timebuffer.time + ((double)timebuffer.millitm / 1000.0));
 }
+
+
+
+int GetNumProcessors( void )
+	// Returns the number of hardware threads available to the program (at least 1).
+{
+	int n = (int) std::thread::hardware_concurrency();
+	return ( n > 0 )? n : 1;
+}
+
+
+
+static void ParallelForWorker( std::atomic<int> *nextItem, int numItems, int thread,
+							   void (*func)( int item, int thread, void *arg ), void *arg )
+{
+	for (;;)
+	{
+		int item = nextItem->fetch_add( 1 );
+		if ( item >= numItems ) return;
+		func( item, thread, arg );
+	}
+}
+
+
+
+void ParallelFor( int numItems, int numThreads, void (*func)( int item, int thread, void *arg ), void *arg )
+	// Calls func( item, thread, arg ) for every item from 0 to (numItems - 1), using up 
+	// to numThreads worker threads. If numThreads <= 0, GetNumProcessors() threads are used.
+{
+	if ( numItems <= 0 ) return;
+	if ( numThreads <= 0 ) numThreads = GetNumProcessors();
+	if ( numThreads > numItems ) numThreads = numItems;
+
+	std::atomic<int> nextItem( 0 );
+
+	if ( numThreads == 1 )
+	{
+		ParallelForWorker( &nextItem, numItems, 0, func, arg );
+		return;
+	}
+
+	// The calling thread works as thread 0.
+	std::vector<std::thread> workers;
+	for ( int t = 1; t < numThreads; t++ )
+		workers.push_back( std::thread( ParallelForWorker, &nextItem, numItems, t, func, arg ) );
+
+	ParallelForWorker( &nextItem, numItems, 0, func, arg );
+
+	for ( size_t t = 0; t < workers.size(); t++ ) workers[t].join();
+}
+
+
+
+const void *MapFileReadOnly( const char *filename, size_t *size )
+	// Maps the whole file into memory for reading, and writes its size in bytes to *size.
+	// Returns NULL if the file cannot be opened or mapped, or is empty.
+{
+	*size = 0;
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 
+							   FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( file == INVALID_HANDLE_VALUE ) return NULL;
+
+	LARGE_INTEGER fileSize;
+	if ( !GetFileSizeEx( file, &fileSize ) || fileSize.QuadPart == 0 )
+	{
+		CloseHandle( file );
+		return NULL;
+	}
+
+	// The view keeps the mapping alive after the handles are closed.
+	HANDLE mapping = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+	CloseHandle( file );
+	if ( mapping == NULL ) return NULL;
+
+	void *data = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+	CloseHandle( mapping );
+	if ( data == NULL ) return NULL;
+
+	*size = (size_t) fileSize.QuadPart;
+	return data;
+#else
+	int fd = open( filename, O_RDONLY );
+	if ( fd < 0 ) return NULL;
+
+	struct stat st;
+	if ( fstat( fd, &st ) != 0 || st.st_size == 0 )
+	{
+		close( fd );
+		return NULL;
+	}
+
+	// The mapping stays valid after the file is closed.
+	void *data = mmap( NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if ( data == MAP_FAILED ) return NULL;
+
+	*size = (size_t) st.st_size;
+	return data;
+#endif
+}
+
+
+
+void UnmapFile( const void *data, size_t size )
+	// Releases memory returned by MapFileReadOnly().
+{
+	if ( data == NULL ) return;
+#ifdef _WIN32
+	UnmapViewOfFile( data );
+#else
+	munmap( (void *) data, size );
+#endif
+}
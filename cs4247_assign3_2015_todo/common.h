@@ -31,6 +31,29 @@ extern double GetCurrRealTime( void );
 	// Up to millisecond precision.
 
 
+extern int GetNumProcessors( void );
+	// Returns the number of hardware threads available to the program (at least 1).
+
+
+extern void ParallelFor( int numItems, int numThreads, void (*func)( int item, int thread, void *arg ), void *arg );
+	// Calls func( item, thread, arg ) for every item from 0 to (numItems - 1), using up 
+	// to numThreads worker threads. If numThreads <= 0, GetNumProcessors() threads are used.
+	// Items are handed out to the threads in increasing order, one at a time.
+	// The thread parameter is the index of the calling worker thread, from 0 to 
+	// (numThreads - 1), and can be used to index per-thread scratch memory.
+	// Returns only after all items have been processed.
+
+
+extern const void *MapFileReadOnly( const char *filename, size_t *size );
+	// Maps the whole file into memory for reading, and writes its size in bytes to *size.
+	// Returns NULL if the file cannot be opened or mapped, or is empty.
+	// The memory must be released with UnmapFile().
+
+
+extern void UnmapFile( const void *data, size_t size );
+	// Releases memory returned by MapFileReadOnly().
+
+
 #define CheckedMalloc(mem_size) _CheckedMalloc( (mem_size), __FILE__, __LINE__ )
 
 inline void *_CheckedMalloc( size_t size, const char *srcfile, int lineNum )
@@ -0,0 +1,692 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <float.h>
+#include <string.h>
+#include "common.h"
+#include "vector3.h"
+#include "quadmodel.h"
+#include "formfactor.h"
+
+
+#define RAY_EPSILON			(1e-4f)		// Rays start at this distance (relative to the model radius)
+										// above the shooter quad, to avoid hitting its own surface.
+
+#define GRID_CELLS_PER_QUAD	2			// Target number of grid cells per gatherer quad.
+#define GRID_MAX_RES		256			// Max number of grid cells along each axis.
+
+#define CACHE_MAGIC			"FFC1"		// First 4 bytes of a form factor cache file.
+#define CACHE_BYTE_ORDER	0x01020304u
+
+#define DELTA_MAGIC			"DFF1"		// First 4 bytes of a delta form factor file.
+
+
+
+void FF_RowInit( FF_Row *row )
+{
+	if ( row == NULL ) return;
+	row->numEntries = 0;
+	row->capacity = 0;
+	row->gathererIDs = NULL;
+	row->formFactors = NULL;
+}
+
+
+void FF_RowCleanUp( FF_Row *row )
+{
+	if ( row == NULL ) return;
+	free( row->gathererIDs );
+	free( row->formFactors );
+	FF_RowInit( row );
+}
+
+
+void FF_RowReserve( FF_Row *row, int capacity )
+{
+	if ( capacity <= row->capacity ) return;
+	free( row->gathererIDs );
+	free( row->formFactors );
+	row->gathererIDs = (int *) CheckedMalloc( sizeof(int) * capacity );
+	row->formFactors = (float *) CheckedMalloc( sizeof(float) * capacity );
+	row->capacity = capacity;
+	row->numEntries = 0;
+}
+
+
+
+void FF_RowCopy( FF_Row *dest, const FF_Row *src )
+{
+	FF_RowReserve( dest, src->numEntries );
+	CopyArrayN( dest->gathererIDs, src->gathererIDs, src->numEntries );
+	CopyArrayN( dest->formFactors, src->formFactors, src->numEntries );
+	dest->numEntries = src->numEntries;
+}
+
+
+
+void FF_AccumulatorInit( FF_Accumulator *acc, int numGatherers )
+{
+	acc->numGatherers = numGatherers;
+	acc->formFactors = (float *) CheckedMalloc( sizeof(float) * numGatherers );
+	acc->visibleGatherers = (int *) CheckedMalloc( sizeof(int) * numGatherers );
+	acc->numVisible = 0;
+	for ( int g = 0; g < numGatherers; g++ ) acc->formFactors[g] = 0.0f;
+}
+
+
+void FF_AccumulatorCleanUp( FF_Accumulator *acc )
+{
+	free( acc->formFactors );
+	free( acc->visibleGatherers );
+	acc->formFactors = NULL;
+	acc->visibleGatherers = NULL;
+	acc->numGatherers = acc->numVisible = 0;
+}
+
+
+void FF_AccumulatorToRow( FF_Accumulator *acc, FF_Row *row )
+	// Copy the accumulated form factors to row, and clear the accumulator.
+{
+	FF_RowReserve( row, acc->numVisible );
+	row->numEntries = acc->numVisible;
+
+	for ( int k = 0; k < acc->numVisible; k++ )
+	{
+		int g = acc->visibleGatherers[k];
+		row->gathererIDs[k] = g;
+		row->formFactors[k] = acc->formFactors[g];
+		acc->formFactors[g] = 0.0f;
+	}
+
+	acc->numVisible = 0;
+}
+
+
+
+
+void FF_DeltaFormFactorsInit( FF_DeltaFormFactors *d, int resolution )
+	// Compute the delta form factors of a hemicube with the resolution, which must be even.
+	// The hemicube has unit height, and its top face spans [-1, 1] in x and y.
+	// A pixel of area dA at (x, y, 1) on the top face has delta form factor
+	//     dA / ( pi * (x^2 + y^2 + 1)^2 ),
+	// and a pixel at (x, 1, z) on a side face has delta form factor
+	//     dA * z / ( pi * (x^2 + z^2 + 1)^2 ).
+{
+	int half = resolution / 2;
+	d->resolution = resolution;
+	d->top = (float *) CheckedMalloc( sizeof(float) * Max2( half * half, 1 ) );
+	d->side = (float *) CheckedMalloc( sizeof(float) * Max2( half * half, 1 ) );
+
+	double pixelWidth = 2.0 / resolution;
+	double dA = pixelWidth * pixelWidth;
+
+	for ( int i = 0; i < half; i++ )
+		for ( int j = 0; j < half; j++ )
+		{
+			// Pixel centers, with the top face center and the side face base at 0.
+			double a = ( i + 0.5 ) * pixelWidth;
+			double b = ( j + 0.5 ) * pixelWidth;
+			double t = a * a + b * b + 1.0;
+			d->top[ i * half + j ] = (float) ( dA / ( M_PI * t * t ) );
+			d->side[ i * half + j ] = (float) ( dA * a / ( M_PI * t * t ) );
+		}
+}
+
+
+
+void FF_DeltaFormFactorsCleanUp( FF_DeltaFormFactors *d )
+{
+	if ( d == NULL ) return;
+	free( d->top );
+	free( d->side );
+	d->resolution = 0;
+	d->top = d->side = NULL;
+}
+
+
+
+bool FF_DeltaFormFactorsLoad( FF_DeltaFormFactors *d, int resolution, const char *filename )
+	// Read the delta form factors of a hemicube with the resolution from the file.
+	// The file has the 4 bytes DELTA_MAGIC, the byte order mark and the resolution as 
+	// unsigned ints, followed by the top and side arrays.
+{
+	d->resolution = 0;
+	d->top = d->side = NULL;
+
+	FILE *fp = fopen( filename, "rb" );
+	if ( fp == NULL ) return false;
+
+	char magic[4];
+	unsigned int header[2];		// Byte order mark and resolution.
+	bool ok = ( fread( magic, 1, 4, fp ) == 4 && memcmp( magic, DELTA_MAGIC, 4 ) == 0 &&
+				fread( header, sizeof(unsigned int), 2, fp ) == 2 && 
+				header[0] == CACHE_BYTE_ORDER && header[1] == (unsigned int) resolution );
+
+	if ( ok )
+	{
+		int n = ( resolution / 2 ) * ( resolution / 2 );
+		d->resolution = resolution;
+		d->top = (float *) CheckedMalloc( sizeof(float) * Max2( n, 1 ) );
+		d->side = (float *) CheckedMalloc( sizeof(float) * Max2( n, 1 ) );
+		ok = ( fread( d->top, sizeof(float), n, fp ) == (size_t) n &&
+			   fread( d->side, sizeof(float), n, fp ) == (size_t) n );
+	}
+
+	fclose( fp );
+	if ( !ok ) FF_DeltaFormFactorsCleanUp( d );
+	return ok;
+}
+
+
+
+void FF_DeltaFormFactorsSave( const FF_DeltaFormFactors *d, const char *filename )
+{
+	char badWrite[] = "Error writing to file";
+
+	FILE *fp = fopen( filename, "wb" );
+	if ( fp == NULL ) 
+		ShowFatalError( __FILE__, __LINE__, "Cannot open file \"%s\" for output", filename );
+
+	unsigned int header[2] = { CACHE_BYTE_ORDER, (unsigned int) d->resolution };
+	int n = ( d->resolution / 2 ) * ( d->resolution / 2 );
+
+	if ( fwrite( DELTA_MAGIC, 1, 4, fp ) != 4 || fwrite( header, sizeof(unsigned int), 2, fp ) != 2 ||
+		 fwrite( d->top, sizeof(float), n, fp ) != (size_t) n || fwrite( d->side, sizeof(float), n, fp ) != (size_t) n )
+		ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badWrite, filename );
+
+	fclose( fp );
+}
+
+
+
+
+static void QuadBoundingBox( float min_xyz[3], float max_xyz[3], const float v[4][3] )
+{
+	for ( int j = 0; j < 3; j++ )
+	{
+		min_xyz[j] = Min2( Min2( v[0][j], v[1][j] ), Min2( v[2][j], v[3][j] ) );
+		max_xyz[j] = Max2( Max2( v[0][j], v[1][j] ), Max2( v[2][j], v[3][j] ) );
+	}
+}
+
+
+static inline int GridCellCoord( const FF_Grid *grid, int axis, float x )
+{
+	int c = (int) floor( ( x - grid->min_xyz[axis] ) / grid->cellSize[axis] );
+	return Clamp( c, 0, grid->res[axis] - 1 );
+}
+
+
+FF_Grid FF_BuildGrid( const QM_Model *m )
+	// Build a uniform grid over the gatherer quads of the model, for ray casting.
+{
+	FF_Grid grid;
+
+	// Pad the model's bounding box, so that flat models still have a non-zero volume.
+	float pad = 1e-3f * m->radius;
+	float dim[3];
+	for ( int j = 0; j < 3; j++ )
+	{
+		grid.min_xyz[j] = m->min_xyz[j] - pad;
+		grid.max_xyz[j] = m->max_xyz[j] + pad;
+		dim[j] = grid.max_xyz[j] - grid.min_xyz[j];
+	}
+
+	// Choose cubical cells so that there are about GRID_CELLS_PER_QUAD cells per gatherer quad.
+	float volume = dim[0] * dim[1] * dim[2];
+	float cellLen = (float) pow( volume / ( GRID_CELLS_PER_QUAD * Max2( m->totalGatherers, 1 ) ), 1.0 / 3.0 );
+
+	int numCells = 1;
+	for ( int j = 0; j < 3; j++ )
+	{
+		grid.res[j] = Clamp( (int) ceil( dim[j] / cellLen ), 1, GRID_MAX_RES );
+		grid.cellSize[j] = dim[j] / grid.res[j];
+		numCells *= grid.res[j];
+	}
+
+	// First pass counts the gatherer quads overlapping each cell,
+	// second pass fills in the gatherer quad IDs.
+	grid.cellStart = (int *) CheckedMalloc( sizeof(int) * ( numCells + 1 ) );
+	for ( int c = 0; c <= numCells; c++ ) grid.cellStart[c] = 0;
+
+	for ( int pass = 0; pass < 2; pass++ )
+	{
+		for ( int g = 0; g < m->totalGatherers; g++ )
+		{
+			float qmin[3], qmax[3];
+			QuadBoundingBox( qmin, qmax, m->gatherers[g]->v );
+
+			int c0[3], c1[3];
+			for ( int j = 0; j < 3; j++ )
+			{
+				c0[j] = GridCellCoord( &grid, j, qmin[j] - pad );
+				c1[j] = GridCellCoord( &grid, j, qmax[j] + pad );
+			}
+
+			for ( int z = c0[2]; z <= c1[2]; z++ )
+				for ( int y = c0[1]; y <= c1[1]; y++ )
+					for ( int x = c0[0]; x <= c1[0]; x++ )
+					{
+						int c = ( z * grid.res[1] + y ) * grid.res[0] + x;
+						if ( pass == 0 )
+							grid.cellStart[c + 1]++;
+						else
+							grid.cellItems[ grid.cellStart[c]++ ] = g;
+					}
+		}
+
+		if ( pass == 0 )
+		{
+			for ( int c = 0; c < numCells; c++ ) grid.cellStart[c + 1] += grid.cellStart[c];
+			grid.cellItems = (int *) CheckedMalloc( sizeof(int) * Max2( grid.cellStart[numCells], 1 ) );
+		}
+		else
+		{
+			// The second pass has advanced each cellStart[c] to the start of cell c+1.
+			for ( int c = numCells; c > 0; c-- ) grid.cellStart[c] = grid.cellStart[c - 1];
+			grid.cellStart[0] = 0;
+		}
+	}
+
+	return grid;
+}
+
+
+void FF_GridCleanUp( FF_Grid *grid )
+{
+	if ( grid == NULL ) return;
+	free( grid->cellStart );
+	free( grid->cellItems );
+	grid->cellStart = NULL;
+	grid->cellItems = NULL;
+	grid->res[0] = grid->res[1] = grid->res[2] = 0;
+}
+
+
+
+
+static inline float RayTriangleIntersect( const float o[3], const float d[3],
+										  const float v0[3], const float v1[3], const float v2[3] )
+	// Returns the ray parameter t of the intersection of the ray o + t*d with the
+	// triangle v0v1v2, or FLT_MAX if there is no intersection. Both sides of the triangle are hit.
+{
+	float e1[3], e2[3], p[3], s[3], q[3];
+	VecDiff( e1, v1, v0 );
+	VecDiff( e2, v2, v0 );
+	VecCrossProd( p, d, e2 );
+	float det = VecDotProd( e1, p );
+	if ( det == 0.0f ) return FLT_MAX;
+
+	float invDet = 1.0f / det;
+	VecDiff( s, o, v0 );
+	float u = VecDotProd( s, p ) * invDet;
+	if ( u < 0.0f || u > 1.0f ) return FLT_MAX;
+
+	VecCrossProd( q, s, e1 );
+	float v = VecDotProd( d, q ) * invDet;
+	if ( v < 0.0f || u + v > 1.0f ) return FLT_MAX;
+
+	return VecDotProd( e2, q ) * invDet;
+}
+
+
+static int CastRay( const QM_Model *m, const FF_Grid *grid, const float o[3], const float d[3] )
+	// Returns the ID of the nearest gatherer quad hit by the ray o + t*d, t > 0,
+	// or -1 if the ray hits nothing. The grid is traversed with a 3D-DDA.
+{
+	// Clip the ray against the grid's bounding box.
+	float tEnter = 0.0f, tExit = FLT_MAX;
+	for ( int j = 0; j < 3; j++ )
+	{
+		if ( d[j] == 0.0f )
+		{
+			if ( o[j] < grid->min_xyz[j] || o[j] > grid->max_xyz[j] ) return -1;
+			continue;
+		}
+		float t0 = ( grid->min_xyz[j] - o[j] ) / d[j];
+		float t1 = ( grid->max_xyz[j] - o[j] ) / d[j];
+		if ( t0 > t1 ) { float t = t0; t0 = t1; t1 = t; }
+		tEnter = Max2( tEnter, t0 );
+		tExit = Min2( tExit, t1 );
+	}
+	if ( tEnter > tExit ) return -1;
+
+	// Set up the 3D-DDA.
+	int cell[3], step[3];
+	float tMax[3], tDelta[3];
+	for ( int j = 0; j < 3; j++ )
+	{
+		cell[j] = GridCellCoord( grid, j, o[j] + tEnter * d[j] );
+		if ( d[j] > 0.0f )
+		{
+			step[j] = 1;
+			tDelta[j] = grid->cellSize[j] / d[j];
+			tMax[j] = ( grid->min_xyz[j] + ( cell[j] + 1 ) * grid->cellSize[j] - o[j] ) / d[j];
+		}
+		else if ( d[j] < 0.0f )
+		{
+			step[j] = -1;
+			tDelta[j] = -grid->cellSize[j] / d[j];
+			tMax[j] = ( grid->min_xyz[j] + cell[j] * grid->cellSize[j] - o[j] ) / d[j];
+		}
+		else
+		{
+			step[j] = 0;
+			tDelta[j] = tMax[j] = FLT_MAX;
+		}
+	}
+
+	int hitID = -1;
+	float hitT = FLT_MAX;
+
+	for (;;)
+	{
+		int c = ( cell[2] * grid->res[1] + cell[1] ) * grid->res[0] + cell[0];
+
+		for ( int k = grid->cellStart[c]; k < grid->cellStart[c + 1]; k++ )
+		{
+			int g = grid->cellItems[k];
+			const QM_GathererQuad *quad = m->gatherers[g];
+			float t = RayTriangleIntersect( o, d, quad->v[0], quad->v[1], quad->v[2] );
+			if ( t > 0.0f && t < hitT ) { hitT = t;  hitID = g; }
+			t = RayTriangleIntersect( o, d, quad->v[0], quad->v[2], quad->v[3] );
+			if ( t > 0.0f && t < hitT ) { hitT = t;  hitID = g; }
+		}
+
+		// A hit inside the current cell cannot be occluded by quads in later cells.
+		int axis = ( tMax[0] < tMax[1] )? ( ( tMax[0] < tMax[2] )? 0 : 2 ) : ( ( tMax[1] < tMax[2] )? 1 : 2 );
+		if ( hitT <= tMax[axis] || tMax[axis] > tExit ) return hitID;
+
+		cell[axis] += step[axis];
+		if ( cell[axis] < 0 || cell[axis] >= grid->res[axis] ) return hitID;
+		tMax[axis] += tDelta[axis];
+	}
+}
+
+
+
+
+static inline float NextRandom( unsigned int *state )
+	// Returns a pseudo-random number in [0, 1), and advances the state (xorshift32).
+{
+	unsigned int x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return ( x >> 8 ) * ( 1.0f / 16777216.0f );
+}
+
+
+void FF_ComputeRowByRayCasting( FF_Row *row, FF_Accumulator *acc, const QM_Model *m,
+								const FF_Grid *grid, int shooter, int numRays, unsigned int seed )
+	// Compute the form factors from shooter quad m->shooters[shooter] to the gatherer quads,
+	// by casting numRays cosine-distributed rays from the centroid of the shooter quad.
+{
+	const QM_ShooterQuad *shooterQuad = m->shooters[shooter];
+
+	// Local frame of the shooter quad. w is the normal vector.
+	float u[3], v[3], w[3];
+	CopyArray3( w, shooterQuad->normal );
+	VecNormalize( u, VecDiff( u, shooterQuad->v[1], shooterQuad->v[0] ) );
+	VecCrossProd( v, w, u );
+
+	float origin[3];
+	VecSum( origin, shooterQuad->centroid, VecScale( origin, RAY_EPSILON * m->radius, w ) );
+
+	// The rays are stratified on a numStrata x numStrata grid. With cosine-distributed
+	// directions, every ray carries the same fraction of the form factor.
+	int numStrata = Max2( (int) sqrt( (double) numRays ), 1 );
+	float rayFF = 1.0f / ( numStrata * numStrata );
+
+	unsigned int state = seed * 2654435761u + 0x9E3779B9u;
+	if ( state == 0 ) state = 1;
+
+	for ( int i = 0; i < numStrata; i++ )
+		for ( int j = 0; j < numStrata; j++ )
+		{
+			float s1 = ( i + NextRandom( &state ) ) / numStrata;
+			float s2 = ( j + NextRandom( &state ) ) / numStrata;
+			float r = sqrt( s1 );
+			float phi = (float) ( 2.0 * M_PI ) * s2;
+			float lx = r * cos( phi ), ly = r * sin( phi ), lz = sqrt( Max2( 1.0f - s1, 0.0f ) );
+
+			float d[3];
+			for ( int k = 0; k < 3; k++ ) d[k] = lx * u[k] + ly * v[k] + lz * w[k];
+
+			int g = CastRay( m, grid, origin, d );
+			if ( g >= 0 ) FF_AccumulatorAdd( acc, g, rayFF );
+		}
+
+	FF_AccumulatorToRow( acc, row );
+}
+
+
+
+
+// The form factor cache file has a CacheFileHeader, followed by CacheFileHeader::numRows rows.
+// Each row is the shooter quad index and the number of entries n as two ints, 
+// followed by n gatherer quad IDs (ints) and n form factors (floats).
+typedef struct CacheFileHeader {
+	char magic[4];					// CACHE_MAGIC, without the terminating null character.
+	unsigned int byteOrder;			// CACHE_BYTE_ORDER.
+	unsigned long long geometryHash;
+	int numShooters;
+	int numGatherers;
+	int numRows;
+	int reserved;					// 0.
+}
+CacheFileHeader;
+
+
+
+static inline void HashBytes( unsigned long long *h, const void *data, size_t size )
+{
+	const unsigned char *bytes = (const unsigned char *) data;
+	for ( size_t i = 0; i < size; i++ )
+	{
+		*h ^= bytes[i];
+		*h *= 1099511628211ull;
+	}
+}
+
+
+unsigned long long FF_GeometryHash( const QM_Model *m, unsigned long long salt )
+	// Returns a 64-bit FNV-1a hash of the vertices of the shooter and gatherer quads.
+{
+	unsigned long long h = 14695981039346656037ull;
+	HashBytes( &h, &salt, sizeof(salt) );
+	HashBytes( &h, &(m->totalShooters), sizeof(int) );
+	HashBytes( &h, &(m->totalGatherers), sizeof(int) );
+
+	for ( int s = 0; s < m->totalShooters; s++ )
+		HashBytes( &h, m->shooters[s]->v, sizeof(float) * 12 );
+
+	for ( int g = 0; g < m->totalGatherers; g++ )
+		HashBytes( &h, m->gatherers[g]->v, sizeof(float) * 12 );
+
+	return h;
+}
+
+
+
+void FF_CacheInit( FF_Cache *cache, const QM_Model *m, unsigned long long geometryHash )
+{
+	cache->geometryHash = geometryHash;
+	cache->numShooters = m->totalShooters;
+	cache->numGatherers = m->totalGatherers;
+	cache->rows = (FF_Row *) CheckedMalloc( sizeof(FF_Row) * Max2( m->totalShooters, 1 ) );
+	cache->hasRow = (bool *) CheckedMalloc( sizeof(bool) * Max2( m->totalShooters, 1 ) );
+	cache->numRows = 0;
+	cache->modified = false;
+
+	for ( int s = 0; s < m->totalShooters; s++ )
+	{
+		FF_RowInit( &(cache->rows[s]) );
+		cache->hasRow[s] = false;
+	}
+}
+
+
+void FF_CacheCleanUp( FF_Cache *cache )
+{
+	if ( cache == NULL ) return;
+	for ( int s = 0; s < cache->numShooters; s++ ) FF_RowCleanUp( &(cache->rows[s]) );
+	free( cache->rows );
+	free( cache->hasRow );
+	cache->rows = NULL;
+	cache->hasRow = NULL;
+	cache->numShooters = cache->numGatherers = cache->numRows = 0;
+	cache->modified = false;
+}
+
+
+static void CacheClear( FF_Cache *cache )
+	// Remove all the rows.
+{
+	for ( int s = 0; s < cache->numShooters; s++ )
+	{
+		cache->rows[s].numEntries = 0;
+		cache->hasRow[s] = false;
+	}
+	cache->numRows = 0;
+	cache->modified = false;
+}
+
+
+const FF_Row *FF_CacheAddRow( FF_Cache *cache, int shooter, const FF_Row *row )
+	// Copy the row of the shooter quad into the cache. Returns the copy.
+{
+	FF_RowCopy( &(cache->rows[shooter]), row );
+	if ( !cache->hasRow[shooter] ) cache->numRows++;
+	cache->hasRow[shooter] = true;
+	cache->modified = true;
+	return &(cache->rows[shooter]);
+}
+
+
+
+int FF_CacheRemapGatherers( FF_Cache *cache, const int newIDs[], int numGatherers, bool removed[] )
+	// Change the gatherer quad IDs in the rows to newIDs[ID], after the gatherer quads
+	// have been refined. The rows that have a gatherer quad without a new ID are removed.
+	// Returns the number of rows removed.
+{
+	int numRemoved = 0;
+
+	for ( int s = 0; s < cache->numShooters; s++ )
+	{
+		removed[s] = false;
+		if ( !cache->hasRow[s] ) continue;
+
+		FF_Row *row = &(cache->rows[s]);
+		for ( int k = 0; k < row->numEntries && !removed[s]; k++ )
+		{
+			row->gathererIDs[k] = newIDs[ row->gathererIDs[k] ];
+			removed[s] = ( row->gathererIDs[k] < 0 );
+		}
+
+		if ( removed[s] )
+		{
+			row->numEntries = 0;
+			cache->hasRow[s] = false;
+			cache->numRows--;
+			numRemoved++;
+		}
+	}
+
+	cache->numGatherers = numGatherers;
+	return numRemoved;
+}
+
+
+
+bool FF_CacheLoad( FF_Cache *cache, const char *filename )
+	// Read the rows saved in the file into the cache.
+	// Returns false, leaving the cache empty, if the file cannot be read or 
+	// was saved for a different geometry.
+{
+	CacheClear( cache );
+
+	FILE *fp = fopen( filename, "rb" );
+	if ( fp == NULL ) return false;
+
+	CacheFileHeader header;
+	bool ok = ( fread( &header, sizeof(CacheFileHeader), 1, fp ) == 1 &&
+				memcmp( header.magic, CACHE_MAGIC, 4 ) == 0 && header.byteOrder == CACHE_BYTE_ORDER &&
+				header.geometryHash == cache->geometryHash && header.numShooters == cache->numShooters && 
+				header.numGatherers == cache->numGatherers && header.numRows >= 0 && 
+				header.numRows <= cache->numShooters );
+
+	for ( int r = 0; ok && r < header.numRows; r++ )
+	{
+		int rowHeader[2];	// Shooter quad index and number of entries.
+		if ( fread( rowHeader, sizeof(int), 2, fp ) != 2 ||
+			 rowHeader[0] < 0 || rowHeader[0] >= cache->numShooters || cache->hasRow[ rowHeader[0] ] ||
+			 rowHeader[1] < 0 || rowHeader[1] > cache->numGatherers ) 
+		{
+			ok = false;
+			break;
+		}
+
+		FF_Row *row = &(cache->rows[ rowHeader[0] ]);
+		int n = rowHeader[1];
+		FF_RowReserve( row, n );
+		if ( fread( row->gathererIDs, sizeof(int), n, fp ) != (size_t) n ||
+			 fread( row->formFactors, sizeof(float), n, fp ) != (size_t) n )
+		{
+			ok = false;
+			break;
+		}
+
+		for ( int k = 0; k < n; k++ )
+			if ( row->gathererIDs[k] < 0 || row->gathererIDs[k] >= cache->numGatherers ) ok = false;
+
+		row->numEntries = n;
+		cache->hasRow[ rowHeader[0] ] = true;
+		cache->numRows++;
+	}
+
+	fclose( fp );
+	if ( !ok ) CacheClear( cache );
+	cache->modified = false;
+	return ok;
+}
+
+
+
+void FF_CacheSave( FF_Cache *cache, const char *filename )
+	// Write the rows in the cache to the file.
+{
+	char badWrite[] = "Error writing to file";
+
+	FILE *fp = fopen( filename, "wb" );
+	if ( fp == NULL ) 
+		ShowFatalError( __FILE__, __LINE__, "Cannot open file \"%s\" for output", filename );
+
+	CacheFileHeader header;
+	memcpy( header.magic, CACHE_MAGIC, 4 );
+	header.byteOrder = CACHE_BYTE_ORDER;
+	header.geometryHash = cache->geometryHash;
+	header.numShooters = cache->numShooters;
+	header.numGatherers = cache->numGatherers;
+	header.numRows = cache->numRows;
+	header.reserved = 0;
+
+	if ( fwrite( &header, sizeof(CacheFileHeader), 1, fp ) != 1 )
+		ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badWrite, filename );
+
+	for ( int s = 0; s < cache->numShooters; s++ )
+	{
+		if ( !cache->hasRow[s] ) continue;
+
+		const FF_Row *row = &(cache->rows[s]);
+		int rowHeader[2] = { s, row->numEntries };
+		if ( fwrite( rowHeader, sizeof(int), 2, fp ) != 2 ||
+			 fwrite( row->gathererIDs, sizeof(int), row->numEntries, fp ) != (size_t) row->numEntries ||
+			 fwrite( row->formFactors, sizeof(float), row->numEntries, fp ) != (size_t) row->numEntries )
+			ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badWrite, filename );
+	}
+
+	fclose( fp );
+	cache->modified = false;
+}
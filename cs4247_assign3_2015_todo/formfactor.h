@@ -0,0 +1,164 @@
+#ifndef _FORMFACTOR_H_
+#define _FORMFACTOR_H_
+
+#include "quadmodel.h"
+
+// Form factors from one shooter quad to the gatherer quads of a QM_Model.
+// Only the gatherer quads that are visible from the shooter quad are stored.
+// Gatherer quads are identified by their index in QM_Model::gatherers.
+
+
+typedef struct FF_Row {
+	int numEntries;			// Number of gatherer quads visible from the shooter quad.
+	int capacity;			// Number of entries allocated.
+	int *gathererIDs;		// IDs of the visible gatherer quads.
+	float *formFactors;		// Form factor from the shooter quad to each visible gatherer quad.
+}
+FF_Row;
+
+
+typedef struct FF_Accumulator {
+	int numGatherers;		// Number of gatherer quads in the model.
+	float *formFactors;		// Summed form factor, indexed by gatherer quad ID.
+							// It is zero for gatherer quads that are not visible.
+	int numVisible;			// Number of visible gatherer quads.
+	int *visibleGatherers;	// IDs of the visible gatherer quads, in the order they were first seen.
+}
+FF_Accumulator;
+
+
+typedef struct FF_Grid {
+	int res[3];				// Number of cells along x, y and z.
+	float min_xyz[3];		// Corner of the grid with minimum x, y, z.
+	float max_xyz[3];		// Corner of the grid with maximum x, y, z.
+	float cellSize[3];		// Dimensions of a cell in x, y, z.
+	int *cellStart;			// The gatherer quads overlapping cell c are
+	int *cellItems;			// cellItems[ cellStart[c] ] to cellItems[ cellStart[c+1] - 1 ].
+}
+FF_Grid;
+
+
+// Delta form factors of the pixels of a hemicube that has resolution x resolution pixels
+// on the top face, and resolution x (resolution/2) pixels on each side face.
+// They are symmetric about the center lines of the faces, so only a quadrant of the 
+// top face and half of a side face are stored. The other pixels are found by reflection.
+typedef struct FF_DeltaFormFactors {
+	int resolution;			// Number of pixels across the top face. Even.
+	float *top;				// top[ i * (resolution/2) + j ] is for the top face pixel i rows and 
+							// j columns away from the pixels next to the center of the face.
+	float *side;			// side[ i * (resolution/2) + j ] is for the side face pixel in row i, 
+							// counted from the base of the face, j columns away from the center.
+}
+FF_DeltaFormFactors;
+
+
+// Form factor rows of the shooter quads, saved to a file so that later runs on the same
+// geometry can use them instead of computing them again. The form factors do not depend
+// on the emission or reflectivity of the surfaces, so only the lighting can be changed.
+// The cache is keyed by a hash of the geometry, see FF_GeometryHash().
+typedef struct FF_Cache {
+	unsigned long long geometryHash;
+	int numShooters;		// Number of shooter quads in the model.
+	int numGatherers;		// Number of gatherer quads in the model.
+	FF_Row *rows;			// The row of each shooter quad.
+	bool *hasRow;			// True for the shooter quads whose rows have been computed.
+	int numRows;			// Number of shooter quads with rows.
+	bool modified;			// True if rows have been added since it was loaded or saved.
+}
+FF_Cache;
+
+
+
+extern void FF_RowInit( FF_Row *row );
+extern void FF_RowCleanUp( FF_Row *row );
+extern void FF_RowReserve( FF_Row *row, int capacity );
+extern void FF_RowCopy( FF_Row *dest, const FF_Row *src );
+
+
+extern void FF_AccumulatorInit( FF_Accumulator *acc, int numGatherers );
+extern void FF_AccumulatorCleanUp( FF_Accumulator *acc );
+
+inline void FF_AccumulatorAdd( FF_Accumulator *acc, int g, float formFactor )
+	// Add formFactor to gatherer quad g. formFactor must be positive.
+{
+	// A zero total means that the gatherer quad has not been seen before.
+	if ( acc->formFactors[g] == 0.0f ) acc->visibleGatherers[ acc->numVisible++ ] = g;
+	acc->formFactors[g] += formFactor;
+}
+
+extern void FF_AccumulatorToRow( FF_Accumulator *acc, FF_Row *row );
+	// Copy the accumulated form factors to row, and clear the accumulator.
+
+
+extern void FF_DeltaFormFactorsInit( FF_DeltaFormFactors *d, int resolution );
+	// Compute the delta form factors of a hemicube with the resolution, which must be even.
+
+extern void FF_DeltaFormFactorsCleanUp( FF_DeltaFormFactors *d );
+
+extern bool FF_DeltaFormFactorsLoad( FF_DeltaFormFactors *d, int resolution, const char *filename );
+	// Read the delta form factors of a hemicube with the resolution from the file.
+	// Returns false, leaving d empty, if the file cannot be read or is for another resolution.
+
+extern void FF_DeltaFormFactorsSave( const FF_DeltaFormFactors *d, const char *filename );
+
+inline const float *FF_DeltaFormFactorRow( const FF_DeltaFormFactors *d, bool topFace, int row )
+	// Returns the stored half row of delta form factors for a row of pixels of the top face 
+	// or of a side face. The pixel in column c of the face is in entry (c - resolution/2) of 
+	// the half row if c >= resolution/2, and in entry (resolution/2 - 1 - c) otherwise.
+{
+	int half = d->resolution / 2;
+	if ( !topFace ) return &(d->side[ row * half ]);
+	return &(d->top[ ( ( row >= half )? row - half : half - 1 - row ) * half ]);
+}
+
+
+extern FF_Grid FF_BuildGrid( const QM_Model *m );
+	// Build a uniform grid over the gatherer quads of the model, for ray casting.
+
+extern void FF_GridCleanUp( FF_Grid *grid );
+
+
+extern void FF_ComputeRowByRayCasting( FF_Row *row, FF_Accumulator *acc, const QM_Model *m,
+									   const FF_Grid *grid, int shooter, int numRays, unsigned int seed );
+	// Compute the form factors from shooter quad m->shooters[shooter] to the gatherer quads,
+	// by casting numRays cosine-distributed rays from the centroid of the shooter quad.
+	// The rays are stratified and jittered using a random sequence determined by seed only,
+	// so the result does not depend on which thread computes it.
+	// acc is used as scratch memory, and must be empty on entry. It is left empty on return.
+
+
+extern unsigned long long FF_GeometryHash( const QM_Model *m, unsigned long long salt );
+	// Returns a 64-bit FNV-1a hash of the vertices of the shooter and gatherer quads.
+	// Settings that change the form factors without changing the geometry, such as 
+	// the form factor method and its resolution, should be combined into salt.
+
+extern void FF_CacheInit( FF_Cache *cache, const QM_Model *m, unsigned long long geometryHash );
+	// Make an empty cache for the model.
+
+extern void FF_CacheCleanUp( FF_Cache *cache );
+
+extern bool FF_CacheLoad( FF_Cache *cache, const char *filename );
+	// Read the rows saved in the file into the cache, which must have been initialized.
+	// Returns false, leaving the cache empty, if the file cannot be read or 
+	// was saved for a different geometry.
+
+extern void FF_CacheSave( FF_Cache *cache, const char *filename );
+	// Write the rows in the cache to the file.
+
+inline const FF_Row *FF_CacheGetRow( const FF_Cache *cache, int shooter )
+	// Returns the row of the shooter quad, or NULL if it is not in the cache.
+{
+	return cache->hasRow[shooter]? &(cache->rows[shooter]) : NULL;
+}
+
+extern const FF_Row *FF_CacheAddRow( FF_Cache *cache, int shooter, const FF_Row *row );
+	// Copy the row of the shooter quad into the cache. Returns the copy.
+
+extern int FF_CacheRemapGatherers( FF_Cache *cache, const int newIDs[], int numGatherers, bool removed[] );
+	// Update the rows after the gatherer quads have been refined (see QM_RefineGatherers()).
+	// The gatherer quad with ID g gets the ID newIDs[g], and the model now has numGatherers 
+	// gatherer quads. The rows that have a gatherer quad with newIDs[g] < 0, i.e. one that 
+	// has been split, are removed, and removed[s] is set to true for their shooter quads. 
+	// removed must have an entry for each shooter quad. Returns the number of rows removed.
+
+#endif
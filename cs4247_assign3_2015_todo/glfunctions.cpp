@@ -0,0 +1,127 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "glfunctions.h"
+#include "common.h"
+
+
+#ifdef _WIN32
+PFNGLBINDBUFFERPROC glBindBuffer = NULL;
+PFNGLBUFFERDATAPROC glBufferData = NULL;
+PFNGLBUFFERSUBDATAPROC glBufferSubData = NULL;
+PFNGLDELETEBUFFERSPROC glDeleteBuffers = NULL;
+PFNGLGENBUFFERSPROC glGenBuffers = NULL;
+
+PFNGLATTACHSHADERPROC glAttachShader = NULL;
+PFNGLCOMPILESHADERPROC glCompileShader = NULL;
+PFNGLCREATEPROGRAMPROC glCreateProgram = NULL;
+PFNGLCREATESHADERPROC glCreateShader = NULL;
+PFNGLDELETESHADERPROC glDeleteShader = NULL;
+PFNGLGETPROGRAMINFOLOGPROC glGetProgramInfoLog = NULL;
+PFNGLGETPROGRAMIVPROC glGetProgramiv = NULL;
+PFNGLGETSHADERINFOLOGPROC glGetShaderInfoLog = NULL;
+PFNGLGETSHADERIVPROC glGetShaderiv = NULL;
+PFNGLGETUNIFORMLOCATIONPROC glGetUniformLocation = NULL;
+PFNGLLINKPROGRAMPROC glLinkProgram = NULL;
+PFNGLSHADERSOURCEPROC glShaderSource = NULL;
+PFNGLUNIFORM1FPROC glUniform1f = NULL;
+PFNGLUSEPROGRAMPROC glUseProgram = NULL;
+
+#define LOAD_GL_FUNCTION(type, name)	( ( name = (type) wglGetProcAddress( #name ) ) != NULL )
+#endif
+
+
+
+bool IsGLVersionAtLeast( int major, int minor )
+	// Returns true if the OpenGL version of the current context is at least major.minor.
+{
+	const char *version = (const char *) glGetString( GL_VERSION );
+	int versionMajor = 0, versionMinor = 0;
+	if ( version == NULL || sscanf( version, "%d.%d", &versionMajor, &versionMinor ) != 2 ) return false;
+	return ( versionMajor > major || ( versionMajor == major && versionMinor >= minor ) );
+}
+
+
+
+bool LoadGLFunctions( void )
+	// Makes the OpenGL functions declared in glfunctions.h available.
+	// Returns false if the OpenGL implementation is older than version 2.0.
+{
+	if ( !IsGLVersionAtLeast( 2, 0 ) ) return false;
+
+#ifdef _WIN32
+	if ( !LOAD_GL_FUNCTION( PFNGLBINDBUFFERPROC, glBindBuffer ) ||
+		 !LOAD_GL_FUNCTION( PFNGLBUFFERDATAPROC, glBufferData ) ||
+		 !LOAD_GL_FUNCTION( PFNGLBUFFERSUBDATAPROC, glBufferSubData ) ||
+		 !LOAD_GL_FUNCTION( PFNGLDELETEBUFFERSPROC, glDeleteBuffers ) ||
+		 !LOAD_GL_FUNCTION( PFNGLGENBUFFERSPROC, glGenBuffers ) )
+		return false;
+
+	if ( !LOAD_GL_FUNCTION( PFNGLATTACHSHADERPROC, glAttachShader ) ||
+		 !LOAD_GL_FUNCTION( PFNGLCOMPILESHADERPROC, glCompileShader ) ||
+		 !LOAD_GL_FUNCTION( PFNGLCREATEPROGRAMPROC, glCreateProgram ) ||
+		 !LOAD_GL_FUNCTION( PFNGLCREATESHADERPROC, glCreateShader ) ||
+		 !LOAD_GL_FUNCTION( PFNGLDELETESHADERPROC, glDeleteShader ) ||
+		 !LOAD_GL_FUNCTION( PFNGLGETPROGRAMINFOLOGPROC, glGetProgramInfoLog ) ||
+		 !LOAD_GL_FUNCTION( PFNGLGETPROGRAMIVPROC, glGetProgramiv ) ||
+		 !LOAD_GL_FUNCTION( PFNGLGETSHADERINFOLOGPROC, glGetShaderInfoLog ) ||
+		 !LOAD_GL_FUNCTION( PFNGLGETSHADERIVPROC, glGetShaderiv ) ||
+		 !LOAD_GL_FUNCTION( PFNGLGETUNIFORMLOCATIONPROC, glGetUniformLocation ) ||
+		 !LOAD_GL_FUNCTION( PFNGLLINKPROGRAMPROC, glLinkProgram ) ||
+		 !LOAD_GL_FUNCTION( PFNGLSHADERSOURCEPROC, glShaderSource ) ||
+		 !LOAD_GL_FUNCTION( PFNGLUNIFORM1FPROC, glUniform1f ) ||
+		 !LOAD_GL_FUNCTION( PFNGLUSEPROGRAMPROC, glUseProgram ) )
+		return false;
+#endif
+
+	return true;
+}
+
+
+
+static GLuint CompileShader( GLenum type, const char *source )
+	// Compiles a GLSL shader. Exits program if there is an error.
+{
+	GLuint shader = glCreateShader( type );
+	glShaderSource( shader, 1, &source, NULL );
+	glCompileShader( shader );
+
+	GLint status;
+	glGetShaderiv( shader, GL_COMPILE_STATUS, &status );
+	if ( status != GL_TRUE )
+	{
+		char log[1024];
+		glGetShaderInfoLog( shader, sizeof(log), NULL, log );
+		ShowFatalError( __FILE__, __LINE__, "Cannot compile %s shader:\n%s", 
+						( type == GL_VERTEX_SHADER )? "vertex" : "fragment", log );
+	}
+	return shader;
+}
+
+
+
+GLuint MakeShaderProgram( const char *vertexShaderSource, const char *fragmentShaderSource )
+	// Compiles the two GLSL shaders and links them into a program.
+	// Shows the compiler or linker log and exits program if there is an error.
+{
+	GLuint vertexShader = CompileShader( GL_VERTEX_SHADER, vertexShaderSource );
+	GLuint fragmentShader = CompileShader( GL_FRAGMENT_SHADER, fragmentShaderSource );
+
+	GLuint program = glCreateProgram();
+	glAttachShader( program, vertexShader );
+	glAttachShader( program, fragmentShader );
+	glLinkProgram( program );
+
+	// The shaders are deleted together with the program.
+	glDeleteShader( vertexShader );
+	glDeleteShader( fragmentShader );
+
+	GLint status;
+	glGetProgramiv( program, GL_LINK_STATUS, &status );
+	if ( status != GL_TRUE )
+	{
+		char log[1024];
+		glGetProgramInfoLog( program, sizeof(log), NULL, log );
+		ShowFatalError( __FILE__, __LINE__, "Cannot link shader program:\n%s", log );
+	}
+	return program;
+}
@@ -0,0 +1,61 @@
+#ifndef _GLFUNCTIONS_H_
+#define _GLFUNCTIONS_H_
+
+// Include this instead of glut.h and glext.h to use the OpenGL functions 
+// that are newer than OpenGL 1.1, such as those for vertex buffer objects and shaders.
+// LoadGLFunctions() must be called after the OpenGL context has been created.
+
+#ifdef __APPLE__
+#include <GLUT/glut.h>
+#include <GLUT/glext.h>
+#else
+#ifdef _WIN32
+#include <windows.h>			// For wglGetProcAddress().
+#else
+#define GL_GLEXT_PROTOTYPES		// Declare the functions exported by libGL.
+#endif
+#include <GL/glut.h>
+#include <GL/glext.h>
+#endif
+
+
+#ifdef _WIN32
+// On Windows, opengl32.dll exports only OpenGL 1.1 functions. 
+// The others are obtained with wglGetProcAddress().
+extern PFNGLBINDBUFFERPROC glBindBuffer;
+extern PFNGLBUFFERDATAPROC glBufferData;
+extern PFNGLBUFFERSUBDATAPROC glBufferSubData;
+extern PFNGLDELETEBUFFERSPROC glDeleteBuffers;
+extern PFNGLGENBUFFERSPROC glGenBuffers;
+
+extern PFNGLATTACHSHADERPROC glAttachShader;
+extern PFNGLCOMPILESHADERPROC glCompileShader;
+extern PFNGLCREATEPROGRAMPROC glCreateProgram;
+extern PFNGLCREATESHADERPROC glCreateShader;
+extern PFNGLDELETESHADERPROC glDeleteShader;
+extern PFNGLGETPROGRAMINFOLOGPROC glGetProgramInfoLog;
+extern PFNGLGETPROGRAMIVPROC glGetProgramiv;
+extern PFNGLGETSHADERINFOLOGPROC glGetShaderInfoLog;
+extern PFNGLGETSHADERIVPROC glGetShaderiv;
+extern PFNGLGETUNIFORMLOCATIONPROC glGetUniformLocation;
+extern PFNGLLINKPROGRAMPROC glLinkProgram;
+extern PFNGLSHADERSOURCEPROC glShaderSource;
+extern PFNGLUNIFORM1FPROC glUniform1f;
+extern PFNGLUSEPROGRAMPROC glUseProgram;
+#endif
+
+
+extern bool LoadGLFunctions( void );
+	// Makes the OpenGL functions declared above available.
+	// Returns false if the OpenGL implementation is older than version 2.0.
+
+
+extern bool IsGLVersionAtLeast( int major, int minor );
+	// Returns true if the OpenGL version of the current context is at least major.minor.
+
+
+extern GLuint MakeShaderProgram( const char *vertexShaderSource, const char *fragmentShaderSource );
+	// Compiles the two GLSL shaders and links them into a program.
+	// Shows the compiler or linker log and exits program if there is an error.
+
+#endif
@@ -0,0 +1,245 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "common.h"
+#include "quadmodel.h"
+#include "formfactor.h"
+#include "matrixsolver.h"
+
+// The power of a shooter quad is stored as RGBA, with A unused, so that the
+// three channels can be processed together in an SSE register.
+#if defined(__SSE__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 1 )
+#define MS_USE_SSE
+#include <xmmintrin.h>
+#endif
+
+
+
+MS_Matrix MS_BuildMatrix( const FF_Cache *cache, const QM_ModelSoA *soa )
+	// Build the matrix from the form factor rows of all the shooter quads in the cache.
+{
+	MS_Matrix a;
+	a.numShooters = soa->numShooters;
+	a.numGatherers = soa->numGatherers;
+
+	// Transpose the rows, which are per shooter quad, to entries per gatherer quad.
+	a.entryStart = (int *) CheckedMalloc( sizeof(int) * ( a.numGatherers + 1 ) );
+	for ( int g = 0; g <= a.numGatherers; g++ ) a.entryStart[g] = 0;
+
+	for ( int s = 0; s < a.numShooters; s++ )
+	{
+		const FF_Row *row = FF_CacheGetRow( cache, s );
+		if ( row == NULL ) continue;
+		for ( int k = 0; k < row->numEntries; k++ ) a.entryStart[ row->gathererIDs[k] + 1 ]++;
+	}
+	for ( int g = 0; g < a.numGatherers; g++ ) a.entryStart[g + 1] += a.entryStart[g];
+
+	int numEntries = a.entryStart[ a.numGatherers ];
+	a.entryShooters = (int *) CheckedMalloc( sizeof(int) * Max2( numEntries, 1 ) );
+	a.entryFormFactors = (float *) CheckedMalloc( sizeof(float) * Max2( numEntries, 1 ) );
+
+	int *next = (int *) CheckedMalloc( sizeof(int) * Max2( a.numGatherers, 1 ) );
+	CopyArrayN( next, a.entryStart, a.numGatherers );
+
+	// Going through the shooter quads in order keeps the entries of each gatherer quad sorted.
+	for ( int s = 0; s < a.numShooters; s++ )
+	{
+		const FF_Row *row = FF_CacheGetRow( cache, s );
+		if ( row == NULL ) continue;
+		for ( int k = 0; k < row->numEntries; k++ )
+		{
+			int e = next[ row->gathererIDs[k] ]++;
+			a.entryShooters[e] = s;
+			a.entryFormFactors[e] = row->formFactors[k];
+		}
+	}
+	free( next );
+
+	// The gatherer quads of each shooter quad.
+	a.shooterGathererStart = (int *) CheckedMalloc( sizeof(int) * ( a.numShooters + 1 ) );
+	a.shooterGatherers = (int *) CheckedMalloc( sizeof(int) * Max2( a.numGatherers, 1 ) );
+
+	for ( int s = 0; s <= a.numShooters; s++ ) a.shooterGathererStart[s] = 0;
+	for ( int g = 0; g < a.numGatherers; g++ ) a.shooterGathererStart[ soa->gathererShooter[g] + 1 ]++;
+	for ( int s = 0; s < a.numShooters; s++ ) a.shooterGathererStart[s + 1] += a.shooterGathererStart[s];
+
+	next = (int *) CheckedMalloc( sizeof(int) * Max2( a.numShooters, 1 ) );
+	CopyArrayN( next, a.shooterGathererStart, a.numShooters );
+	for ( int g = 0; g < a.numGatherers; g++ ) a.shooterGatherers[ next[ soa->gathererShooter[g] ]++ ] = g;
+	free( next );
+
+	a.gathererArea = (float *) CheckedMalloc( sizeof(float) * Max2( a.numGatherers, 1 ) );
+	for ( int g = 0; g < a.numGatherers; g++ ) a.gathererArea[g] = 1.0f / soa->gathererInvArea[g];
+
+	return a;
+}
+
+
+
+void MS_MatrixCleanUp( MS_Matrix *a )
+{
+	if ( a == NULL ) return;
+	free( a->entryStart );
+	free( a->entryShooters );
+	free( a->entryFormFactors );
+	free( a->shooterGathererStart );
+	free( a->shooterGatherers );
+	free( a->gathererArea );
+	a->entryStart = a->entryShooters = a->shooterGathererStart = a->shooterGatherers = NULL;
+	a->entryFormFactors = a->gathererArea = NULL;
+	a->numShooters = a->numGatherers = 0;
+}
+
+
+
+static inline void GatherPower( float gathered[4], const MS_Matrix *a, int g, const float (*power)[4] )
+	// Sum the form factor times the power of the shooter quads, over the entries of gatherer quad g.
+{
+	int start = a->entryStart[g], end = a->entryStart[g + 1];
+	const int *shooters = a->entryShooters;
+	const float *formFactors = a->entryFormFactors;
+
+#ifdef MS_USE_SSE
+	__m128 sum = _mm_setzero_ps();
+	for ( int k = start; k < end; k++ )
+		sum = _mm_add_ps( sum, _mm_mul_ps( _mm_set1_ps( formFactors[k] ), _mm_loadu_ps( power[ shooters[k] ] ) ) );
+	_mm_storeu_ps( gathered, sum );
+#else
+	gathered[0] = gathered[1] = gathered[2] = gathered[3] = 0.0f;
+	for ( int k = start; k < end; k++ )
+	{
+		const float *p = power[ shooters[k] ];
+		gathered[0] += formFactors[k] * p[0];
+		gathered[1] += formFactors[k] * p[1];
+		gathered[2] += formFactors[k] * p[2];
+	}
+#endif
+}
+
+
+
+typedef struct SolveState {
+	const MS_Matrix *a;
+	QM_ModelSoA *soa;
+	const float (*power)[4];	// Power of each shooter quad used to update the gatherer quads.
+	float (*newPower)[4];		// Updated power of each shooter quad.
+}
+SolveState;
+
+
+static void UpdateShooter( int s, int thread, void *arg )
+	// Update the gatherer quads of shooter quad s, and the power leaving the shooter quad.
+	// Can be called by ParallelFor().
+{
+	const SolveState *state = (const SolveState *) arg;
+	const MS_Matrix *a = state->a;
+	QM_ModelSoA *soa = state->soa;
+
+	float power[3] = { 0.0f, 0.0f, 0.0f };
+
+	for ( int j = a->shooterGathererStart[s]; j < a->shooterGathererStart[s + 1]; j++ )
+	{
+		int g = a->shooterGatherers[j];
+		const float *emission = soa->surfaceEmission[ soa->gathererSurface[g] ];
+		const float *reflectivity = soa->surfaceReflectivity[ soa->gathererSurface[g] ];
+		float invArea = soa->gathererInvArea[g];
+
+		float gathered[4];
+		GatherPower( gathered, a, g, state->power );
+
+		float *radiosity = soa->gathererRadiosity[g];
+		for ( int c = 0; c < 3; c++ )
+		{
+			radiosity[c] = emission[c] + reflectivity[c] * invArea * gathered[c];
+			power[c] += a->gathererArea[g] * radiosity[c];
+		}
+	}
+
+	state->newPower[s][0] = power[0];
+	state->newPower[s][1] = power[1];
+	state->newPower[s][2] = power[2];
+	state->newPower[s][3] = 0.0f;
+}
+
+
+
+static double AcceptNewPower( QM_ModelSoA *soa, float (*power)[4], const float (*newPower)[4], int s )
+	// Make the updated power of shooter quad s its current power. The change is kept as 
+	// the power not yet distributed. Returns the sum of the magnitudes of the change.
+{
+	double change = 0.0;
+	for ( int c = 0; c < 3; c++ )
+	{
+		soa->shooterUnshotPower[s][c] = newPower[s][c] - power[s][c];
+		change += fabs( soa->shooterUnshotPower[s][c] );
+		power[s][c] = newPower[s][c];
+	}
+	return change;
+}
+
+
+
+int MS_Solve( const MS_Matrix *a, QM_ModelSoA *soa, int method, int maxIterations,
+			  double convergenceThreshold, int numThreads, double *residual )
+	// Solve for the gatherer quad radiosities, starting from their current values.
+	// Returns the number of iterations done, and the final residual in *residual.
+{
+	int numShooters = a->numShooters;
+	float (*power)[4] = (float (*)[4]) CheckedMalloc( sizeof(float) * 4 * Max2( numShooters, 1 ) );
+	float (*newPower)[4] = (float (*)[4]) CheckedMalloc( sizeof(float) * 4 * Max2( numShooters, 1 ) );
+
+	// Start from the current radiosity, and the power leaving the shooter quads with it.
+	double emittedPower = 0.0;
+	for ( int s = 0; s < numShooters; s++ )
+	{
+		power[s][0] = power[s][1] = power[s][2] = power[s][3] = 0.0f;
+		for ( int j = a->shooterGathererStart[s]; j < a->shooterGathererStart[s + 1]; j++ )
+		{
+			int g = a->shooterGatherers[j];
+			const float *emission = soa->surfaceEmission[ soa->gathererSurface[g] ];
+			for ( int c = 0; c < 3; c++ )
+			{
+				power[s][c] += a->gathererArea[g] * soa->gathererRadiosity[g][c];
+				emittedPower += a->gathererArea[g] * emission[c];
+			}
+		}
+	}
+
+	SolveState state;
+	state.a = a;
+	state.soa = soa;
+	state.power = power;
+	state.newPower = newPower;
+
+	*residual = ( emittedPower > 0.0 )? 1.0 : 0.0;
+	int iterationCount = 0;
+
+	while ( iterationCount < maxIterations && *residual > convergenceThreshold )
+	{
+		double change = 0.0;
+
+		if ( method == MS_GAUSS_SEIDEL )
+		{
+			// One shooter quad at a time, each using the new power of those before it.
+			for ( int s = 0; s < numShooters; s++ )
+			{
+				UpdateShooter( s, 0, &state );
+				change += AcceptNewPower( soa, power, newPower, s );
+			}
+		}
+		else
+		{
+			// All the shooter quads at once, using the power from the previous iteration.
+			ParallelFor( numShooters, numThreads, UpdateShooter, &state );
+			for ( int s = 0; s < numShooters; s++ )
+				change += AcceptNewPower( soa, power, newPower, s );
+		}
+
+		iterationCount++;
+		*residual = ( emittedPower > 0.0 )? change / emittedPower : 0.0;
+	}
+
+	free( power );
+	free( newPower );
+	return iterationCount;
+}
@@ -0,0 +1,66 @@
+#ifndef _MATRIXSOLVER_H_
+#define _MATRIXSOLVER_H_
+
+#include "quadmodel.h"
+#include "formfactor.h"
+
+// Solves the radiosity equation B = E + R F B with iterative methods, using the
+// form factors between all the shooter quads and gatherer quads at once.
+//
+// The radiosity of gatherer quad g is
+//     B(g) = E(g) + R(g) / A(g) * sum over shooter quads s of F(s, g) * P(s),
+// where F(s, g) is the form factor from shooter quad s to gatherer quad g, and P(s)
+// is the power leaving shooter quad s, the sum of A(g) * B(g) over its gatherer quads.
+// This follows from the reciprocity A(g) F(g, s) = A(s) F(s, g).
+//
+// The matrix only has the form factors and areas, which do not depend on the emission
+// and reflectivity of the surfaces, so it can be solved again after changing them.
+
+
+typedef struct MS_Matrix {
+	int numShooters;			// Number of shooter quads.
+	int numGatherers;			// Number of gatherer quads.
+
+	// The form factors to gatherer quad g are entries entryStart[g] to entryStart[g+1] - 1,
+	// each with its shooter quad entryShooters[k] and form factor entryFormFactors[k].
+	int *entryStart;
+	int *entryShooters;
+	float *entryFormFactors;
+
+	// The gatherer quads of shooter quad s are
+	// shooterGatherers[ shooterGathererStart[s] ] to shooterGatherers[ shooterGathererStart[s+1] - 1 ].
+	int *shooterGathererStart;
+	int *shooterGatherers;
+
+	float *gathererArea;		// Area of each gatherer quad.
+}
+MS_Matrix;
+
+
+#define MS_JACOBI				0	// All shooter quads are updated from the previous iteration.
+#define MS_GAUSS_SEIDEL			1	// The shooter quads are updated one at a time, in order,
+									// each using the new values of those before it.
+
+
+extern MS_Matrix MS_BuildMatrix( const FF_Cache *cache, const QM_ModelSoA *soa );
+	// Build the matrix from the form factor rows of all the shooter quads in the cache.
+	// Shooter quads without rows in the cache are taken to see no gatherer quads.
+
+extern void MS_MatrixCleanUp( MS_Matrix *a );
+
+
+extern int MS_Solve( const MS_Matrix *a, QM_ModelSoA *soa, int method, int maxIterations,
+					 double convergenceThreshold, int numThreads, double *residual );
+	// Solve for the gatherer quad radiosities, starting from their values in soa, using the
+	// emission and reflectivity in soa. To solve from scratch, set the radiosities to the 
+	// emission first. Starting from an earlier solution takes fewer iterations.
+	// The result is written to soa->gathererRadiosity.
+	// It stops after maxIterations iterations, or when the residual drops below
+	// convergenceThreshold. The residual is the total magnitude of the change in the power
+	// of the shooter quads in an iteration, relative to the total power emitted.
+	// That change in power is also written to soa->shooterUnshotPower, as the power
+	// not yet distributed. MS_JACOBI uses numThreads worker threads (see ParallelFor()),
+	// and MS_GAUSS_SEIDEL runs on the calling thread.
+	// Returns the number of iterations done, and the final residual in *residual.
+
+#endif
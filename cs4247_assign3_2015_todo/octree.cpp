@@ -0,0 +1,275 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <float.h>
+#include "common.h"
+#include "octree.h"
+
+
+#define MAX_DEPTH	20		// Nodes at this depth are not split.
+
+
+static int NewNodes( OT_Octree *t, int *capacity, int count )
+	// Append count nodes to t->nodes, and return the index of the first one.
+{
+	if ( t->numNodes + count > *capacity )
+	{
+		*capacity = Max2( 2 * (*capacity), t->numNodes + count );
+		t->nodes = (OT_Node *) realloc( t->nodes, sizeof(OT_Node) * (*capacity) );
+		if ( t->nodes == NULL ) ShowFatalError( __FILE__, __LINE__, "Cannot allocate memory" );
+	}
+	int first = t->numNodes;
+	t->numNodes += count;
+	return first;
+}
+
+
+
+static void BuildNode( OT_Octree *t, int *capacity, int n, int depth,
+					   const float (*itemMin)[3], const float (*itemMax)[3], int maxItemsPerLeaf, int *scratch )
+	// Compute the bounding box of node n, and split it if it has too many items.
+	// The node's firstItem and numItems must have been set.
+{
+	OT_Node *node = &(t->nodes[n]);
+	int *items = &(t->items[ node->firstItem ]);
+	int numItems = node->numItems;
+
+	// Bounding box of the items, and of their centers.
+	float cmin[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+	float cmax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	node->min_xyz[0] = node->min_xyz[1] = node->min_xyz[2] = FLT_MAX;
+	node->max_xyz[0] = node->max_xyz[1] = node->max_xyz[2] = -FLT_MAX;
+
+	for ( int i = 0; i < numItems; i++ )
+		for ( int k = 0; k < 3; k++ )
+		{
+			float lo = itemMin[ items[i] ][k], hi = itemMax[ items[i] ][k];
+			float c = 0.5f * ( lo + hi );
+			node->min_xyz[k] = Min2( node->min_xyz[k], lo );
+			node->max_xyz[k] = Max2( node->max_xyz[k], hi );
+			cmin[k] = Min2( cmin[k], c );
+			cmax[k] = Max2( cmax[k], c );
+		}
+
+	node->firstChild = -1;
+	node->numChildren = 0;
+
+	if ( numItems <= maxItemsPerLeaf || depth >= MAX_DEPTH ) return;
+	if ( cmin[0] == cmax[0] && cmin[1] == cmax[1] && cmin[2] == cmax[2] ) return;	// Cannot be split.
+
+	// Sort the items into the 8 octants around the center.
+	float split[3];
+	for ( int k = 0; k < 3; k++ ) split[k] = 0.5f * ( cmin[k] + cmax[k] );
+
+	int octantCount[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+	for ( int i = 0; i < numItems; i++ )
+	{
+		int octant = 0;
+		for ( int k = 0; k < 3; k++ )
+			if ( 0.5f * ( itemMin[ items[i] ][k] + itemMax[ items[i] ][k] ) > split[k] ) octant |= ( 1 << k );
+		scratch[i] = octant;
+		octantCount[octant]++;
+	}
+
+	int octantStart[8], numChildren = 0;
+	for ( int o = 0, sum = 0; o < 8; o++ )
+	{
+		octantStart[o] = sum;
+		sum += octantCount[o];
+		if ( octantCount[o] > 0 ) numChildren++;
+	}
+
+	// Reorder the items by octant, using the upper half of scratch[] as temporary storage.
+	int *sorted = scratch + numItems;
+	int octantNext[8];
+	CopyArrayN( octantNext, octantStart, 8 );
+	for ( int i = 0; i < numItems; i++ ) sorted[ octantNext[ scratch[i] ]++ ] = items[i];
+	CopyArrayN( items, sorted, numItems );
+
+	// Create the children. The node array may move.
+	int firstChild = NewNodes( t, capacity, numChildren );
+	int firstItem = t->nodes[n].firstItem;
+	t->nodes[n].firstChild = firstChild;
+	t->nodes[n].numChildren = numChildren;
+
+	for ( int o = 0, c = firstChild; o < 8; o++ )
+	{
+		if ( octantCount[o] == 0 ) continue;
+		t->nodes[c].firstItem = firstItem + octantStart[o];
+		t->nodes[c].numItems = octantCount[o];
+		c++;
+	}
+
+	for ( int c = firstChild; c < firstChild + numChildren; c++ )
+		BuildNode( t, capacity, c, depth + 1, itemMin, itemMax, maxItemsPerLeaf, scratch );
+}
+
+
+
+OT_Octree OT_Build( int numItems, const float (*itemMin)[3], const float (*itemMax)[3], int maxItemsPerLeaf )
+	// Build an octree over the items, with bounding boxes itemMin[i] to itemMax[i].
+{
+	OT_Octree t;
+	t.numItems = numItems;
+	t.items = (int *) CheckedMalloc( sizeof(int) * Max2( numItems, 1 ) );
+	for ( int i = 0; i < numItems; i++ ) t.items[i] = i;
+
+	t.numNodes = 0;
+	t.nodes = NULL;
+	int capacity = 0;
+	NewNodes( &t, &capacity, 1 );
+	t.nodes[0].firstItem = 0;
+	t.nodes[0].numItems = numItems;
+
+	int *scratch = (int *) CheckedMalloc( sizeof(int) * 2 * Max2( numItems, 1 ) );
+	BuildNode( &t, &capacity, 0, 0, itemMin, itemMax, Max2( maxItemsPerLeaf, 1 ), scratch );
+	free( scratch );
+	return t;
+}
+
+
+
+void OT_CleanUp( OT_Octree *t )
+{
+	if ( t == NULL ) return;
+	free( t->nodes );
+	free( t->items );
+	t->numNodes = t->numItems = 0;
+	t->nodes = NULL;
+	t->items = NULL;
+}
+
+
+
+void OT_GetFrustum( OT_Frustum *f, const float projection[16], const float modelview[16] )
+	// Get the view frustum from the OpenGL projection and modelview matrices (column-major).
+{
+	// clip[r][c] is row r, column c of projection * modelview.
+	float clip[4][4];
+	for ( int r = 0; r < 4; r++ )
+		for ( int c = 0; c < 4; c++ )
+		{
+			clip[r][c] = 0.0f;
+			for ( int k = 0; k < 4; k++ ) clip[r][c] += projection[ r + 4 * k ] * modelview[ k + 4 * c ];
+		}
+
+	// Left, right, bottom, top, near, far.
+	for ( int p = 0; p < 6; p++ )
+	{
+		int row = p / 2;
+		float sign = ( p % 2 == 0 )? 1.0f : -1.0f;
+		for ( int c = 0; c < 4; c++ ) f->planes[p][c] = clip[3][c] + sign * clip[row][c];
+	}
+}
+
+
+
+void OT_GetEyePosition( float eye[3], const float modelview[16] )
+	// Get the eye position in the coordinate frame that the modelview matrix transforms from.
+	// The eye is at the origin after the transformation, so eye = -inverse(A) * t, where
+	// A is the upper-left 3x3 part of the modelview matrix and t is its translation.
+{
+	const float *m = modelview;
+	#define A(r, c)		m[ (r) + 4 * (c) ]
+	float inv[3][3];
+	inv[0][0] = A(1,1) * A(2,2) - A(1,2) * A(2,1);
+	inv[0][1] = A(0,2) * A(2,1) - A(0,1) * A(2,2);
+	inv[0][2] = A(0,1) * A(1,2) - A(0,2) * A(1,1);
+	inv[1][0] = A(1,2) * A(2,0) - A(1,0) * A(2,2);
+	inv[1][1] = A(0,0) * A(2,2) - A(0,2) * A(2,0);
+	inv[1][2] = A(0,2) * A(1,0) - A(0,0) * A(1,2);
+	inv[2][0] = A(1,0) * A(2,1) - A(1,1) * A(2,0);
+	inv[2][1] = A(0,1) * A(2,0) - A(0,0) * A(2,1);
+	inv[2][2] = A(0,0) * A(1,1) - A(0,1) * A(1,0);
+	float det = A(0,0) * inv[0][0] + A(0,1) * inv[1][0] + A(0,2) * inv[2][0];
+	#undef A
+
+	if ( det == 0.0f )
+	{
+		eye[0] = eye[1] = eye[2] = 0.0f;
+		return;
+	}
+
+	for ( int r = 0; r < 3; r++ )
+		eye[r] = -( inv[r][0] * m[12] + inv[r][1] * m[13] + inv[r][2] * m[14] ) / det;
+}
+
+
+
+int OT_TestBox( const OT_Frustum *f, const float min_xyz[3], const float max_xyz[3] )
+	// Returns 0 if the box is outside the frustum, 2 if it is inside, and 1 otherwise.
+{
+	int result = 2;
+	for ( int p = 0; p < 6; p++ )
+	{
+		const float *plane = f->planes[p];
+
+		// The box corners furthest along and against the plane normal.
+		float maxDist = plane[3], minDist = plane[3];
+		for ( int k = 0; k < 3; k++ )
+		{
+			if ( plane[k] >= 0.0f )
+			{
+				maxDist += plane[k] * max_xyz[k];
+				minDist += plane[k] * min_xyz[k];
+			}
+			else
+			{
+				maxDist += plane[k] * min_xyz[k];
+				minDist += plane[k] * max_xyz[k];
+			}
+		}
+
+		if ( maxDist < 0.0f ) return 0;
+		if ( minDist < 0.0f ) result = 1;
+	}
+	return result;
+}
+
+
+
+static void FindVisibleLeaves( const OT_Octree *t, const OT_Frustum *f, int n, bool inside, int leaves[], int *numLeaves )
+{
+	const OT_Node *node = &(t->nodes[n]);
+
+	if ( !inside )
+	{
+		int result = OT_TestBox( f, node->min_xyz, node->max_xyz );
+		if ( result == 0 ) return;
+		inside = ( result == 2 );	// No need to test the descendants.
+	}
+
+	if ( node->numChildren == 0 )
+	{
+		leaves[ (*numLeaves)++ ] = n;
+		return;
+	}
+
+	for ( int c = node->firstChild; c < node->firstChild + node->numChildren; c++ )
+		FindVisibleLeaves( t, f, c, inside, leaves, numLeaves );
+}
+
+
+
+int OT_FindVisibleLeaves( const OT_Octree *t, const OT_Frustum *f, int leaves[] )
+	// Find the leaf nodes that are inside or intersect the frustum.
+	// Returns the number of leaf nodes found.
+{
+	int numLeaves = 0;
+	if ( t->numNodes > 0 && t->numItems > 0 ) FindVisibleLeaves( t, f, 0, false, leaves, &numLeaves );
+	return numLeaves;
+}
+
+
+
+float OT_BoxDistance( const float p[3], const float min_xyz[3], const float max_xyz[3] )
+	// Returns the distance from point p to the nearest point in the box. 0 if p is inside.
+{
+	float sqrDist = 0.0f;
+	for ( int k = 0; k < 3; k++ )
+	{
+		if ( p[k] < min_xyz[k] ) sqrDist += Sqr( min_xyz[k] - p[k] );
+		else if ( p[k] > max_xyz[k] ) sqrDist += Sqr( p[k] - max_xyz[k] );
+	}
+	return sqrt( sqrDist );
+}
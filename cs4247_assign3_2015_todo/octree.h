@@ -0,0 +1,61 @@
+#ifndef _OCTREE_H_
+#define _OCTREE_H_
+
+// An octree over items that have axis-aligned bounding boxes, for view-frustum culling.
+// Items are identified by their index in the arrays given to OT_Build().
+// The items are reordered so that the items of every node are contiguous in OT_Octree::items.
+
+
+typedef struct OT_Node {
+	float min_xyz[3];		// Bounding box of all the items in the node.
+	float max_xyz[3];
+	int firstChild;			// The children are nodes[firstChild] to nodes[firstChild + numChildren - 1].
+	int numChildren;		// 0 for a leaf node.
+	int firstItem;			// The items in the node are items[firstItem] to
+	int numItems;			// items[firstItem + numItems - 1].
+}
+OT_Node;
+
+
+typedef struct OT_Octree {
+	int numNodes;			// Number of nodes.
+	OT_Node *nodes;			// Array of OT_Node. nodes[0] is the root.
+	int numItems;			// Number of items.
+	int *items;				// The item indices, in depth-first order of the leaf nodes.
+}
+OT_Octree;
+
+
+typedef struct OT_Frustum {
+	float planes[6][4];		// Plane (a, b, c, d) has a*x + b*y + c*z + d >= 0 for points inside.
+}
+OT_Frustum;
+
+
+
+extern OT_Octree OT_Build( int numItems, const float (*itemMin)[3], const float (*itemMax)[3], int maxItemsPerLeaf );
+	// Build an octree over the items, with bounding boxes itemMin[i] to itemMax[i].
+	// Nodes with more than maxItemsPerLeaf items are split, based on the item centers.
+
+extern void OT_CleanUp( OT_Octree *t );
+
+
+extern void OT_GetFrustum( OT_Frustum *f, const float projection[16], const float modelview[16] );
+	// Get the view frustum from the OpenGL projection and modelview matrices (column-major).
+	// The frustum is in the coordinate frame that the modelview matrix transforms from.
+
+extern void OT_GetEyePosition( float eye[3], const float modelview[16] );
+	// Get the eye position in the coordinate frame that the modelview matrix transforms from.
+
+extern int OT_TestBox( const OT_Frustum *f, const float min_xyz[3], const float max_xyz[3] );
+	// Returns 0 if the box is outside the frustum, 2 if it is inside, and 1 otherwise.
+
+extern int OT_FindVisibleLeaves( const OT_Octree *t, const OT_Frustum *f, int leaves[] );
+	// Find the leaf nodes that are inside or intersect the frustum. Their indices are
+	// written to leaves[], which must have space for t->numNodes entries, in the same
+	// order as their items are in t->items. Returns the number of leaf nodes found.
+
+extern float OT_BoxDistance( const float p[3], const float min_xyz[3], const float max_xyz[3] );
+	// Returns the distance from point p to the nearest point in the box. 0 if p is inside.
+
+#endif
@@ -7,6 +7,7 @@
 #include "common.h"
 #include "vector3.h"
 #include "quadmodel.h"
+#include "radfile.h"
 
 
 #define EQUAL_VERTEX_THRESHOLD	(1e-6f)		// If the distance between two vertices are less than this threshold,
@@ -27,8 +28,11 @@ void QM_SurfaceInit( QM_Surface *s )
 	s->origQuads = NULL;
 	s->numShooterQuads = 0;
 	s->shooters = NULL;
+	s->firstShooterID = 0;
 	s->numGathererQuads = 0;
 	s->gatherers = NULL;
+	s->shootersInArena = false;
+	s->gatherersInArena = false;
 }
 
 
@@ -44,8 +48,8 @@ void QM_SurfaceCleanUp( QM_Surface *s )
 {
 	if ( s == NULL ) return;
 	free( s->origQuads );
-	free( s->shooters );
-	free( s->gatherers );
+	if ( !s->shootersInArena ) free( s->shooters );
+	if ( !s->gatherersInArena ) free( s->gatherers );
 	QM_SurfaceInit( s );
 }
 
@@ -59,6 +63,7 @@ void QM_ModelInit( QM_Model *m )
 	m->shooters = NULL;
 	m->totalGatherers = 0;
 	m->gatherers = NULL;
+	m->arena = NULL;
 
 	CopyArray3( m->min_xyz, ZERO_VEC_3F );
 	CopyArray3( m->max_xyz, ZERO_VEC_3F );
@@ -79,9 +84,11 @@ QM_Model QM_ModelInit( void )
 void QM_ModelCleanUp( QM_Model *m )
 {
 	if ( m == NULL ) return;
+	for ( int s = 0; s < m->numSurfaces; s++ ) QM_SurfaceCleanUp( &(m->surfaces[s]) );
 	free( m->surfaces );
 	free( m->shooters );
 	free( m->gatherers );
+	free( m->arena );
 	QM_ModelInit( m );
 }
 
@@ -123,36 +130,175 @@ static void ComputeBoundingBox( QM_Model *m )
 
 
 
-#define MAX_LINE_LEN	1024	// Max number of characters, including newline char, per line in the input file.
+// Reads the input model file line by line, from the file mapped into memory.
+typedef struct InputReader {
+	const char *filename;
+	const char *next;		// Start of the next line to read.
+	const char *end;		// End of the file.
+	int lineNum;			// Line number of the current line, starting from 1.
+	const char *line;		// The current line, excluding the newline character(s).
+	const char *lineEnd;
+}
+InputReader;
 
 
-static bool ReadDataLine( char *lineBuf, int *lineNum, const char *filename, FILE *fp )
+static bool ReadDataLine( InputReader *r )
+	// Read the next line that is not a comment line or an empty line.
+	// A comment line starts with '#' in the first column.
+	// Returns false at the end of file.
 {
-	while ( !feof( fp ) ) {
-
-		// Read next line from input file.
-		(*lineNum)++;
-		char *line = fgets( lineBuf, MAX_LINE_LEN + 1, fp );  
-		if ( line == NULL )
-			ShowFatalError( __FILE__, __LINE__, "Fail to read line %d of file \"%s\"", *lineNum, filename );
+	while ( r->next < r->end ) {
 
-		// Check that the line is not too long.
-		int lineLen = strlen( lineBuf );
-		if ( lineLen == MAX_LINE_LEN && lineBuf[MAX_LINE_LEN-1] != '\n' )
-			ShowFatalError( __FILE__, __LINE__, "Line %d of file \"%s\" is too long", *lineNum, filename );
+		// Find the end of the next line.
+		const char *line = r->next;
+		const char *lineEnd = (const char *) memchr( line, '\n', r->end - line );
+		if ( lineEnd == NULL ) lineEnd = r->end;
+		r->next = ( lineEnd < r->end )? lineEnd + 1 : r->end;
+		r->lineNum++;
 
-		// Skip comment and empty line.
-		if ( lineLen > 1 && lineBuf[0] == '#' ) continue;	// Skip comment line.
-		if ( lineLen == 1 ) continue;  // Skip empty line.
+		if ( line[0] == '#' ) continue;	// Skip comment line.
 
-		for ( int i = 0; i < lineLen; i++ )
-			if ( !isspace( lineBuf[i] ) ) return true;   // Return the line if it is not all spaces.
+		for ( const char *c = line; c < lineEnd; c++ )
+			if ( !isspace( (unsigned char) *c ) )	// Return the line if it is not all spaces.
+			{
+				r->line = line;
+				r->lineEnd = lineEnd;
+				return true;
+			}
 	}
 
 	return false;  // End of file.
 }
 
 
+static bool ParseInt( const char **pp, const char *end, int *value )
+	// Parse a decimal integer after optional spaces, like sscanf's "%d".
+	// On success, *pp is moved past it.
+{
+	const char *p = *pp;
+	while ( p < end && isspace( (unsigned char) *p ) ) p++;
+
+	bool negative = false;
+	if ( p < end && ( *p == '-' || *p == '+' ) ) negative = ( *p++ == '-' );
+	if ( p >= end || !isdigit( (unsigned char) *p ) ) return false;
+
+	long long v = 0;
+	while ( p < end && isdigit( (unsigned char) *p ) )
+	{
+		v = v * 10 + ( *p++ - '0' );
+		if ( v > INT_MAX ) return false;
+	}
+
+	*value = (int) ( negative? -v : v );
+	*pp = p;
+	return true;
+}
+
+
+static bool ParseFloat( const char **pp, const char *end, float *value )
+	// Parse a floating-point number after optional spaces, like sscanf's "%f".
+	// On success, *pp is moved past it.
+{
+	static const float powersOf10[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+
+	const char *p = *pp;
+	while ( p < end && isspace( (unsigned char) *p ) ) p++;
+	const char *start = p;
+
+	bool negative = false;
+	if ( p < end && ( *p == '-' || *p == '+' ) ) negative = ( *p++ == '-' );
+
+	// Decimal digits, with the first 19 significant ones kept in mantissa.
+	unsigned long long mantissa = 0;
+	int numDigits = 0, numSignificant = 0, exponent = 0;
+
+	while ( p < end && isdigit( (unsigned char) *p ) )
+	{
+		if ( numSignificant < 19 ) { mantissa = mantissa * 10 + ( *p - '0' ); if ( mantissa > 0 ) numSignificant++; }
+		else exponent++;
+		p++; numDigits++;
+	}
+	if ( p < end && *p == '.' )
+	{
+		p++;
+		while ( p < end && isdigit( (unsigned char) *p ) )
+		{
+			if ( numSignificant < 19 ) { mantissa = mantissa * 10 + ( *p - '0' ); exponent--; if ( mantissa > 0 ) numSignificant++; }
+			p++; numDigits++;
+		}
+	}
+
+	if ( numDigits == 0 )
+	{
+		// Not a plain decimal number. It may still be something like "inf" or "nan".
+		char buf[64];
+		int len = (int) Min2( (long) ( end - start ), (long) sizeof(buf) - 1 );
+		memcpy( buf, start, len );
+		buf[len] = '\0';
+		char *bufEnd;
+		*value = strtof( buf, &bufEnd );
+		if ( bufEnd == buf ) return false;
+		*pp = start + ( bufEnd - buf );
+		return true;
+	}
+
+	if ( p < end && ( *p == 'e' || *p == 'E' ) )
+	{
+		// The exponent is used only if it has digits, otherwise the 'e' is not part of the number.
+		const char *q = p + 1;
+		const char *d = ( q < end && ( *q == '-' || *q == '+' ) )? q + 1 : q;
+		int e;
+		if ( d < end && isdigit( (unsigned char) *d ) && ParseInt( &q, end, &e ) ) 
+		{
+			exponent += Clamp( e, -1000, 1000 );
+			p = q;
+		}
+	}
+
+	float v;
+	if ( mantissa <= ( 1ull << 24 ) && exponent >= -10 && exponent <= 10 )
+	{
+		// Both operands are exact floats, so the result is correctly rounded.
+		v = ( exponent < 0 )? (float) mantissa / powersOf10[-exponent] : (float) mantissa * powersOf10[exponent];
+	}
+	else
+	{
+		// Going through a double would round twice, so let the C library do it.
+		char buf[128];
+		int len = (int) Min2( (long) ( p - start ), (long) sizeof(buf) - 1 );
+		memcpy( buf, start, len );
+		buf[len] = '\0';
+		v = fabs( strtof( buf, NULL ) );
+	}
+
+	*value = negative? -v : v;
+	*pp = p;
+	return true;
+}
+
+
+static bool ParseInts( const InputReader *r, int n, int values[] )
+	// Parse n integers from the current line, like sscanf's "%d %d ...".
+	// Anything after them on the line is ignored.
+{
+	const char *p = r->line;
+	for ( int i = 0; i < n; i++ )
+		if ( !ParseInt( &p, r->lineEnd, &values[i] ) ) return false;
+	return true;
+}
+
+
+static bool ParseFloats( const InputReader *r, int n, float values[] )
+	// Parse n floating-point numbers from the current line, like sscanf's "%f %f ...".
+	// Anything after them on the line is ignored.
+{
+	const char *p = r->line;
+	for ( int i = 0; i < n; i++ )
+		if ( !ParseFloat( &p, r->lineEnd, &values[i] ) ) return false;
+	return true;
+}
+
+
 QM_Model QM_ReadFile( const char *filename )
 	// Read model from input file.
 	// The output QM_Model has only QM_OrigQuad.
@@ -160,14 +306,28 @@ QM_Model QM_ReadFile( const char *filename )
 {
 	char badFile[] = "Invalid input model file";
 	char badEOF[] = "Unexpected end of file";
-	char lineBuf[ MAX_LINE_LEN + 1 ];
 
-	// Open input file
-	FILE *fp = fopen( filename, "r" );
-	if ( fp == NULL ) 
-		ShowFatalError( __FILE__, __LINE__, "Cannot open input model file \"%s\"", filename );
+	// Map input file into memory.
+	size_t fileSize;
+	const char *fileData = (const char *) MapFileReadOnly( filename, &fileSize );
+	if ( fileData == NULL ) 
+	{
+		// An empty file cannot be mapped, and is reported as ending too early below.
+		FILE *fp = fopen( filename, "rb" );
+		if ( fp == NULL ) 
+			ShowFatalError( __FILE__, __LINE__, "Cannot open input model file \"%s\"", filename );
+		bool empty = ( fseek( fp, 0, SEEK_END ) == 0 && ftell( fp ) == 0 );
+		fclose( fp );
+		if ( !empty )
+			ShowFatalError( __FILE__, __LINE__, "Cannot map input model file \"%s\" into memory", filename );
+	}
 
-	int lineNum = 0;
+	InputReader reader;
+	reader.filename = filename;
+	reader.next = fileData;
+	reader.end = fileData + fileSize;
+	reader.lineNum = 0;
+	reader.line = reader.lineEnd = NULL;
 
 //=== VERTICES ===
 
@@ -175,28 +335,26 @@ QM_Model QM_ReadFile( const char *filename )
 	float *vertexTable = NULL;  // An array of 3D vertices.
 
 	// Read number of vertices.
-	if ( !ReadDataLine( lineBuf, &lineNum, filename, fp ) )
+	if ( !ReadDataLine( &reader ) )
 		ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badEOF, filename );
 
-	if ( sscanf( lineBuf, "%d", &numVertices ) != 1  ||  numVertices < 0 )
-		ShowFatalError( __FILE__, __LINE__, "%s \"%s\" at line %d", badFile, filename, lineNum );
+	if ( !ParseInts( &reader, 1, &numVertices )  ||  numVertices < 0 )
+		ShowFatalError( __FILE__, __LINE__, "%s \"%s\" at line %d", badFile, filename, reader.lineNum );
 
 	vertexTable = (float *) CheckedMalloc( sizeof(float) * 3 * numVertices );
 
 	// Read the vertices.
 	for ( int v = 0; v < numVertices; v++ )
 	{
-		float x, y, z;
+		float xyz[3];
 
-		if ( !ReadDataLine( lineBuf, &lineNum, filename, fp ) )
+		if ( !ReadDataLine( &reader ) )
 			ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badEOF, filename );
 
-		if ( sscanf( lineBuf, "%f %f %f", &x, &y, &z ) != 3 )
-			ShowFatalError( __FILE__, __LINE__, "%s \"%s\" at line %d", badFile, filename, lineNum );
+		if ( !ParseFloats( &reader, 3, xyz ) )
+			ShowFatalError( __FILE__, __LINE__, "%s \"%s\" at line %d", badFile, filename, reader.lineNum );
 
-		vertexTable[ 3 * v + 0 ] = x;
-		vertexTable[ 3 * v + 1 ] = y;
-		vertexTable[ 3 * v + 2 ] = z;
+		CopyArray3( &vertexTable[ 3 * v ], xyz );
 	}
 
 
@@ -207,11 +365,11 @@ QM_Model QM_ReadFile( const char *filename )
 	float *emissionTable = NULL;		// An array of RGB emission values.
 
 	// Read number of materials.
-	if ( !ReadDataLine( lineBuf, &lineNum, filename, fp ) )
+	if ( !ReadDataLine( &reader ) )
 		ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badEOF, filename );
 
-	if ( sscanf( lineBuf, "%d", &numMaterials ) != 1  ||  numMaterials < 0 )
-		ShowFatalError( __FILE__, __LINE__, "%s \"%s\" at line %d", badFile, filename, lineNum );
+	if ( !ParseInts( &reader, 1, &numMaterials )  ||  numMaterials < 0 )
+		ShowFatalError( __FILE__, __LINE__, "%s \"%s\" at line %d", badFile, filename, reader.lineNum );
 
 	reflectivityTable = (float *) CheckedMalloc( sizeof(float) * 3 * numMaterials );
 	emissionTable = (float *) CheckedMalloc( sizeof(float) * 3 * numMaterials );
@@ -219,27 +377,23 @@ QM_Model QM_ReadFile( const char *filename )
 	// Read the materials.
 	for ( int m = 0; m < numMaterials; m++ )
 	{
-		float r, g, b;
+		float rgb[3];
 
-		if ( !ReadDataLine( lineBuf, &lineNum, filename, fp ) )
+		if ( !ReadDataLine( &reader ) )
 			ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badEOF, filename );
 
-		if ( sscanf( lineBuf, "%f %f %f", &r, &g, &b ) != 3 )
-			ShowFatalError( __FILE__, __LINE__, "%s \"%s\" at line %d", badFile, filename, lineNum );
+		if ( !ParseFloats( &reader, 3, rgb ) )
+			ShowFatalError( __FILE__, __LINE__, "%s \"%s\" at line %d", badFile, filename, reader.lineNum );
 
-		reflectivityTable[ 3 * m + 0 ] = r;
-		reflectivityTable[ 3 * m + 1 ] = g;
-		reflectivityTable[ 3 * m + 2 ] = b;
+		CopyArray3( &reflectivityTable[ 3 * m ], rgb );
 
-		if ( !ReadDataLine( lineBuf, &lineNum, filename, fp ) )
+		if ( !ReadDataLine( &reader ) )
 			ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badEOF, filename );
 
-		if ( sscanf( lineBuf, "%f %f %f", &r, &g, &b ) != 3 )
-			ShowFatalError( __FILE__, __LINE__, "%s \"%s\" at line %d", badFile, filename, lineNum );
+		if ( !ParseFloats( &reader, 3, rgb ) )
+			ShowFatalError( __FILE__, __LINE__, "%s \"%s\" at line %d", badFile, filename, reader.lineNum );
 
-		emissionTable[ 3 * m + 0 ] = r;
-		emissionTable[ 3 * m + 1 ] = g;
-		emissionTable[ 3 * m + 2 ] = b;
+		CopyArray3( &emissionTable[ 3 * m ], rgb );
 	}
 
 
@@ -249,11 +403,11 @@ QM_Model QM_ReadFile( const char *filename )
 	QM_Surface *surfaceTable = NULL;	// An array of surfaces.
 
 	// Read number of surfaces.
-	if ( !ReadDataLine( lineBuf, &lineNum, filename, fp ) )
+	if ( !ReadDataLine( &reader ) )
 		ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badEOF, filename );
 
-	if ( sscanf( lineBuf, "%d", &numSurfaces ) != 1  ||  numSurfaces < 0 )
-		ShowFatalError( __FILE__, __LINE__, "%s \"%s\" at line %d", badFile, filename, lineNum );
+	if ( !ParseInts( &reader, 1, &numSurfaces )  ||  numSurfaces < 0 )
+		ShowFatalError( __FILE__, __LINE__, "%s \"%s\" at line %d", badFile, filename, reader.lineNum );
 
 	surfaceTable = (QM_Surface *) CheckedMalloc( sizeof(QM_Surface) * numSurfaces );
 
@@ -265,21 +419,21 @@ QM_Model QM_ReadFile( const char *filename )
 		int matID, numQuads;
 
 		// Read material index.
-		if ( !ReadDataLine( lineBuf, &lineNum, filename, fp ) )
+		if ( !ReadDataLine( &reader ) )
 			ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badEOF, filename );
 
-		if ( sscanf( lineBuf, "%d", &matID ) != 1  ||  matID < 0 || matID >= numMaterials )
-			ShowFatalError( __FILE__, __LINE__, "%s \"%s\" at line %d", badFile, filename, lineNum );
+		if ( !ParseInts( &reader, 1, &matID )  ||  matID < 0 || matID >= numMaterials )
+			ShowFatalError( __FILE__, __LINE__, "%s \"%s\" at line %d", badFile, filename, reader.lineNum );
 
 		CopyArray3( surfaceTable[s].reflectivity, &reflectivityTable[3*matID] );
 		CopyArray3( surfaceTable[s].emission, &emissionTable[3*matID] );
 
 		// Read number of quadrilaterals in the surface.
-		if ( !ReadDataLine( lineBuf, &lineNum, filename, fp ) )
+		if ( !ReadDataLine( &reader ) )
 			ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badEOF, filename );
 
-		if ( sscanf( lineBuf, "%d", &numQuads ) != 1  ||  numQuads < 0 )
-			ShowFatalError( __FILE__, __LINE__, "%s \"%s\" at line %d", badFile, filename, lineNum );
+		if ( !ParseInts( &reader, 1, &numQuads )  ||  numQuads < 0 )
+			ShowFatalError( __FILE__, __LINE__, "%s \"%s\" at line %d", badFile, filename, reader.lineNum );
 
 		surfaceTable[s].numOrigQuads = numQuads;
 		surfaceTable[s].origQuads = (QM_OrigQuad *) CheckedMalloc( sizeof(QM_OrigQuad) * numQuads );
@@ -289,13 +443,13 @@ QM_Model QM_ReadFile( const char *filename )
 		{
 			int vertID[4];
 
-			if ( !ReadDataLine( lineBuf, &lineNum, filename, fp ) )
+			if ( !ReadDataLine( &reader ) )
 				ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badEOF, filename );
 
-			if ( sscanf( lineBuf, "%d %d %d %d", &vertID[0], &vertID[1], &vertID[2], &vertID[3] ) != 4 || 
+			if ( !ParseInts( &reader, 4, vertID ) || 
 				 vertID[0] < 0 || vertID[0] >= numVertices || vertID[1] < 0 || vertID[1] >= numVertices ||
 				 vertID[2] < 0 || vertID[2] >= numVertices || vertID[3] < 0 || vertID[3] >= numVertices )
-				ShowFatalError( __FILE__, __LINE__, "%s \"%s\" at line %d", badFile, filename, lineNum );
+				ShowFatalError( __FILE__, __LINE__, "%s \"%s\" at line %d", badFile, filename, reader.lineNum );
 
 			CopyArray3( surfaceTable[s].origQuads[q].v[0], &vertexTable[ 3*vertID[0] ] );
 			CopyArray3( surfaceTable[s].origQuads[q].v[1], &vertexTable[ 3*vertID[1] ] );
@@ -316,7 +470,7 @@ QM_Model QM_ReadFile( const char *filename )
 	model.surfaces = surfaceTable;
 	ComputeBoundingBox( &model );
 
-	fclose( fp );
+	UnmapFile( fileData, fileSize );
 	free( vertexTable );
 	free( reflectivityTable );
 	free( emissionTable );
@@ -368,17 +522,186 @@ static inline void QuadBilinearInterpolate( float vo[3], float x, float y, float
 
 
 
-void QM_Subdivide( QM_Model *m, float maxShooterQuadEdgeLength, float maxGathererQuadEdgeLength )
+static inline void QuadGrid( float (*grid)[3], float (*edges)[3], int n, const float v[4][3] )
+	// Bilinearly interpolate the vertices of the input quad at the (n+1) x (n+1) grid points
+	// (x/n, y/n), 0 <= x, y <= n, into grid[ y * (n+1) + x ]. These are the same points as
+	// given by QuadBilinearInterpolate(), but the points on the edges v[0]v[1] and v[3]v[2]
+	// are computed once per column instead of once per point.
+	// edges is scratch space for 2 * (n+1) points.
+{
+	float (*v01)[3] = edges;
+	float (*v32)[3] = edges + ( n + 1 );
+
+	for ( int x = 0; x <= n; x++ )
+	{
+		LineInterpolate( v01[x], (float) x / n, v[0], v[1] );
+		LineInterpolate( v32[x], (float) x / n, v[3], v[2] );
+	}
+
+	// Each row is one interpolation between the two edges, over 3 * (n+1) contiguous floats.
+	for ( int y = 0; y <= n; y++ )
+	{
+		float k = (float) y / n, m = 1.0f - k;
+		const float *a = v01[0], *b = v32[0];
+		float *row = grid[ y * ( n + 1 ) ];
+		for ( int i = 0; i < 3 * ( n + 1 ); i++ ) row[i] = m * a[i] + k * b[i];
+	}
+}
+
+
+static inline void GridQuad( float v[4][3], const float (*grid)[3], int n, int x, int y )
+	// Get the vertices of sub-quad (x, y) from a grid made by QuadGrid().
+{
+	CopyArray3( v[0], grid[ y * ( n + 1 ) + x ] );
+	CopyArray3( v[1], grid[ y * ( n + 1 ) + x + 1 ] );
+	CopyArray3( v[2], grid[ ( y + 1 ) * ( n + 1 ) + x + 1 ] );
+	CopyArray3( v[3], grid[ ( y + 1 ) * ( n + 1 ) + x ] );
+}
+
+
+
+// The original quads of all the surfaces, numbered one after another, are the items
+// processed by the worker threads in QM_Subdivide().
+typedef struct SubdivideWork {
+	QM_Model *m;
+	const int *origQuadSurface;		// Index of the surface of each original quad.
+	const int *firstOrigQuad;		// Number of the first original quad of each surface.
+	const int *shooterSegments;		// Number of segments that the edges of the original quads
+									// of each surface are divided into.
+	const int *gathererSegments;	// Number of segments that the edges of the shooter quads
+									// of each surface are divided into.
+	float *maxShooterEdgeLen;		// Longest shooter quad edge from each original quad.
+}
+SubdivideWork;
+
+
+static void FindMaxShooterEdgeLength( int i, int thread, void *arg )
+	// Called by ParallelFor() to find the longest edge of the shooter quads 
+	// that the i-th original quad will be subdivided into.
+{
+	const SubdivideWork *work = (const SubdivideWork *) arg;
+	int s = work->origQuadSurface[i];
+	const QM_OrigQuad *origQuad = &(work->m->surfaces[s].origQuads[ i - work->firstOrigQuad[s] ]);
+	int n = work->shooterSegments[s];
+
+	float maxEdgeLen = 0.0f;
+	if ( n > 0 )
+	{
+		float (*grid)[3] = (float (*)[3]) CheckedMalloc( sizeof(float) * 3 * ( ( n + 1 ) * ( n + 1 ) + 2 * ( n + 1 ) ) );
+		QuadGrid( grid, grid + ( n + 1 ) * ( n + 1 ), n, origQuad->v );
+
+		// Each edge is shared by two neighboring shooter quads, but only needs to be measured once.
+		for ( int y = 0; y <= n; y++ )
+			for ( int x = 0; x <= n; x++ )
+			{
+				const float *p = grid[ y * ( n + 1 ) + x ];
+				if ( x < n ) maxEdgeLen = Max2( maxEdgeLen, VecDist( p, grid[ y * ( n + 1 ) + x + 1 ] ) );
+				if ( y < n ) maxEdgeLen = Max2( maxEdgeLen, VecDist( p, grid[ ( y + 1 ) * ( n + 1 ) + x ] ) );
+			}
+
+		free( grid );
+	}
+
+	work->maxShooterEdgeLen[i] = maxEdgeLen;
+}
+
+
+static void SubdivideOrigQuad( int i, int thread, void *arg )
+	// Called by ParallelFor() to subdivide the i-th original quad to shooter quads, 
+	// and those shooter quads to gatherer quads.
+{
+	const SubdivideWork *work = (const SubdivideWork *) arg;
+	int s = work->origQuadSurface[i];
+	QM_Surface *surface = &(work->m->surfaces[s]);
+	int q = i - work->firstOrigQuad[s];
+	const QM_OrigQuad *origQuad = &(surface->origQuads[q]);
+
+	int ns = work->shooterSegments[s];
+	int ng = work->gathererSegments[s];
+	if ( ns == 0 ) return;
+
+	int n = Max2( ns, ng );
+	float (*grid)[3] = (float (*)[3]) CheckedMalloc( sizeof(float) * 3 * ( ( n + 1 ) * ( n + 1 ) + 2 * ( n + 1 ) ) );
+	float (*edges)[3] = grid + ( n + 1 ) * ( n + 1 );
+
+	// The shooter quads of the original quad, in the same order as the original quads.
+	QM_ShooterQuad *shooters = &(surface->shooters[ q * ns * ns ]);
+	QuadGrid( grid, edges, ns, origQuad->v );
+
+	for ( int y = 0; y < ns; y++ )
+		for ( int x = 0; x < ns; x++ )
+		{
+			QM_ShooterQuad *shooterQuad = &(shooters[ y * ns + x ]);
+			GridQuad( shooterQuad->v, grid, ns, x, y );
+			QuadCentroid( shooterQuad->centroid, shooterQuad->v );
+			CopyArray3( shooterQuad->normal, origQuad->normal );
+			shooterQuad->area = QuadArea( shooterQuad->v );
+
+			// Initialize the unshot power of the shooter quad.
+			shooterQuad->unshotPower[0] = surface->emission[0] * shooterQuad->area;
+			shooterQuad->unshotPower[1] = surface->emission[1] * shooterQuad->area;
+			shooterQuad->unshotPower[2] = surface->emission[2] * shooterQuad->area;
+
+			shooterQuad->surface = surface;
+		}
+
+	if ( ng > 0 )
+		for ( int j = 0; j < ns * ns; j++ )
+		{
+			QM_ShooterQuad *shooterQuad = &(shooters[j]);
+			QM_GathererQuad *gatherers = &(surface->gatherers[ ( q * ns * ns + j ) * ng * ng ]);
+			QuadGrid( grid, edges, ng, shooterQuad->v );
+
+			for ( int y = 0; y < ng; y++ )
+				for ( int x = 0; x < ng; x++ )
+				{
+					QM_GathererQuad *gathererQuad = &(gatherers[ y * ng + x ]);
+					GridQuad( gathererQuad->v, grid, ng, x, y );
+					CopyArray3( gathererQuad->normal, shooterQuad->normal );
+					gathererQuad->area = QuadArea( gathererQuad->v );
+
+					// Initialize the radiosity of the gatherer quad.
+					gathererQuad->radiosity[0] = surface->emission[0];
+					gathererQuad->radiosity[1] = surface->emission[1];
+					gathererQuad->radiosity[2] = surface->emission[2];
+
+					CopyArray3( gathererQuad->vRadiosity[0], ZERO_VEC_3F );
+					CopyArray3( gathererQuad->vRadiosity[1], ZERO_VEC_3F );
+					CopyArray3( gathererQuad->vRadiosity[2], ZERO_VEC_3F );
+					CopyArray3( gathererQuad->vRadiosity[3], ZERO_VEC_3F );
+
+					gathererQuad->shooter = shooterQuad;
+					gathererQuad->surface = surface;
+					gathererQuad->level = 0;
+					gathererQuad->parent = -1;
+					gathererQuad->firstChild = -1;
+				}
+		}
+
+	free( grid );
+}
+
+
+
+static void BuildGathererArray( QM_Model *m );
+
+
+
+void QM_Subdivide( QM_Model *m, float maxShooterQuadEdgeLength, float maxGathererQuadEdgeLength, int numThreads )
 	// Subdivide the original quads in the model to smaller
 	// shooter quads and even-smaller gatherer quads.
 	// Each shooter quad cannot have edge longer than maxShooterQuadEdgeLength, and
 	// each gatherer quad cannot have edge longer than maxGathererQuadEdgeLength.
+	// Every original quad of a surface is subdivided into the same number of shooter quads,
+	// and every shooter quad into the same number of gatherer quads, so the position of each 
+	// quad in the arrays is known before the original quads are subdivided in parallel.
 {
 	if ( m == NULL || m->numSurfaces <= 0 ) return;
 
-// Subdivide original quads to get shooter quads.
-
-	int modelTotalShooters = 0;		// This will contain the total number of shooter quads in model.
+	int *shooterSegments = (int *) CheckedMalloc( sizeof(int) * m->numSurfaces );
+	int *gathererSegments = (int *) CheckedMalloc( sizeof(int) * m->numSurfaces );
+	int *firstOrigQuad = (int *) CheckedMalloc( sizeof(int) * m->numSurfaces );
+	int totalOrigQuads = 0;
 
 	for ( int s = 0; s < m->numSurfaces; s++ )
 	{
@@ -402,65 +725,30 @@ void QM_Subdivide( QM_Model *m, float maxShooterQuadEdgeLength, float maxGathere
 
 		// Compute how many regular segments to divide the longest edge into so that 
 		// every resulting segment is not longer than maxShooterQuadEdgeLength.
-		int numSegments = (int) ceil( maxEdgeLen / maxShooterQuadEdgeLength );
-
-		// Each original quad on the current surface is going to be subdivided into
-		// (numSegments*numSegments) shooter quads.
-		// Therefore, the total number of shooter quads for this surface is...
-		surface->numShooterQuads = surface->numOrigQuads * numSegments * numSegments;
-
-		surface->shooters = (QM_ShooterQuad *) CheckedMalloc( sizeof(QM_ShooterQuad) * surface->numShooterQuads );
-		int surfShootersCount = 0;  // This will contain the number of shooters in this surface.
-
-		for ( int q = 0; q < surface->numOrigQuads; q++ )
-		{
-			QM_OrigQuad *origQuad = &(surface->origQuads[q]);
+		shooterSegments[s] = (int) ceil( maxEdgeLen / maxShooterQuadEdgeLength );
 
-			for ( int y = 0; y < numSegments; y++ )
-				for ( int x = 0; x < numSegments; x++ )
-				{
-					float newv[4][3];
-					QuadBilinearInterpolate( newv[0], (float) x / numSegments, (float) y / numSegments, origQuad->v );
-					QuadBilinearInterpolate( newv[1], (float) (x+1) / numSegments, (float) y / numSegments, origQuad->v );
-					QuadBilinearInterpolate( newv[2], (float) (x+1) / numSegments, (float) (y+1) / numSegments, origQuad->v );
-					QuadBilinearInterpolate( newv[3], (float) x / numSegments, (float) (y+1) / numSegments, origQuad->v );
-
-					QM_ShooterQuad *shooterQuad = &(surface->shooters[ surfShootersCount ]);
-					for ( int i = 0; i < 4; i++ ) CopyArray3( shooterQuad->v[i], newv[i] );
-					QuadCentroid( shooterQuad->centroid, shooterQuad->v );
-					CopyArray3( shooterQuad->normal, origQuad->normal );
-					shooterQuad->area = QuadArea( shooterQuad->v );
-
-					// Initialize the unshot power of the shooter quad.
-					shooterQuad->unshotPower[0] = surface->emission[0] * shooterQuad->area;
-					shooterQuad->unshotPower[1] = surface->emission[1] * shooterQuad->area;
-					shooterQuad->unshotPower[2] = surface->emission[2] * shooterQuad->area;
-
-					shooterQuad->surface = surface;
-					surfShootersCount++;
-					modelTotalShooters++;
-				}
-		}
+		firstOrigQuad[s] = totalOrigQuads;
+		totalOrigQuads += surface->numOrigQuads;
 	}
 
-
-	// Build an array of pointers to all the shooters in the model.
-	m->totalShooters = modelTotalShooters;
-	m->shooters = (QM_ShooterQuad **) CheckedMalloc( sizeof(QM_ShooterQuad *) * modelTotalShooters );
-	int modelTotalShootersCount = 0;
-
+	int *origQuadSurface = (int *) CheckedMalloc( sizeof(int) * Max2( totalOrigQuads, 1 ) );
+	float *maxShooterEdgeLen = (float *) CheckedMalloc( sizeof(float) * Max2( totalOrigQuads, 1 ) );
 	for ( int s = 0; s < m->numSurfaces; s++ )
-		for ( int q = 0; q < m->surfaces[s].numShooterQuads; q++ )
-		{
-			m->shooters[ modelTotalShootersCount ] = &(m->surfaces[s].shooters[q]);
-			modelTotalShootersCount++;
-		}
+		for ( int q = 0; q < m->surfaces[s].numOrigQuads; q++ ) origQuadSurface[ firstOrigQuad[s] + q ] = s;
 
+	SubdivideWork work;
+	work.m = m;
+	work.origQuadSurface = origQuadSurface;
+	work.firstOrigQuad = firstOrigQuad;
+	work.shooterSegments = shooterSegments;
+	work.gathererSegments = gathererSegments;
+	work.maxShooterEdgeLen = maxShooterEdgeLen;
 
+// Find the number of shooter quads and gatherer quads of each surface.
 
-// Subdivide shooter quads to get gatherer quads.
+	ParallelFor( totalOrigQuads, numThreads, FindMaxShooterEdgeLength, &work );
 
-	int modelTotalGatherers = 0;		// This will contain the total number of gatherers quads in model.
+	size_t modelTotalShooters = 0, modelTotalGatherers = 0;
 
 	for ( int s = 0; s < m->numSurfaces; s++ )
 	{
@@ -468,70 +756,73 @@ void QM_Subdivide( QM_Model *m, float maxShooterQuadEdgeLength, float maxGathere
 
 		// Find longest edge length of all shooter quads in the current surface.
 		float maxEdgeLen = 0.0f;
-		for ( int q = 0; q < surface->numShooterQuads; q++ )
-		{
-			QM_ShooterQuad *shooterQuad = &(surface->shooters[q]);
-			float edgeLen;
-			edgeLen = VecDist( shooterQuad->v[0], shooterQuad->v[1] );
-			if ( edgeLen > maxEdgeLen ) maxEdgeLen = edgeLen;
-			edgeLen = VecDist( shooterQuad->v[1], shooterQuad->v[2] );
-			if ( edgeLen > maxEdgeLen ) maxEdgeLen = edgeLen;
-			edgeLen = VecDist( shooterQuad->v[2], shooterQuad->v[3] );
-			if ( edgeLen > maxEdgeLen ) maxEdgeLen = edgeLen;
-			edgeLen = VecDist( shooterQuad->v[3], shooterQuad->v[0] );
-			if ( edgeLen > maxEdgeLen ) maxEdgeLen = edgeLen;
-		}
+		for ( int q = 0; q < surface->numOrigQuads; q++ )
+			maxEdgeLen = Max2( maxEdgeLen, maxShooterEdgeLen[ firstOrigQuad[s] + q ] );
 
 		// Compute how many regular segments to divide the longest edge into so that 
 		// every resulting segment is not longer than maxGathererQuadEdgeLength.
-		int numSegments = (int) ceil( maxEdgeLen / maxGathererQuadEdgeLength );
+		gathererSegments[s] = (int) ceil( maxEdgeLen / maxGathererQuadEdgeLength );
 
-		// Each shooter quad on the current surface is going to be subdivided into
-		// (numSegments*numSegments) gatherer quads.
-		// Therefore, the total number of gatherer quads for this surface is...
-		surface->numGathererQuads = surface->numShooterQuads * numSegments * numSegments;
+		// Each original quad on the current surface is going to be subdivided into
+		// (numSegments*numSegments) shooter quads, and each shooter quad likewise 
+		// into gatherer quads.
+		surface->numShooterQuads = surface->numOrigQuads * shooterSegments[s] * shooterSegments[s];
+		surface->numGathererQuads = surface->numShooterQuads * gathererSegments[s] * gathererSegments[s];
+		surface->firstShooterID = (int) modelTotalShooters;
+
+		modelTotalShooters += surface->numShooterQuads;
+		modelTotalGatherers += surface->numGathererQuads;
+	}
 
-		surface->gatherers = (QM_GathererQuad *) CheckedMalloc( sizeof(QM_GathererQuad) * surface->numGathererQuads );
-		int surfGatherersCount = 0;  // This will contain the number of gatherers in this surface.
+// Put the shooter quads and gatherer quads of all the surfaces in one block.
 
-		for ( int q = 0; q < surface->numShooterQuads; q++ )
-		{
-			QM_ShooterQuad *shooterQuad = &(surface->shooters[q]);
+	m->arena = CheckedMalloc( Max2( sizeof(QM_ShooterQuad) * modelTotalShooters + 
+									sizeof(QM_GathererQuad) * modelTotalGatherers, (size_t) 1 ) );
+	QM_ShooterQuad *arenaShooters = (QM_ShooterQuad *) m->arena;
+	QM_GathererQuad *arenaGatherers = (QM_GathererQuad *) ( arenaShooters + modelTotalShooters );
 
-			for ( int y = 0; y < numSegments; y++ )
-				for ( int x = 0; x < numSegments; x++ )
-				{
-					float newv[4][3];
-					QuadBilinearInterpolate( newv[0], (float) x / numSegments, (float) y / numSegments, shooterQuad->v );
-					QuadBilinearInterpolate( newv[1], (float) (x+1) / numSegments, (float) y / numSegments, shooterQuad->v );
-					QuadBilinearInterpolate( newv[2], (float) (x+1) / numSegments, (float) (y+1) / numSegments, shooterQuad->v );
-					QuadBilinearInterpolate( newv[3], (float) x / numSegments, (float) (y+1) / numSegments, shooterQuad->v );
-
-					QM_GathererQuad *gathererQuad = &(surface->gatherers[ surfGatherersCount ]);
-					for ( int i = 0; i < 4; i++ ) CopyArray3( gathererQuad->v[i], newv[i] );
-					CopyArray3( gathererQuad->normal, shooterQuad->normal );
-					gathererQuad->area = QuadArea( gathererQuad->v );
+	for ( int s = 0, numShooters = 0, numGatherers = 0; s < m->numSurfaces; s++ )
+	{
+		QM_Surface *surface = &(m->surfaces[s]);
+		surface->shooters = &(arenaShooters[ numShooters ]);
+		surface->gatherers = &(arenaGatherers[ numGatherers ]);
+		surface->shootersInArena = surface->gatherersInArena = true;
+		numShooters += surface->numShooterQuads;
+		numGatherers += surface->numGathererQuads;
+	}
 
-					// Initialize the radiosity of the gatherer quad.
-					gathererQuad->radiosity[0] = surface->emission[0];
-					gathererQuad->radiosity[1] = surface->emission[1];
-					gathererQuad->radiosity[2] = surface->emission[2];
+// Subdivide original quads to get shooter quads, and those to get gatherer quads.
 
-					CopyArray3( gathererQuad->vRadiosity[0], ZERO_VEC_3F );
-					CopyArray3( gathererQuad->vRadiosity[1], ZERO_VEC_3F );
-					CopyArray3( gathererQuad->vRadiosity[2], ZERO_VEC_3F );
-					CopyArray3( gathererQuad->vRadiosity[3], ZERO_VEC_3F );
+	ParallelFor( totalOrigQuads, numThreads, SubdivideOrigQuad, &work );
+
+	free( shooterSegments );
+	free( gathererSegments );
+	free( firstOrigQuad );
+	free( origQuadSurface );
+	free( maxShooterEdgeLen );
 
-					gathererQuad->shooter = shooterQuad;
-					gathererQuad->surface = surface;
-					surfGatherersCount++;
-					modelTotalGatherers++;
-				}
-		}
-	}
 
+	// Build an array of pointers to all the shooters in the model.
+	m->totalShooters = (int) modelTotalShooters;
+	m->shooters = (QM_ShooterQuad **) CheckedMalloc( sizeof(QM_ShooterQuad *) * Max2( m->totalShooters, 1 ) );
+	for ( int i = 0; i < m->totalShooters; i++ ) m->shooters[i] = &(arenaShooters[i]);
 
 	// Build an array of pointers to all the gatherers in the model.
+	BuildGathererArray( m );
+	return;
+}
+
+
+
+static void BuildGathererArray( QM_Model *m )
+	// Build an array of pointers to all the leaf gatherers in the model.
+{
+	int modelTotalGatherers = 0;
+	for ( int s = 0; s < m->numSurfaces; s++ )
+		for ( int q = 0; q < m->surfaces[s].numGathererQuads; q++ )
+			if ( m->surfaces[s].gatherers[q].firstChild < 0 ) modelTotalGatherers++;
+
+	free( m->gatherers );
 	m->totalGatherers = modelTotalGatherers;
 	m->gatherers = (QM_GathererQuad **) CheckedMalloc( sizeof(QM_GathererQuad *) * modelTotalGatherers );
 	int modelTotalGatherersCount = 0;
@@ -539,20 +830,92 @@ void QM_Subdivide( QM_Model *m, float maxShooterQuadEdgeLength, float maxGathere
 	for ( int s = 0; s < m->numSurfaces; s++ )
 		for ( int q = 0; q < m->surfaces[s].numGathererQuads; q++ )
 		{
+			if ( m->surfaces[s].gatherers[q].firstChild >= 0 ) continue;
 			m->gatherers[ modelTotalGatherersCount ] = &(m->surfaces[s].gatherers[q]);
 			modelTotalGatherersCount++;
 		}
+}
 
-	return;
+
+
+
+
+static bool PointInsideEdge( const float p[3], const float v1[3], const float v2[3], float *k )
+	// Returns true if point p lies on the edge from v1 to v2, but is not one of its ends.
+	// The point is then (1-k)*v1 + k*v2, and k is written to *k.
+{
+	float edge[3], d[3], onEdge[3];
+	VecDiff( edge, v2, v1 );
+	VecDiff( d, p, v1 );
+	float sqrLen = VecSqrLen( edge );
+	if ( sqrLen <= EQUAL_VERTEX_THRESHOLD ) return false;
+
+	*k = VecDotProd( d, edge ) / sqrLen;
+	LineInterpolate( onEdge, *k, v1, v2 );
+	return VecSqrDist( p, onEdge ) <= EQUAL_VERTEX_THRESHOLD &&
+		   VecSqrDist( p, v1 ) > EQUAL_VERTEX_THRESHOLD && VecSqrDist( p, v2 ) > EQUAL_VERTEX_THRESHOLD &&
+		   *k > 0.0f && *k < 1.0f;
 }
 
 
 
+static bool GatherersMayTouch( const QM_GathererQuad *a, const QM_GathererQuad *b )
+	// Returns false if the bounding boxes of the two gatherer quads are apart, 
+	// so that the quads cannot share a vertex or an edge.
+{
+	const float margin = sqrt( EQUAL_VERTEX_THRESHOLD );
+	for ( int j = 0; j < 3; j++ )
+	{
+		float aMin = Min2( Min2( a->v[0][j], a->v[1][j] ), Min2( a->v[2][j], a->v[3][j] ) );
+		float aMax = Max2( Max2( a->v[0][j], a->v[1][j] ), Max2( a->v[2][j], a->v[3][j] ) );
+		float bMin = Min2( Min2( b->v[0][j], b->v[1][j] ), Min2( b->v[2][j], b->v[3][j] ) );
+		float bMax = Max2( Max2( b->v[0][j], b->v[1][j] ), Max2( b->v[2][j], b->v[3][j] ) );
+		if ( bMin > aMax + margin || bMax < aMin - margin ) return false;
+	}
+	return true;
+}
+
+
+
+static void ResolveTJunctions( QM_Surface *surface )
+	// A vertex of a leaf gatherer quad that lies inside an edge of a larger leaf gatherer quad
+	// is a T-junction. The larger quad is drawn with the radiosity interpolated along that edge,
+	// so the radiosity at the vertex is set to the interpolated value to avoid a visible seam.
+	// Larger quads are done first, since the ends of their edges may be T-junctions themselves.
+{
+	int maxLevel = 0;
+	for ( int g = 0; g < surface->numGathererQuads; g++ )
+		maxLevel = Max2( maxLevel, surface->gatherers[g].level );
+
+	for ( int level = 0; level < maxLevel; level++ )
+		for ( int g = 0; g < surface->numGathererQuads; g++ )
+		{
+			const QM_GathererQuad *coarse = &(surface->gatherers[g]);
+			if ( coarse->firstChild >= 0 || coarse->level != level ) continue;
+
+			for ( int g2 = 0; g2 < surface->numGathererQuads; g2++ )
+			{
+				QM_GathererQuad *fine = &(surface->gatherers[g2]);
+				if ( fine->firstChild >= 0 || fine->level <= level || !GatherersMayTouch( coarse, fine ) ) continue;
+
+				for ( int i2 = 0; i2 < 4; i2++ )
+					for ( int i = 0; i < 4; i++ )
+					{
+						float k;
+						if ( !PointInsideEdge( fine->v[i2], coarse->v[i], coarse->v[(i+1)%4], &k ) ) continue;
+						LineInterpolate( fine->vRadiosity[i2], k, coarse->vRadiosity[i], coarse->vRadiosity[(i+1)%4] );
+						break;
+					}
+			}
+		}
+}
+
 
 
 void QM_ComputeVertexRadiosities( QM_Model *m )
 	// Compute the radiosities at the vertices by averaging 
 	// the radiosities of the quads that use the vertex.
+	// The radiosities at T-junctions are then interpolated along the edges they lie on.
 {
 	if ( m == NULL || m->numSurfaces <= 0 ) return;
 
@@ -560,9 +923,28 @@ void QM_ComputeVertexRadiosities( QM_Model *m )
 	{
 		QM_Surface *surface = &(m->surfaces[s]);
 
+		// Children always come after their parent, so going backwards 
+		// updates the children before their parent.
+		for ( int g = surface->numGathererQuads - 1; g >= 0; g-- )
+		{
+			QM_GathererQuad *gatherer = &(surface->gatherers[g]);
+			if ( gatherer->firstChild < 0 ) continue;
+
+			CopyArray3( gatherer->radiosity, ZERO_VEC_3F );
+			for ( int c = gatherer->firstChild; c < gatherer->firstChild + 4; c++ )
+			{
+				QM_GathererQuad *child = &(surface->gatherers[c]);
+				float w = child->area / gatherer->area;
+				gatherer->radiosity[0] += w * child->radiosity[0];
+				gatherer->radiosity[1] += w * child->radiosity[1];
+				gatherer->radiosity[2] += w * child->radiosity[2];
+			}
+		}
+
 		for ( int g = 0; g < surface->numGathererQuads; g++ )
 		{
 			QM_GathererQuad *gatherer = &(surface->gatherers[g]);
+			if ( gatherer->firstChild >= 0 ) continue;
 
 			for ( int i = 0; i < 4; i++ )
 			{
@@ -572,6 +954,7 @@ void QM_ComputeVertexRadiosities( QM_Model *m )
 				for ( int g2 = 0; g2 < surface->numGathererQuads; g2++ )
 				{
 					QM_GathererQuad *gatherer2 = &(surface->gatherers[g2]);
+					if ( gatherer2->firstChild >= 0 ) continue;
 
 					for ( int i2 = 0; i2 < 4; i2++ )
 					{
@@ -591,13 +974,316 @@ void QM_ComputeVertexRadiosities( QM_Model *m )
 				gatherer->vRadiosity[i][2] /= numQuadsUsingVertex;
 			}
 		}
+
+		ResolveTJunctions( surface );
+	}
+}
+
+
+
+static bool GatherersAdjacent( const QM_GathererQuad *a, const QM_GathererQuad *b )
+	// Returns true if the two gatherer quads share an edge, or part of an edge.
+	// That is when two vertices of one quad lie on the edges of the other quad.
+{
+	for ( int pass = 0; pass < 2; pass++ )
+	{
+		int numOnEdges = 0;
+		for ( int j = 0; j < 4; j++ )
+			for ( int i = 0; i < 4; i++ )
+			{
+				float k;
+				if ( VecSqrDist( b->v[j], a->v[i] ) <= EQUAL_VERTEX_THRESHOLD || 
+					 PointInsideEdge( b->v[j], a->v[i], a->v[(i+1)%4], &k ) )
+				{
+					numOnEdges++;
+					break;
+				}
+			}
+		if ( numOnEdges >= 2 ) return true;
+
+		const QM_GathererQuad *t = a;  a = b;  b = t;
 	}
+	return false;
 }
 
 
 
-void QM_WriteGatherersToFile( const char *filename, const QM_Model *m )
+static bool GathererNeedsSplit( const QM_Surface *surface, int g, float threshold, float minEdgeLength )
+	// Returns true if the radiosity changes sharply across the leaf gatherer quad g of the surface,
+	// that is, if its radiosity differs from that of an adjacent leaf gatherer quad by more than 
+	// threshold times their sum.
+{
+	const QM_GathererQuad *gatherer = &(surface->gatherers[g]);
+
+	float minEdgeLen = VecDist( gatherer->v[0], gatherer->v[1] );
+	minEdgeLen = Min2( minEdgeLen, VecDist( gatherer->v[1], gatherer->v[2] ) );
+	minEdgeLen = Min2( minEdgeLen, VecDist( gatherer->v[2], gatherer->v[3] ) );
+	minEdgeLen = Min2( minEdgeLen, VecDist( gatherer->v[3], gatherer->v[0] ) );
+	if ( minEdgeLen < 2.0f * minEdgeLength ) return false;
+
+	const float *B = gatherer->radiosity;
+
+	for ( int g2 = 0; g2 < surface->numGathererQuads; g2++ )
+	{
+		const QM_GathererQuad *neighbor = &(surface->gatherers[g2]);
+		if ( g2 == g || neighbor->firstChild >= 0 ) continue;
+
+		const float *nB = neighbor->radiosity;
+		float diff = fabs( nB[0] - B[0] ) + fabs( nB[1] - B[1] ) + fabs( nB[2] - B[2] );
+		float sum = nB[0] + B[0] + nB[1] + B[1] + nB[2] + B[2];
+		if ( diff <= threshold * sum ) continue;
+
+		if ( GatherersMayTouch( gatherer, neighbor ) && GatherersAdjacent( gatherer, neighbor ) ) return true;
+	}
+	return false;
+}
+
+
+
+int QM_RefineGatherers( QM_Model *m, float threshold, float minEdgeLength, int newIDs[] )
+	// Split each leaf gatherer quad into 4 children where the radiosity changes sharply.
+	// Returns the number of gatherer quads split.
+{
+	if ( m == NULL || m->numSurfaces <= 0 ) return 0;
+
+	int totalSplit = 0;
+	int *numOldGatherers = (int *) CheckedMalloc( sizeof(int) * m->numSurfaces );
+
+	for ( int s = 0; s < m->numSurfaces; s++ )
+	{
+		QM_Surface *surface = &(m->surfaces[s]);
+		int numOld = surface->numGathererQuads;
+		numOldGatherers[s] = numOld;
+
+		// Decide on all the quads of the surface before marking any of them, since a marked quad
+		// is no longer a leaf. A marked quad also still counts as a neighbor of the others.
+		bool *needsSplit = (bool *) CheckedMalloc( sizeof(bool) * Max2( numOld, 1 ) );
+		for ( int g = 0; g < numOld; g++ )
+			needsSplit[g] = ( surface->gatherers[g].firstChild < 0 && 
+							  GathererNeedsSplit( surface, g, threshold, minEdgeLength ) );
+
+		int numSplit = 0;
+		for ( int g = 0; g < numOld; g++ )
+		{
+			if ( !needsSplit[g] ) continue;
+			surface->gatherers[g].firstChild = 0;	// Marked. The actual index is set below.
+			numSplit++;
+		}
+		free( needsSplit );
+
+		if ( numSplit == 0 ) continue;
+
+		surface->numGathererQuads = numOld + 4 * numSplit;
+		if ( surface->gatherersInArena )
+		{
+			// Move the gatherer quads out of the arena, which cannot grow.
+			QM_GathererQuad *gatherers = (QM_GathererQuad *) CheckedMalloc( sizeof(QM_GathererQuad) * surface->numGathererQuads );
+			CopyArrayN( gatherers, surface->gatherers, numOld );
+			surface->gatherers = gatherers;
+			surface->gatherersInArena = false;
+		}
+		else
+		{
+			surface->gatherers = (QM_GathererQuad *) realloc( surface->gatherers, sizeof(QM_GathererQuad) * surface->numGathererQuads );
+			if ( surface->gatherers == NULL ) ShowFatalError( __FILE__, __LINE__, "Cannot allocate memory" );
+		}
+
+		int surfGatherersCount = numOld;
+
+		for ( int g = 0; g < numOld; g++ )
+		{
+			QM_GathererQuad *gatherer = &(surface->gatherers[g]);
+			if ( gatherer->firstChild != 0 ) continue;
+
+			gatherer->firstChild = surfGatherersCount;
+
+			for ( int y = 0; y < 2; y++ )
+				for ( int x = 0; x < 2; x++ )
+				{
+					QM_GathererQuad *child = &(surface->gatherers[ surfGatherersCount ]);
+					QuadBilinearInterpolate( child->v[0], 0.5f * x, 0.5f * y, gatherer->v );
+					QuadBilinearInterpolate( child->v[1], 0.5f * (x+1), 0.5f * y, gatherer->v );
+					QuadBilinearInterpolate( child->v[2], 0.5f * (x+1), 0.5f * (y+1), gatherer->v );
+					QuadBilinearInterpolate( child->v[3], 0.5f * x, 0.5f * (y+1), gatherer->v );
+					CopyArray3( child->normal, gatherer->normal );
+					child->area = QuadArea( child->v );
+
+					CopyArray3( child->radiosity, gatherer->radiosity );
+					for ( int i = 0; i < 4; i++ ) CopyArray3( child->vRadiosity[i], ZERO_VEC_3F );
+
+					child->shooter = gatherer->shooter;
+					child->surface = surface;
+					child->level = gatherer->level + 1;
+					child->parent = g;
+					child->firstChild = -1;
+					surfGatherersCount++;
+				}
+		}
+
+		totalSplit += numSplit;
+	}
+
+	if ( newIDs != NULL )
+	{
+		// The leaves are in QM_Model::gatherers in the order of the surfaces and of their 
+		// index in the surface. The children are added after the existing gatherer quads 
+		// of their surface, so the order of the leaves that were not split is unchanged.
+		for ( int s = 0, oldID = 0, newID = 0; s < m->numSurfaces; s++ )
+		{
+			const QM_Surface *surface = &(m->surfaces[s]);
+			for ( int g = 0; g < surface->numGathererQuads; g++ )
+			{
+				const QM_GathererQuad *gatherer = &(surface->gatherers[g]);
+				if ( g >= numOldGatherers[s] )
+					newID++;						// A new child.
+				else if ( gatherer->firstChild < 0 )
+					newIDs[ oldID++ ] = newID++;	// A leaf that was not split.
+				else if ( gatherer->firstChild >= numOldGatherers[s] )
+					newIDs[ oldID++ ] = -1;			// A leaf that was split.
+			}
+		}
+	}
+
+	free( numOldGatherers );
+	if ( totalSplit > 0 ) BuildGathererArray( m );
+	return totalSplit;
+}
+
+
+
+int QM_ShooterID( const QM_ShooterQuad *shooter )
+	// Returns the index of the shooter quad in QM_Model::shooters.
+{
+	return shooter->surface->firstShooterID + (int) ( shooter - shooter->surface->shooters );
+}
+
+
+
+void QM_ComputeAmbient( const QM_Model *m, float ambient[3] )
+	// Estimate the ambient radiosity due to the unshot power of the shooter quads.
+{
+	ambient[0] = ambient[1] = ambient[2] = 0.0f;
+	if ( m == NULL || m->totalShooters <= 0 ) return;
+
+	double totalArea = 0.0;
+	double totalUnshotPower[3] = { 0.0, 0.0, 0.0 };
+	double totalReflectivity[3] = { 0.0, 0.0, 0.0 };	// Area-weighted.
+
+	for ( int q = 0; q < m->totalShooters; q++ )
+	{
+		const QM_ShooterQuad *shooter = m->shooters[q];
+		totalArea += shooter->area;
+		for ( int i = 0; i < 3; i++ )
+		{
+			totalUnshotPower[i] += shooter->unshotPower[i];
+			totalReflectivity[i] += shooter->area * shooter->surface->reflectivity[i];
+		}
+	}
+
+	if ( totalArea <= 0.0 ) return;
+
+	for ( int i = 0; i < 3; i++ )
+	{
+		double avgReflectivity = Min2( totalReflectivity[i] / totalArea, 0.999 );
+		double interreflection = 1.0 / ( 1.0 - avgReflectivity );
+		ambient[i] = (float) ( interreflection * totalUnshotPower[i] / totalArea );
+	}
+}
+
+
+
+void QM_BuildSoA( QM_ModelSoA *soa, const QM_Model *m )
+	// Allocate the arrays of soa and copy the data from the quads of the model into them.
+{
+	soa->numGatherers = m->totalGatherers;
+	soa->gathererRadiosity = (float (*)[3]) CheckedMalloc( sizeof(float) * 3 * Max2( m->totalGatherers, 1 ) );
+	soa->gathererInvArea = (float *) CheckedMalloc( sizeof(float) * Max2( m->totalGatherers, 1 ) );
+	soa->gathererSurface = (int *) CheckedMalloc( sizeof(int) * Max2( m->totalGatherers, 1 ) );
+	soa->gathererShooter = (int *) CheckedMalloc( sizeof(int) * Max2( m->totalGatherers, 1 ) );
+
+	for ( int g = 0; g < m->totalGatherers; g++ )
+	{
+		const QM_GathererQuad *gatherer = m->gatherers[g];
+		CopyArray3( soa->gathererRadiosity[g], gatherer->radiosity );
+		soa->gathererInvArea[g] = 1.0f / gatherer->area;
+		soa->gathererSurface[g] = (int) ( gatherer->surface - m->surfaces );
+		soa->gathererShooter[g] = QM_ShooterID( gatherer->shooter );
+	}
+
+	soa->numShooters = m->totalShooters;
+	soa->shooterUnshotPower = (float (*)[3]) CheckedMalloc( sizeof(float) * 3 * Max2( m->totalShooters, 1 ) );
+	soa->shooterArea = (float *) CheckedMalloc( sizeof(float) * Max2( m->totalShooters, 1 ) );
+	soa->shooterSurface = (int *) CheckedMalloc( sizeof(int) * Max2( m->totalShooters, 1 ) );
+
+	for ( int s = 0; s < m->totalShooters; s++ )
+	{
+		const QM_ShooterQuad *shooter = m->shooters[s];
+		CopyArray3( soa->shooterUnshotPower[s], shooter->unshotPower );
+		soa->shooterArea[s] = shooter->area;
+		soa->shooterSurface[s] = (int) ( shooter->surface - m->surfaces );
+	}
+
+	soa->numSurfaces = m->numSurfaces;
+	soa->surfaceReflectivity = (float (*)[3]) CheckedMalloc( sizeof(float) * 3 * Max2( m->numSurfaces, 1 ) );
+	soa->surfaceEmission = (float (*)[3]) CheckedMalloc( sizeof(float) * 3 * Max2( m->numSurfaces, 1 ) );
+
+	for ( int i = 0; i < m->numSurfaces; i++ )
+	{
+		CopyArray3( soa->surfaceReflectivity[i], m->surfaces[i].reflectivity );
+		CopyArray3( soa->surfaceEmission[i], m->surfaces[i].emission );
+	}
+}
+
+
+
+void QM_SoAToModel( QM_Model *m, const QM_ModelSoA *soa )
+	// Copy the gatherer quad radiosities and the shooter quad unshot power back to the quads.
+{
+	for ( int g = 0; g < soa->numGatherers; g++ )
+		CopyArray3( m->gatherers[g]->radiosity, soa->gathererRadiosity[g] );
+
+	for ( int s = 0; s < soa->numShooters; s++ )
+		CopyArray3( m->shooters[s]->unshotPower, soa->shooterUnshotPower[s] );
+}
+
+
+
+void QM_SoACleanUp( QM_ModelSoA *soa )
+{
+	if ( soa == NULL ) return;
+	free( soa->gathererRadiosity );
+	free( soa->gathererInvArea );
+	free( soa->gathererSurface );
+	free( soa->gathererShooter );
+	free( soa->shooterUnshotPower );
+	free( soa->shooterArea );
+	free( soa->shooterSurface );
+	free( soa->surfaceReflectivity );
+	free( soa->surfaceEmission );
+	memset( soa, 0, sizeof(QM_ModelSoA) );
+}
+
+
+
+static void GathererVertexRadiosity( float rgb[3], const QM_GathererQuad *gatherer, int i, const float ambient[3] )
+	// Get the radiosity at vertex i of the gatherer quad to be written to the output file.
+	// If ambient is not NULL, (reflectivity * ambient) is added to it.
+{
+	CopyArray3( rgb, gatherer->vRadiosity[i] );
+	if ( ambient != NULL )
+	{
+		// Overshooting can make the ambient term negative.
+		rgb[0] = Max2( rgb[0] + gatherer->surface->reflectivity[0] * ambient[0], 0.0f );
+		rgb[1] = Max2( rgb[1] + gatherer->surface->reflectivity[1] * ambient[1], 0.0f );
+		rgb[2] = Max2( rgb[2] + gatherer->surface->reflectivity[2] * ambient[2], 0.0f );
+	}
+}
+
+
+
+void QM_WriteGatherersToFile( const char *filename, const QM_Model *m, const float ambient[3] )
 	// Write the gatherer quads and their vertex radiosity values to a file.
+	// If ambient is not NULL, (reflectivity * ambient) is added to the vertex radiosities written.
 {
 	char badWrite[] = "Error writing to file";
 
@@ -623,7 +1309,9 @@ void QM_WriteGatherersToFile( const char *filename, const QM_Model *m )
 				ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badWrite, filename );
 
 			// Write its RGB radiosity values.
-			if ( fprintf( fp, "%.3f %.3f %.3f\n", gatherer->vRadiosity[i][0], gatherer->vRadiosity[i][1], gatherer->vRadiosity[i][2] ) < 0 )
+			float rgb[3];
+			GathererVertexRadiosity( rgb, gatherer, i, ambient );
+			if ( fprintf( fp, "%.3f %.3f %.3f\n", rgb[0], rgb[1], rgb[2] ) < 0 )
 				ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badWrite, filename );
 		}
 	}
@@ -631,3 +1319,214 @@ void QM_WriteGatherersToFile( const char *filename, const QM_Model *m )
 	fclose( fp );
 }
 
+
+
+
+static unsigned int HashVertex( const int pos[3], const float rgb[3] )
+	// FNV-1a hash of the quantized position and the bits of the RGB values.
+{
+	unsigned int words[6];
+	memcpy( words, pos, sizeof(int) * 3 );
+	memcpy( words + 3, rgb, sizeof(float) * 3 );
+
+	unsigned int h = 2166136261u;
+	for ( int i = 0; i < 6; i++ )
+		for ( int b = 0; b < 4; b++ )
+		{
+			h ^= ( words[i] >> ( 8 * b ) ) & 0xFFu;
+			h *= 16777619u;
+		}
+	return h;
+}
+
+
+// Vertices with a hash table for finding the same vertex. 
+// Positions are quantized so that equal vertices have the same key.
+typedef struct VertexTable {
+	int numVertices;
+	RF_Vertex *vertices;
+	int (*keys)[3];			// Quantized position of each vertex.
+	int tableSize;			// A power of 2.
+	int *table;				// Vertex indices, with linear probing. -1 for empty slots.
+}
+VertexTable;
+
+
+static void VertexTableInit( VertexTable *vt, int maxVertices )
+{
+	vt->numVertices = 0;
+	vt->vertices = (RF_Vertex *) CheckedMalloc( sizeof(RF_Vertex) * Max2( maxVertices, 1 ) );
+	vt->keys = (int (*)[3]) CheckedMalloc( sizeof(int) * 3 * Max2( maxVertices, 1 ) );
+	vt->tableSize = 1;
+	while ( vt->tableSize < 2 * maxVertices ) vt->tableSize *= 2;
+	vt->table = (int *) CheckedMalloc( sizeof(int) * vt->tableSize );
+	for ( int i = 0; i < vt->tableSize; i++ ) vt->table[i] = -1;
+}
+
+
+static void VertexTableCleanUp( VertexTable *vt )
+{
+	free( vt->vertices );
+	free( vt->keys );
+	free( vt->table );
+}
+
+
+static int VertexTableAdd( VertexTable *vt, const float v[3], const float rgb[3] )
+	// Returns the index of the vertex, after adding it if it is not in the table yet.
+{
+	const float invQuantum = 1.0f / sqrt( EQUAL_VERTEX_THRESHOLD );
+	int key[3];
+	key[0] = (int) floor( v[0] * invQuantum + 0.5f );
+	key[1] = (int) floor( v[1] * invQuantum + 0.5f );
+	key[2] = (int) floor( v[2] * invQuantum + 0.5f );
+
+	int slot = (int) ( HashVertex( key, rgb ) & (unsigned int) ( vt->tableSize - 1 ) );
+	for (;;)
+	{
+		int index = vt->table[slot];
+		if ( index < 0 ) break;
+		if ( vt->keys[index][0] == key[0] && vt->keys[index][1] == key[1] && vt->keys[index][2] == key[2] &&
+			 memcmp( vt->vertices[index].rgb, rgb, sizeof(float) * 3 ) == 0 ) return index;
+		slot = ( slot + 1 ) & ( vt->tableSize - 1 );
+	}
+
+	// New vertex.
+	int index = vt->numVertices++;
+	vt->table[slot] = index;
+	CopyArray3( vt->keys[index], key );
+	CopyArray3( vt->vertices[index].v, v );
+	CopyArray3( vt->vertices[index].rgb, rgb );
+	return index;
+}
+
+
+
+void QM_WriteGatherersToBinaryFile( const char *filename, const QM_Model *m, const float ambient[3] )
+	// Same as QM_WriteGatherersToFile(), but writes the binary format defined in radfile.h.
+	// Vertices with the same position and the same radiosity are written once.
+	// The gatherer quads are written grouped by shooter quad, followed by the shooter quads.
+{
+	char badWrite[] = "Error writing to file";
+
+	if ( m == NULL || m->totalGatherers <= 0 ) return;
+
+	// Order the gatherer quads by shooter quad.
+	unsigned int *shooterQuadStart = (unsigned int *) CheckedMalloc( sizeof(unsigned int) * ( m->totalShooters + 1 ) );
+	int *order = (int *) CheckedMalloc( sizeof(int) * m->totalGatherers );
+
+	for ( int s = 0; s <= m->totalShooters; s++ ) shooterQuadStart[s] = 0;
+	for ( int q = 0; q < m->totalGatherers; q++ ) shooterQuadStart[ QM_ShooterID( m->gatherers[q]->shooter ) + 1 ]++;
+	for ( int s = 0; s < m->totalShooters; s++ ) shooterQuadStart[s + 1] += shooterQuadStart[s];
+	{
+		unsigned int *next = (unsigned int *) CheckedMalloc( sizeof(unsigned int) * Max2( m->totalShooters, 1 ) );
+		CopyArrayN( next, shooterQuadStart, m->totalShooters );
+		for ( int q = 0; q < m->totalGatherers; q++ ) order[ next[ QM_ShooterID( m->gatherers[q]->shooter ) ]++ ] = q;
+		free( next );
+	}
+
+	RF_Header header;
+	memcpy( header.magic, RF_MAGIC, 4 );
+	header.version = RF_VERSION;
+	header.byteOrder = RF_BYTE_ORDER;
+	header.numQuads = (unsigned int) m->totalGatherers;
+	header.min_xyz[0] = header.min_xyz[1] = header.min_xyz[2] = FLT_MAX;
+	header.max_xyz[0] = header.max_xyz[1] = header.max_xyz[2] = -FLT_MAX;
+	header.minIntensity = FLT_MAX;
+	header.maxIntensity = 0.0f;
+	header.max_rgb[0] = header.max_rgb[1] = header.max_rgb[2] = 0.0f;
+	header.numShooterQuads = (unsigned int) m->totalShooters;
+
+// The gatherer quads.
+
+	VertexTable vt;
+	VertexTableInit( &vt, 4 * m->totalGatherers );
+	unsigned int *quadVertIndices = (unsigned int *) CheckedMalloc( sizeof(unsigned int) * 4 * m->totalGatherers );
+
+	for ( int k = 0; k < m->totalGatherers; k++ )
+	{
+		QM_GathererQuad *gatherer = m->gatherers[ order[k] ];
+
+		for ( int i = 0; i < 4; i++ )
+		{
+			float rgb[3];
+			GathererVertexRadiosity( rgb, gatherer, i, ambient );
+
+			int numBefore = vt.numVertices;
+			int index = VertexTableAdd( &vt, gatherer->v[i], rgb );
+			quadVertIndices[ 4 * k + i ] = (unsigned int) index;
+			if ( index < numBefore ) continue;
+
+			// New vertex.
+			for ( int c = 0; c < 3; c++ )
+			{
+				header.min_xyz[c] = Min2( header.min_xyz[c], gatherer->v[i][c] );
+				header.max_xyz[c] = Max2( header.max_xyz[c], gatherer->v[i][c] );
+				header.max_rgb[c] = Max2( header.max_rgb[c], rgb[c] );
+			}
+			float intensity = rgb[0] + rgb[1] + rgb[2];
+			header.minIntensity = Min2( header.minIntensity, intensity );
+			header.maxIntensity = Max2( header.maxIntensity, intensity );
+		}
+	}
+
+	header.numVertices = (unsigned int) vt.numVertices;
+
+// The shooter quads. The radiosity at a shooter quad corner is taken from the 
+// nearest vertex of its gatherer quads.
+
+	VertexTable svt;
+	VertexTableInit( &svt, 4 * m->totalShooters );
+	unsigned int *shooterQuadVertIndices = (unsigned int *) CheckedMalloc( sizeof(unsigned int) * 4 * Max2( m->totalShooters, 1 ) );
+
+	for ( int s = 0; s < m->totalShooters; s++ )
+	{
+		const QM_ShooterQuad *shooter = m->shooters[s];
+
+		for ( int i = 0; i < 4; i++ )
+		{
+			float rgb[3] = { 0.0f, 0.0f, 0.0f };
+			float minSqrDist = FLT_MAX;
+
+			for ( unsigned int k = shooterQuadStart[s]; k < shooterQuadStart[s + 1]; k++ )
+				for ( int j = 0; j < 4; j++ )
+				{
+					const RF_Vertex *vertex = &(vt.vertices[ quadVertIndices[ 4 * k + j ] ]);
+					float sqrDist = VecSqrDist( vertex->v, shooter->v[i] );
+					if ( sqrDist < minSqrDist )
+					{
+						minSqrDist = sqrDist;
+						CopyArray3( rgb, vertex->rgb );
+					}
+				}
+
+			shooterQuadVertIndices[ 4 * s + i ] = (unsigned int) VertexTableAdd( &svt, shooter->v[i], rgb );
+		}
+	}
+
+	header.numShooterVertices = (unsigned int) svt.numVertices;
+
+	// Open output file.
+	FILE *fp = fopen( filename, "wb" );
+	if ( fp == NULL ) 
+		ShowFatalError( __FILE__, __LINE__, "Cannot open file \"%s\" for output", filename );
+
+	size_t numQuadIndices = 4 * (size_t) header.numQuads;
+	size_t numShooterQuadIndices = 4 * (size_t) header.numShooterQuads;
+
+	if ( fwrite( &header, sizeof(RF_Header), 1, fp ) != 1 ||
+		 fwrite( vt.vertices, sizeof(RF_Vertex), vt.numVertices, fp ) != (size_t) vt.numVertices ||
+		 fwrite( quadVertIndices, sizeof(unsigned int), numQuadIndices, fp ) != numQuadIndices ||
+		 fwrite( svt.vertices, sizeof(RF_Vertex), svt.numVertices, fp ) != (size_t) svt.numVertices ||
+		 fwrite( shooterQuadVertIndices, sizeof(unsigned int), numShooterQuadIndices, fp ) != numShooterQuadIndices ||
+		 fwrite( shooterQuadStart, sizeof(unsigned int), m->totalShooters + 1, fp ) != (size_t) m->totalShooters + 1 )
+		ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badWrite, filename );
+
+	fclose( fp );
+	VertexTableCleanUp( &vt );
+	VertexTableCleanUp( &svt );
+	free( quadVertIndices );
+	free( shooterQuadVertIndices );
+	free( shooterQuadStart );
+	free( order );
+}
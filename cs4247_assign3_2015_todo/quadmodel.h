@@ -35,6 +35,11 @@ typedef struct QM_GathererQuad {
 	float vRadiosity[4][3]; // The radiosities at the vertices.
 	QM_ShooterQuad *shooter;	// Pointer to its parent shooter quadrilateral.
 	QM_Surface *surface;		// Pointer to the surface which the quadrilateral belongs to.
+
+	// Hierarchy created by QM_RefineGatherers(). The indices are into QM_Surface::gatherers.
+	int level;					// 0 for the gatherer quads created by QM_Subdivide().
+	int parent;					// Index of the gatherer quad it was split from, or -1.
+	int firstChild;				// Index of the first of its 4 children, or -1 if it is a leaf.
 }
 QM_GathererQuad;
 
@@ -49,9 +54,14 @@ typedef struct QM_Surface {
 
 	int numShooterQuads;		// Number of shooter quadrilaterals on the surface.
 	QM_ShooterQuad *shooters;	// Array of QM_ShooterQuad.
+	int firstShooterID;			// Index of shooters[0] in QM_Model::shooters.
+
+	int numGathererQuads;		// Number of gatherer quadrilaterals on the surface.
+	QM_GathererQuad *gatherers;	// Array of QM_GathererQuad. Includes the gatherer quads 
+								// that have been split, which are not leaves.
 
-	int numGathererQuads;		// Number of shooter quadrilaterals on the surface.
-	QM_GathererQuad *gatherers;	// Array of QM_GathererQuad.
+	bool shootersInArena;		// True if shooters is in QM_Model::arena, and is not freed on its own.
+	bool gatherersInArena;		// True if gatherers is in QM_Model::arena, and is not freed on its own.
 }
 QM_Surface;
 
@@ -66,14 +76,17 @@ typedef struct QM_Model {
 									// NOTE: Use this array to search the shooters for the
 									// one that has the highest unshot power.
 
-	int totalGatherers;				// Total number of gatherer quadrilaterals on all surfaces.
-	QM_GathererQuad **gatherers;	// Array of pointers to all QM_GathererQuad.
+	int totalGatherers;				// Total number of leaf gatherer quadrilaterals on all surfaces.
+	QM_GathererQuad **gatherers;	// Array of pointers to all leaf QM_GathererQuad.
 									// NOTE: Use the index of this array as a unique ID for each gatherer.
 									// When using Hemicube, use this unique ID to render gatherer quad in 
 									// a unique RGB color. Each pixel's RGB color is converted back to the
 									// unique ID, and use it to index this array to access the 
 									// corresponding gatherer quad.
 
+	void *arena;					// Single block that holds the shooter quad and gatherer quad arrays
+									// of all the surfaces, allocated by QM_Subdivide().
+
 	// Axis-aligned bounding box (AABB).
 	float min_xyz[3];		// Corner of bounding box with minimum x, y, z.
 	float max_xyz[3];		// Corner of bounding box with maximum x, y, z.
@@ -85,6 +98,30 @@ QM_Model;
 
 
 
+// Structure-of-arrays (SoA) copy of the data that the radiosity solver reads and updates 
+// for every shot. Entry g of the gatherer arrays is QM_Model::gatherers[g], entry s of the 
+// shooter arrays is QM_Model::shooters[s], and entry i of the surface arrays is 
+// QM_Model::surfaces[i]. Each loop over the quads then only touches the arrays it needs.
+typedef struct QM_ModelSoA {
+	int numGatherers;
+	float (*gathererRadiosity)[3];	// Same as QM_GathererQuad::radiosity.
+	float *gathererInvArea;			// 1 / QM_GathererQuad::area.
+	int *gathererSurface;			// Index of QM_GathererQuad::surface.
+	int *gathererShooter;			// Index of QM_GathererQuad::shooter.
+
+	int numShooters;
+	float (*shooterUnshotPower)[3];	// Same as QM_ShooterQuad::unshotPower.
+	float *shooterArea;				// Same as QM_ShooterQuad::area.
+	int *shooterSurface;			// Index of QM_ShooterQuad::surface.
+
+	int numSurfaces;
+	float (*surfaceReflectivity)[3];	// Same as QM_Surface::reflectivity.
+	float (*surfaceEmission)[3];		// Same as QM_Surface::emission.
+}
+QM_ModelSoA;
+
+
+
 extern void QM_SurfaceInit( QM_Surface *s );
 extern QM_Surface QM_SurfaceInit( void );
 extern void QM_SurfaceCleanUp( QM_Surface *s );
@@ -98,17 +135,63 @@ extern QM_Model QM_ReadFile( const char *filename );
 	// The output QM_Model has only QM_OrigQuad.
 	// The axis-aligned bounding box is computed.
 
-extern void QM_Subdivide( QM_Model *m, float maxShooterQuadEdgeLength, float maxGathererQuadEdgeLength );
+extern void QM_Subdivide( QM_Model *m, float maxShooterQuadEdgeLength, float maxGathererQuadEdgeLength, 
+						  int numThreads = 0 );
 	// Subdivide the original quads in the model to smaller
 	// shooter quads and even-smaller gatherer quads.
 	// Each shooter quad cannot have edge longer than maxShooterQuadEdgeLength, and
 	// each gatherer quad cannot have edge longer than maxGathererQuadEdgeLength.
+	// The original quads are subdivided by numThreads worker threads (see ParallelFor()),
+	// and the shooter quads and gatherer quads of all the surfaces are put in QM_Model::arena.
 
 extern void QM_ComputeVertexRadiosities( QM_Model *m );
 	// Compute the radiosities at the vertices by averaging 
 	// the radiosities of the quads that use the vertex.
-
-extern void QM_WriteGatherersToFile( const char *filename, const QM_Model *m );
+	// A vertex that lies inside an edge of a larger leaf gatherer quad (a T-junction) 
+	// gets the radiosity interpolated along that edge instead, so that the larger quad 
+	// and the smaller quads next to it have the same radiosity along the edge.
+	// The radiosity of a gatherer quad that has been split is set to the 
+	// area-weighted average of the radiosities of its children.
+
+extern int QM_RefineGatherers( QM_Model *m, float threshold, float minEdgeLength, int newIDs[] = NULL );
+	// Split each leaf gatherer quad into 4 children where the radiosity changes sharply,
+	// i.e. where its radiosity differs from that of an adjacent leaf gatherer quad on the same 
+	// surface by more than threshold times their sum. Quads with an edge shorter than 
+	// 2 * minEdgeLength are not split.
+	// The children get the radiosity of their parent. QM_Model::gatherers is rebuilt, and the
+	// gatherer quads of the surfaces that have split quads are moved out of QM_Model::arena,
+	// so pointers to gatherer quads are no longer valid.
+	// If newIDs is not NULL, newIDs[g] is set to the new index in QM_Model::gatherers of the
+	// gatherer quad that had index g, or to -1 if it was split. It must have 
+	// QM_Model::totalGatherers entries, as it was before the call.
+	// Returns the number of gatherer quads split.
+
+extern int QM_ShooterID( const QM_ShooterQuad *shooter );
+	// Returns the index of the shooter quad in QM_Model::shooters.
+
+extern void QM_ComputeAmbient( const QM_Model *m, float ambient[3] );
+	// Estimate the ambient radiosity due to the unshot power of the shooter quads, as
+	// ambient = R * (total unshot power) / (total area), where R = 1 / (1 - average reflectivity)
+	// accounts for the interreflections, and the average reflectivity is area-weighted.
+	// The estimated radiosity of a gatherer quad is then its radiosity plus
+	// (reflectivity * ambient).
+
+extern void QM_BuildSoA( QM_ModelSoA *soa, const QM_Model *m );
+	// Allocate the arrays of soa and copy the data from the quads of the model into them.
+	// Must be called again after QM_RefineGatherers().
+
+extern void QM_SoAToModel( QM_Model *m, const QM_ModelSoA *soa );
+	// Copy the gatherer quad radiosities and the shooter quad unshot power back to the quads.
+
+extern void QM_SoACleanUp( QM_ModelSoA *soa );
+
+extern void QM_WriteGatherersToFile( const char *filename, const QM_Model *m, const float ambient[3] = NULL );
 	// Write the gatherer quads and their vertex radiosity values to a file.
+	// If ambient is not NULL, (reflectivity * ambient) is added to the vertex radiosities written.
+
+extern void QM_WriteGatherersToBinaryFile( const char *filename, const QM_Model *m, const float ambient[3] = NULL );
+	// Same as QM_WriteGatherersToFile(), but writes the binary format defined in radfile.h.
+	// Vertices with the same position and the same radiosity are written once.
+	// The gatherer quads are written grouped by shooter quad, followed by the shooter quads.
 
 #endif
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <float.h>
 
 #ifdef __APPLE__
 #include <GLUT/glut.h>
@@ -12,6 +13,7 @@
 
 #include "common.h"
 #include "quadmodel.h"
+#include "octree.h"
 #include "trackball.h"
 
 
@@ -48,10 +50,26 @@ static const GLfloat light1Position[] = { -1.0, 0.0, -0.5, 0.0 };
 
 static QM_Model model;
 
-// OpenGL display lists.
-static GLuint origQuadsDList = 0;
-static GLuint shooterQuadsDList = 0;
-static GLuint gathererQuadsDList = 0;
+// OpenGL display lists, one per surface. The list of surface s is the base list + s.
+static GLuint origQuadsDLists = 0;
+static GLuint shooterQuadsDLists = 0;
+static GLuint gathererQuadsDLists = 0;
+
+// View-frustum culling and level of detail (LOD). An octree is built over the 
+// surfaces, and only the surfaces in octree leaf nodes in the view frustum are drawn.
+// When drawing gatherer quads, the shooter quads of a surface are drawn instead
+// if its gatherer quads are smaller than lodMaxGathererPixels pixels on the screen.
+static const int maxSurfacesPerLeaf = 4;
+static const float lodMaxGathererPixels = 2.0f;
+
+static OT_Octree octree;
+static float *surfaceGathererSize = NULL;	// Average edge length of the leaf gatherer quads of each surface.
+static int *visibleLeaves = NULL;			// The octree leaf nodes in the view frustum.
+static int numVisibleSurfaces = 0;
+static GLuint *visibleDLists = NULL;		// The display lists to draw in the current frame.
+
+static bool frustumCulling = true;			// Enable or disable view-frustum culling.
+static bool useLOD = true;					// Enable or disable level of detail.
 
 // Window's size.
 static int winWidth = 800;     // Window width in pixels.
@@ -67,6 +85,8 @@ static int drawStyle = 2;			// Draw polygons in different drawing styles:
 static int drawWhichQuads = 0;		// Draw which types of quads: 
 									// 0: original quads, 1: shooter quads, 2: gatherer quads.
 
+static const double fovy = 45.0;	// Vertical field of view in degrees.
+
 // Trackball object.
 TrackBall tb( GLUT_LEFT_BUTTON, GLUT_MIDDLE_BUTTON, GLUT_RIGHT_BUTTON );
 
@@ -102,6 +122,66 @@ static void DrawAxes( double length )
 
 #define DEPTH_OFFSET		(1.0/1024.0)
 
+
+/////////////////////////////////////////////////////////////////////////////
+// Find the display lists of the surfaces to draw, using the current 
+// OpenGL projection and modelview matrices.
+/////////////////////////////////////////////////////////////////////////////
+
+static void FindVisibleSurfaces( void )
+{
+	float projection[16], modelview[16];
+	glGetFloatv( GL_PROJECTION_MATRIX, projection );
+	glGetFloatv( GL_MODELVIEW_MATRIX, modelview );
+
+	GLuint dlists = origQuadsDLists;
+	if ( drawWhichQuads == 1 ) dlists = shooterQuadsDLists;
+	else if ( drawWhichQuads == 2 ) dlists = gathererQuadsDLists;
+
+	// Without culling, use a frustum that contains everything.
+	OT_Frustum frustum;
+	if ( frustumCulling )
+		OT_GetFrustum( &frustum, projection, modelview );
+	else
+		for ( int p = 0; p < 6; p++ )
+		{
+			frustum.planes[p][0] = frustum.planes[p][1] = frustum.planes[p][2] = 0.0f;
+			frustum.planes[p][3] = 1.0f;
+		}
+
+	numVisibleSurfaces = 0;
+	int numVisibleLeaves = OT_FindVisibleLeaves( &octree, &frustum, visibleLeaves );
+
+	// Number of pixels covered by a unit length at unit distance from the eye.
+	float eye[3];
+	OT_GetEyePosition( eye, modelview );
+	float pixelsPerUnit = (float) ( winHeight / ( 2.0 * tan( 0.5 * fovy * M_PI / 180.0 ) ) );
+
+	for ( int i = 0; i < numVisibleLeaves; i++ )
+	{
+		const OT_Node *node = &(octree.nodes[ visibleLeaves[i] ]);
+		bool coarse = false;
+
+		if ( drawWhichQuads == 2 && useLOD )
+		{
+			float dist = OT_BoxDistance( eye, node->min_xyz, node->max_xyz );
+			coarse = true;
+			for ( int k = node->firstItem; k < node->firstItem + node->numItems; k++ )
+				if ( surfaceGathererSize[ octree.items[k] ] * pixelsPerUnit >= lodMaxGathererPixels * dist ) coarse = false;
+		}
+
+		for ( int k = node->firstItem; k < node->firstItem + node->numItems; k++ )
+			visibleDLists[ numVisibleSurfaces++ ] = ( coarse? shooterQuadsDLists : dlists ) + octree.items[k];
+	}
+}
+
+
+static void DrawVisibleSurfaces( void )
+{
+	for ( int i = 0; i < numVisibleSurfaces; i++ ) glCallList( visibleDLists[i] );
+}
+
+
 /////////////////////////////////////////////////////////////////////////////
 // The display callback function.
 /////////////////////////////////////////////////////////////////////////////
@@ -125,6 +205,8 @@ static void MyDisplay( void )
 		tb.applyTransform();
 		glTranslatef( -model.center[0], -model.center[1], -model.center[2] );
 
+		FindVisibleSurfaces();
+
 		// Set world positions of the two lights.
 		glLightfv( GL_LIGHT0, GL_POSITION, light0Position );
 		glLightfv( GL_LIGHT1, GL_POSITION, light1Position );
@@ -139,12 +221,7 @@ static void MyDisplay( void )
 		else
 			glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );	// Wireframe.
 
-		if ( drawWhichQuads == 0 )
-			glCallList( origQuadsDList );		// Draw original model.
-		else if ( drawWhichQuads == 1 )
-			glCallList( shooterQuadsDList );	// Draw shooter quads.
-		else if ( drawWhichQuads == 2 )
-			glCallList( gathererQuadsDList );	// Draw gatherer quads.
+		DrawVisibleSurfaces();
 
 		if ( drawStyle == 2 )	// Draw the outlines of the outlined fill style.
 		{
@@ -156,12 +233,7 @@ static void MyDisplay( void )
 			glLineWidth( 1.0 );
 			glColor3f( 0.0f, 0.0f, 0.0f );
 
-			if ( drawWhichQuads == 0 )
-				glCallList( origQuadsDList );		// Draw original model.
-			else if ( drawWhichQuads == 1 )
-				glCallList( shooterQuadsDList );	// Draw shooter quads.
-			else if ( drawWhichQuads == 2 )
-				glCallList( gathererQuadsDList );	// Draw gatherer quads.
+			DrawVisibleSurfaces();
 
 			glPopAttrib();
 		}
@@ -174,7 +246,7 @@ static void MyDisplay( void )
 	double fps = 1.0 / ((stoptime - starttime) / 1000.0);
 
 	static char s[256];
-	sprintf( s, "Quads Viewer  (%.1f FPS)", fps );
+	sprintf( s, "Quads Viewer  (%.1f FPS, %d of %d surfaces)", fps, numVisibleSurfaces, model.numSurfaces );
 	glutSetWindowTitle( s );
 }
 
@@ -232,6 +304,22 @@ static void MyKeyboard( unsigned char key, int x, int y )
             drawWhichQuads = ( drawWhichQuads + 1 ) % 3;
             glutPostRedisplay();
             break;
+
+		// Toggle view-frustum culling.
+        case 'f':
+        case 'F': 
+            frustumCulling = !frustumCulling;
+            printf( "View-frustum culling %s\n", frustumCulling? "on" : "off" );
+            glutPostRedisplay();
+            break;
+
+		// Toggle level of detail.
+        case 'l':
+        case 'L': 
+            useLOD = !useLOD;
+            printf( "Level of detail %s\n", useLOD? "on" : "off" );
+            glutPostRedisplay();
+            break;
     }
 }
 
@@ -313,13 +401,15 @@ static void MyInit( void )
 
 
 
-static GLuint MakeOrigQuadsDisplayList( const QM_Model *m )
+static GLuint MakeOrigQuadsDisplayLists( const QM_Model *m )
+	// Make one display list per surface. Returns the first of them.
 {
-	GLuint dlist = glGenLists( 1 );
-	if ( dlist == 0 ) ShowFatalError( __FILE__, __LINE__, "Cannot create display list" );
-	glNewList( dlist, GL_COMPILE );
+	GLuint dlists = glGenLists( Max2( m->numSurfaces, 1 ) );
+	if ( dlists == 0 ) ShowFatalError( __FILE__, __LINE__, "Cannot create display list" );
 
-		for ( int s = 0; s < m->numSurfaces; s++ )
+	for ( int s = 0; s < m->numSurfaces; s++ )
+	{
+		glNewList( dlists + s, GL_COMPILE );
 		{
 			float am[4], di[4], sp[4], em[4], shininess = 32.0;
 			CopyArray3( am, m->surfaces[s].reflectivity ); am[3] = 1.0f;
@@ -346,19 +436,22 @@ static GLuint MakeOrigQuadsDisplayList( const QM_Model *m )
 				}
 			glEnd();
 		}
+		glEndList();
+	}
 
-	glEndList();
-	return dlist;
+	return dlists;
 }
 
 
-static GLuint MakeShooterQuadsDisplayList( const QM_Model *m )
+static GLuint MakeShooterQuadsDisplayLists( const QM_Model *m )
+	// Make one display list per surface. Returns the first of them.
 {
-	GLuint dlist = glGenLists( 1 );
-	if ( dlist == 0 ) ShowFatalError( __FILE__, __LINE__, "Cannot create display list" );
-	glNewList( dlist, GL_COMPILE );
+	GLuint dlists = glGenLists( Max2( m->numSurfaces, 1 ) );
+	if ( dlists == 0 ) ShowFatalError( __FILE__, __LINE__, "Cannot create display list" );
 
-		for ( int s = 0; s < m->numSurfaces; s++ )
+	for ( int s = 0; s < m->numSurfaces; s++ )
+	{
+		glNewList( dlists + s, GL_COMPILE );
 		{
 			float am[4], di[4], sp[4], em[4], shininess = 32.0;
 			CopyArray3( am, m->surfaces[s].reflectivity ); am[3] = 1.0f;
@@ -385,19 +478,22 @@ static GLuint MakeShooterQuadsDisplayList( const QM_Model *m )
 				}
 			glEnd();
 		}
+		glEndList();
+	}
 
-	glEndList();
-	return dlist;
+	return dlists;
 }
 
 
-static GLuint MakeGathererQuadsDisplayList( const QM_Model *m )
+static GLuint MakeGathererQuadsDisplayLists( const QM_Model *m )
+	// Make one display list per surface. Returns the first of them.
 {
-	GLuint dlist = glGenLists( 1 );
-	if ( dlist == 0 ) ShowFatalError( __FILE__, __LINE__, "Cannot create display list" );
-	glNewList( dlist, GL_COMPILE );
+	GLuint dlists = glGenLists( Max2( m->numSurfaces, 1 ) );
+	if ( dlists == 0 ) ShowFatalError( __FILE__, __LINE__, "Cannot create display list" );
 
-		for ( int s = 0; s < m->numSurfaces; s++ )
+	for ( int s = 0; s < m->numSurfaces; s++ )
+	{
+		glNewList( dlists + s, GL_COMPILE );
 		{
 			float am[4], di[4], sp[4], em[4], shininess = 32.0;
 			CopyArray3( am, m->surfaces[s].reflectivity ); am[3] = 1.0f;
@@ -415,6 +511,7 @@ static GLuint MakeGathererQuadsDisplayList( const QM_Model *m )
 				for ( int q = 0; q < m->surfaces[s].numGathererQuads; q++ )
 				{
 					QM_GathererQuad *quad = &(m->surfaces[s].gatherers[q]);
+					if ( quad->firstChild >= 0 ) continue;	// Drawn by its children.
 
 					glNormal3fv( quad->normal );
 					glVertex3fv( quad->v[0] );
@@ -424,9 +521,54 @@ static GLuint MakeGathererQuadsDisplayList( const QM_Model *m )
 				}
 			glEnd();
 		}
+		glEndList();
+	}
+
+	return dlists;
+}
 
-	glEndList();
-	return dlist;
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Build the octree over the surfaces for view-frustum culling.
+/////////////////////////////////////////////////////////////////////////////
+
+static void BuildOctree( const QM_Model *m )
+{
+	float (*surfaceMin)[3] = (float (*)[3]) CheckedMalloc( sizeof(float) * 3 * Max2( m->numSurfaces, 1 ) );
+	float (*surfaceMax)[3] = (float (*)[3]) CheckedMalloc( sizeof(float) * 3 * Max2( m->numSurfaces, 1 ) );
+	surfaceGathererSize = (float *) CheckedMalloc( sizeof(float) * Max2( m->numSurfaces, 1 ) );
+
+	for ( int s = 0; s < m->numSurfaces; s++ )
+	{
+		const QM_Surface *surface = &(m->surfaces[s]);
+		surfaceMin[s][0] = surfaceMin[s][1] = surfaceMin[s][2] = FLT_MAX;
+		surfaceMax[s][0] = surfaceMax[s][1] = surfaceMax[s][2] = -FLT_MAX;
+
+		for ( int q = 0; q < surface->numOrigQuads; q++ )
+			for ( int i = 0; i < 4; i++ )
+				for ( int k = 0; k < 3; k++ )
+				{
+					surfaceMin[s][k] = Min2( surfaceMin[s][k], surface->origQuads[q].v[i][k] );
+					surfaceMax[s][k] = Max2( surfaceMax[s][k], surface->origQuads[q].v[i][k] );
+				}
+
+		float area = 0.0f;
+		int numLeaves = 0;
+		for ( int q = 0; q < surface->numGathererQuads; q++ )
+		{
+			if ( surface->gatherers[q].firstChild >= 0 ) continue;
+			area += surface->gatherers[q].area;
+			numLeaves++;
+		}
+		surfaceGathererSize[s] = ( numLeaves > 0 )? sqrt( area / numLeaves ) : 0.0f;
+	}
+
+	octree = OT_Build( m->numSurfaces, surfaceMin, surfaceMax, maxSurfacesPerLeaf );
+	visibleLeaves = (int *) CheckedMalloc( sizeof(int) * octree.numNodes );
+	visibleDLists = (GLuint *) CheckedMalloc( sizeof(GLuint) * Max2( m->numSurfaces, 1 ) );
+	free( surfaceMin );
+	free( surfaceMax );
 }
 
 
@@ -449,9 +591,10 @@ int main( int argc, char** argv )
 	QM_Subdivide( &model, maxShooterQuadEdgeLength, maxGathererQuadEdgeLength );
 
 	// Make OpenGL display lists.
-	origQuadsDList = MakeOrigQuadsDisplayList( &model );
-	shooterQuadsDList = MakeShooterQuadsDisplayList( &model );
-	gathererQuadsDList = MakeGathererQuadsDisplayList( &model );
+	origQuadsDLists = MakeOrigQuadsDisplayLists( &model );
+	shooterQuadsDLists = MakeShooterQuadsDisplayLists( &model );
+	gathererQuadsDLists = MakeGathererQuadsDisplayLists( &model );
+	BuildOctree( &model );
 
     // Register the callback functions.
     glutDisplayFunc( MyDisplay ); 
@@ -466,6 +609,8 @@ int main( int argc, char** argv )
 	printf( "Press 'C' to toggle back-face culling.\n" );
     printf( "Press 'S' to cycle thru different drawing styles.\n" );
 	printf( "Press 'M' to cycle thru different types of quads.\n" );
+    printf( "Press 'F' to toggle view-frustum culling.\n" );
+    printf( "Press 'L' to toggle level of detail.\n" );
     printf( "Press 'Q' to quit.\n\n" );
 
     // Enter GLUT event loop.
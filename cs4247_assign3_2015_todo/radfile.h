@@ -0,0 +1,120 @@
+#ifndef _RADFILE_H_
+#define _RADFILE_H_
+
+// Binary file format of the radiosity solution.
+// Written by the radiosity solver, and read by the radiosity viewer.
+//
+// The file has these parts, one after another:
+//   1. An RF_Header.
+//   2. An array of RF_Header::numVertices RF_Vertex.
+//   3. An array of (4 * RF_Header::numQuads) unsigned ints. These are the indices
+//      of the 4 vertices of each quad, into the vertex array.
+// Since version 2, a coarser level of detail follows, with one quad per shooter quad:
+//   4. An array of RF_Header::numShooterVertices RF_Vertex.
+//   5. An array of (4 * RF_Header::numShooterQuads) unsigned ints, the indices of the
+//      4 vertices of each shooter quad into the shooter vertex array.
+//   6. An array of (RF_Header::numShooterQuads + 1) unsigned ints. The quads in part 3
+//      that belong to shooter quad s are quads shooterQuadStart[s] to shooterQuadStart[s+1] - 1.
+// The vertices are shared by the quads that use them. A vertex is shared only if
+// its position and its RGB radiosity are the same.
+// All values are stored in the byte order of the machine that wrote the file,
+// which is checked using RF_Header::byteOrder.
+// The arrays are 4-byte aligned, so they can be used in place after mapping the file.
+
+
+#define RF_MAGIC			"QMRB"		// First 4 bytes of the file.
+#define RF_VERSION			2
+#define RF_BYTE_ORDER		0x01020304u
+
+
+typedef struct RF_Header {
+	char magic[4];				// RF_MAGIC, without the terminating null character.
+	unsigned int version;		// RF_VERSION.
+	unsigned int byteOrder;		// RF_BYTE_ORDER.
+	unsigned int numVertices;	// Number of vertices.
+	unsigned int numQuads;		// Number of quads.
+
+	// Axis-aligned bounding box (AABB) of the vertices.
+	float min_xyz[3];			// Corner of bounding box with minimum x, y, z.
+	float max_xyz[3];			// Corner of bounding box with maximum x, y, z.
+
+	// Color stats. For tone mapping.
+	float minIntensity;			// Minimum of (r + g + b) over the vertices.
+	float maxIntensity;			// Maximum of (r + g + b) over the vertices.
+	float max_rgb[3];			// Maximum r, g and b over the vertices.
+
+	// Since version 2.
+	unsigned int numShooterVertices;	// Number of vertices of the shooter quads.
+	unsigned int numShooterQuads;		// Number of shooter quads.
+}
+RF_Header;
+
+#define RF_HEADER_SIZE_V1	( 16 * 4 )		// Size of the header in version 1 files.
+
+
+typedef struct RF_Vertex {
+	float v[3];			// 3D coordinates of the vertex.
+	float rgb[3];		// The radiosity at the vertex.
+}
+RF_Vertex;
+
+
+inline bool RF_HasShooterQuads( const RF_Header *h )
+	// Returns true if the file has the shooter quad level of detail.
+{
+	return ( h->version >= 2 );
+}
+
+
+inline size_t RF_HeaderSize( const RF_Header *h )
+	// Returns the size of the header in bytes.
+{
+	return RF_HasShooterQuads( h )? sizeof(RF_Header) : RF_HEADER_SIZE_V1;
+}
+
+
+inline size_t RF_FileSize( const RF_Header *h )
+	// Returns the size of the file in bytes. The header must be complete.
+{
+	size_t size = RF_HeaderSize( h ) + sizeof(RF_Vertex) * h->numVertices + sizeof(unsigned int) * 4 * h->numQuads;
+	if ( RF_HasShooterQuads( h ) )
+		size += sizeof(RF_Vertex) * h->numShooterVertices + sizeof(unsigned int) * ( 5 * (size_t) h->numShooterQuads + 1 );
+	return size;
+}
+
+
+inline const RF_Vertex *RF_Vertices( const RF_Header *h )
+	// Returns the vertex array that follows the header in memory.
+{
+	return (const RF_Vertex *) ( (const char *) h + RF_HeaderSize( h ) );
+}
+
+
+inline const unsigned int *RF_QuadVertIndices( const RF_Header *h )
+	// Returns the quad vertex index array that follows the vertex array in memory.
+{
+	return (const unsigned int *) ( RF_Vertices( h ) + h->numVertices );
+}
+
+
+inline const RF_Vertex *RF_ShooterVertices( const RF_Header *h )
+	// Returns the shooter vertex array. Only for files that have shooter quads.
+{
+	return (const RF_Vertex *) ( RF_QuadVertIndices( h ) + 4 * (size_t) h->numQuads );
+}
+
+
+inline const unsigned int *RF_ShooterQuadVertIndices( const RF_Header *h )
+	// Returns the shooter quad vertex index array. Only for files that have shooter quads.
+{
+	return (const unsigned int *) ( RF_ShooterVertices( h ) + h->numShooterVertices );
+}
+
+
+inline const unsigned int *RF_ShooterQuadStart( const RF_Header *h )
+	// Returns the array of the first quad of each shooter quad. Only for files that have shooter quads.
+{
+	return RF_ShooterQuadVertIndices( h ) + 4 * (size_t) h->numShooterQuads;
+}
+
+#endif
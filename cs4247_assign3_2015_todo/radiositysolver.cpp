@@ -25,6 +25,8 @@
 #include "common.h"
 #include "vector3.h"
 #include "quadmodel.h"
+#include "formfactor.h"
+#include "matrixsolver.h"
 
 
 /////////////////////////////////////////////////////////////////////////////
@@ -38,24 +40,88 @@ static const char inputModelFilename[] = "myinput.in";
 // Output model filename. This model contains the radiosity solution.
 static const char outputModelFilename[] = "myscene.out";
 
+// The same model in the binary format, which loads much faster in the radiosity viewer.
+static const char outputBinaryModelFilename[] = "myscene.rad";
+
 // Threshold for subdiving the original quads to get shooter quads.
 static const float maxShooterQuadEdgeLength = 70.0f;
 
 // Threshold for subdiving the shooter quads to get gatherer quads.
 static const float maxGathererQuadEdgeLength = 30.0f;
 
-// This value tells when to terminate the progressive refinement radiosity computation.
-// It sets the maximum number of iterations.
+// Adaptive refinement of the gatherer quads. After the radiosity is computed, gatherer quads
+// where the radiosity changes sharply are split into 4. The radiosity of the new gatherer quads
+// is gathered from the power shot so far, and the computation continues from there.
+// This is repeated adaptiveRefinementPasses times. A gatherer quad is split if its radiosity
+// differs from that of an adjacent gatherer quad on the same surface by more than 
+// refinementThreshold times their sum.
+// Gatherer quads are not split into quads with edges shorter than minGathererQuadEdgeLength.
+// With refinement, maxGathererQuadEdgeLength can be made much larger.
+// Refinement is off by default. Each pass computes the form factors of the shooter quads that
+// see split quads again, and solves again with up to maxIterations iterations, so a run with
+// 2 passes takes about 3 times as long on myinput.in.
+static const int adaptiveRefinementPasses = 0;
+static const float refinementThreshold = 0.1f;
+static const float minGathererQuadEdgeLength = 4.0f;
+
+// These values tell when to terminate the progressive refinement radiosity computation.
+// It stops after maxIterations iterations, or when the total unshot power has dropped 
+// below convergenceThreshold times the total power initially emitted, whichever comes first.
+// Set convergenceThreshold to 0 to always run maxIterations iterations.
 static const int maxIterations = 250;
-
-
-/**********************************************************
- ****************** WRITE YOUR CODE HERE ******************
- **********************************************************
- * IF NECESSARY, ADD SOME MORE CONSTANTS TO CONTROL WHEN
- * TO TERMINATE THE RADIOSITY COMPUTATION.
- **********************************************************/
-
+static const double convergenceThreshold = 0.001;
+
+// Overshooting factor. A shooter quad shoots overshootFactor times its unshot power,
+// which also accounts for part of the power it will receive back from the rest of the scene.
+// Its unshot power then becomes (1 - overshootFactor) times the original, and may be negative.
+// Its own radiosity does not change, since the extra power shot is taken from its unshot power.
+// 1.0 gives the standard progressive refinement. Values around 1.2 to 1.5 usually need
+// fewer iterations to reach the same residual.
+static const float overshootFactor = 1.0f;
+
+// If true, an ambient term estimated from the remaining unshot power is added to 
+// the radiosity values written to the output model file. This makes solutions
+// that stopped after few iterations look closer to the converged solution.
+static const bool applyAmbientTerm = true;
+
+// How the form factors from a shooter quad are computed.
+// 0: A hemicube is rendered with OpenGL. One shooter quad is shot per iteration.
+// 1: Rays are cast on the CPU. A batch of shooter quads with the highest unshot power 
+//    is shot together, with their form factors computed in parallel by worker threads.
+static const int formFactorMethod = 0;
+
+// These are used only when formFactorMethod == 1, except numWorkerThreads, 
+// which is also used to subdivide the model, and when solverMode != 0.
+static const int shootersPerBatch = 32;     // Number of shooter quads shot together. Each counts as one iteration.
+static const int raysPerShooter = 65536;    // Number of rays cast from each shooter quad.
+static const int numWorkerThreads = 0;      // Number of worker threads. 0 means one per processor.
+
+// Form factor cache. The form factors computed from each shooter quad are saved to a file
+// named after formFactorCachePrefix and a hash of the geometry and the form factor settings.
+// Later runs on the same geometry read the form factors from the file instead of computing
+// them again, so changing only the emission or reflectivity values in the input model file
+// and solving again takes much less time.
+// The cache only holds the form factors to the gatherer quads made by the subdivision, so it
+// only speeds up solves without adaptive refinement. With adaptiveRefinementPasses > 0, the
+// form factor rows that have split gatherer quads are computed again on every run, and the
+// cache is not saved after the first refinement pass.
+// The delta form factor tables of the hemicube are likewise saved to a file named after
+// deltaFormFactorCachePrefix and the hemicube resolution.
+static const bool useFormFactorCache = true;
+static const char formFactorCachePrefix[] = "myscene";
+static const char deltaFormFactorCachePrefix[] = "hemicube";
+
+// How the radiosity equation is solved.
+// 0: Progressive refinement, as described above.
+// 1: Jacobi iterations. The form factors from all the shooter quads are computed first,
+//    then every iteration updates all the gatherer quads from the previous iteration.
+// 2: Gauss-Seidel iterations. Like 1, but the gatherer quads of one shooter quad are updated
+//    at a time, using the new values of the shooter quads before it. This takes fewer
+//    iterations than 1, but runs on one thread.
+// For 1 and 2, an iteration updates all the gatherer quads, and the residual is the total
+// change in the power leaving the shooter quads relative to the total power emitted.
+// The Jacobi iterations run on numWorkerThreads worker threads.
+static const int solverMode = 0;
 
 
 
@@ -63,8 +129,9 @@ static const int maxIterations = 250;
 // CONSTANTS
 /////////////////////////////////////////////////////////////////////////////
 
-// Window size.
-static const int winWidthHeight = 600;     // Window width & height in pixels. Must be even number.
+// Default window size, which is also the hemicube resolution. 
+// It can be changed by giving the resolution on the command line.
+static const int defaultWinWidthHeight = 600;
 
 // Use white background, so that it will not conflict
 // with the colors of the the gatherer quads.
@@ -82,12 +149,42 @@ static const int backgroundColorInt = (255 * 256 + 255) * 256 + 255;
 // The 3D model.
 static QM_Model model;
 
+// The radiosities and unshot power, which are updated during the radiosity computation
+// in this SoA copy, and copied back to the quads in the model when it is done.
+static QM_ModelSoA soa;
+
+// Window width & height in pixels. Must be even number.
+static int winWidthHeight = defaultWinWidthHeight;
+
 // OpenGL display list.
 static GLuint gathererQuadsDList = 0;
 
 // Pre-computed delta form factors lookup tables.
-static float *topDeltaFormFactors = NULL;
-static float *sideDeltaFormFactors = NULL;
+static FF_DeltaFormFactors deltaFormFactors;
+
+// Accumulates the delta form factors read from the hemicube faces.
+static FF_Accumulator hemicubeFF;
+
+// For computing form factors by ray casting.
+static FF_Grid rayGrid;                     // Uniform grid over the gatherer quads.
+static int numRayThreads = 0;               // Number of worker threads.
+static FF_Accumulator *rayFF = NULL;        // Scratch accumulator of each worker thread.
+
+// Form factors of the shooter quads computed in the current iteration.
+static FF_Row *shotRows = NULL;
+
+// Form factors computed so far, and the file they are saved to.
+// The cache is also used to keep all the form factors when solverMode != 0.
+static FF_Cache ffCache;
+static char ffCacheFilename[256];
+static const bool keepFormFactors = useFormFactorCache || solverMode != 0;
+
+// True after the gatherer quads have been refined. The rows in the form factor cache then
+// have the new gatherer quad IDs, and the cache is not saved again.
+static bool gatherersRefined = false;
+
+// Number of worker threads for the Jacobi or Gauss-Seidel iterations.
+static int numSolverThreads = 0;
 
 
 
@@ -163,18 +260,64 @@ static GLuint MakeGathererQuadsDisplayList( const QM_Model *m )
 
 
 
-static int FindShooterQuadWithHighestUnshotPower( const QM_Model *m )
+static int FindShooterQuadsWithHighestUnshotPower( const QM_ModelSoA *m, int shooters[], int maxShooters )
+    // Find up to maxShooters shooter quads with the highest non-zero unshot power.
+    // The magnitude of the unshot power is used, since overshooting can make it negative.
+    // Their indices are written to shooters[] in decreasing order of unshot power.
+    // Returns the number of shooter quads found.
 {
-    int s = 0;
-    float maxUnshotPower = 0.0f;
+    float *maxUnshotPower = (float *) CheckedMalloc( sizeof(float) * maxShooters );
+    int numFound = 0;
 
-    for ( int q = 0; q < m->totalShooters; q++ )
+    for ( int q = 0; q < m->numShooters; q++ )
     {
-        float *unshotPower = m->shooters[q]->unshotPower;
-        float RGBunshotPower = unshotPower[0] + unshotPower[1] + unshotPower[2]; 
-        if ( RGBunshotPower > maxUnshotPower ) { maxUnshotPower = RGBunshotPower;  s = q; }
+        const float *unshotPower = m->shooterUnshotPower[q];
+        float RGBunshotPower = fabs( unshotPower[0] ) + fabs( unshotPower[1] ) + fabs( unshotPower[2] ); 
+        if ( RGBunshotPower <= 0.0f ) continue;
+        if ( numFound == maxShooters && RGBunshotPower <= maxUnshotPower[numFound - 1] ) continue;
+
+        // Insert into the sorted list.
+        int i = ( numFound < maxShooters )? numFound++ : numFound - 1;
+        while ( i > 0 && maxUnshotPower[i - 1] < RGBunshotPower )
+        {
+            maxUnshotPower[i] = maxUnshotPower[i - 1];
+            shooters[i] = shooters[i - 1];
+            i--;
+        }
+        maxUnshotPower[i] = RGBunshotPower;
+        shooters[i] = q;
     }
-    return s;
+
+    free( maxUnshotPower );
+    return numFound;
+}
+
+
+
+static double TotalEmittedPower( const QM_ModelSoA *m )
+    // Returns the sum of the RGB power emitted by all the shooter quads.
+{
+    double total = 0.0;
+    for ( int q = 0; q < m->numShooters; q++ )
+    {
+        const float *emission = m->surfaceEmission[ m->shooterSurface[q] ];
+        total += (double) m->shooterArea[q] * ( emission[0] + emission[1] + emission[2] );
+    }
+    return total;
+}
+
+
+
+static double TotalUnshotPower( const QM_ModelSoA *m )
+    // Returns the sum of the magnitudes of the RGB unshot power of all the shooter quads.
+{
+    double total = 0.0;
+    for ( int q = 0; q < m->numShooters; q++ )
+    {
+        const float *unshotPower = m->shooterUnshotPower[q];
+        total += (double) fabs( unshotPower[0] ) + fabs( unshotPower[1] ) + fabs( unshotPower[2] );
+    }
+    return total;
 }
 
 
@@ -209,59 +352,6 @@ static float ComputeHemicubeWidth( const QM_ShooterQuad *shooterQuad )
 
 
 
-static void PreComputeTopFaceDeltaFormFactors( float deltaFormFactors[], int numPixelsOnWidth )
-    // Pre-compute the delta form factors on the top face of the hemicube.
-    // The results are stored in the 1-D array deltaFormFactors[] of 
-    // size of (numPixelsOnWidth x numPixelsOnWidth) elements.
-    // Note that numPixelsOnWidth must be a even number.
-{
-    /**********************************************************
-     ****************** WRITE YOUR CODE HERE ******************
-     **********************************************************/
-	double x = 0;
-	double y = 0;
-	double deltaX = 0.5 * 2.0 / numPixelsOnWidth;
-	double deltaY = deltaX;
-	double dA = 2.0 * 2.0 / pow(numPixelsOnWidth, 2);
-
-	for(int i = 0; i < numPixelsOnWidth; i++) {
-		for(int j = 0; j < numPixelsOnWidth; j++) {
-			x = -1.0 + deltaX + (double)i * 2.0 / numPixelsOnWidth;
-			y = -1.0 + deltaY + (double)j * 2.0 / numPixelsOnWidth;
-			deltaFormFactors[numPixelsOnWidth * i + j] = dA / (M_PI * pow(x * x + y * y + 1, 2));
-		}
-	}
-}
-
-
-
-
-static void PreComputeSideFaceDeltaFormFactors( float deltaFormFactors[], int numPixelsOnWidth )
-    // Pre-compute the delta form factors on a side face of the hemicube.
-    // The results are stored in the 1-D array deltaFormFactors[] of 
-    // size of [(numPixelsOnWidth/2) x numPixelsOnWidth] elements.
-    // Note that numPixelsOnWidth must be a even number.
-{
-    /**********************************************************
-     ****************** WRITE YOUR CODE HERE ******************
-     **********************************************************/
-	double z = 0;
-	double y = 0;
-	double deltaY = 0.5 * 2.0 / numPixelsOnWidth;
-	double deltaZ = deltaY;
-	double dA = 2.0 * 2.0 / pow(numPixelsOnWidth, 2) ;
-
-	for(int i = 0; i < numPixelsOnWidth / 2; i++) {
-		for(int j = 0; j < numPixelsOnWidth; j++) {
-			z = deltaZ + (double)i * 2.0 / numPixelsOnWidth;
-			y = -1.0 + deltaY + (double)j * 2.0 / numPixelsOnWidth;
-			deltaFormFactors[numPixelsOnWidth * i + j] = dA * z / (M_PI * pow(z * z + y * y + 1, 2));
-		}
-	}
-}
-
-
-
 static void SetupHemicubeTopView( const QM_ShooterQuad *shooterQuad, float nearPlane, float farPlane )
     // Set up a view for the top face of a hemicube.
     // Need to set up the viewport, projection and view transfromation.
@@ -342,98 +432,502 @@ static void SetupHemicubeSideView( int face, const QM_ShooterQuad *shooterQuad,
 
 
 
-static void UpdateRadiosities( const QM_Model *m, const float shotPower[3], const GLubyte colorBuf[], 
-                               const float deltaFormFactors[], int width, int height )
-    // Use the color buffer (item buffer) to update the radiosities of the gatherer quads,
-    // and update the unshot power of their parent shooter quads.
+static inline void AddFormFactorRun( const QM_Model *m, int g, float formFactor )
+    // Add the summed delta form factors of a run of pixels to gatherer quad g.
 {
-    for ( int i = 0; i < width * height; i++ )
-    {
-        int g = (int) RGBToUnsignedInt( &colorBuf[3 * i] );	// Which gatherer quad.
-        if ( g < 0 || g >= m->totalGatherers || g == backgroundColorInt ) continue;
-
-        /**********************************************************
-         ****************** WRITE YOUR CODE HERE ******************
-         **********************************************************/
-//        float formFactor[3] = {deltaFormFactors[i], deltaFormFactors[i], deltaFormFactors[i]};
-
-        //R component
-        float red, gre, blu;
-        red = m->gatherers[g]->surface->reflectivity[0] * deltaFormFactors[i] * shotPower[0] / m->gatherers[g]->area;
-        gre = m->gatherers[g]->surface->reflectivity[1] * deltaFormFactors[i] * shotPower[1] / m->gatherers[g]->area;
-        blu = m->gatherers[g]->surface->reflectivity[2] * deltaFormFactors[i] * shotPower[2] / m->gatherers[g]->area;
-
-        m->gatherers[g]->radiosity[0] += red;
-        m->gatherers[g]->radiosity[1] += gre;
-        m->gatherers[g]->radiosity[2] += blu;
-
-        m->gatherers[g]->shooter->unshotPower[0] += m->gatherers[g]->surface->reflectivity[0] * deltaFormFactors[i] * shotPower[0];
-        m->gatherers[g]->shooter->unshotPower[1] += m->gatherers[g]->surface->reflectivity[1] * deltaFormFactors[i] * shotPower[1];
-        m->gatherers[g]->shooter->unshotPower[2] += m->gatherers[g]->surface->reflectivity[2] * deltaFormFactors[i] * shotPower[2];
-    }
+    if ( g < 0 || g >= m->totalGatherers || g == backgroundColorInt ) return;
+    FF_AccumulatorAdd( &hemicubeFF, g, formFactor );
 }
 
 
 
-/////////////////////////////////////////////////////////////////////////////
-// The display callback function.
-// This is where the progressive refinement radiosity computation is performed.
-/////////////////////////////////////////////////////////////////////////////
+static inline void AddPixel( const QM_Model *m, int g, float deltaFormFactor, int *runID, float *runFF )
+    // Add a pixel of gatherer quad g to the current run of pixels, 
+    // or end the run and start a new one if the pixel belongs to another gatherer quad.
+{
+    if ( g == *runID ) { *runFF += deltaFormFactor;  return; }
 
-static void ComputeRadiosity( void )
+    AddFormFactorRun( m, *runID, *runFF );
+    *runID = g;
+    *runFF = deltaFormFactor;
+}
+
+
+
+static void AccumulateFormFactors( const QM_Model *m, const GLubyte colorBuf[], 
+                                   bool topFace, int width, int height )
+    // Reduce the color buffer (item buffer) to a compact list of visible gatherer quads,
+    // summing the delta form factors of all the pixels that each gatherer quad covers.
+    // Consecutive pixels usually belong to the same gatherer quad, so each run of
+    // equal IDs is summed locally before it is added to the gatherer quad's total.
+    // The color buffer is of the top face of the hemicube if topFace is true, 
+    // or of a side face otherwise.
 {
-    // Allocate temporary memory for reading in the colorbuffer.
-    GLubyte *colorBuf = (GLubyte *) CheckedMalloc( sizeof(GLubyte) * 3 * winWidthHeight * winWidthHeight );
+    int runID = -1;         // Gatherer quad ID of the current run of pixels.
+    float runFF = 0.0f;     // Sum of delta form factors of the current run of pixels.
+    int half = width / 2;
 
-    for( int iterationCount = 0; iterationCount < maxIterations; iterationCount++ )
+    for ( int y = 0; y < height; y++ )
     {
-    // Find a shooter quad to shoot power.
-        printf( "Iteration %d\n", iterationCount );
+        // The left half of the row uses the stored half row in reverse.
+        const float *dff = FF_DeltaFormFactorRow( &deltaFormFactors, topFace, y );
+        const GLubyte *pixel = &colorBuf[ 3 * y * width ];
+
+        for ( int x = 0; x < half; x++ )
+            AddPixel( m, (int) RGBToUnsignedInt( &pixel[3 * x] ), dff[half - 1 - x], &runID, &runFF );
+        for ( int x = half; x < width; x++ )
+            AddPixel( m, (int) RGBToUnsignedInt( &pixel[3 * x] ), dff[x - half], &runID, &runFF );
+    }
 
-        int s = FindShooterQuadWithHighestUnshotPower( &model );
-        QM_ShooterQuad *shooterQuad = model.shooters[s];
-        float unshotPower[3] = { shooterQuad->unshotPower[0], shooterQuad->unshotPower[1], shooterQuad->unshotPower[2] };
+    AddFormFactorRun( m, runID, runFF );
+}
 
-        /**********************************************************
-         ****************** WRITE YOUR CODE HERE ******************
-         **********************************************************
-         * ADD ADDITIONAL TERMINATING CONDITION TO TERMINATE
-         * RADIOSITY COMPUTATION.
-         **********************************************************/
 
-        // After shooting power, the shooter quad's unshot power becomes zero.
-        shooterQuad->unshotPower[0] = shooterQuad->unshotPower[1] = shooterQuad->unshotPower[2] = 0.0f;
 
-    // Set up a hemicube at the centroid of the shooter.
+static void ComputeFormFactorsByHemicube( FF_Row *row, const QM_ShooterQuad *shooterQuad, GLubyte *colorBuf )
+    // Compute the form factors from the shooter quad to the gatherer quads, by rendering
+    // the gatherer quads onto a hemicube placed at the centroid of the shooter quad.
+    // colorBuf[] must be large enough for the top face of the hemicube.
+{
+    float hemicubeWidth = ComputeHemicubeWidth( shooterQuad );
 
-        float hemicubeWidth = ComputeHemicubeWidth( shooterQuad );
+    // Top face.
+    SetupHemicubeTopView( shooterQuad, hemicubeWidth/2.0f, 2.0f * model.radius );
+    glCallList( gathererQuadsDList );
+    glFinish();
+    ReadColorBuffer( colorBuf, true, 0, 0, winWidthHeight, winWidthHeight );
+    AccumulateFormFactors( &model, colorBuf, true, winWidthHeight, winWidthHeight );
 
-        // Top face.
-        SetupHemicubeTopView( shooterQuad, hemicubeWidth/2.0f, 2.0f * model.radius );
+    // Side faces.
+    for ( int face = 1; face <= 4; face++ )
+    {
+        SetupHemicubeSideView( face, shooterQuad, hemicubeWidth/2.0f, 2.0f * model.radius );
         glCallList( gathererQuadsDList );
         glFinish();
-        ReadColorBuffer( colorBuf, true, 0, 0, winWidthHeight, winWidthHeight );
-        UpdateRadiosities( &model, unshotPower, colorBuf, topDeltaFormFactors, winWidthHeight, winWidthHeight );
+        ReadColorBuffer( colorBuf, true, 0, 0, winWidthHeight, winWidthHeight/2 );
+        AccumulateFormFactors( &model, colorBuf, false, winWidthHeight, winWidthHeight/2 );
+    }
+
+    FF_AccumulatorToRow( &hemicubeFF, row );
+}
+
+
+
+typedef struct RayCastBatch {
+    const int *shooters;        // Indices of the shooter quads in model.shooters.
+    const int *slots;           // The i-th row computed is for shooter slots[i].
+}
+RayCastBatch;
+
+
+static void RayCastWorker( int i, int thread, void *arg )
+    // Called by ParallelFor() to compute the i-th row of a RayCastBatch into shotRows[i].
+{
+    const RayCastBatch *batch = (const RayCastBatch *) arg;
+    int b = batch->slots[i];
+    FF_ComputeRowByRayCasting( &shotRows[i], &rayFF[thread], &model, &rayGrid, 
+                               batch->shooters[b], raysPerShooter, (unsigned int) batch->shooters[b] );
+}
 
-        // Side faces.
-        for ( int face = 1; face <= 4; face++ )
+
+
+static int GetFormFactorRows( const int shooters[], int count, const FF_Row *rows[], int computeSlots[],
+                              GLubyte *colorBuf, long *samples )
+    // Get the form factors from the shooter quads, shooters[0] to shooters[count-1], into rows[].
+    // The rows not in the cache are computed, and added to the cache if keepFormFactors is true.
+    // Otherwise, count must be 1 when formFactorMethod == 0. computeSlots[] is scratch space
+    // for count entries. The rays cast from a shooter quad depend only on its index, so a row
+    // computed again hits the gatherer quads that were not split as before.
+    // The number of hemicube pixels or rays processed is written to *samples.
+    // Returns the number of rows computed.
+{
+    int numToCompute = 0;
+    for ( int b = 0; b < count; b++ )
+    {
+        rows[b] = keepFormFactors? FF_CacheGetRow( &ffCache, shooters[b] ) : NULL;
+        if ( rows[b] == NULL ) computeSlots[ numToCompute++ ] = b;
+    }
+
+    *samples = 0;
+
+    if ( formFactorMethod == 1 )
+    {
+        if ( numToCompute > 0 )
+        {
+            RayCastBatch batch;
+            batch.shooters = shooters;
+            batch.slots = computeSlots;
+            ParallelFor( numToCompute, numRayThreads, RayCastWorker, &batch );
+            *samples = (long) numToCompute * raysPerShooter;
+        }
+
+        for ( int i = 0; i < numToCompute; i++ )
+        {
+            int b = computeSlots[i];
+            rows[b] = keepFormFactors? FF_CacheAddRow( &ffCache, shooters[b], &shotRows[i] ) : &shotRows[i];
+        }
+    }
+    else
+    {
+        // One hemicube at a time.
+        for ( int i = 0; i < numToCompute; i++ )
         {
-            SetupHemicubeSideView( face, shooterQuad, hemicubeWidth/2.0f, 2.0f * model.radius );
-            glCallList( gathererQuadsDList );
-            glFinish();
-            ReadColorBuffer( colorBuf, true, 0, 0, winWidthHeight, winWidthHeight/2 );
-            UpdateRadiosities( &model, unshotPower, colorBuf, sideDeltaFormFactors, winWidthHeight, winWidthHeight/2 );
+            int b = computeSlots[i];
+            ComputeFormFactorsByHemicube( &shotRows[0], model.shooters[ shooters[b] ], colorBuf );
+            rows[b] = keepFormFactors? FF_CacheAddRow( &ffCache, shooters[b], &shotRows[0] ) : &shotRows[0];
+            *samples += 3L * winWidthHeight * winWidthHeight;     // Top face plus 4 half-size side faces.
         }
     }
+
+    return numToCompute;
+}
+
+
+
+static void SaveFormFactorCache( void )
+    // Save the form factor cache if it has new rows, unless the gatherer quads have been refined.
+{
+    if ( useFormFactorCache && ffCache.modified && !gatherersRefined )
+    {
+        FF_CacheSave( &ffCache, ffCacheFilename );
+        printf( "Saved form factors of %d shooter quads to \"%s\".\n", ffCache.numRows, ffCacheFilename );
+    }
+}
+
+
+
+static double ApplyShotPower( QM_ModelSoA *m, const FF_Row *row, const float shotPower[3], 
+                              const bool *onlyGatherers = NULL )
+    // Use the form factors in row to update the radiosities of the visible gatherer quads,
+    // and update the unshot power of their parent shooter quads.
+    // If onlyGatherers is not NULL, only the gatherer quads g with onlyGatherers[g] true are updated.
+    // Returns the sum of the RGB power added to the unshot power of the shooter quads.
+{
+    double reflectedPower = 0.0;
+
+    for ( int k = 0; k < row->numEntries; k++ )
+    {
+        int g = row->gathererIDs[k];
+        if ( onlyGatherers != NULL && !onlyGatherers[g] ) continue;
+        const float *reflectivity = m->surfaceReflectivity[ m->gathererSurface[g] ];
+        float formFactor = row->formFactors[k];
+
+        // Power received and reflected by the gatherer quad.
+        float power[3];
+        power[0] = reflectivity[0] * formFactor * shotPower[0];
+        power[1] = reflectivity[1] * formFactor * shotPower[1];
+        power[2] = reflectivity[2] * formFactor * shotPower[2];
+
+        float invArea = m->gathererInvArea[g];
+        float *radiosity = m->gathererRadiosity[g];
+        radiosity[0] += power[0] * invArea;
+        radiosity[1] += power[1] * invArea;
+        radiosity[2] += power[2] * invArea;
+
+        float *unshotPower = m->shooterUnshotPower[ m->gathererShooter[g] ];
+        unshotPower[0] += power[0];
+        unshotPower[1] += power[1];
+        unshotPower[2] += power[2];
+
+        reflectedPower += (double) power[0] + power[1] + power[2];
+    }
+
+    return reflectedPower;
+}
+
+
+
+static void SetupGathererData( void );
+static void ReleaseGathererData( void );
+static void ResetRadiosity( void );
+
+
+
+static double ShootPower( GLubyte *colorBuf )
+    // Run the progressive refinement radiosity computation from the current state.
+    // colorBuf is for reading the hemicube faces.
+    // Returns the residual at the end.
+{
+    // Shooter quads shot in the current iteration, and the power they shoot.
+    int batchCapacity = ( formFactorMethod == 1 )? shootersPerBatch : 1;
+    int *batchShooters = (int *) CheckedMalloc( sizeof(int) * batchCapacity );
+    float (*batchPower)[3] = (float (*)[3]) CheckedMalloc( sizeof(float) * 3 * batchCapacity );
+    const FF_Row **batchRows = (const FF_Row **) CheckedMalloc( sizeof(FF_Row *) * batchCapacity );
+    int *computeSlots = (int *) CheckedMalloc( sizeof(int) * batchCapacity );
+
+    // The residual is the total unshot power relative to the total power initially emitted.
+    // Without overshooting, the total unshot power is updated as power is shot and reflected.
+    // With overshooting, the unshot power can be negative, and the magnitudes are summed instead.
+    double emittedPower = TotalEmittedPower( &soa );
+    double unshotPower = TotalUnshotPower( &soa );
+    double residual = ( emittedPower > 0.0 )? unshotPower / emittedPower : 0.0;
+    double startTime = GetCurrRealTime();
+
+    int iterationCount = 0;
+
+    while ( iterationCount < maxIterations && residual > convergenceThreshold )
+    {
+        double iterationStartTime = GetCurrRealTime();
+
+    // Find the shooter quads to shoot power.
+        int batchSize = Min2( batchCapacity, maxIterations - iterationCount );
+        batchSize = FindShooterQuadsWithHighestUnshotPower( &soa, batchShooters, batchSize );
+        if ( batchSize == 0 ) break;    // No more unshot power.
+
+        // After shooting power, the shooter quads' unshot power becomes zero,
+        // or (1 - overshootFactor) times what it was when overshooting.
+        for ( int b = 0; b < batchSize; b++ )
+        {
+            float *shooterUnshotPower = soa.shooterUnshotPower[ batchShooters[b] ];
+
+            for ( int i = 0; i < 3; i++ )
+            {
+                batchPower[b][i] = overshootFactor * shooterUnshotPower[i];
+                shooterUnshotPower[i] -= batchPower[b][i];
+            }
+            unshotPower -= (double) batchPower[b][0] + batchPower[b][1] + batchPower[b][2];
+        }
+
+    // Get the form factors from the shooter quads, computing those that are not in the cache.
+        long samples;   // Number of hemicube pixels or rays processed.
+        int numToCompute = GetFormFactorRows( batchShooters, batchSize, batchRows, computeSlots, 
+                                              colorBuf, &samples );
+
+    // Distribute the shot power to the visible gatherer quads.
+    // This is done in the order the shooter quads were selected, so that the 
+    // result does not depend on how the work was divided among the threads.
+        for ( int b = 0; b < batchSize; b++ )
+            unshotPower += ApplyShotPower( &soa, batchRows[b], batchPower[b] );
+
+        iterationCount += batchSize;
+        if ( overshootFactor != 1.0f ) unshotPower = TotalUnshotPower( &soa );
+        residual = ( emittedPower > 0.0 )? Max2( unshotPower, 0.0 ) / emittedPower : 0.0;
+
+        double currTime = GetCurrRealTime();
+        printf( "Iteration %d: residual = %.3e, time = %.3f s (total %.3f s), %ld %s, %d cached\n", 
+                iterationCount - 1, residual, currTime - iterationStartTime, currTime - startTime, 
+                samples, ( formFactorMethod == 1 )? "rays" : "pixels", batchSize - numToCompute );
+    }
     
+    free( batchShooters );
+    free( batchPower );
+    free( batchRows );
+    free( computeSlots );
+
+    SaveFormFactorCache();
+
+    printf( "Radiosity computation completed after %d iterations in %.3f s (residual = %.3e).\n",
+            iterationCount, GetCurrRealTime() - startTime, residual );
+    return residual;
+
+}
+
+
+
+static double SolveMatrix( GLubyte *colorBuf )
+    // Compute the form factors from all the shooter quads, then solve the radiosity equation
+    // by Jacobi or Gauss-Seidel iterations, starting from the current state.
+    // colorBuf is for reading the hemicube faces.
+    // Returns the residual at the end.
+{
+    double startTime = GetCurrRealTime();
+
+// Compute the form factors from the shooter quads that are not in the cache.
+    int batchCapacity = ( formFactorMethod == 1 )? shootersPerBatch : 1;
+    int *batchShooters = (int *) CheckedMalloc( sizeof(int) * batchCapacity );
+    const FF_Row **batchRows = (const FF_Row **) CheckedMalloc( sizeof(FF_Row *) * batchCapacity );
+    int *computeSlots = (int *) CheckedMalloc( sizeof(int) * batchCapacity );
+
+    int numComputed = 0;
+    for ( int first = 0; first < soa.numShooters; first += batchCapacity )
+    {
+        int batchSize = Min2( batchCapacity, soa.numShooters - first );
+        for ( int b = 0; b < batchSize; b++ ) batchShooters[b] = first + b;
+
+        long samples;
+        numComputed += GetFormFactorRows( batchShooters, batchSize, batchRows, computeSlots, colorBuf, &samples );
+    }
+
+    free( batchShooters );
+    free( batchRows );
+    free( computeSlots );
+
+    SaveFormFactorCache();
+
+    double solveStartTime = GetCurrRealTime();
+    printf( "Form factors of %d shooter quads computed, %d read from cache, in %.3f s.\n",
+            numComputed, soa.numShooters - numComputed, solveStartTime - startTime );
+
+// Solve.
+    MS_Matrix a = MS_BuildMatrix( &ffCache, &soa );
+    printf( "Form factor matrix has %d entries.\n", a.entryStart[ a.numGatherers ] );
+
+    int method = ( solverMode == 2 )? MS_GAUSS_SEIDEL : MS_JACOBI;
+    double residual;
+    int iterationCount = MS_Solve( &a, &soa, method, maxIterations, convergenceThreshold, numSolverThreads, &residual );
+    MS_MatrixCleanUp( &a );
+
+    double currTime = GetCurrRealTime();
+    printf( "%s solve completed after %d iterations in %.3f s (total %.3f s, residual = %.3e).\n",
+            ( method == MS_JACOBI )? "Jacobi" : "Gauss-Seidel",
+            iterationCount, currTime - solveStartTime, currTime - startTime, residual );
+    return residual;
+}
+
+
+
+static double Solve( GLubyte *colorBuf )
+    // Compute the radiosity solution from the current state, using the method set by solverMode.
+    // Returns the residual at the end.
+{
+    if ( solverMode == 0 ) 
+        return ShootPower( colorBuf );
+    else
+        return SolveMatrix( colorBuf );
+}
+
+
+
+static int RefineGatherers( GLubyte *colorBuf )
+    // Split the gatherer quads where the radiosity changes sharply, keeping the current solution.
+    // The new gatherer quads gather the power shot so far by the shooter quads that see them.
+    // Only the form factors of those shooter quads are computed again. The other form factor 
+    // rows in the cache are kept, with the new gatherer quad IDs.
+    // Returns the number of gatherer quads split.
+{
+// The power shot so far by each shooter quad is the power leaving it minus its unshot power.
+    int numShooters = soa.numShooters;
+    float (*shotPower)[3] = (float (*)[3]) CheckedMalloc( sizeof(float) * 3 * Max2( numShooters, 1 ) );
+    for ( int s = 0; s < numShooters; s++ ) VecNeg( shotPower[s], soa.shooterUnshotPower[s] );
+
+    for ( int g = 0; g < soa.numGatherers; g++ )
+    {
+        float area = 1.0f / soa.gathererInvArea[g];
+        float *power = shotPower[ soa.gathererShooter[g] ];
+        power[0] += area * soa.gathererRadiosity[g][0];
+        power[1] += area * soa.gathererRadiosity[g][1];
+        power[2] += area * soa.gathererRadiosity[g][2];
+    }
+
+// Split the gatherer quads.
+    QM_SoAToModel( &model, &soa );
+    int numOldGatherers = model.totalGatherers;
+    int *newIDs = (int *) CheckedMalloc( sizeof(int) * Max2( numOldGatherers, 1 ) );
+    int numSplit = QM_RefineGatherers( &model, refinementThreshold, minGathererQuadEdgeLength, newIDs );
+
+    if ( numSplit == 0 )
+    {
+        free( shotPower );
+        free( newIDs );
+        return 0;
+    }
+
+    ReleaseGathererData();
+    SetupGathererData();
+    gatherersRefined = true;
+
+    bool *isNew = (bool *) CheckedMalloc( sizeof(bool) * Max2( soa.numGatherers, 1 ) );
+    for ( int g = 0; g < soa.numGatherers; g++ ) isNew[g] = true;
+    for ( int g = 0; g < numOldGatherers; g++ ) 
+        if ( newIDs[g] >= 0 ) isNew[ newIDs[g] ] = false;
+
+    // The shooter quads whose form factor rows have split gatherer quads.
+    bool *recompute = (bool *) CheckedMalloc( sizeof(bool) * Max2( numShooters, 1 ) );
+    if ( keepFormFactors )
+        FF_CacheRemapGatherers( &ffCache, newIDs, soa.numGatherers, recompute );
+    else
+        for ( int s = 0; s < numShooters; s++ ) recompute[s] = true;   // Not known without the rows.
+    free( newIDs );
+
+// The new gatherer quads start from their emission. The power their parent had received
+// is taken back from the unshot power of their shooter quad, and gathered again below.
+    for ( int g = 0; g < soa.numGatherers; g++ )
+    {
+        if ( !isNew[g] ) continue;
+        const float *emission = soa.surfaceEmission[ soa.gathererSurface[g] ];
+        float area = 1.0f / soa.gathererInvArea[g];
+        float *unshotPower = soa.shooterUnshotPower[ soa.gathererShooter[g] ];
+        for ( int i = 0; i < 3; i++ )
+        {
+            unshotPower[i] -= area * ( soa.gathererRadiosity[g][i] - emission[i] );
+            soa.gathererRadiosity[g][i] = emission[i];
+        }
+    }
+
+// Gather the power shot so far into the new gatherer quads.
+    int batchCapacity = ( formFactorMethod == 1 )? shootersPerBatch : 1;
+    int *batchShooters = (int *) CheckedMalloc( sizeof(int) * batchCapacity );
+    const FF_Row **batchRows = (const FF_Row **) CheckedMalloc( sizeof(FF_Row *) * batchCapacity );
+    int *computeSlots = (int *) CheckedMalloc( sizeof(int) * batchCapacity );
+    int numComputed = 0;
+
+    for ( int s = 0; s < numShooters; )
+    {
+        int batchSize = 0;
+        for ( ; s < numShooters && batchSize < batchCapacity; s++ )
+        {
+            const float *power = shotPower[s];
+            if ( recompute[s] && fabs( power[0] ) + fabs( power[1] ) + fabs( power[2] ) > 0.0f ) 
+                batchShooters[ batchSize++ ] = s;
+        }
+        if ( batchSize == 0 ) continue;
+
+        long samples;
+        numComputed += GetFormFactorRows( batchShooters, batchSize, batchRows, computeSlots, colorBuf, &samples );
+        for ( int b = 0; b < batchSize; b++ )
+            ApplyShotPower( &soa, batchRows[b], shotPower[ batchShooters[b] ], isNew );
+    }
+
+    printf( "Form factors of %d shooter quads computed again for the new gatherer quads.\n", numComputed );
+
+    free( batchShooters );
+    free( batchRows );
+    free( computeSlots );
+    free( recompute );
+    free( isNew );
+    free( shotPower );
+    return numSplit;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////////
+// The display callback function.
+// This is where the progressive refinement radiosity computation is performed.
+/////////////////////////////////////////////////////////////////////////////
+
+static void ComputeRadiosity( void )
+{
+    // Allocate temporary memory for reading in the colorbuffer.
+    GLubyte *colorBuf = (GLubyte *) CheckedMalloc( sizeof(GLubyte) * 3 * winWidthHeight * winWidthHeight );
+
+    Solve( colorBuf );
+
+    for ( int pass = 0; pass < adaptiveRefinementPasses; pass++ )
+    {
+        int numSplit = RefineGatherers( colorBuf );
+        printf( "Refinement pass %d: %d gatherer quads split, %d gatherer quads now.\n", 
+                pass + 1, numSplit, model.totalGatherers );
+        if ( numSplit == 0 ) break;
+
+        // Continue from the current solution with the new gatherer quads.
+        Solve( colorBuf );
+    }
+
     free( colorBuf );
-    printf( "Radiosity computation completed.\n" );
 
     printf( "Computing vertex radiosities...\n" );
+    QM_SoAToModel( &model, &soa );
     QM_ComputeVertexRadiosities( &model );
 
+    float ambient[3];
+    QM_ComputeAmbient( &model, ambient );
+    printf( "Estimated ambient radiosity = (%.3g, %.3g, %.3g)%s.\n", ambient[0], ambient[1], ambient[2],
+            applyAmbientTerm? "" : " (not applied)" );
+
     printf( "Writing output model file...\n" );
-    QM_WriteGatherersToFile( outputModelFilename, &model );
+    QM_WriteGatherersToFile( outputModelFilename, &model, applyAmbientTerm? ambient : NULL );
+    QM_WriteGatherersToBinaryFile( outputBinaryModelFilename, &model, applyAmbientTerm? ambient : NULL );
 
     printf( "DONE.\nPress ENTER to exit program.\n" );
     char ch;
@@ -498,38 +992,116 @@ static void InitRadiosityComputation( void )
 
 // Subdivide the original quads to shooter quads and gatherer quads.
     printf( "Subdividing original quads...\n" );
-    QM_Subdivide( &model, maxShooterQuadEdgeLength, maxGathererQuadEdgeLength );
+    QM_Subdivide( &model, maxShooterQuadEdgeLength, maxGathererQuadEdgeLength, numWorkerThreads );
+
+// Read or pre-compute the delta form factors for the window resolution.
+    if ( formFactorMethod == 0 )
+    {
+        char filename[256];
+        sprintf( filename, "%s-%d.dff", deltaFormFactorCachePrefix, winWidthHeight );
+
+        if ( useFormFactorCache && FF_DeltaFormFactorsLoad( &deltaFormFactors, winWidthHeight, filename ) )
+            printf( "Read delta form factors from \"%s\".\n", filename );
+        else
+        {
+            FF_DeltaFormFactorsInit( &deltaFormFactors, winWidthHeight );
+            if ( useFormFactorCache ) FF_DeltaFormFactorsSave( &deltaFormFactors, filename );
+        }
+    }
+
+// Allocate memory for computing the form factors.
+    int batchCapacity = 1;
+    if ( formFactorMethod == 1 )
+    {
+        numRayThreads = ( numWorkerThreads > 0 )? numWorkerThreads : GetNumProcessors();
+        printf( "Using %d worker threads.\n", numRayThreads );
+        batchCapacity = shootersPerBatch;
+    }
+
+    shotRows = (FF_Row *) CheckedMalloc( sizeof(FF_Row) * batchCapacity );
+    for ( int b = 0; b < batchCapacity; b++ ) FF_RowInit( &shotRows[b] );
+
+    if ( solverMode != 0 )
+        numSolverThreads = ( numWorkerThreads > 0 )? numWorkerThreads : GetNumProcessors();
+
+    SetupGathererData();
+    ResetRadiosity();
 
+    if ( keepFormFactors )
+    {
+        // The form factors also depend on the method used and its resolution.
+        unsigned long long settings = ( formFactorMethod == 1 )? ( 1ull << 32 ) | raysPerShooter : winWidthHeight;
+        FF_CacheInit( &ffCache, &model, FF_GeometryHash( &model, settings ) );
+        sprintf( ffCacheFilename, "%s-%016llx.ffc", formFactorCachePrefix, ffCache.geometryHash );
+
+        if ( useFormFactorCache && FF_CacheLoad( &ffCache, ffCacheFilename ) )
+            printf( "Read form factors of %d shooter quads from \"%s\".\n", ffCache.numRows, ffCacheFilename );
+    }
+}
+
+
+
+static void SetupGathererData( void )
+    // Set up the data that depend on the gatherer quads, except the form factor cache,
+    // which is kept when the gatherer quads are refined.
+{
 // Make OpenGL display list for the gatherer quads.
     gathererQuadsDList = MakeGathererQuadsDisplayList( &model );
 
-// Pre-compute the delta form factors for the fixed window resolution.
-    topDeltaFormFactors = (float *) CheckedMalloc( sizeof(float) * winWidthHeight * winWidthHeight );
-    sideDeltaFormFactors = (float *) CheckedMalloc( sizeof(float) * winWidthHeight * winWidthHeight / 2 );
-    PreComputeTopFaceDeltaFormFactors( topDeltaFormFactors, winWidthHeight );
-    PreComputeSideFaceDeltaFormFactors( sideDeltaFormFactors, winWidthHeight );
+    FF_AccumulatorInit( &hemicubeFF, model.totalGatherers );
+    QM_BuildSoA( &soa, &model );
 
-// Initialize the unshot power of the shooter quads.
-    for ( int s = 0; s < model.totalShooters; s++ )
+    if ( formFactorMethod == 1 )
     {
-        QM_ShooterQuad *shooterQuad = model.shooters[s];
-        shooterQuad->unshotPower[0] = shooterQuad->area * shooterQuad->surface->emission[0];
-        shooterQuad->unshotPower[1] = shooterQuad->area * shooterQuad->surface->emission[1];
-        shooterQuad->unshotPower[2] = shooterQuad->area * shooterQuad->surface->emission[2];
+        printf( "Building ray casting grid...\n" );
+        rayGrid = FF_BuildGrid( &model );
+
+        rayFF = (FF_Accumulator *) CheckedMalloc( sizeof(FF_Accumulator) * numRayThreads );
+        for ( int t = 0; t < numRayThreads; t++ ) FF_AccumulatorInit( &rayFF[t], model.totalGatherers );
     }
+}
 
-// Initialize the radiosity of the gatherer quads.
-    for ( int g = 0; g < model.totalGatherers; g++ )
+
+
+static void ReleaseGathererData( void )
+    // Free the data set up by SetupGathererData().
+{
+    glDeleteLists( gathererQuadsDList, 1 );
+    gathererQuadsDList = 0;
+
+    FF_AccumulatorCleanUp( &hemicubeFF );
+    QM_SoACleanUp( &soa );
+
+    if ( formFactorMethod == 1 )
     {
-        QM_GathererQuad *gathererQuad = model.gatherers[g];
-        gathererQuad->radiosity[0] = gathererQuad->surface->emission[0];
-        gathererQuad->radiosity[1] = gathererQuad->surface->emission[1];
-        gathererQuad->radiosity[2] = gathererQuad->surface->emission[2];
+        FF_GridCleanUp( &rayGrid );
+        for ( int t = 0; t < numRayThreads; t++ ) FF_AccumulatorCleanUp( &rayFF[t] );
+        free( rayFF );
+        rayFF = NULL;
     }
 }
 
 
 
+static void ResetRadiosity( void )
+    // Set the initial unshot power of the shooter quads and the radiosity of the gatherer quads.
+{
+// Initialize the unshot power of the shooter quads.
+    for ( int s = 0; s < soa.numShooters; s++ )
+    {
+        const float *emission = soa.surfaceEmission[ soa.shooterSurface[s] ];
+        soa.shooterUnshotPower[s][0] = soa.shooterArea[s] * emission[0];
+        soa.shooterUnshotPower[s][1] = soa.shooterArea[s] * emission[1];
+        soa.shooterUnshotPower[s][2] = soa.shooterArea[s] * emission[2];
+    }
+
+// Initialize the radiosity of the gatherer quads.
+    for ( int g = 0; g < soa.numGatherers; g++ )
+        CopyArray3( soa.gathererRadiosity[g], soa.surfaceEmission[ soa.gathererSurface[g] ] );
+}
+
+
+
 
 /////////////////////////////////////////////////////////////////////////////
 // The main function.
@@ -543,7 +1115,16 @@ int main( int argc, char** argv )
     scanf( "%c", &ch );
 
 // Initialize GLUT and create the drawing window.
+// glutInit() removes the GLUT options, leaving the optional hemicube resolution.
     glutInit( &argc, argv );
+
+    if ( argc > 1 )
+    {
+        winWidthHeight = atoi( argv[1] );
+        if ( argc > 2 || winWidthHeight < 2 || winWidthHeight % 2 != 0 )
+            ShowFatalError( __FILE__, __LINE__, "Usage: %s [hemicube resolution, an even number]", argv[0] );
+    }
+    printf( "Hemicube resolution is %d x %d pixels.\n", winWidthHeight, winWidthHeight );
     glutInitDisplayMode ( GLUT_RGB | GLUT_SINGLE | GLUT_DEPTH );
     glutInitWindowSize( winWidthHeight, winWidthHeight ); // Window must be square and size is fixed.
     glutCreateWindow( "Radiosity Solver" );
@@ -2,40 +2,50 @@
 #include <stdio.h>
 #include <math.h>
 #include <float.h>
+#include <stddef.h>
 
-#ifdef __APPLE__
-#include <GLUT/glut.h>
-#include <GLUT/glext.h>
-#else
-#include <GL/glut.h>
-#include <GL/glext.h>
-#endif
-
+#include "glfunctions.h"
 #include "common.h"
 #include "trackball.h"
+#include "vector3.h"
+#include "octree.h"
+#include "radfile.h"
 
 
 /////////////////////////////////////////////////////////////////////////////
 // CONSTANTS THAT YOU CHANGE FOR DIFFERENT INPUT FILE
 /////////////////////////////////////////////////////////////////////////////
 
-// Input model filename.
-static const char radiosityModelFilename[] = "myscene.out";
+// Input model filename. Both the text format and the binary format (see radfile.h)
+// written by the radiosity solver can be read. The binary format loads much faster.
+static const char radiosityModelFilename[] = "myscene.rad";
 
 
 /////////////////////////////////////////////////////////////////////////////
 // TYPE DEFINITIONS
 /////////////////////////////////////////////////////////////////////////////
 
-typedef struct RAD_Quad {
-	float v[4][3];		// 3D coordinates of the 4 vertices of the quadrilateral.
-	float rgb[4][3];	// The colors at the vertices.
-}
-RAD_Quad;
-
 typedef struct RAD_Model {
+	int numVertices;			// Number of vertices.
+	const RF_Vertex *vertices;	// Array of RF_Vertex, each with its position and color.
+
 	int numQuads;				// Number of quads.
-	RAD_Quad *quads;			// Array of RAD_Quad.
+	const unsigned int *quadVertIndices;	// The vertices of quad q are 
+											// vertices[ quadVertIndices[4*q] ] to vertices[ quadVertIndices[4*q + 3] ].
+
+	// The shooter quads, a coarser level of detail of the same surfaces.
+	// Only binary files since version 2 have them. Otherwise, numShooterQuads is 0.
+	int numShooterVertices;		// Number of shooter quad vertices.
+	const RF_Vertex *shooterVertices;	// Array of RF_Vertex of the shooter quads.
+	int numShooterQuads;		// Number of shooter quads.
+	const unsigned int *shooterQuadVertIndices;	// Indices into shooterVertices, 4 per shooter quad.
+	const unsigned int *shooterQuadStart;		// Quads shooterQuadStart[s] to shooterQuadStart[s+1] - 1 
+												// are the gatherer quads of shooter quad s.
+
+	// If the model was read from a binary file, the arrays above point into the
+	// mapped file, otherwise they are allocated with malloc().
+	const void *mappedFile;
+	size_t mappedFileSize;
 
 	// Color stats. For tone mapping.
 	float maxIntensity;
@@ -52,6 +62,19 @@ typedef struct RAD_Model {
 RAD_Model;
 
 
+// The index ranges for drawing the quads in an octree leaf node.
+// Level 0 is the gatherer quads, and level 1 is the shooter quads.
+typedef struct RAD_LeafRanges {
+	int firstTriangleIndex[2];	// Into triangleIndexBuffer.
+	int numTriangleIndices[2];
+	int firstLineIndex[2];		// Into lineIndexBuffer.
+	int numLineIndices[2];
+	int numQuads[2];
+	float gathererSize;			// Average edge length of the gatherer quads.
+}
+RAD_LeafRanges;
+
+
 /////////////////////////////////////////////////////////////////////////////
 // GLOBAL VARIABLES
 /////////////////////////////////////////////////////////////////////////////
@@ -59,9 +82,64 @@ RAD_Model;
 // The model with radiosity solution.
 static RAD_Model model;
 
-// OpenGL display lists.
-static GLuint gathererQuadsDList = 0;
-static GLuint gathererQuadsNoColorDList = 0;
+// OpenGL buffer objects.
+static GLuint vertexBuffer = 0;				// Array of RF_Vertex, with the radiosity values as they are in the file.
+static GLuint triangleIndexBuffer = 0;		// 2 triangles per quad.
+static GLuint lineIndexBuffer = 0;			// The quad edges, each shared edge once.
+
+// View-frustum culling and level of detail (LOD). The quads are grouped into clusters, one 
+// per shooter quad (or one per quad if the model has no shooter quads), and an octree is 
+// built over the clusters. Only the octree leaf nodes in the view frustum are drawn. 
+// The shooter quads of a leaf node are drawn instead of its gatherer quads when the 
+// gatherer quads are smaller than lodMaxGathererPixels pixels on the screen.
+// The triangle and line index buffers hold the gatherer quads of every leaf node, in the 
+// order of the leaf nodes, followed by the shooter quads in the same order, so that
+// adjacent visible leaf nodes can be drawn with one call.
+static const int maxClustersPerLeaf = 64;
+static const float lodMaxGathererPixels = 2.0f;
+
+static OT_Octree octree;
+static RAD_LeafRanges *leafRanges = NULL;	// One per octree node. Only used for leaf nodes.
+static int numLeaves = 0;
+static int *allLeaves = NULL;				// All the leaf nodes, in the order of their items.
+static int *visibleLeaves = NULL;			// The leaf nodes drawn in the current frame,
+static int *visibleLevels = NULL;			// and their levels of detail.
+static int numVisibleLeaves = 0;
+
+static bool frustumCulling = true;			// Enable or disable view-frustum culling.
+static bool useLOD = true;					// Enable or disable level of detail.
+
+// Tone mapping. The radiosity values are tone mapped in the fragment shader as
+// color = ( log( exposure * radiosity + 1 ) / log( maxColor + 1 ) ) ^ ( 1 / gamma ),
+// where maxColor is the maximum radiosity value of the model.
+// Changing the exposure or gamma only changes the shader uniforms.
+static const float defaultExposure = 1.0f;
+static const float defaultGamma = 2.5f;
+static float exposure = defaultExposure;
+static float displayGamma = defaultGamma;
+
+static GLuint toneMapProgram = 0;
+static GLint exposureLoc, invGammaLoc, logMaxColorLoc;		// Uniform locations.
+
+// The radiosity is passed in as texture coordinates, which are not clamped to [0, 1] like colors.
+static const char toneMapVertexShader[] = 
+	"varying vec3 radiosity;\n"
+	"void main()\n"
+	"{\n"
+	"	radiosity = gl_MultiTexCoord0.xyz;\n"
+	"	gl_Position = ftransform();\n"
+	"}\n";
+
+static const char toneMapFragmentShader[] = 
+	"uniform float exposure;\n"
+	"uniform float invGamma;\n"
+	"uniform float logMaxColor;\n"
+	"varying vec3 radiosity;\n"
+	"void main()\n"
+	"{\n"
+	"	vec3 c = log( exposure * max( radiosity, 0.0 ) + 1.0 ) / logMaxColor;\n"
+	"	gl_FragColor = vec4( pow( min( c, 1.0 ), vec3( invGamma ) ), 1.0 );\n"
+	"}\n";
 
 // Window's size.
 static int winWidth = 800;     // Window width in pixels.
@@ -74,6 +152,8 @@ static bool backfaceCulling = true; // Enable or disable back-face culling.
 static int drawStyle = 0;			// Draw polygons in different drawing styles: 
 									// 0: filled, 1: wireframe, 2: outlined fill.
 
+static const double fovy = 45.0;	// Vertical field of view in degrees.
+
 // Trackball object.
 TrackBall tb( GLUT_LEFT_BUTTON, GLUT_MIDDLE_BUTTON, GLUT_RIGHT_BUTTON );
 
@@ -83,28 +163,35 @@ TrackBall tb( GLUT_LEFT_BUTTON, GLUT_MIDDLE_BUTTON, GLUT_RIGHT_BUTTON );
 // HELPER FUNCTIONS.
 /////////////////////////////////////////////////////////////////////////////
 
+static void ComputeBoundingSphere( RAD_Model *m );
+
+
 static void ComputeBoundingBox( RAD_Model *m )
 	// Compute an axis-aligned bounding box (AABB).
 {
-	if ( m == NULL || m->numQuads <= 0 ) return;
+	if ( m == NULL || m->numVertices <= 0 ) return;
 
 	m->min_xyz[0] = m->min_xyz[1] = m->min_xyz[2] = FLT_MAX;
 	m->max_xyz[0] = m->max_xyz[1] = m->max_xyz[2] = -FLT_MAX;
 
-	for ( int q = 0; q < m->numQuads; q++ )
+	for ( int i = 0; i < m->numVertices; i++ )
 	{
-		RAD_Quad *quad = &(m->quads[q]);
-		for ( int i = 0; i < 4; i++ )
-		{
-			if ( quad->v[i][0] < m->min_xyz[0] ) m->min_xyz[0] = quad->v[i][0];
-			if ( quad->v[i][1] < m->min_xyz[1] ) m->min_xyz[1] = quad->v[i][1];
-			if ( quad->v[i][2] < m->min_xyz[2] ) m->min_xyz[2] = quad->v[i][2];
-			if ( quad->v[i][0] > m->max_xyz[0] ) m->max_xyz[0] = quad->v[i][0];
-			if ( quad->v[i][1] > m->max_xyz[1] ) m->max_xyz[1] = quad->v[i][1];
-			if ( quad->v[i][2] > m->max_xyz[2] ) m->max_xyz[2] = quad->v[i][2];
-		}
+		const float *v = m->vertices[i].v;
+		if ( v[0] < m->min_xyz[0] ) m->min_xyz[0] = v[0];
+		if ( v[1] < m->min_xyz[1] ) m->min_xyz[1] = v[1];
+		if ( v[2] < m->min_xyz[2] ) m->min_xyz[2] = v[2];
+		if ( v[0] > m->max_xyz[0] ) m->max_xyz[0] = v[0];
+		if ( v[1] > m->max_xyz[1] ) m->max_xyz[1] = v[1];
+		if ( v[2] > m->max_xyz[2] ) m->max_xyz[2] = v[2];
 	}
 
+	ComputeBoundingSphere( m );
+}
+
+
+static void ComputeBoundingSphere( RAD_Model *m )
+	// Compute the dimensions, center and bounding sphere radius from the AABB corners.
+{
 	m->dim_xyz[0] = m->max_xyz[0] - m->min_xyz[0];
 	m->dim_xyz[1] = m->max_xyz[1] - m->min_xyz[1];
 	m->dim_xyz[2] = m->max_xyz[2] - m->min_xyz[2];
@@ -115,9 +202,88 @@ static void ComputeBoundingBox( RAD_Model *m )
 }
 
 
-static RAD_Model RAD_ReadFile( const char *filename )
-	// Read radiosity solution model from input file.
-	// The axis-aligned bounding box is computed.
+static bool RAD_ReadBinaryFile( RAD_Model *m, const char *filename )
+	// Read radiosity solution model from a binary file (see radfile.h).
+	// The file is mapped into memory and used in place.
+	// Returns false if the file is not in the binary format.
+{
+	char badFile[] = "Invalid input model file";
+
+	size_t size;
+	const void *data = MapFileReadOnly( filename, &size );
+	if ( data == NULL ) 
+		ShowFatalError( __FILE__, __LINE__, "Cannot open input model file \"%s\"", filename );
+
+	const RF_Header *header = (const RF_Header *) data;
+	if ( size < 4 || memcmp( header->magic, RF_MAGIC, 4 ) != 0 )
+	{
+		UnmapFile( data, size );
+		return false;
+	}
+
+	if ( size < RF_HEADER_SIZE_V1 || header->byteOrder != RF_BYTE_ORDER )
+		ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badFile, filename );
+	if ( header->version < 1 || header->version > RF_VERSION )
+		ShowFatalError( __FILE__, __LINE__, "Unsupported version %u of input model file \"%s\"", header->version, filename );
+	if ( size < RF_HeaderSize( header ) )
+		ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badFile, filename );
+
+	bool hasShooterQuads = RF_HasShooterQuads( header );
+	unsigned int numShooterVertices = hasShooterQuads? header->numShooterVertices : 0;
+	unsigned int numShooterQuads = hasShooterQuads? header->numShooterQuads : 0;
+
+	if ( header->numVertices > INT_MAX / sizeof(RF_Vertex) || header->numQuads > INT_MAX / 16 || 
+		 numShooterVertices > INT_MAX / sizeof(RF_Vertex) - header->numVertices || numShooterQuads > INT_MAX / 16 || 
+		 size < RF_FileSize( header ) )
+		ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badFile, filename );
+
+	m->numVertices = (int) header->numVertices;
+	m->vertices = RF_Vertices( header );
+	m->numQuads = (int) header->numQuads;
+	m->quadVertIndices = RF_QuadVertIndices( header );
+	m->mappedFile = data;
+	m->mappedFileSize = size;
+
+	for ( int i = 0; i < 4 * m->numQuads; i++ )
+		if ( m->quadVertIndices[i] >= header->numVertices )
+			ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badFile, filename );
+
+	m->numShooterVertices = (int) numShooterVertices;
+	m->numShooterQuads = (int) numShooterQuads;
+	m->shooterVertices = NULL;
+	m->shooterQuadVertIndices = NULL;
+	m->shooterQuadStart = NULL;
+
+	if ( hasShooterQuads )
+	{
+		m->shooterVertices = RF_ShooterVertices( header );
+		m->shooterQuadVertIndices = RF_ShooterQuadVertIndices( header );
+		m->shooterQuadStart = RF_ShooterQuadStart( header );
+
+		for ( int i = 0; i < 4 * m->numShooterQuads; i++ )
+			if ( m->shooterQuadVertIndices[i] >= numShooterVertices )
+				ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badFile, filename );
+
+		if ( m->shooterQuadStart[0] != 0 || m->shooterQuadStart[ m->numShooterQuads ] != header->numQuads )
+			ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badFile, filename );
+		for ( int s = 0; s < m->numShooterQuads; s++ )
+			if ( m->shooterQuadStart[s] > m->shooterQuadStart[s + 1] )
+				ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badFile, filename );
+	}
+
+	m->minIntensity = header->minIntensity;
+	m->maxIntensity = header->maxIntensity;
+	CopyArray3( m->max_rgb, header->max_rgb );
+	CopyArray3( m->min_xyz, header->min_xyz );
+	CopyArray3( m->max_xyz, header->max_xyz );
+	ComputeBoundingSphere( m );
+	return true;
+}
+
+
+static void RAD_ReadTextFile( RAD_Model *m, const char *filename )
+	// Read radiosity solution model from a text file.
+	// Every quad gets its own 4 vertices.
 {
 	char badFile[] = "Invalid input model file";
 
@@ -126,46 +292,69 @@ static RAD_Model RAD_ReadFile( const char *filename )
 	if ( fp == NULL ) 
 		ShowFatalError( __FILE__, __LINE__, "Cannot open input model file \"%s\"", filename );
 
-	RAD_Model m;
-
-	if ( fscanf( fp, "%d", &(m.numQuads) ) != 1 || m.numQuads < 0 )
+	if ( fscanf( fp, "%d", &(m->numQuads) ) != 1 || m->numQuads < 0 )
 		ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badFile, filename );
 
-	m.quads = (RAD_Quad *) CheckedMalloc( sizeof(RAD_Quad) * m.numQuads );
+	m->numVertices = 4 * m->numQuads;
+	RF_Vertex *vertices = (RF_Vertex *) CheckedMalloc( sizeof(RF_Vertex) * m->numVertices );
+	unsigned int *quadVertIndices = (unsigned int *) CheckedMalloc( sizeof(unsigned int) * m->numVertices );
 
 	float minIntensity = FLT_MAX;
 	float maxIntensity = 0.0f;
 	float max_rgb[3] = { 0.0f, 0.0f, 0.0f };
 
-	for ( int q = 0; q < m.numQuads; q++ )
+	for ( int k = 0; k < m->numVertices; k++ )
 	{
-		for ( int i = 0; i < 4; i++ )
-		{
-			float vert[3], rgb[3];
+		float vert[3], rgb[3];
 
-			if ( fscanf( fp, "%f %f %f", &vert[0], &vert[1], &vert[2] ) != 3 )
-				ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badFile, filename );
+		if ( fscanf( fp, "%f %f %f", &vert[0], &vert[1], &vert[2] ) != 3 )
+			ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badFile, filename );
 
-			if ( fscanf( fp, "%f %f %f", &rgb[0], &rgb[1], &rgb[2] ) != 3 )
-				ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badFile, filename );
+		if ( fscanf( fp, "%f %f %f", &rgb[0], &rgb[1], &rgb[2] ) != 3 )
+			ShowFatalError( __FILE__, __LINE__, "%s \"%s\"", badFile, filename );
 
-			CopyArray3( m.quads[q].v[i], vert );
-			CopyArray3( m.quads[q].rgb[i], rgb );
+		CopyArray3( vertices[k].v, vert );
+		CopyArray3( vertices[k].rgb, rgb );
+		quadVertIndices[k] = (unsigned int) k;
 
-			float intensity = rgb[0] + rgb[1] + rgb[2];
-			if ( intensity > maxIntensity ) maxIntensity = intensity;
-			if ( intensity < minIntensity ) minIntensity = intensity;
-			if ( rgb[0] > max_rgb[0] ) max_rgb[0] = rgb[0];
-			if ( rgb[1] > max_rgb[1] ) max_rgb[1] = rgb[1];
-			if ( rgb[2] > max_rgb[2] ) max_rgb[2] = rgb[2];
-		}
+		float intensity = rgb[0] + rgb[1] + rgb[2];
+		if ( intensity > maxIntensity ) maxIntensity = intensity;
+		if ( intensity < minIntensity ) minIntensity = intensity;
+		if ( rgb[0] > max_rgb[0] ) max_rgb[0] = rgb[0];
+		if ( rgb[1] > max_rgb[1] ) max_rgb[1] = rgb[1];
+		if ( rgb[2] > max_rgb[2] ) max_rgb[2] = rgb[2];
 	}
 
 	fclose( fp );
-	m.minIntensity = minIntensity;
-	m.maxIntensity = maxIntensity;
-	CopyArray3( m.max_rgb, max_rgb );
-	ComputeBoundingBox( &m );
+	m->vertices = vertices;
+	m->quadVertIndices = quadVertIndices;
+	m->mappedFile = NULL;
+	m->mappedFileSize = 0;
+	m->numShooterVertices = 0;
+	m->shooterVertices = NULL;
+	m->numShooterQuads = 0;
+	m->shooterQuadVertIndices = NULL;
+	m->shooterQuadStart = NULL;
+	m->minIntensity = minIntensity;
+	m->maxIntensity = maxIntensity;
+	CopyArray3( m->max_rgb, max_rgb );
+	ComputeBoundingBox( m );
+}
+
+
+static RAD_Model RAD_ReadFile( const char *filename )
+	// Read radiosity solution model from input file.
+	// The format is detected from the first bytes of the file.
+	// The axis-aligned bounding box is computed.
+{
+	RAD_Model m;
+	double startTime = GetCurrRealTime();
+
+	if ( !RAD_ReadBinaryFile( &m, filename ) ) 
+		RAD_ReadTextFile( &m, filename );
+
+	printf( "Read %d quads, %d vertices, %d shooter quads from \"%s\" in %.3f s.\n", 
+			m.numQuads, m.numVertices, m.numShooterQuads, filename, GetCurrRealTime() - startTime );
 	return m;
 }
 
@@ -202,6 +391,88 @@ static void DrawAxes( double length )
 
 #define DEPTH_OFFSET		(1.0/1024.0)
 
+
+/////////////////////////////////////////////////////////////////////////////
+// Find the octree leaf nodes to draw, and their levels of detail, using
+// the current OpenGL projection and modelview matrices.
+// Returns the number of quads that will be drawn.
+/////////////////////////////////////////////////////////////////////////////
+
+static int FindVisibleLeaves( void )
+{
+	float projection[16], modelview[16];
+	glGetFloatv( GL_PROJECTION_MATRIX, projection );
+	glGetFloatv( GL_MODELVIEW_MATRIX, modelview );
+
+	if ( frustumCulling )
+	{
+		OT_Frustum frustum;
+		OT_GetFrustum( &frustum, projection, modelview );
+		numVisibleLeaves = OT_FindVisibleLeaves( &octree, &frustum, visibleLeaves );
+	}
+	else
+	{
+		numVisibleLeaves = numLeaves;
+		CopyArrayN( visibleLeaves, allLeaves, numLeaves );
+	}
+
+	// Number of pixels covered by a unit length at unit distance from the eye.
+	// The trackball only scales uniformly, so the ratio of a length to its 
+	// distance from the eye is the same in the model's coordinate frame.
+	float eye[3];
+	OT_GetEyePosition( eye, modelview );
+	float pixelsPerUnit = (float) ( winHeight / ( 2.0 * tan( 0.5 * fovy * M_PI / 180.0 ) ) );
+
+	int numQuadsDrawn = 0;
+	for ( int i = 0; i < numVisibleLeaves; i++ )
+	{
+		const OT_Node *node = &(octree.nodes[ visibleLeaves[i] ]);
+		const RAD_LeafRanges *r = &(leafRanges[ visibleLeaves[i] ]);
+		int level = 0;
+
+		if ( useLOD && model.numShooterQuads > 0 )
+		{
+			float dist = OT_BoxDistance( eye, node->min_xyz, node->max_xyz );
+			if ( r->gathererSize * pixelsPerUnit < lodMaxGathererPixels * dist ) level = 1;
+		}
+
+		visibleLevels[i] = level;
+		numQuadsDrawn += r->numQuads[level];
+	}
+	return numQuadsDrawn;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Draw the visible leaf nodes with the bound triangle or line index buffer. 
+// Index ranges that follow one another are drawn with one call.
+/////////////////////////////////////////////////////////////////////////////
+
+static void DrawVisibleLeaves( GLenum mode )
+{
+	int runStart = 0, runEnd = 0;
+
+	for ( int i = 0; i < numVisibleLeaves; i++ )
+	{
+		const RAD_LeafRanges *r = &(leafRanges[ visibleLeaves[i] ]);
+		int level = visibleLevels[i];
+		int first = ( mode == GL_LINES )? r->firstLineIndex[level] : r->firstTriangleIndex[level];
+		int count = ( mode == GL_LINES )? r->numLineIndices[level] : r->numTriangleIndices[level];
+
+		if ( first != runEnd )
+		{
+			if ( runEnd > runStart )
+				glDrawElements( mode, runEnd - runStart, GL_UNSIGNED_INT, (const GLvoid *) ( sizeof(unsigned int) * runStart ) );
+			runStart = first;
+		}
+		runEnd = first + count;
+	}
+
+	if ( runEnd > runStart )
+		glDrawElements( mode, runEnd - runStart, GL_UNSIGNED_INT, (const GLvoid *) ( sizeof(unsigned int) * runStart ) );
+}
+
+
 /////////////////////////////////////////////////////////////////////////////
 // The display callback function.
 /////////////////////////////////////////////////////////////////////////////
@@ -216,7 +487,7 @@ static void MyDisplay( void )
 
     glMatrixMode( GL_PROJECTION );
     glLoadIdentity();
-    gluPerspective( 45.0, (double)winWidth/winHeight, model.radius, 10.0 * model.radius );
+    gluPerspective( fovy, (double)winWidth/winHeight, model.radius, 10.0 * model.radius );
 
     glMatrixMode( GL_MODELVIEW );
     glLoadIdentity();
@@ -225,17 +496,40 @@ static void MyDisplay( void )
 		tb.applyTransform();
 		glTranslatef( -model.center[0], -model.center[1], -model.center[2] );
 
+		int numQuadsDrawn = FindVisibleLeaves();
+
 		glDepthRange( DEPTH_OFFSET, 1.0 );  // This is for outlined fill.
 
 		// Draw axes.
 		if ( drawAxes ) DrawAxes( 2.0 * model.radius );
 
-		if ( drawStyle == 0 || drawStyle == 2 ) 
-			glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );	// Filled or outlined fill.
+		glPolygonMode( GL_FRONT_AND_BACK, GL_FILL );
+
+		// Draw gatherer quads.
+		glPushClientAttrib( GL_CLIENT_VERTEX_ARRAY_BIT );
+		glBindBuffer( GL_ARRAY_BUFFER, vertexBuffer );
+		glEnableClientState( GL_VERTEX_ARRAY );
+		glVertexPointer( 3, GL_FLOAT, sizeof(RF_Vertex), (const GLvoid *) offsetof(RF_Vertex, v) );
+		glEnableClientState( GL_TEXTURE_COORD_ARRAY );
+		glTexCoordPointer( 3, GL_FLOAT, sizeof(RF_Vertex), (const GLvoid *) offsetof(RF_Vertex, rgb) );
+
+		glUseProgram( toneMapProgram );
+		glUniform1f( exposureLoc, exposure );
+		glUniform1f( invGammaLoc, 1.0f / displayGamma );
+
+		if ( drawStyle == 1 )
+		{
+			// Wireframe. Only the quad edges are drawn, not the triangle diagonals.
+			glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, lineIndexBuffer );
+			DrawVisibleLeaves( GL_LINES );
+		}
 		else
-			glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );	// Wireframe.
+		{
+			glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, triangleIndexBuffer );
+			DrawVisibleLeaves( GL_TRIANGLES );
+		}
 
-		glCallList( gathererQuadsDList );	// Draw gatherer quads.
+		glUseProgram( 0 );
 
 		if ( drawStyle == 2 )	// Draw the outlines of the outlined fill style.
 		{
@@ -243,13 +537,17 @@ static void MyDisplay( void )
 			glDisable( GL_LIGHTING );
 			glDepthFunc( GL_LEQUAL );
 			glDepthRange( 0.0, 1.0 - DEPTH_OFFSET );
-			glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );	// Wireframe.
 			glLineWidth( 1.0 );
 			glColor3f( 0.0f, 0.0f, 0.0f );
-			glCallList( gathererQuadsNoColorDList );	// Draw gatherer quads.
+			glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, lineIndexBuffer );
+			DrawVisibleLeaves( GL_LINES );
 			glPopAttrib();
 		}
 
+		glBindBuffer( GL_ARRAY_BUFFER, 0 );
+		glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
+		glPopClientAttrib();
+
 	glPopMatrix();
 
     glutSwapBuffers();
@@ -258,7 +556,7 @@ static void MyDisplay( void )
 	double fps = 1.0 / ((stoptime - starttime) / 1000.0);
 
 	static char s[256];
-	sprintf( s, "Radiosity Viewer  (%.1f FPS)", fps );
+	sprintf( s, "Radiosity Viewer  (%.1f FPS, %d of %d quads)", fps, numQuadsDrawn, model.numQuads );
 	glutSetWindowTitle( s );
 }
 
@@ -303,6 +601,60 @@ static void MyKeyboard( unsigned char key, int x, int y )
 			glutPostRedisplay();
             break;
 
+		// Adjust exposure.
+        case '+':
+        case '=':
+            exposure *= 1.25f;
+            printf( "Exposure = %.3g\n", exposure );
+            glutPostRedisplay();
+            break;
+
+        case '-':
+        case '_':
+            exposure /= 1.25f;
+            printf( "Exposure = %.3g\n", exposure );
+            glutPostRedisplay();
+            break;
+
+		// Adjust gamma.
+        case '>':
+        case '.':
+            displayGamma += 0.1f;
+            printf( "Gamma = %.2f\n", displayGamma );
+            glutPostRedisplay();
+            break;
+
+        case '<':
+        case ',':
+            displayGamma = Max2( displayGamma - 0.1f, 0.1f );
+            printf( "Gamma = %.2f\n", displayGamma );
+            glutPostRedisplay();
+            break;
+
+		// Reset tone mapping.
+        case '0':
+            exposure = defaultExposure;
+            displayGamma = defaultGamma;
+            printf( "Exposure = %.3g, Gamma = %.2f\n", exposure, displayGamma );
+            glutPostRedisplay();
+            break;
+
+		// Toggle view-frustum culling.
+        case 'f':
+        case 'F': 
+            frustumCulling = !frustumCulling;
+            printf( "View-frustum culling %s\n", frustumCulling? "on" : "off" );
+            glutPostRedisplay();
+            break;
+
+		// Toggle level of detail.
+        case 'l':
+        case 'L': 
+            useLOD = !useLOD;
+            printf( "Level of detail %s\n", useLOD? "on" : "off" );
+            glutPostRedisplay();
+            break;
+
 		// Cycle thru different types of quads.
         case 's':
         case 'S': 
@@ -372,64 +724,258 @@ static void MyInit( void )
 
 
 /////////////////////////////////////////////////////////////////////////////
-// Make a display list of the quads with vertex colors.
+// Make the vertex buffer. The vertices are uploaded as they are in the model,
+// the gatherer quad vertices followed by the shooter quad vertices.
 /////////////////////////////////////////////////////////////////////////////
 
-static GLuint MakeGathererQuadsDisplayList( const RAD_Model *m )
+static void MakeVertexBuffer( const RAD_Model *m )
 {
-	const float log2 = log( 2.0f );
+	size_t gathererSize = sizeof(RF_Vertex) * m->numVertices;
+	size_t shooterSize = sizeof(RF_Vertex) * m->numShooterVertices;
+
+	glGenBuffers( 1, &vertexBuffer );
+	glBindBuffer( GL_ARRAY_BUFFER, vertexBuffer );
+	glBufferData( GL_ARRAY_BUFFER, gathererSize + shooterSize, NULL, GL_STATIC_DRAW );
+	glBufferSubData( GL_ARRAY_BUFFER, 0, gathererSize, m->vertices );
+	if ( shooterSize > 0 ) glBufferSubData( GL_ARRAY_BUFFER, gathererSize, shooterSize, m->shooterVertices );
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+}
 
+
+/////////////////////////////////////////////////////////////////////////////
+// Make the tone mapping shader program.
+/////////////////////////////////////////////////////////////////////////////
+
+static void MakeToneMapProgram( const RAD_Model *m )
+{
 	float maxColor = Max3( m->max_rgb[0], m->max_rgb[1], m->max_rgb[2] );
-	float logMaxColor = log( maxColor + 1.0f );
 	printf( "maxColor = %f\n", maxColor );
 
-	GLuint dlist = glGenLists( 1 );
-	if ( dlist == 0 ) ShowFatalError( __FILE__, __LINE__, "Cannot create display list" );
-	glNewList( dlist, GL_COMPILE );
-	glBegin( GL_QUADS );
-		for ( int q = 0; q < m->numQuads; q++ )
-		{
-			RAD_Quad *quad = &(m->quads[q]);
-			for ( int i = 0; i < 4; i++ )
-			{
-				float rgb[3];
-
-				// Tone mapping.
-				rgb[0] = pow( log( quad->rgb[i][0] + 1.0f ) / logMaxColor, 0.4f );
-				rgb[1] = pow( log( quad->rgb[i][1] + 1.0f ) / logMaxColor, 0.4f );
-				rgb[2] = pow( log( quad->rgb[i][2] + 1.0f ) / logMaxColor, 0.4f );
+	toneMapProgram = MakeShaderProgram( toneMapVertexShader, toneMapFragmentShader );
+	exposureLoc = glGetUniformLocation( toneMapProgram, "exposure" );
+	invGammaLoc = glGetUniformLocation( toneMapProgram, "invGamma" );
+	logMaxColorLoc = glGetUniformLocation( toneMapProgram, "logMaxColor" );
 
-				glColor3fv( rgb );
-				glVertex3fv( quad->v[i] );
-			}
-		}
-	glEnd();
-	glEndList();
-	return dlist;
+	// Avoid dividing by zero in the shader if the model is all black.
+	glUseProgram( toneMapProgram );
+	glUniform1f( logMaxColorLoc, Max2( (float) log( maxColor + 1.0f ), FLT_MIN ) );
+	glUseProgram( 0 );
 }
 
 
 /////////////////////////////////////////////////////////////////////////////
-// Make a display list of the quads without vertex colors.
+// Make the index buffers for drawing the quads as triangles and as lines.
 /////////////////////////////////////////////////////////////////////////////
 
-static GLuint MakeGathererQuadsNoColorDisplayList( const RAD_Model *m )
+static int CompareEdges( const void *a, const void *b )
+{
+	unsigned long long ea = *(const unsigned long long *) a;
+	unsigned long long eb = *(const unsigned long long *) b;
+	return ( ea < eb )? -1 : ( ( ea > eb )? 1 : 0 );
+}
+
+
+static int AppendQuadTriangles( unsigned int triangles[], const unsigned int quadVertIndices[], int numQuads, unsigned int offset )
+	// Each quad v0 v1 v2 v3 is split into triangles v0 v1 v2 and v0 v2 v3,
+	// which keep the orientation of the quad. offset is added to the vertex indices.
+	// Returns the number of indices appended.
+{
+	for ( int q = 0; q < numQuads; q++ )
+	{
+		const unsigned int *quad = &(quadVertIndices[4 * q]);
+		unsigned int *tri = &(triangles[6 * q]);
+		tri[0] = quad[0] + offset;  tri[1] = quad[1] + offset;  tri[2] = quad[2] + offset;
+		tri[3] = quad[0] + offset;  tri[4] = quad[2] + offset;  tri[5] = quad[3] + offset;
+	}
+	return 6 * numQuads;
+}
+
+
+static int AppendQuadEdges( unsigned int lines[], const unsigned int quadVertIndices[], int numQuads, unsigned int offset, 
+						    unsigned long long edges[] )
+	// Append the edges of the quads, each shared edge once. offset is added to the vertex indices.
+	// edges[] is temporary storage for 4 * numQuads edges. Returns the number of indices appended.
+{
+	// An edge shared by two quads has the same two vertex indices, 
+	// so sorting the edges brings the duplicates together.
+	int numEdges = 4 * numQuads;
+
+	for ( int q = 0; q < numQuads; q++ )
+		for ( int i = 0; i < 4; i++ )
+		{
+			unsigned long long a = quadVertIndices[4 * q + i] + offset;
+			unsigned long long b = quadVertIndices[4 * q + (i + 1) % 4] + offset;
+			edges[4 * q + i] = ( a < b )? ( a << 32 ) | b : ( b << 32 ) | a;
+		}
+
+	qsort( edges, numEdges, sizeof(unsigned long long), CompareEdges );
+
+	int numIndices = 0;
+	for ( int e = 0; e < numEdges; e++ )
+	{
+		if ( e > 0 && edges[e] == edges[e - 1] ) continue;
+		lines[ numIndices++ ] = (unsigned int) ( edges[e] >> 32 );
+		lines[ numIndices++ ] = (unsigned int) ( edges[e] & 0xFFFFFFFFull );
+	}
+	return numIndices;
+}
+
+
+static int ClusterQuads( const RAD_Model *m, int c, int *firstQuad )
+	// Returns the number of gatherer quads in cluster c, and the first of them in *firstQuad.
+{
+	if ( m->numShooterQuads == 0 )
+	{
+		*firstQuad = c;
+		return 1;
+	}
+	*firstQuad = (int) m->shooterQuadStart[c];
+	return (int) ( m->shooterQuadStart[c + 1] - m->shooterQuadStart[c] );
+}
+
+
+static float QuadArea( const RF_Vertex *vertices, const unsigned int quad[4] )
+	// Area of the quad, from the cross product of its diagonals.
 {
-	GLuint dlist = glGenLists( 1 );
-	if ( dlist == 0 ) ShowFatalError( __FILE__, __LINE__, "Cannot create display list" );
-	glNewList( dlist, GL_COMPILE );
-	glBegin( GL_QUADS );
-		for ( int q = 0; q < m->numQuads; q++ )
+	float d1[3], d2[3], n[3];
+	VecDiff( d1, vertices[ quad[2] ].v, vertices[ quad[0] ].v );
+	VecDiff( d2, vertices[ quad[3] ].v, vertices[ quad[1] ].v );
+	return 0.5f * VecLen( VecCrossProd( n, d1, d2 ) );
+}
+
+
+static void BuildOctree( const RAD_Model *m )
+	// Build the octree over the quad clusters.
+{
+	int numClusters = ( m->numShooterQuads > 0 )? m->numShooterQuads : m->numQuads;
+	float (*clusterMin)[3] = (float (*)[3]) CheckedMalloc( sizeof(float) * 3 * Max2( numClusters, 1 ) );
+	float (*clusterMax)[3] = (float (*)[3]) CheckedMalloc( sizeof(float) * 3 * Max2( numClusters, 1 ) );
+
+	for ( int c = 0; c < numClusters; c++ )
+	{
+		clusterMin[c][0] = clusterMin[c][1] = clusterMin[c][2] = FLT_MAX;
+		clusterMax[c][0] = clusterMax[c][1] = clusterMax[c][2] = -FLT_MAX;
+
+		int firstQuad, numQuads = ClusterQuads( m, c, &firstQuad );
+		for ( int i = 4 * firstQuad; i < 4 * ( firstQuad + numQuads ); i++ )
+			for ( int k = 0; k < 3; k++ )
+			{
+				float x = m->vertices[ m->quadVertIndices[i] ].v[k];
+				clusterMin[c][k] = Min2( clusterMin[c][k], x );
+				clusterMax[c][k] = Max2( clusterMax[c][k], x );
+			}
+
+		if ( m->numShooterQuads > 0 )
+			for ( int i = 4 * c; i < 4 * c + 4; i++ )
+				for ( int k = 0; k < 3; k++ )
+				{
+					float x = m->shooterVertices[ m->shooterQuadVertIndices[i] ].v[k];
+					clusterMin[c][k] = Min2( clusterMin[c][k], x );
+					clusterMax[c][k] = Max2( clusterMax[c][k], x );
+				}
+	}
+
+	octree = OT_Build( numClusters, clusterMin, clusterMax, maxClustersPerLeaf );
+	free( clusterMin );
+	free( clusterMax );
+
+	allLeaves = (int *) CheckedMalloc( sizeof(int) * octree.numNodes );
+	visibleLeaves = (int *) CheckedMalloc( sizeof(int) * octree.numNodes );
+	visibleLevels = (int *) CheckedMalloc( sizeof(int) * octree.numNodes );
+
+	// All the leaf nodes, found with a frustum that contains everything.
+	OT_Frustum everything;
+	for ( int p = 0; p < 6; p++ )
+	{
+		everything.planes[p][0] = everything.planes[p][1] = everything.planes[p][2] = 0.0f;
+		everything.planes[p][3] = 1.0f;
+	}
+	numLeaves = OT_FindVisibleLeaves( &octree, &everything, allLeaves );
+
+	printf( "Octree has %d nodes, %d leaf nodes over %d clusters.\n", octree.numNodes, numLeaves, numClusters );
+}
+
+
+static void MakeIndexBuffers( const RAD_Model *m )
+	// Make the index buffers, with the quads of each octree leaf node together.
+	// BuildOctree() must have been called.
+{
+	int maxTriangleIndices = 6 * ( m->numQuads + m->numShooterQuads );
+	int maxLineIndices = 8 * ( m->numQuads + m->numShooterQuads );
+	unsigned int *triangles = (unsigned int *) CheckedMalloc( sizeof(unsigned int) * Max2( maxTriangleIndices, 1 ) );
+	unsigned int *lines = (unsigned int *) CheckedMalloc( sizeof(unsigned int) * Max2( maxLineIndices, 1 ) );
+	int numTriangleIndices = 0, numLineIndices = 0;
+
+	// The quads of a leaf node, copied together. 
+	int maxQuads = Max3( m->numQuads, m->numShooterQuads, 1 );
+	unsigned int *quads = (unsigned int *) CheckedMalloc( sizeof(unsigned int) * 4 * maxQuads );
+	unsigned long long *edges = (unsigned long long *) CheckedMalloc( sizeof(unsigned long long) * 4 * maxQuads );
+
+	leafRanges = (RAD_LeafRanges *) CheckedMalloc( sizeof(RAD_LeafRanges) * octree.numNodes );
+
+	for ( int level = 0; level < 2; level++ )
+		for ( int i = 0; i < numLeaves; i++ )
 		{
-			RAD_Quad *quad = &(m->quads[q]);
-			for ( int i = 0; i < 4; i++ )
+			const OT_Node *node = &(octree.nodes[ allLeaves[i] ]);
+			RAD_LeafRanges *r = &(leafRanges[ allLeaves[i] ]);
+			int numQuads = 0;
+			unsigned int offset = 0;
+
+			if ( level == 1 && m->numShooterQuads == 0 )
+			{
+				// Without shooter quads, level 1 is the same as level 0.
+				r->firstTriangleIndex[1] = r->firstTriangleIndex[0];
+				r->numTriangleIndices[1] = r->numTriangleIndices[0];
+				r->firstLineIndex[1] = r->firstLineIndex[0];
+				r->numLineIndices[1] = r->numLineIndices[0];
+				r->numQuads[1] = r->numQuads[0];
+				continue;
+			}
+
+			if ( level == 0 )
+			{
+				// Gatherer quads.
+				float area = 0.0f;
+				for ( int k = node->firstItem; k < node->firstItem + node->numItems; k++ )
+				{
+					int firstQuad, numClusterQuads = ClusterQuads( m, octree.items[k], &firstQuad );
+					for ( int q = firstQuad; q < firstQuad + numClusterQuads; q++ )
+						area += QuadArea( m->vertices, &(m->quadVertIndices[4 * q]) );
+					CopyArrayN( &quads[4 * numQuads], &(m->quadVertIndices[4 * firstQuad]), 4 * numClusterQuads );
+					numQuads += numClusterQuads;
+				}
+				r->gathererSize = ( numQuads > 0 )? sqrt( area / numQuads ) : 0.0f;
+			}
+			else
 			{
-				glVertex3fv( quad->v[i] );
+				// Shooter quads, whose vertices follow the gatherer quad vertices in the vertex buffer.
+				for ( int k = node->firstItem; k < node->firstItem + node->numItems; k++ )
+					CopyArrayN( &quads[4 * numQuads++], &(m->shooterQuadVertIndices[4 * octree.items[k]]), 4 );
+				offset = (unsigned int) m->numVertices;
 			}
+
+			r->numQuads[level] = numQuads;
+			r->firstTriangleIndex[level] = numTriangleIndices;
+			r->numTriangleIndices[level] = AppendQuadTriangles( &triangles[numTriangleIndices], quads, numQuads, offset );
+			numTriangleIndices += r->numTriangleIndices[level];
+			r->firstLineIndex[level] = numLineIndices;
+			r->numLineIndices[level] = AppendQuadEdges( &lines[numLineIndices], quads, numQuads, offset, edges );
+			numLineIndices += r->numLineIndices[level];
 		}
-	glEnd();
-	glEndList();
-	return dlist;
+
+	free( quads );
+	free( edges );
+
+	glGenBuffers( 1, &triangleIndexBuffer );
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, triangleIndexBuffer );
+	glBufferData( GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * numTriangleIndices, triangles, GL_STATIC_DRAW );
+	free( triangles );
+
+	glGenBuffers( 1, &lineIndexBuffer );
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, lineIndexBuffer );
+	glBufferData( GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * numLineIndices, lines, GL_STATIC_DRAW );
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
+	free( lines );
 }
 
 
@@ -446,14 +992,19 @@ int main( int argc, char** argv )
     glutInitWindowSize( winWidth, winHeight );
     glutCreateWindow( "Radiosity Viewer" );
 
+    if ( !LoadGLFunctions() )
+		ShowFatalError( __FILE__, __LINE__, "OpenGL 2.0 or later is required" );
+
     MyInit();
 
 	// Read model file.
 	model = RAD_ReadFile( radiosityModelFilename );
 
-	// Make OpenGL display lists.
-	gathererQuadsDList = MakeGathererQuadsDisplayList( &model );
-	gathererQuadsNoColorDList = MakeGathererQuadsNoColorDisplayList( &model );
+	// Make OpenGL buffer objects.
+	BuildOctree( &model );
+	MakeVertexBuffer( &model );
+	MakeIndexBuffers( &model );
+	MakeToneMapProgram( &model );
 
     // Register the callback functions.
     glutDisplayFunc( MyDisplay ); 
@@ -467,6 +1018,11 @@ int main( int argc, char** argv )
     printf( "Press 'X' to toggle axes.\n" );
 	printf( "Press 'C' to toggle back-face culling.\n" );
     printf( "Press 'S' to cycle thru different drawing styles.\n" );
+    printf( "Press '+' / '-' to increase / decrease exposure.\n" );
+    printf( "Press '>' / '<' to increase / decrease gamma.\n" );
+    printf( "Press '0' to reset exposure and gamma.\n" );
+    printf( "Press 'F' to toggle view-frustum culling.\n" );
+    printf( "Press 'L' to toggle level of detail.\n" );
     printf( "Press 'Q' to quit.\n\n" );
 
     // Enter GLUT event loop.